@@ -0,0 +1,146 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* Buffer pool benchmark
+ *
+ * Several threads allocate and free buffers of mixed sizes from a small pool
+ * with three size classes, so that classes run empty and allocations fall
+ * back or fail. Each thread stamps the buffers it holds and checks the
+ * stamps before freeing them, which catches a buffer handed out twice.
+ * At the end every buffer must be back in the pool, and the failed
+ * allocations counted by csp_buffer_stats() must match the NULL returns
+ * seen by the threads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <csp/csp.h>
+
+/* Using un-exported header file.
+ * This is allowed since we are still in libcsp */
+#include <csp/arch/csp_thread.h>
+
+#define THREADS		4
+#define ROUNDS		200000
+#define HOLD		8
+
+static const csp_buffer_class_t classes[] = {
+	{.size = 64, .count = 16},
+	{.size = 128, .count = 8},
+	{.size = 300, .count = 8},
+};
+
+static const size_t sizes[] = {8, 40, 100, 250};
+
+static volatile unsigned int errors;
+static volatile unsigned int nulls;
+static volatile int done;
+
+CSP_DEFINE_TASK(task_stress) {
+
+	unsigned int id = (unsigned int) (uintptr_t) param;
+	unsigned int seed = id, i, j;
+	csp_packet_t * held[HOLD];
+	size_t size[HOLD];
+
+	for (i = 0; i < ROUNDS; i++) {
+
+		for (j = 0; j < HOLD; j++) {
+			size[j] = sizes[rand_r(&seed) % 4];
+			held[j] = csp_buffer_get(size[j]);
+			if (held[j] == NULL) {
+				__sync_fetch_and_add(&nulls, 1);
+				continue;
+			}
+			memset(held[j]->data, id, size[j]);
+		}
+
+		for (j = 0; j < HOLD; j++) {
+			if (held[j] == NULL)
+				continue;
+			if (held[j]->data[0] != id || held[j]->data[size[j] - 1] != id)
+				__sync_fetch_and_add(&errors, 1);
+			csp_buffer_free(held[j]);
+		}
+
+	}
+
+	__sync_fetch_and_add(&done, 1);
+
+	return CSP_TASK_RETURN;
+
+}
+
+static double now(void) {
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+
+}
+
+int main(int argc, char * argv[]) {
+
+	unsigned int c, total = 0, failed = 0;
+	uintptr_t t;
+	double start, elapsed;
+	csp_buffer_stats_t stats;
+	csp_thread_handle_t handle;
+
+	csp_buffer_init_classes(3, classes);
+
+	/* Empty classes are expected, do not log every failed allocation */
+	csp_debug_set_level(CSP_ERROR, false);
+
+	start = now();
+	for (t = 1; t <= THREADS; t++)
+		csp_thread_create(task_stress, (signed char *) "STRESS", 1000, (void *) t, 0, &handle);
+	while (done < THREADS)
+		csp_sleep_ms(10);
+	elapsed = now() - start;
+
+	printf("%d threads, %.1f ns per get and free\r\n", THREADS,
+			elapsed * 1e9 / ((double) THREADS * ROUNDS * HOLD));
+
+	printf("Size  Count  Used  Peak  Failed\r\n");
+	for (c = 0; c < sizeof(classes) / sizeof(classes[0]); c++) {
+		csp_buffer_stats(c, &stats);
+		printf("%4u  %5u  %4u  %4u  %6u\r\n", stats.size, stats.count,
+				stats.in_use, stats.high_watermark, stats.failed);
+		total += stats.count;
+		failed += stats.failed;
+		if (stats.in_use != 0 || stats.high_watermark > stats.count)
+			errors++;
+	}
+
+	if (csp_buffer_remaining() != (int) total)
+		errors++;
+	if (failed != nulls)
+		errors++;
+
+	printf("Failed allocations %u, counted %u\r\n", nulls, failed);
+	printf("Errors: %u\r\n", errors);
+
+	return errors ? 1 : 0;
+
+}
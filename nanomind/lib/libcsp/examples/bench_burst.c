@@ -0,0 +1,166 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* Router burst benchmark
+ *
+ * Hands bursts of packets to the router the way an interface driver does,
+ * with csp_new_packet(), and waits for a connectionless socket to receive
+ * each burst. Reports packets per second and how often the router task
+ * was woken per packet, read from the context switch counters of the
+ * router thread. Build with --with-router-batch 1 and the default to
+ * compare draining one packet per wakeup with draining a batch.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <csp/csp.h>
+#include <csp/csp_interface.h>
+#include <csp/interfaces/csp_if_lo.h>
+
+/* Using un-exported header file.
+ * This is allowed since we are still in libcsp */
+#include <csp/arch/csp_thread.h>
+
+#define MY_ADDRESS	1
+#define MY_PORT		10
+#define PACKETS		100000
+
+static volatile unsigned int delivered;
+static volatile pid_t server_tid;
+
+CSP_DEFINE_TASK(task_server) {
+
+	csp_packet_t * packet;
+	csp_socket_t * sock = csp_socket(CSP_SO_CONN_LESS);
+
+	server_tid = syscall(SYS_gettid);
+	csp_bind(sock, MY_PORT);
+
+	while (1) {
+		packet = csp_recvfrom(sock, CSP_MAX_DELAY);
+		if (packet == NULL)
+			continue;
+		delivered++;
+		csp_buffer_free(packet);
+	}
+
+	return CSP_TASK_RETURN;
+
+}
+
+/* Context switches of all threads except main and the server, which
+ * leaves the router task */
+static unsigned long router_switches(void) {
+
+	char path[64], line[128];
+	unsigned long count, total = 0;
+	struct dirent * entry;
+	DIR * dir = opendir("/proc/self/task");
+	FILE * f;
+	pid_t tid;
+
+	while ((entry = readdir(dir)) != NULL) {
+		tid = atoi(entry->d_name);
+		if (tid == 0 || tid == getpid() || tid == server_tid)
+			continue;
+		snprintf(path, sizeof(path), "/proc/self/task/%d/status", tid);
+		f = fopen(path, "r");
+		if (f == NULL)
+			continue;
+		while (fgets(line, sizeof(line), f) != NULL)
+			if (sscanf(line, "voluntary_ctxt_switches: %lu", &count) == 1)
+				total += count;
+		fclose(f);
+	}
+
+	closedir(dir);
+
+	return total;
+
+}
+
+static double now(void) {
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+
+}
+
+int main(int argc, char * argv[]) {
+
+	unsigned int burst, i, j, target;
+	unsigned long switches;
+	double start, elapsed;
+	csp_packet_t * packet;
+	csp_thread_handle_t handle;
+
+	csp_buffer_init(CSP_FIFO_INPUT + 10, 300);
+	csp_init(MY_ADDRESS);
+	csp_route_start_task(1000, 1);
+
+	csp_thread_create(task_server, (signed char *) "SERVER", 1000, NULL, 0, &handle);
+	while (server_tid == 0)
+		csp_sleep_ms(1);
+
+	printf("Router batch %d, input FIFO %d\r\n", CSP_ROUTER_BATCH, CSP_FIFO_INPUT);
+	printf("Burst  packets/s  wakeups/packet\r\n");
+
+	for (burst = 1; burst <= CSP_FIFO_INPUT; burst *= 2) {
+
+		delivered = 0;
+		switches = router_switches();
+		start = now();
+
+		for (i = 0; i < PACKETS / burst; i++) {
+			for (j = 0; j < burst; j++) {
+				packet = csp_buffer_get(100);
+				packet->id.pri = CSP_PRIO_NORM;
+				packet->id.src = MY_ADDRESS;
+				packet->id.dst = MY_ADDRESS;
+				packet->id.dport = MY_PORT;
+				packet->id.sport = 20;
+				packet->id.flags = 0;
+				packet->length = 100;
+				csp_new_packet(packet, &csp_if_lo, NULL);
+			}
+			target = (i + 1) * burst;
+			while (delivered + csp_if_lo.drop < target)
+				sched_yield();
+		}
+
+		elapsed = now() - start;
+		switches = router_switches() - switches;
+
+		printf("%5u  %9.0f  %14.2f\r\n", burst, delivered / elapsed,
+				(double) switches / delivered);
+
+	}
+
+	return csp_if_lo.drop ? 1 : 0;
+
+}
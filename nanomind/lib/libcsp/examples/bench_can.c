@@ -0,0 +1,319 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* SocketCAN benchmark
+ *
+ * A raw CAN socket on the same interface plays the peer. Measures:
+ *  - latency: one packet at a time, from csp_sendto() until the peer has
+ *    the last fragment
+ *  - transmit: packets sent back to back, frames per second seen by the peer
+ *  - receive: the peer writes the fragments of packets as fast as the node
+ *    takes them, frames per second reassembled and delivered to a socket
+ *    on the node
+ * together with the CPU time of the process per frame. Needs the socketcan
+ * driver and a CAN interface, e.g. a virtual one:
+ *
+ *   ip link add dev vcan0 type vcan && ip link set up vcan0
+ *
+ * usage: bench_can [-i interface] [-n packets] [-s size]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sched.h>
+
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <linux/can.h>
+
+#include <csp/csp.h>
+#include <csp/csp_endian.h>
+#include <csp/interfaces/csp_if_can.h>
+
+/* Using un-exported header file.
+ * This is allowed since we are still in libcsp */
+#include <csp/arch/csp_thread.h>
+
+#define MY_ADDRESS		1
+#define PEER_ADDRESS	2
+#define MY_PORT			10
+#define PEER_PORT		20
+#define LATENCY_SAMPLES	1000
+
+/* Frames the peer writes ahead of the node, the CAN RX queue holds 100.
+ * The reassembled packets wait in the router input queue as well */
+#define RX_AHEAD		96
+
+/* CFP identifier fields, see csp_if_can.c */
+#define CFP_BEGIN		0
+#define CFP_MORE		1
+#define CFP_REMAIN(id)	(((id) >> 10) & 0xff)
+#define CFP_MAKE_ID(src, dst, type, remain, ident) \
+	(((uint32_t)(src) << 24) | ((uint32_t)(dst) << 19) | ((uint32_t)(type) << 18) \
+	| ((uint32_t)(remain) << 10) | ((uint32_t)(ident) & 0x3ff))
+
+static unsigned int packets = 10000, size = 256;
+static int peer;
+static volatile unsigned int peer_frames, peer_packets, delivered;
+static volatile double peer_last, delivered_last;
+
+static double now(clockid_t clock) {
+
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+
+}
+
+/* Count the frames reaching the peer, and the packets they complete */
+CSP_DEFINE_TASK(task_peer) {
+
+	struct can_frame frame;
+
+	while (read(peer, &frame, sizeof(frame)) == sizeof(frame)) {
+		peer_frames++;
+		if (CFP_REMAIN(frame.can_id & CAN_EFF_MASK) == 0) {
+			peer_last = now(CLOCK_MONOTONIC);
+			peer_packets++;
+		}
+	}
+
+	return CSP_TASK_RETURN;
+
+}
+
+CSP_DEFINE_TASK(task_server) {
+
+	csp_packet_t * packet;
+	csp_socket_t * sock = csp_socket(CSP_SO_CONN_LESS);
+
+	csp_bind(sock, MY_PORT);
+
+	while (1) {
+		packet = csp_recvfrom(sock, CSP_MAX_DELAY);
+		if (packet == NULL)
+			continue;
+		csp_buffer_free(packet);
+		delivered_last = now(CLOCK_MONOTONIC);
+		delivered++;
+	}
+
+	return CSP_TASK_RETURN;
+
+}
+
+/* Send a packet to the peer, retry while the interface is busy */
+static int node_send(void) {
+
+	csp_packet_t * packet;
+	unsigned int tries;
+
+	for (tries = 0; tries < 1000; tries++) {
+		packet = csp_buffer_get(size);
+		if (packet != NULL) {
+			memset(packet->data, 0x55, size);
+			packet->length = size;
+			if (csp_sendto(CSP_PRIO_NORM, PEER_ADDRESS, PEER_PORT, MY_PORT, CSP_O_NONE, packet, 1000) == CSP_ERR_NONE)
+				return 0;
+			csp_buffer_free(packet);
+		}
+		csp_sleep_ms(1);
+	}
+
+	return -1;
+
+}
+
+/* Write all fragments of a packet from the peer to the node */
+static int peer_send(unsigned int ident) {
+
+	unsigned int overhead = sizeof(csp_id_t) + sizeof(uint16_t);
+	unsigned int frames = (size + overhead + 7) / 8;
+	unsigned int f, bytes, start;
+	struct can_frame frame;
+	csp_id_t id;
+	uint16_t length;
+
+	for (f = 0; f < frames; f++) {
+		memset(&frame, 0, sizeof(frame));
+		frame.can_id = CFP_MAKE_ID(PEER_ADDRESS, MY_ADDRESS, f ? CFP_MORE : CFP_BEGIN, frames - 1 - f, ident) | CAN_EFF_FLAG;
+		if (f == 0) {
+			id.ext = 0;
+			id.pri = CSP_PRIO_NORM;
+			id.src = PEER_ADDRESS;
+			id.dst = MY_ADDRESS;
+			id.dport = MY_PORT;
+			id.sport = PEER_PORT;
+			id.ext = csp_hton32(id.ext);
+			length = csp_hton16(size);
+			memcpy(frame.data, &id, sizeof(id));
+			memcpy(frame.data + sizeof(id), &length, sizeof(length));
+			start = 0;
+			bytes = size < 8 - overhead ? size : 8 - overhead;
+			frame.can_dlc = overhead + bytes;
+		} else {
+			start = f * 8 - overhead;
+			bytes = size - start < 8 ? size - start : 8;
+			frame.can_dlc = bytes;
+		}
+
+		/* Wait for room when the interface queue is full */
+		while (write(peer, &frame, sizeof(frame)) != sizeof(frame)) {
+			if (errno != ENOBUFS && errno != EAGAIN && errno != EINTR)
+				return -1;
+			poll(NULL, 0, 1);
+		}
+	}
+
+	return 0;
+
+}
+
+/* Wait until a counter reaches a value or stops moving for a second */
+static void wait_for(volatile unsigned int * counter, unsigned int value) {
+
+	unsigned int last = *counter;
+	double progress = now(CLOCK_MONOTONIC);
+
+	while (*counter < value && now(CLOCK_MONOTONIC) - progress < 1) {
+		csp_sleep_ms(1);
+		if (*counter != last) {
+			last = *counter;
+			progress = now(CLOCK_MONOTONIC);
+		}
+	}
+
+}
+
+int main(int argc, char * argv[]) {
+
+	int opt;
+	char * ifc = "vcan0";
+	unsigned int i, frames, samples;
+	double start, cpu, elapsed, latency, sum = 0, max = 0;
+	struct ifreq ifr;
+	struct sockaddr_can addr;
+	struct csp_can_config conf = {0};
+	csp_thread_handle_t handle;
+
+	while ((opt = getopt(argc, argv, "i:n:s:")) != -1) {
+		switch (opt) {
+		case 'i': ifc = optarg; break;
+		case 'n': packets = atoi(optarg); break;
+		case 's': size = atoi(optarg); break;
+		default:
+			printf("usage: %s [-i interface] [-n packets] [-s size]\r\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (packets < 1 || size < 1 || size > 256) {
+		printf("Need at least one packet of 1 to 256 bytes\r\n");
+		return 1;
+	}
+
+	csp_buffer_init(100, size + 16);
+	csp_init(MY_ADDRESS);
+	csp_debug_set_level(CSP_ERROR, false);
+	csp_debug_set_level(CSP_WARN, false);
+
+	conf.ifc = ifc;
+	if (csp_can_init(CSP_CAN_MASKED, &conf) != CSP_ERR_NONE) {
+		printf("Failed to open %s\r\n", ifc);
+		return 1;
+	}
+	csp_route_set(PEER_ADDRESS, &csp_if_can, CSP_NODE_MAC);
+	csp_route_start_task(1000, 1);
+	csp_thread_create(task_server, (signed char *) "SERVER", 1000, NULL, 0, &handle);
+
+	peer = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, ifc, IFNAMSIZ - 1);
+	if (peer < 0 || ioctl(peer, SIOCGIFINDEX, &ifr) < 0) {
+		printf("Failed to open %s: %s\r\n", ifc, strerror(errno));
+		return 1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = ifr.ifr_ifindex;
+	if (bind(peer, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		printf("Failed to bind to %s: %s\r\n", ifc, strerror(errno));
+		return 1;
+	}
+	csp_thread_create(task_peer, (signed char *) "PEER", 1000, NULL, 0, &handle);
+
+	frames = (size + sizeof(csp_id_t) + sizeof(uint16_t) + 7) / 8;
+	printf("%s, %u byte packets, %u frames each\r\n", ifc, size, frames);
+
+	/* Latency, one packet in flight */
+	samples = packets < LATENCY_SAMPLES ? packets : LATENCY_SAMPLES;
+	for (i = 0; i < samples; i++) {
+		start = now(CLOCK_MONOTONIC);
+		if (node_send() != 0)
+			break;
+		wait_for(&peer_packets, i + 1);
+		if (peer_packets < i + 1)
+			break;
+		latency = (peer_last - start) * 1e6;
+		sum += latency;
+		if (latency > max)
+			max = latency;
+	}
+	printf("Latency: %u packets, mean %.1f us, max %.1f us\r\n", i, i ? sum / i : 0, max);
+
+	/* Transmit, back to back */
+	peer_frames = peer_packets = 0;
+	start = now(CLOCK_MONOTONIC);
+	cpu = now(CLOCK_PROCESS_CPUTIME_ID);
+	for (i = 0; i < packets; i++)
+		if (node_send() != 0)
+			break;
+	wait_for(&peer_packets, packets);
+	elapsed = peer_last - start;
+	cpu = now(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+	printf("Transmit: %u of %u packets, %u frames in %.2f s, %.0f frames/s, %.2f us CPU per frame\r\n",
+			peer_packets, packets, peer_frames, elapsed, peer_frames / elapsed, cpu * 1e6 / peer_frames);
+
+	/* Receive, back to back */
+	start = now(CLOCK_MONOTONIC);
+	cpu = now(CLOCK_PROCESS_CPUTIME_ID);
+	for (i = 0; i < packets; i++) {
+		while (i > delivered && ((i - delivered + 1) * frames > RX_AHEAD || i - delivered >= CSP_FIFO_INPUT))
+			sched_yield();
+		if (peer_send(i) != 0)
+			break;
+	}
+	wait_for(&delivered, packets);
+	elapsed = delivered_last - start;
+	cpu = now(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+	printf("Receive: %u of %u packets, %u frames in %.2f s, %.0f frames/s, %.2f us CPU per frame\r\n",
+			delivered, packets, delivered * frames, elapsed, delivered * frames / elapsed, cpu * 1e6 / (packets * frames));
+
+	close(peer);
+
+	return (peer_packets == packets && delivered == packets) ? 0 : 1;
+
+}
@@ -0,0 +1,195 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* Connection lookup benchmark
+ *
+ * Fills the connection table and times csp_conn_find() with the full
+ * connection mask, as the router calls it for every packet. Build once with
+ * and once without --enable-conn-hash to compare the index with the linear
+ * scan, and raise --with-max-connections to see how each scales.
+ *
+ * Then the router is started, and packets are sent on every connection in
+ * turn over the loopback interface. The router looks up the connection of
+ * each packet and queues it there, so this is the lookup in the full
+ * receive path. Reports packets per second through the router.
+ *
+ * A second thread keeps closing and reopening half of the connections while
+ * the lookups run, to check that lookups without the lock never return a
+ * connection with another tuple.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <csp/csp.h>
+#include <csp/interfaces/csp_if_lo.h>
+
+/* Using un-exported header files.
+ * This is allowed since we are still in libcsp */
+#include <csp/arch/csp_thread.h>
+#include "csp_conn.h"
+
+#define LOOKUPS 2000000
+#define ROUTED	50000
+
+/* Packets in flight, kept below the router input FIFO length */
+#define WINDOW	((CSP_FIFO_INPUT - 2) < CSP_CONN_MAX ? (CSP_FIFO_INPUT - 2) : CSP_CONN_MAX)
+
+static csp_id_t tuple(int i) {
+
+	csp_id_t id;
+
+	id.ext = 0;
+	id.pri = CSP_PRIO_NORM;
+	id.src = 2 + i % 29;
+	id.dst = 1;
+	id.dport = 16 + i % 47;
+	id.sport = i % 64;
+
+	return id;
+
+}
+
+static csp_conn_t * conns[CSP_CONN_MAX];
+static volatile int running = 1;
+
+CSP_DEFINE_TASK(task_churn) {
+
+	int i;
+	unsigned long cycles = 0;
+
+	while (running) {
+		for (i = 0; i < CSP_CONN_MAX; i += 2) {
+			csp_close(conns[i]);
+			conns[i] = csp_conn_new(tuple(i), tuple(i));
+		}
+		cycles++;
+	}
+
+	printf("Churn thread reopened %lu connections\r\n", cycles * ((CSP_CONN_MAX + 1) / 2));
+
+	return CSP_TASK_RETURN;
+
+}
+
+static double now(void) {
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+
+}
+
+int main(int argc, char * argv[]) {
+
+	int i, j, errors = 0;
+	unsigned long found = 0, routed = 0;
+	double start, hit, miss, elapsed;
+	csp_conn_t * conn;
+	csp_id_t id;
+
+	csp_buffer_init(WINDOW + 10, 300);
+	csp_init(1);
+
+#ifdef CSP_USE_CONN_HASH
+	printf("Connection lookup, hash index, %d connections\r\n", CSP_CONN_MAX);
+#else
+	printf("Connection lookup, linear scan, %d connections\r\n", CSP_CONN_MAX);
+#endif
+
+	for (i = 0; i < CSP_CONN_MAX; i++) {
+		conns[i] = csp_conn_new(tuple(i), tuple(i));
+		if (conns[i] == NULL) {
+			printf("Failed to open connection %d\r\n", i);
+			return 1;
+		}
+	}
+
+	/* Every connection in turn */
+	start = now();
+	for (i = 0; i < LOOKUPS; i++) {
+		id = tuple(i % CSP_CONN_MAX);
+		if (csp_conn_find(id.ext, CSP_ID_CONN_MASK) != NULL)
+			found++;
+	}
+	hit = (now() - start) * 1e9 / LOOKUPS;
+
+	/* A tuple with no connection, the worst case for the scan */
+	id = tuple(0);
+	id.dport = 63;
+	start = now();
+	for (i = 0; i < LOOKUPS; i++)
+		if (csp_conn_find(id.ext, CSP_ID_CONN_MASK) != NULL)
+			errors++;
+	miss = (now() - start) * 1e9 / LOOKUPS;
+
+	printf("Hit  %6.1f ns per lookup (%lu of %d found)\r\n", hit, found, LOOKUPS);
+	printf("Miss %6.1f ns per lookup\r\n", miss);
+
+	/* Through the router. Each connection sends to itself, the outgoing
+	 * tuple of a connection is its incoming tuple */
+	csp_route_start_task(500, 1);
+
+	start = now();
+	for (i = 0; i < ROUTED; i += WINDOW) {
+		for (j = 0; j < WINDOW; j++) {
+			csp_packet_t * packet = csp_buffer_get(10);
+			if (packet == NULL)
+				break;
+			packet->length = 10;
+			if (!csp_send(conns[j], packet, 0))
+				csp_buffer_free(packet);
+		}
+		for (j = 0; j < WINDOW; j++) {
+			csp_packet_t * packet = csp_read(conns[j], 1000);
+			if (packet == NULL)
+				continue;
+			csp_buffer_free(packet);
+			routed++;
+		}
+	}
+	elapsed = now() - start;
+
+	printf("Router %6.0f packets/s over loopback on %d connections (%lu of %d delivered, %"PRIu32" dropped)\r\n",
+			routed / elapsed, WINDOW, routed, i, csp_if_lo.drop);
+	if (routed != (unsigned long) i)
+		errors++;
+
+	/* Lookups racing csp_close and csp_conn_new */
+	csp_thread_handle_t handle_churn;
+	csp_thread_create(task_churn, (signed char *) "CHURN", 1000, NULL, 0, &handle_churn);
+
+	for (i = 0; i < LOOKUPS; i++) {
+		id = tuple(i % CSP_CONN_MAX);
+		conn = csp_conn_find(id.ext, CSP_ID_CONN_MASK);
+		if (conn != NULL && (conn->idin.ext & CSP_ID_CONN_MASK) != (id.ext & CSP_ID_CONN_MASK))
+			errors++;
+	}
+
+	running = 0;
+	csp_sleep_ms(100);
+
+	printf("Wrong connections returned: %d\r\n", errors);
+
+	return errors ? 1 : 0;
+
+}
@@ -0,0 +1,166 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* CRC32 conformance test and benchmark
+ *
+ * Checks the bytewise table against the standard CRC32C check value, then
+ * compares slice-by-8 and, if the CPU has it, SSE4.2 with the bytewise
+ * table on random lengths and alignments. csp_crc32_update() is checked
+ * in two random pieces against one call. Reports bytes per second of each
+ * implementation per packet size. Build with --enable-crc32 and
+ * --with-crc32 slice8 to test all of them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* The implementations are static, so the source is included instead of
+ * linking libcsp. This is allowed since we are still in libcsp */
+#include "csp_crc32.c"
+
+#define ROUNDS		100000
+#define MAXLEN		2048
+#define BYTES		(64 * 1024 * 1024)
+
+#ifdef CSP_USE_CRC32
+
+typedef uint32_t (*crc_func_t)(uint32_t crc, const uint8_t * data, uint32_t length);
+
+typedef struct {
+	const char * name;
+	crc_func_t func;
+} crc_impl_t;
+
+static crc_impl_t impls[3];
+static int impl_count;
+
+static uint8_t buf[MAXLEN + 16];
+static volatile uint32_t sink;
+
+static uint32_t bench_bytewise(uint32_t crc, const uint8_t * data, uint32_t length) {
+	return csp_crc32_bytewise(crc ^ 0xFFFFFFFF, data, length) ^ 0xFFFFFFFF;
+}
+
+#ifdef CSP_CRC32_SLICE8
+static uint32_t bench_slice8(uint32_t crc, const uint8_t * data, uint32_t length) {
+	return csp_crc32_slice8(crc ^ 0xFFFFFFFF, data, length) ^ 0xFFFFFFFF;
+}
+
+#ifdef CSP_CRC32_SSE42
+static uint32_t bench_sse42(uint32_t crc, const uint8_t * data, uint32_t length) {
+	return csp_crc32_sse42(crc ^ 0xFFFFFFFF, data, length) ^ 0xFFFFFFFF;
+}
+#endif
+#endif
+
+static double now(void) {
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+
+}
+
+#endif
+
+int main(int argc, char * argv[]) {
+
+#ifdef CSP_USE_CRC32
+	static const uint32_t sizes[] = {16, 64, 256, 1024};
+	unsigned int i, j, errors = 0;
+	unsigned int seed = 1;
+	uint32_t offset, length, split, expect, crc, rounds, r;
+	double start, elapsed;
+
+	csp_crc32_gentab();
+
+	impls[impl_count++] = (crc_impl_t) {"bytewise", bench_bytewise};
+#ifdef CSP_CRC32_SLICE8
+	impls[impl_count++] = (crc_impl_t) {"slice8", bench_slice8};
+#ifdef CSP_CRC32_SSE42
+	if (crc_sse42)
+		impls[impl_count++] = (crc_impl_t) {"sse4.2", bench_sse42};
+#endif
+#endif
+
+	/* CRC32C check value */
+	crc = bench_bytewise(0, (const uint8_t *) "123456789", 9);
+	if (crc != 0xE3069283) {
+		printf("Bytewise check value %#010"PRIx32", expected 0xe3069283\r\n", crc);
+		errors++;
+	}
+
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = rand_r(&seed);
+
+	for (i = 0; i < ROUNDS; i++) {
+		offset = rand_r(&seed) % 16;
+		length = rand_r(&seed) % (MAXLEN + 1);
+		expect = bench_bytewise(0, &buf[offset], length);
+
+		for (j = 1; j < (unsigned int) impl_count; j++) {
+			if (impls[j].func(0, &buf[offset], length) != expect) {
+				if (errors++ < 10)
+					printf("%s differs at offset %"PRIu32" length %"PRIu32"\r\n", impls[j].name, offset, length);
+			}
+		}
+
+		split = length ? rand_r(&seed) % length : 0;
+		crc = csp_crc32_update(0, &buf[offset], split);
+		crc = csp_crc32_update(crc, &buf[offset + split], length - split);
+		if (crc != expect || csp_crc32_memory(&buf[offset], length) != expect) {
+			if (errors++ < 10)
+				printf("csp_crc32_update differs at offset %"PRIu32" length %"PRIu32" split %"PRIu32"\r\n", offset, length, split);
+		}
+	}
+
+	printf("%d random lengths and alignments checked\r\n", ROUNDS);
+
+	printf("Size");
+	for (j = 0; j < (unsigned int) impl_count; j++)
+		printf("  %13s", impls[j].name);
+	printf("\r\n");
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		printf("%4"PRIu32, sizes[i]);
+		rounds = BYTES / sizes[i];
+		for (j = 0; j < (unsigned int) impl_count; j++) {
+			crc = 0;
+			start = now();
+			for (r = 0; r < rounds; r++)
+				crc = impls[j].func(crc, buf, sizes[i]);
+			elapsed = now() - start;
+			sink = crc;
+			printf("  %8.0f MB/s", (double) rounds * sizes[i] / elapsed / 1e6);
+		}
+		printf("\r\n");
+	}
+
+	printf("Errors: %u\r\n", errors);
+
+	return errors ? 1 : 0;
+#else
+	printf("Build with --enable-crc32\r\n");
+	return 0;
+#endif
+
+}
@@ -0,0 +1,247 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* HMAC conformance test and benchmark
+ *
+ * Checks SHA1 against the FIPS 180 examples and HMAC-SHA1 against the
+ * RFC 2202 test cases. Packet trailers from csp_hmac_append() and the
+ * stream helpers are checked against csp_hmac_memory() with the derived
+ * key, first from THREADS tasks at once before any key is set, then after
+ * csp_hmac_set_key(). Reports packets per second for 10 to 50 byte and
+ * MTU sized packets.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <csp/csp.h>
+
+/* Using un-exported header files.
+ * This is allowed since we are still in libcsp */
+#include <csp/arch/csp_thread.h>
+#include "crypto/csp_hmac.h"
+#include "crypto/csp_sha1.h"
+
+#define THREADS		4
+#define ROUNDS		20000
+#define MTU			256
+#define PACKETS		200000
+
+#ifdef CSP_USE_HMAC
+
+typedef struct {
+	const char * msg;
+	uint32_t repeat;
+	const char * digest;
+} sha1_vector_t;
+
+/* FIPS 180 examples */
+static const sha1_vector_t sha1_vectors[] = {
+	{"abc", 1, "a9993e364706816aba3e25717850c26c9cd0d89d"},
+	{"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1, "84983e441c3bd26ebaae4aa1f95129e5e54670f1"},
+	{"a", 1000000, "34aa973cd4c4daa4f61eeb2bdbad27316534016f"},
+};
+
+typedef struct {
+	uint8_t key_byte;			/* Key is key_byte repeated, or 1, 2, ... if 0 */
+	uint32_t keylen;
+	const char * key;			/* Overrides key_byte if set */
+	uint8_t data_byte;			/* Data is data_byte repeated */
+	uint32_t datalen;
+	const char * data;			/* Overrides data_byte if set */
+	const char * digest;
+} hmac_vector_t;
+
+/* RFC 2202 test cases 1 to 7 */
+static const hmac_vector_t hmac_vectors[] = {
+	{0x0b, 20, NULL, 0, 0, "Hi There", "b617318655057264e28bc0b6fb378c8ef146be00"},
+	{0, 4, "Jefe", 0, 0, "what do ya want for nothing?", "effcdf6ae5eb2fa2d27416d5f184df9c259a7c79"},
+	{0xaa, 20, NULL, 0xdd, 50, NULL, "125d7342b9ac11cd91a39af48aa17b4f63f175d3"},
+	{0, 25, NULL, 0xcd, 50, NULL, "4c9007f4026250c6bc8414f9bf50c86c2d7235da"},
+	{0x0c, 20, NULL, 0, 0, "Test With Truncation", "4c1a03424b55e07fe7f27be1d58bb9324a9a5a04"},
+	{0xaa, 80, NULL, 0, 0, "Test Using Larger Than Block-Size Key - Hash Key First", "aa4ae5e15272d00e95705637ce8a3b55ed402112"},
+	{0xaa, 80, NULL, 0, 0, "Test Using Larger Than Block-Size Key and Larger Than One Block-Size Data", "e8e99d0f45237d786d6bbaa7965c7808bbff1a91"},
+};
+
+/* First 16 bytes of SHA1 of the key string, as csp_hmac_set_key() derives it */
+static uint8_t packet_key[SHA1_DIGESTSIZE];
+
+static volatile unsigned int errors;
+static volatile unsigned int done;
+
+static int digest_is(const uint8_t * digest, const char * hex) {
+
+	char str[2 * SHA1_DIGESTSIZE + 1];
+	unsigned int i;
+
+	for (i = 0; i < SHA1_DIGESTSIZE; i++)
+		sprintf(&str[2 * i], "%02x", digest[i]);
+
+	return strcmp(str, hex) == 0;
+
+}
+
+/* Check the trailer of a packet with length bytes of seed data */
+static unsigned int check_packet(csp_packet_t * packet, uint32_t length, unsigned int seed) {
+
+	uint8_t expect[SHA1_DIGESTSIZE], trailer[CSP_HMAC_LENGTH];
+	csp_hmac_stream_t stream;
+	uint32_t i, split;
+	unsigned int failed = 0;
+
+	for (i = 0; i < length; i++)
+		packet->data[i] = rand_r(&seed);
+	packet->length = length;
+
+	csp_hmac_memory(packet_key, 16, packet->data, length, expect);
+
+	split = length / 3;
+	csp_hmac_stream_init(&stream);
+	csp_hmac_stream_process(&stream, packet->data, split);
+	csp_hmac_stream_process(&stream, &packet->data[split], length - split);
+	csp_hmac_stream_done(&stream, trailer);
+	if (memcmp(trailer, expect, CSP_HMAC_LENGTH) != 0)
+		failed++;
+
+	csp_hmac_append(packet);
+	if (memcmp(&packet->data[length], expect, CSP_HMAC_LENGTH) != 0)
+		failed++;
+	if (csp_hmac_verify(packet) != CSP_ERR_NONE || packet->length != length)
+		failed++;
+
+	return failed;
+
+}
+
+/* Sends before any key is set, at the same time as the other tasks */
+CSP_DEFINE_TASK(task_nokey) {
+
+	unsigned int seed = (uintptr_t) param, i, failed = 0;
+	csp_packet_t * packet = csp_buffer_get(MTU);
+
+	for (i = 0; i < ROUNDS && packet != NULL; i++)
+		failed += check_packet(packet, rand_r(&seed) % (MTU - CSP_HMAC_LENGTH), seed + i);
+
+	if (packet != NULL)
+		csp_buffer_free(packet);
+	else
+		failed++;
+
+	__sync_fetch_and_add(&errors, failed);
+	__sync_fetch_and_add(&done, 1);
+
+	return CSP_TASK_RETURN;
+
+}
+
+static double now(void) {
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+
+}
+
+#endif
+
+int main(int argc, char * argv[]) {
+
+#ifdef CSP_USE_HMAC
+	static const uint32_t sizes[] = {10, 20, 30, 40, 50, MTU - CSP_HMAC_LENGTH};
+	uint8_t key[80], data[80], digest[SHA1_DIGESTSIZE];
+	const uint8_t * k, * d;
+	csp_sha1_state sha1;
+	csp_packet_t * packet;
+	csp_thread_handle_t handle;
+	unsigned int i, j;
+	uintptr_t t;
+	double start, elapsed;
+
+	csp_buffer_init(10, 300);
+
+	for (i = 0; i < sizeof(sha1_vectors) / sizeof(sha1_vectors[0]); i++) {
+		csp_sha1_init(&sha1);
+		for (j = 0; j < sha1_vectors[i].repeat; j++)
+			csp_sha1_process(&sha1, (const uint8_t *) sha1_vectors[i].msg, strlen(sha1_vectors[i].msg));
+		csp_sha1_done(&sha1, digest);
+		if (!digest_is(digest, sha1_vectors[i].digest)) {
+			printf("SHA1 example %u failed\r\n", i + 1);
+			errors++;
+		}
+	}
+
+	for (i = 0; i < sizeof(hmac_vectors) / sizeof(hmac_vectors[0]); i++) {
+		const hmac_vector_t * v = &hmac_vectors[i];
+		for (j = 0; j < v->keylen; j++)
+			key[j] = v->key_byte ? v->key_byte : j + 1;
+		memset(data, v->data_byte, sizeof(data));
+		k = v->key ? (const uint8_t *) v->key : key;
+		d = v->data ? (const uint8_t *) v->data : data;
+		csp_hmac_memory(k, v->keylen, d, v->data ? strlen(v->data) : v->datalen, digest);
+		if (!digest_is(digest, v->digest)) {
+			printf("RFC 2202 test case %u failed\r\n", i + 1);
+			errors++;
+		}
+	}
+
+	/* Without a key, packets use the all-zero key */
+	memset(packet_key, 0, sizeof(packet_key));
+	for (t = 1; t <= THREADS; t++)
+		csp_thread_create(task_nokey, (signed char *) "NOKEY", 1000, (void *) t, 0, &handle);
+	while (done < THREADS)
+		csp_sleep_ms(10);
+
+	csp_hmac_set_key("benchmark hmac key", 18);
+	csp_sha1_memory((const uint8_t *) "benchmark hmac key", 18, packet_key);
+
+	packet = csp_buffer_get(MTU);
+	if (packet == NULL)
+		return 1;
+
+	for (i = 0; i < ROUNDS; i++)
+		errors += check_packet(packet, i % (MTU - CSP_HMAC_LENGTH), i);
+
+	printf("SHA1, RFC 2202 and %u packet trailers checked\r\n", (THREADS + 1) * ROUNDS);
+
+	printf("Size  Packets/s\r\n");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		memset(packet->data, 0x55, sizes[i]);
+		start = now();
+		for (j = 0; j < PACKETS; j++) {
+			packet->length = sizes[i];
+			csp_hmac_append(packet);
+		}
+		elapsed = now() - start;
+		printf("%4"PRIu32"  %9.0f\r\n", sizes[i], PACKETS / elapsed);
+	}
+
+	csp_buffer_free(packet);
+
+	printf("Errors: %u\r\n", errors);
+
+	return errors ? 1 : 0;
+#else
+	printf("Build with --enable-hmac\r\n");
+	return 0;
+#endif
+
+}
@@ -0,0 +1,163 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* KISS transmit benchmark
+ *
+ * Sends KISS frames into a pseudo terminal, once with the byte at a time
+ * putc function and once with a write function that takes whole frames,
+ * see csp_kiss_set_write(). Half the payload bytes need escaping. A reader
+ * on the other end of the terminal counts the frames. Reports frames per
+ * second and write() calls per frame for both. Build with --enable-if-kiss.
+ *
+ * usage: bench_kiss [packets] [size]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pty.h>
+#include <termios.h>
+
+#include <csp/csp.h>
+#include <csp/interfaces/csp_if_kiss.h>
+
+/* Using un-exported header file.
+ * This is allowed since we are still in libcsp */
+#include <csp/arch/csp_thread.h>
+
+#define MY_ADDRESS	1
+#define FEND		0xC0
+
+static int master, slave;
+static csp_iface_t csp_if_kiss;
+static csp_kiss_handle_t csp_kiss_driver;
+static volatile unsigned int writes, frame_ends;
+
+static double now(void) {
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+
+}
+
+static void kiss_putc(char c) {
+
+	writes++;
+	if (write(slave, &c, 1) != 1)
+		printf("write failed\r\n");
+
+}
+
+static void kiss_write(char * buf, int len) {
+
+	writes++;
+	if (write(slave, buf, len) != len)
+		printf("write failed\r\n");
+
+}
+
+/* Every frame starts and ends with FEND */
+CSP_DEFINE_TASK(task_reader) {
+
+	int i, n;
+	uint8_t buf[4096];
+
+	while ((n = read(master, buf, sizeof(buf))) > 0)
+		for (i = 0; i < n; i++)
+			if (buf[i] == FEND)
+				frame_ends++;
+
+	return CSP_TASK_RETURN;
+
+}
+
+static void run(csp_iface_t * ifc, const char * mode, unsigned int packets, unsigned int size) {
+
+	unsigned int i, j;
+	double start, elapsed;
+	csp_packet_t * packet;
+
+	writes = frame_ends = 0;
+	srand(1);
+
+	start = now();
+	for (i = 0; i < packets; i++) {
+		packet = csp_buffer_get(size);
+		if (packet == NULL)
+			break;
+		/* Every other byte is FEND, FESC or close to them */
+		for (j = 0; j < size; j++)
+			packet->data[j] = (rand() & 1) ? FEND + rand() % 30 : rand();
+		packet->length = size;
+		packet->id.ext = 0x12345678;
+		if (ifc->nexthop(ifc, packet, 1000) != CSP_ERR_NONE)
+			csp_buffer_free(packet);
+	}
+	while (frame_ends < 2 * i && now() - start < 30)
+		csp_sleep_ms(1);
+	elapsed = now() - start;
+
+	printf("%-5s %u of %u frames, %.0f frames/s, %.1f writes/frame\r\n",
+			mode, frame_ends / 2, packets, frame_ends / 2 / elapsed, (double) writes / packets);
+
+}
+
+int main(int argc, char * argv[]) {
+
+	unsigned int packets = 20000, size = 200;
+	struct termios tio;
+	csp_thread_handle_t reader;
+
+	if (argc > 1)
+		packets = atoi(argv[1]);
+	if (argc > 2)
+		size = atoi(argv[2]);
+	if (packets < 1 || size > CSP_KISS_MTU) {
+		printf("usage: %s [packets] [size], size at most %d\r\n", argv[0], CSP_KISS_MTU);
+		return 1;
+	}
+
+	if (openpty(&master, &slave, NULL, NULL, NULL) != 0) {
+		printf("openpty failed\r\n");
+		return 1;
+	}
+	tcgetattr(slave, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(slave, TCSANOW, &tio);
+
+	csp_buffer_init(10, 300);
+	csp_init(MY_ADDRESS);
+
+	csp_kiss_init(&csp_if_kiss, &csp_kiss_driver, kiss_putc, NULL, "KISS");
+	csp_thread_create(task_reader, (signed char *) "READER", 1000, NULL, 0, &reader);
+
+	printf("%u byte packets over a pseudo terminal\r\n", size);
+	run(&csp_if_kiss, "putc", packets, size);
+	csp_kiss_set_write(&csp_kiss_driver, kiss_write);
+	run(&csp_if_kiss, "write", packets, size);
+
+	return 0;
+
+}
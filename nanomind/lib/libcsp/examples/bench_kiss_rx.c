@@ -0,0 +1,300 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* KISS receive benchmark
+ *
+ * Writes KISS frames into a pseudo terminal, paced to the byte rate of a
+ * 115200 and a 1000000 baud line and then as fast as the terminal takes
+ * them. The Linux usart driver reads the other end and hands each read()
+ * buffer to csp_kiss_rx_buf(), which delivers the packets to a socket.
+ * The unpaced run stays a few frames ahead of the socket, so the router
+ * input queue never overflows. Reports frames per second, driver reads per
+ * frame and the CPU time spent in csp_kiss_rx_buf() per frame, with the
+ * frames the decoder rejected and those the router input queue dropped.
+ * A paced run can still drop a few small frames when the writer catches up
+ * in a burst on a loaded host. Build with --enable-if-kiss
+ * --with-driver-usart linux.
+ *
+ * usage: bench_kiss_rx [size] [seconds]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pty.h>
+#include <sched.h>
+
+#include <csp/csp.h>
+#include <csp/csp_endian.h>
+#include <csp/csp_crc32.h>
+#include <csp/interfaces/csp_if_kiss.h>
+#include <csp/drivers/usart.h>
+
+/* Using un-exported header file.
+ * This is allowed since we are still in libcsp */
+#include <csp/arch/csp_thread.h>
+
+#define MY_ADDRESS		1
+#define PEER_ADDRESS	2
+#define MY_PORT			10
+#define PEER_PORT		20
+
+#define FEND			0xC0
+#define FESC			0xDB
+#define TFEND			0xDC
+#define TFESC			0xDD
+#define TNC_DATA		0x00
+
+/* Frames written in the unpaced run, and how far it runs ahead of the
+ * socket. The router input queue holds CSP_FIFO_INPUT packets */
+#define UNPACED_FRAMES	20000
+#define UNPACED_AHEAD	CSP_FIFO_INPUT
+
+static int master;
+static csp_iface_t csp_if_kiss;
+static csp_kiss_handle_t csp_kiss_driver;
+static volatile unsigned int reads, delivered;
+static volatile double rx_cpu, delivered_last;
+
+static double now(clockid_t clock) {
+
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+
+}
+
+/* Called from the driver thread with everything one read() returned */
+static void usart_rx(uint8_t * buf, int len, void * pxTaskWoken) {
+
+	double start = now(CLOCK_THREAD_CPUTIME_ID);
+
+	reads++;
+	csp_kiss_rx_buf(&csp_if_kiss, buf, len, pxTaskWoken);
+	rx_cpu += now(CLOCK_THREAD_CPUTIME_ID) - start;
+
+}
+
+static void kiss_putc(char c) {
+
+}
+
+CSP_DEFINE_TASK(task_server) {
+
+	csp_packet_t * packet;
+	csp_socket_t * sock = csp_socket(CSP_SO_CONN_LESS);
+
+	csp_bind(sock, MY_PORT);
+
+	while (1) {
+		packet = csp_recvfrom(sock, CSP_MAX_DELAY);
+		if (packet == NULL)
+			continue;
+		csp_buffer_free(packet);
+		delivered_last = now(CLOCK_MONOTONIC);
+		delivered++;
+	}
+
+	return CSP_TASK_RETURN;
+
+}
+
+/* Encode a packet as a KISS frame, half the payload bytes need escaping */
+static unsigned int encode(uint8_t * out, unsigned int size, unsigned int seq) {
+
+	uint8_t raw[sizeof(csp_id_t) + CSP_KISS_MTU + sizeof(uint32_t)];
+	unsigned int i, n = 0, len = sizeof(csp_id_t) + size + sizeof(uint32_t);
+	csp_id_t id;
+	uint32_t crc;
+
+	id.ext = 0;
+	id.pri = CSP_PRIO_NORM;
+	id.src = PEER_ADDRESS;
+	id.dst = MY_ADDRESS;
+	id.dport = MY_PORT;
+	id.sport = PEER_PORT;
+	id.ext = csp_hton32(id.ext);
+	memcpy(raw, &id, sizeof(id));
+	for (i = 0; i < size; i++)
+		raw[sizeof(id) + i] = (i & 1) ? FEND + (i + seq) % 30 : i + seq;
+	crc = csp_hton32(csp_crc32_memory(raw + sizeof(id), size));
+	memcpy(raw + sizeof(id) + size, &crc, sizeof(crc));
+
+	out[n++] = FEND;
+	out[n++] = TNC_DATA;
+	for (i = 0; i < len; i++) {
+		if (raw[i] == FEND) {
+			out[n++] = FESC;
+			out[n++] = TFEND;
+		} else if (raw[i] == FESC) {
+			out[n++] = FESC;
+			out[n++] = TFESC;
+		} else {
+			out[n++] = raw[i];
+		}
+	}
+	out[n++] = FEND;
+
+	return n;
+
+}
+
+/* Write the frames to the terminal, at baud / 10 bytes per second unless baud is 0.
+ * Frame i is the bytes from offsets[i] to offsets[i + 1] of the stream */
+static int run(const uint8_t * stream, const unsigned int * offsets, unsigned int frames, unsigned int baud) {
+
+	unsigned int offset = 0, end, slice, frame = 0, last;
+	uint32_t rx_error = csp_if_kiss.rx_error, drop = csp_if_kiss.drop;
+	double start, next, elapsed, progress;
+	int n;
+
+	reads = delivered = 0;
+	rx_cpu = 0;
+	start = next = now(CLOCK_MONOTONIC);
+
+	/* Paced runs write a millisecond worth of bytes at a time */
+	slice = baud / 10 / 1000;
+	if (slice < 1)
+		slice = 1;
+
+	while (offset < offsets[frames]) {
+		if (baud) {
+			end = offset + slice;
+			if (end > offsets[frames])
+				end = offsets[frames];
+		} else {
+			while (frame - delivered >= UNPACED_AHEAD)
+				sched_yield();
+			last = frame;
+			while (frame < frames && frame - delivered < UNPACED_AHEAD)
+				frame++;
+			end = offsets[frame];
+			if (frame == last)
+				continue;
+		}
+		while (offset < end) {
+			n = write(master, stream + offset, end - offset);
+			if (n < 0) {
+				printf("write failed\r\n");
+				return -1;
+			}
+			offset += n;
+		}
+		if (baud) {
+			next += 0.001;
+			while (now(CLOCK_MONOTONIC) < next)
+				csp_sleep_ms(1);
+		}
+	}
+
+	/* Wait until the frames are in, or nothing arrives for a second */
+	last = delivered;
+	progress = now(CLOCK_MONOTONIC);
+	while (delivered < frames && now(CLOCK_MONOTONIC) - progress < 1) {
+		csp_sleep_ms(1);
+		if (delivered != last) {
+			last = delivered;
+			progress = now(CLOCK_MONOTONIC);
+		}
+	}
+	elapsed = delivered_last - start;
+
+	if (baud)
+		printf("%7u baud: ", baud);
+	else
+		printf("unpaced:      ");
+	printf("%u of %u frames, %.0f frames/s, %.2f reads/frame, %.2f us CPU per frame, %"PRIu32" rx errors, %"PRIu32" router drops\r\n",
+			delivered, frames, delivered ? delivered / elapsed : 0, delivered ? (double) reads / delivered : 0,
+			delivered ? rx_cpu * 1e6 / delivered : 0, csp_if_kiss.rx_error - rx_error, csp_if_kiss.drop - drop);
+
+	/* Every frame must be decoded, the router may drop some in bursts */
+	return (csp_if_kiss.rx_error == rx_error && delivered + csp_if_kiss.drop - drop == frames) ? 0 : -1;
+
+}
+
+int main(int argc, char * argv[]) {
+
+	static const unsigned int rates[] = {115200, 1000000, 0};
+	unsigned int size = 200, seconds = 2, frame_max, frames, i, r;
+	unsigned int * offsets;
+	int slave, ret = 0;
+	char name[64];
+	uint8_t * stream;
+	struct usart_conf conf = {0};
+	csp_thread_handle_t handle;
+
+	if (argc > 1)
+		size = atoi(argv[1]);
+	if (argc > 2)
+		seconds = atoi(argv[2]);
+	if (size < 1 || size > CSP_KISS_MTU || seconds < 1) {
+		printf("usage: %s [size] [seconds], size 1 to %d\r\n", argv[0], CSP_KISS_MTU);
+		return 1;
+	}
+
+	if (openpty(&master, &slave, name, NULL, NULL) != 0) {
+		printf("openpty failed\r\n");
+		return 1;
+	}
+
+	csp_buffer_init(40, 300);
+	csp_init(MY_ADDRESS);
+	csp_debug_set_level(CSP_ERROR, false);
+	csp_debug_set_level(CSP_WARN, false);
+
+	csp_kiss_init(&csp_if_kiss, &csp_kiss_driver, kiss_putc, NULL, "KISS");
+	csp_route_start_task(1000, 1);
+	csp_thread_create(task_server, (signed char *) "SERVER", 1000, NULL, 0, &handle);
+
+	/* The driver thread reads the slave end */
+	conf.device = name;
+	conf.baudrate = 115200;
+	usart_set_callback(usart_rx);
+	usart_init(&conf);
+	csp_sleep_ms(100);
+
+	/* Worst case every byte is escaped */
+	frame_max = 2 * (sizeof(csp_id_t) + size + sizeof(uint32_t)) + 3;
+	printf("%u byte packets over %s\r\n", size, name);
+
+	for (r = 0; r < sizeof(rates) / sizeof(rates[0]); r++) {
+		frames = rates[r] ? rates[r] / 10 * seconds / frame_max + 1 : UNPACED_FRAMES;
+		stream = malloc(frames * frame_max);
+		offsets = malloc((frames + 1) * sizeof(*offsets));
+		if (stream == NULL || offsets == NULL) {
+			printf("Out of memory\r\n");
+			return 1;
+		}
+		offsets[0] = 0;
+		for (i = 0; i < frames; i++)
+			offsets[i + 1] = offsets[i] + encode(stream + offsets[i], size, i);
+		if (run(stream, offsets, frames, rates[r]) != 0)
+			ret = 1;
+		free(offsets);
+		free(stream);
+	}
+
+	return ret;
+
+}
@@ -0,0 +1,177 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* Promiscuous capture benchmark
+ *
+ * First times the capture step alone: the full buffer copy the router used
+ * to make for the promiscuous queue, against the shared reference it takes
+ * now. Then sends packets through the loopback interface with promiscuous
+ * mode on, and reports how many packets per second are both delivered to a
+ * connectionless socket and captured. The loopback part needs
+ * --enable-promisc.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+
+#include <csp/csp.h>
+
+/* Using un-exported header files.
+ * This is allowed since we are still in libcsp */
+#include <csp/arch/csp_thread.h>
+#include <csp/arch/csp_queue.h>
+#include "csp_route.h"
+
+#define MY_ADDRESS	1
+#define MY_PORT		10
+#define BUF_SIZE	256
+#define CAPTURES	1000000
+#define PACKETS		200000
+#define WINDOW		8
+
+static volatile unsigned int delivered, captured;
+
+static double now(void) {
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+
+}
+
+/* Time one capture step, copy or shared, ns per packet */
+static double capture_step(int shared, unsigned int length) {
+
+	unsigned int i;
+	double start;
+	csp_packet_t * packet, * copy;
+	csp_queue_handle_t queue = csp_queue_create(1, sizeof(csp_packet_t *));
+
+	start = now();
+	for (i = 0; i < CAPTURES; i++) {
+		packet = csp_buffer_get(length);
+		packet->length = length;
+		memset(packet->data, i, length);
+		if (shared)
+			copy = csp_buffer_clone_ref(packet);
+		else
+			copy = csp_buffer_clone(packet);
+		csp_queue_enqueue(queue, &copy, 0);
+		csp_buffer_free(packet);
+		csp_queue_dequeue(queue, &copy, 0);
+		csp_buffer_free(copy);
+	}
+
+	csp_queue_remove(queue);
+
+	return (now() - start) * 1e9 / CAPTURES;
+
+}
+
+#ifdef CSP_USE_PROMISC
+CSP_DEFINE_TASK(task_server) {
+
+	csp_packet_t * packet;
+	csp_socket_t * sock = csp_socket(CSP_SO_CONN_LESS);
+
+	csp_bind(sock, MY_PORT);
+
+	while (1) {
+		packet = csp_recvfrom(sock, CSP_MAX_DELAY);
+		if (packet == NULL)
+			continue;
+		delivered++;
+		csp_buffer_free(packet);
+	}
+
+	return CSP_TASK_RETURN;
+
+}
+
+CSP_DEFINE_TASK(task_capture) {
+
+	csp_packet_t * packet;
+
+	while (1) {
+		packet = csp_promisc_read(CSP_MAX_DELAY);
+		if (packet == NULL)
+			continue;
+		captured++;
+		csp_buffer_free(packet);
+	}
+
+	return CSP_TASK_RETURN;
+
+}
+#endif
+
+int main(int argc, char * argv[]) {
+
+	unsigned int i;
+
+	csp_buffer_init(64, BUF_SIZE);
+	csp_init(MY_ADDRESS);
+
+	printf("Capture step, %d byte buffers\r\n", BUF_SIZE);
+	printf("  length  copy ns  shared ns\r\n");
+	for (i = 16; i <= 192; i *= 2)
+		printf("  %6u  %7.1f  %9.1f\r\n", i, capture_step(0, i), capture_step(1, i));
+
+#ifdef CSP_USE_PROMISC
+	unsigned int sent = 0;
+	double start, elapsed;
+	csp_packet_t * packet;
+	csp_thread_handle_t handle;
+
+	csp_debug_set_level(CSP_ERROR, false);
+	csp_route_start_task(500, 1);
+	csp_promisc_enable(100);
+	csp_thread_create(task_server, (signed char *) "SERVER", 1000, NULL, 0, &handle);
+	csp_thread_create(task_capture, (signed char *) "CAPTURE", 1000, NULL, 0, &handle);
+	csp_sleep_ms(100);
+
+	start = now();
+	for (i = 0; i < PACKETS; i++) {
+		/* Keep the router input FIFO from overflowing */
+		while (sent - delivered >= WINDOW || sent - captured >= WINDOW)
+			sched_yield();
+		packet = csp_buffer_get(200);
+		if (packet == NULL)
+			continue;
+		packet->length = 200;
+		if (csp_sendto(CSP_PRIO_NORM, MY_ADDRESS, MY_PORT, 0, CSP_O_NONE, packet, 0) != CSP_ERR_NONE)
+			csp_buffer_free(packet);
+		else
+			sent++;
+	}
+	while ((delivered < sent || captured < sent) && now() - start < 30)
+		csp_sleep_ms(1);
+	elapsed = now() - start;
+
+	printf("Loopback with capture: %u sent, %u delivered, %u captured, %.0f packets/s\r\n",
+			sent, delivered, captured, delivered / elapsed);
+#endif
+
+	return 0;
+
+}
@@ -0,0 +1,121 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* Queue benchmark
+ *
+ * 1 to MAX_PRODUCERS producer threads enqueue time stamped items into one
+ * CSP queue, the length of the router input FIFO, and a single consumer
+ * dequeues them, as the router task does. Reports items per second and the
+ * median and 99th percentile time from enqueue to dequeue. Build with
+ * --with-posix-queue pthread and ring to compare the two backends.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <csp/csp.h>
+
+/* Using un-exported header files.
+ * This is allowed since we are still in libcsp */
+#include <csp/arch/csp_thread.h>
+#include <csp/arch/csp_queue.h>
+
+#define MAX_PRODUCERS	4
+#define ITEMS			200000
+
+static csp_queue_handle_t queue;
+static uint32_t latency[ITEMS];
+static unsigned int producer_items;
+
+static uint64_t now_ns(void) {
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+}
+
+CSP_DEFINE_TASK(task_producer) {
+
+	unsigned int i;
+	uint64_t stamp;
+
+	for (i = 0; i < producer_items; i++) {
+		stamp = now_ns();
+		csp_queue_enqueue(queue, &stamp, CSP_MAX_DELAY);
+	}
+
+	return CSP_TASK_RETURN;
+
+}
+
+static int compare(const void * a, const void * b) {
+
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+	return (x > y) - (x < y);
+
+}
+
+int main(int argc, char * argv[]) {
+
+	unsigned int p, i, total;
+	uint64_t stamp, start, elapsed;
+	csp_thread_handle_t handle;
+
+	queue = csp_queue_create(CSP_FIFO_INPUT, sizeof(uint64_t));
+
+#ifdef CSP_POSIX_RING_QUEUE
+	printf("Ring queue, length %d\r\n", CSP_FIFO_INPUT);
+#else
+	printf("Pthread queue, length %d\r\n", CSP_FIFO_INPUT);
+#endif
+	printf("Producers  items/s  median ns  p99 ns\r\n");
+
+	for (p = 1; p <= MAX_PRODUCERS; p++) {
+
+		producer_items = ITEMS / p;
+		total = producer_items * p;
+
+		start = now_ns();
+		for (i = 0; i < p; i++)
+			csp_thread_create(task_producer, (signed char *) "PRODUCER", 1000, NULL, 0, &handle);
+
+		for (i = 0; i < total; i++) {
+			csp_queue_dequeue(queue, &stamp, CSP_MAX_DELAY);
+			latency[i] = now_ns() - stamp;
+		}
+		elapsed = now_ns() - start;
+
+		qsort(latency, total, sizeof(latency[0]), compare);
+		printf("%9u  %7.0f  %9u  %6u\r\n", p, total * 1e9 / elapsed,
+				latency[total / 2], latency[total - total / 100 - 1]);
+
+		/* Let the producers exit before the next round */
+		csp_sleep_ms(10);
+
+	}
+
+	csp_queue_remove(queue);
+
+	return 0;
+
+}
@@ -0,0 +1,145 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* Router throughput benchmark
+ *
+ * SENDERS tasks send HMAC authenticated, XTEA encrypted packets over the
+ * loopback interface, each from its own source port, to a connectionless
+ * socket that requires both. The router verifies and decrypts every
+ * packet, so it is the bottleneck. Reports delivered packets per second
+ * and the packets dropped by the router. Build with --enable-hmac
+ * --enable-xtea and --with-router-workers 0, 1, 2 and 4 to compare.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+
+#include <csp/csp.h>
+#include <csp/interfaces/csp_if_lo.h>
+
+/* Using un-exported header file.
+ * This is allowed since we are still in libcsp */
+#include <csp/arch/csp_thread.h>
+
+#define MY_ADDRESS	1
+#define MY_PORT		10
+#define SENDERS		4
+#define PACKETS		100000
+#define LENGTH		200
+
+/* Packets in flight, kept below the router input FIFO length */
+#define WINDOW		(CSP_FIFO_INPUT - 2)
+
+static volatile unsigned int sent, delivered, done;
+
+CSP_DEFINE_TASK(task_server) {
+
+	csp_packet_t * packet;
+	csp_socket_t * sock = csp_socket(CSP_SO_CONN_LESS | CSP_SO_HMACREQ | CSP_SO_XTEAREQ);
+
+	csp_bind(sock, MY_PORT);
+
+	while (1) {
+		packet = csp_recvfrom(sock, CSP_MAX_DELAY);
+		if (packet == NULL)
+			continue;
+		__sync_fetch_and_add(&delivered, 1);
+		csp_buffer_free(packet);
+	}
+
+	return CSP_TASK_RETURN;
+
+}
+
+CSP_DEFINE_TASK(task_sender) {
+
+	unsigned int i;
+	uint8_t sport = (uintptr_t) param;
+	csp_packet_t * packet;
+
+	for (i = 0; i < PACKETS / SENDERS; i++) {
+		while (sent - (delivered + csp_if_lo.drop) >= WINDOW)
+			sched_yield();
+		packet = csp_buffer_get(LENGTH);
+		if (packet == NULL) {
+			i--;
+			sched_yield();
+			continue;
+		}
+		memset(packet->data, i, LENGTH);
+		packet->length = LENGTH;
+		__sync_fetch_and_add(&sent, 1);
+		if (csp_sendto(CSP_PRIO_NORM, MY_ADDRESS, MY_PORT, sport, CSP_O_HMAC | CSP_O_XTEA, packet, 0) != CSP_ERR_NONE) {
+			__sync_fetch_and_sub(&sent, 1);
+			csp_buffer_free(packet);
+		}
+	}
+
+	__sync_fetch_and_add(&done, 1);
+
+	return CSP_TASK_RETURN;
+
+}
+
+static double now(void) {
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+
+}
+
+int main(int argc, char * argv[]) {
+
+#if defined(CSP_USE_HMAC) && defined(CSP_USE_XTEA)
+	uintptr_t i;
+	double start, elapsed;
+	csp_thread_handle_t handle;
+
+	csp_buffer_init(100, 300);
+	csp_init(MY_ADDRESS);
+	csp_hmac_set_key("benchmark hmac key", 18);
+	csp_xtea_set_key("benchmark xtea key", 18);
+	csp_route_start_task(500, 1);
+
+	csp_debug_set_level(CSP_WARN, false);
+	csp_thread_create(task_server, (signed char *) "SERVER", 1000, NULL, 0, &handle);
+	csp_sleep_ms(100);
+
+	start = now();
+	for (i = 0; i < SENDERS; i++)
+		csp_thread_create(task_sender, (signed char *) "SENDER", 1000, (void *) (16 + i), 0, &handle);
+	while ((done < SENDERS || delivered + csp_if_lo.drop < sent) && now() - start < 60)
+		csp_sleep_ms(1);
+	elapsed = now() - start;
+
+	printf("%d router workers, HMAC and XTEA: %u sent, %u delivered, %"PRIu32" dropped, %.0f packets/s\r\n",
+			CSP_ROUTER_WORKERS, sent, delivered, csp_if_lo.drop, delivered / elapsed);
+
+	return (delivered + csp_if_lo.drop == sent) ? 0 : 1;
+#else
+	printf("Build with --enable-hmac and --enable-xtea\r\n");
+	return 0;
+#endif
+
+}
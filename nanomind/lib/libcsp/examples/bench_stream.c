@@ -0,0 +1,164 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* RDP stream benchmark
+ *
+ * Moves 10 MB with csp_stream_write() and csp_stream_read() over an RDP
+ * connection on the loopback interface and checks every byte. Reports the
+ * throughput and the CPU time of the process, which runs both ends and the
+ * router. Build with --enable-rdp. The window is limited to half the router
+ * queue, so build with e.g. --with-router-queue-length 64 to use the full
+ * RDP window.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <csp/csp.h>
+#include <csp/interfaces/csp_if_lo.h>
+
+/* Using un-exported header file.
+ * This is allowed since we are still in libcsp */
+#include <csp/arch/csp_thread.h>
+
+#define MY_ADDRESS	1
+#define MY_PORT		10
+#define TOTAL		(10 * 1024 * 1024)
+#define CHUNK		4096
+
+/* Every segment and acknowledgement passes the router input queue, so a
+ * window larger than half of it only makes the router drop segments */
+#if CSP_RDP_MAX_WINDOW < CSP_FIFO_INPUT / 2
+#define WINDOW		CSP_RDP_MAX_WINDOW
+#else
+#define WINDOW		(CSP_FIFO_INPUT / 2)
+#endif
+
+#ifdef CSP_USE_RDP
+static volatile unsigned int finished;
+static unsigned int received, errors;
+
+CSP_DEFINE_TASK(task_server) {
+
+	int i, n;
+	uint8_t buf[CHUNK];
+	csp_conn_t * conn;
+	csp_socket_t * sock = csp_socket(CSP_SO_RDPREQ);
+
+	csp_bind(sock, MY_PORT);
+	csp_listen(sock, 1);
+
+	conn = csp_accept(sock, 10000);
+	if (conn != NULL) {
+		while (received < TOTAL) {
+			n = csp_stream_read(conn, buf, sizeof(buf), 10000);
+			if (n <= 0)
+				break;
+			/* The stream carries its own offset modulo 256 */
+			for (i = 0; i < n; i++)
+				if (buf[i] != (uint8_t) (received + i))
+					errors++;
+			received += n;
+		}
+		csp_close(conn);
+	}
+
+	finished = 1;
+
+	return CSP_TASK_RETURN;
+
+}
+
+static double now(clockid_t clock) {
+
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+
+}
+#endif
+
+int main(int argc, char * argv[]) {
+
+#ifdef CSP_USE_RDP
+	int i, n;
+	unsigned int sent = 0, len;
+	static uint8_t pattern[CHUNK];
+	double start, cpu, elapsed;
+	csp_conn_t * conn;
+	csp_thread_handle_t handle;
+
+	for (i = 0; i < CHUNK; i++)
+		pattern[i] = i;
+
+	csp_buffer_init(CSP_RDP_MAX_WINDOW * 4 + 40, 512);
+	csp_init(MY_ADDRESS);
+	csp_debug_set_level(CSP_WARN, false);
+	csp_route_start_task(1000, 1);
+	/* Acknowledgements cost nothing on loopback, so do not delay them */
+	csp_rdp_set_opt(WINDOW, 10000, 1000, 0, 250, WINDOW / 2);
+
+	csp_thread_create(task_server, (signed char *) "SERVER", 1000, NULL, 0, &handle);
+	csp_sleep_ms(100);
+
+	conn = csp_connect(CSP_PRIO_NORM, MY_ADDRESS, MY_PORT, 1000, CSP_O_RDP);
+	if (conn == NULL) {
+		printf("Connection failed\r\n");
+		return 1;
+	}
+
+	start = now(CLOCK_MONOTONIC);
+	cpu = now(CLOCK_PROCESS_CPUTIME_ID);
+
+	while (sent < TOTAL) {
+		/* Continue the pattern where the last, possibly short, write ended */
+		len = CHUNK - sent % CHUNK;
+		if (len > TOTAL - sent)
+			len = TOTAL - sent;
+		n = csp_stream_write(conn, &pattern[sent % CHUNK], len, 10000);
+		if (n < 0) {
+			printf("Write failed with %d after %u bytes\r\n", n, sent);
+			break;
+		}
+		sent += n;
+	}
+
+	if (csp_stream_flush(conn, 10000) != CSP_ERR_NONE)
+		printf("Flush failed\r\n");
+	while (!finished && now(CLOCK_MONOTONIC) - start < 60)
+		csp_sleep_ms(1);
+
+	elapsed = now(CLOCK_MONOTONIC) - start;
+	cpu = now(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+	csp_close(conn);
+
+	printf("RDP window %d, %d byte buffers, router queue %d\r\n", WINDOW, 512, CSP_FIFO_INPUT);
+	printf("%u bytes in %.2f s, %.2f MB/s, %.2f s CPU, %u errors, %"PRIu32" loopback drops\r\n",
+			received, elapsed, received / elapsed / 1e6, cpu, errors, csp_if_lo.drop);
+
+	return (received == TOTAL && errors == 0) ? 0 : 1;
+#else
+	printf("Build with --enable-rdp\r\n");
+	return 0;
+#endif
+
+}
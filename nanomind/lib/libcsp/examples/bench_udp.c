@@ -0,0 +1,337 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* UDP interface benchmark
+ *
+ * Starts a number of CSP nodes, one process each, on UDP ports of the
+ * loopback address. Every node sends requests round robin to all other
+ * nodes, which echo them back, with a window of requests in flight. Reports
+ * per node the round trips, the datagrams per second it sent and received
+ * and the CPU time of the process per datagram, together with the
+ * interface drops and errors.
+ *
+ * A node receives up to a window from each node at once, and the UDP task
+ * hands them to the router without waiting. The default window keeps that
+ * within the router input queue, raise --with-router-queue-length for
+ * larger windows.
+ *
+ * Afterwards node 1 sends one broadcast. Every node has its default route
+ * on the endpoint of another node, so that endpoint is mapped twice and
+ * must still receive the broadcast only once. Build with --enable-if-udp.
+ *
+ * usage: bench_udp [-n nodes] [-c requests] [-s size] [-w window] [-p port]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include <csp/csp.h>
+#include <csp/interfaces/csp_if_udp.h>
+
+/* Using un-exported header file.
+ * This is allowed since we are still in libcsp */
+#include <csp/arch/csp_thread.h>
+#include <csp/arch/csp_semaphore.h>
+
+#define REQUEST_PORT	10
+#define REPLY_PORT		11
+#define BCAST_PORT		12
+#define MAX_NODES		(CSP_BROADCAST_ADDR - 1)
+
+typedef struct {
+	unsigned int node, sent, replies, served, broadcasts;
+	uint32_t drop, rx_error, tx_error, tx_queue_drop;
+	double elapsed, cpu;
+} result_t;
+
+static unsigned int nodes = 4, requests = 100000, size = 100, window = 0, port = 20000;
+static volatile unsigned int replies, served, broadcasts;
+static volatile double last_packet;
+static csp_bin_sem_handle_t reply_sem;
+
+static double now(void) {
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+
+}
+
+static double cpu_time(void) {
+
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+
+}
+
+/* Echo requests, count replies and broadcasts */
+CSP_DEFINE_TASK(task_server) {
+
+	csp_packet_t * packet;
+	csp_socket_t * sock = csp_socket(CSP_SO_CONN_LESS);
+
+	csp_bind(sock, CSP_ANY);
+
+	while (1) {
+		packet = csp_recvfrom(sock, CSP_MAX_DELAY);
+		if (packet == NULL)
+			continue;
+		switch (packet->id.dport) {
+		case REQUEST_PORT:
+			if (csp_sendto(CSP_PRIO_NORM, packet->id.src, REPLY_PORT, REQUEST_PORT, CSP_O_NONE, packet, 0) != CSP_ERR_NONE)
+				csp_buffer_free(packet);
+			last_packet = now();
+			served++;
+			break;
+		case REPLY_PORT:
+			csp_buffer_free(packet);
+			last_packet = now();
+			replies++;
+			csp_bin_sem_post(&reply_sem);
+			break;
+		default:
+			csp_buffer_free(packet);
+			broadcasts++;
+			break;
+		}
+	}
+
+	return CSP_TASK_RETURN;
+
+}
+
+/* Send a packet, retry while out of buffers or the TX queue is full */
+static int node_send(uint8_t dst, uint8_t dport) {
+
+	csp_packet_t * packet;
+	unsigned int tries;
+
+	for (tries = 0; tries < 1000; tries++) {
+		packet = csp_buffer_get(size);
+		if (packet != NULL) {
+			memset(packet->data, dst, size);
+			packet->length = size;
+			if (csp_sendto(CSP_PRIO_NORM, dst, dport, REPLY_PORT, CSP_O_NONE, packet, 0) == CSP_ERR_NONE)
+				return 0;
+			csp_buffer_free(packet);
+		}
+		csp_sleep_ms(1);
+	}
+
+	return -1;
+
+}
+
+/* Requests node k serves, every node sends its requests round robin */
+static unsigned int expected(unsigned int k) {
+
+	unsigned int i, idx, count = 0;
+
+	for (i = 1; i <= nodes; i++) {
+		if (i == k)
+			continue;
+		idx = (k > i) ? k - 2 : k - 1;
+		count += requests / (nodes - 1) + (idx < requests % (nodes - 1) ? 1 : 0);
+	}
+
+	return count;
+
+}
+
+/* Wait until a counter reaches a value or stops moving for a second */
+static void wait_for(volatile unsigned int * counter, unsigned int value) {
+
+	unsigned int last = *counter;
+	double progress = now();
+
+	while (*counter < value && now() - progress < 1) {
+		csp_sleep_ms(1);
+		if (*counter != last) {
+			last = *counter;
+			progress = now();
+		}
+	}
+
+}
+
+static void node(unsigned int k, int out) {
+
+	unsigned int i;
+	uint8_t dst;
+	double start, cpu, stall;
+	result_t r;
+	csp_thread_handle_t handle;
+
+	/* Requests in flight and their echoes stay inside the pool */
+	csp_buffer_init(2 * nodes * window + 40, size + CSP_BUFFER_PACKET_OVERHEAD);
+	csp_init(k);
+	csp_debug_set_level(CSP_ERROR, false);
+	csp_debug_set_level(CSP_WARN, false);
+	csp_bin_sem_create(&reply_sem);
+
+	if (csp_udp_init("127.0.0.1", port + k) != CSP_ERR_NONE) {
+		printf("node %u: failed to open UDP port %u\r\n", k, port + k);
+		exit(1);
+	}
+	for (i = 1; i <= nodes; i++) {
+		if (i == k)
+			continue;
+		csp_udp_peer_set(i, "127.0.0.1", port + i);
+		csp_route_set(i, &csp_if_udp, CSP_NODE_MAC);
+	}
+
+	/* The default route shares the endpoint of the next node */
+	csp_udp_peer_set(CSP_DEFAULT_ROUTE, "127.0.0.1", port + k % nodes + 1);
+	csp_route_set(CSP_DEFAULT_ROUTE, &csp_if_udp, CSP_NODE_MAC);
+
+	csp_route_start_task(1000, 1);
+	csp_thread_create(task_server, (signed char *) "SERVER", 1000, NULL, 0, &handle);
+
+	/* Let the other nodes come up */
+	csp_sleep_ms(500);
+
+	memset(&r, 0, sizeof(r));
+	start = now();
+	cpu = cpu_time();
+
+	/* Every other node in turn, give up when the replies stop for a second */
+	for (i = 0; i < requests; i++) {
+		stall = now();
+		while (i - replies >= window && now() - stall < 1)
+			csp_bin_sem_wait(&reply_sem, 100);
+		if (i - replies >= window)
+			break;
+		dst = i % (nodes - 1) + 1;
+		if (dst >= k)
+			dst++;
+		if (node_send(dst, REQUEST_PORT) != 0)
+			break;
+	}
+	r.sent = i;
+
+	/* Wait for the last replies, and until the other nodes are served */
+	wait_for(&replies, r.sent);
+	wait_for(&served, expected(k));
+	r.elapsed = last_packet - start;
+	r.cpu = cpu_time() - cpu;
+	r.replies = replies;
+	r.served = served;
+
+	/* All nodes are done before the broadcast */
+	csp_sleep_ms(1000);
+	if (k == 1)
+		node_send(CSP_BROADCAST_ADDR, BCAST_PORT);
+	csp_sleep_ms(500);
+
+	r.node = k;
+	r.broadcasts = broadcasts;
+	r.drop = csp_if_udp.drop;
+	r.rx_error = csp_if_udp.rx_error;
+	r.tx_error = csp_if_udp.tx_error;
+	r.tx_queue_drop = csp_if_udp.tx_queue_drop;
+	if (write(out, &r, sizeof(r)) != sizeof(r))
+		exit(1);
+
+	exit(0);
+
+}
+
+int main(int argc, char * argv[]) {
+
+	int opt, fds[2], ret = 0;
+	unsigned int k, datagrams, total = 0;
+	double elapsed = 0, cpu = 0;
+	result_t r;
+
+	while ((opt = getopt(argc, argv, "n:c:s:w:p:")) != -1) {
+		switch (opt) {
+		case 'n': nodes = atoi(optarg); break;
+		case 'c': requests = atoi(optarg); break;
+		case 's': size = atoi(optarg); break;
+		case 'w': window = atoi(optarg); break;
+		case 'p': port = atoi(optarg); break;
+		default:
+			printf("usage: %s [-n nodes] [-c requests] [-s size] [-w window] [-p port]\r\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (nodes < 2 || nodes > MAX_NODES || requests < 1 || size < 1 || size > 1024) {
+		printf("Need 2 to %d nodes, at least one request and 1 to 1024 bytes\r\n", MAX_NODES);
+		return 1;
+	}
+
+	/* A node gets a window from every node, requests and replies */
+	if (window == 0)
+		window = CSP_FIFO_INPUT / nodes;
+	if (window == 0)
+		window = 1;
+
+	if (pipe(fds) != 0) {
+		printf("pipe failed\r\n");
+		return 1;
+	}
+
+	/* Results are shorter than PIPE_BUF, so each write is atomic */
+	for (k = 1; k <= nodes; k++) {
+		if (fork() == 0) {
+			close(fds[0]);
+			node(k, fds[1]);
+		}
+	}
+	close(fds[1]);
+
+	printf("%u nodes, %u requests of %u bytes each, window %u\r\n", nodes, requests, size, window);
+	for (k = 0; k < nodes; k++) {
+		if (read(fds[0], &r, sizeof(r)) != sizeof(r)) {
+			printf("A node failed\r\n");
+			ret = 1;
+			break;
+		}
+		/* Requests and replies, both ways */
+		datagrams = 2 * (r.replies + r.served);
+		printf("node %2u: %u of %u round trips, served %u of %u, %.0f datagrams/s, %.2f us CPU per datagram, "
+				"drop %"PRIu32", rx errors %"PRIu32", tx errors %"PRIu32", tx queue full %"PRIu32", broadcasts %u\r\n",
+				r.node, r.replies, requests, r.served, expected(r.node), datagrams / r.elapsed,
+				r.cpu * 1e6 / datagrams, r.drop, r.rx_error, r.tx_error, r.tx_queue_drop, r.broadcasts);
+		total += r.replies;
+		cpu += r.cpu;
+		if (r.elapsed > elapsed)
+			elapsed = r.elapsed;
+		if (r.replies != requests || r.served != expected(r.node) || r.broadcasts != (r.node == 1 ? 0 : 1))
+			ret = 1;
+	}
+	while (wait(NULL) > 0);
+
+	/* Every round trip is two datagrams, the CPU time covers both ends */
+	printf("total: %u round trips in %.2f s, %.0f datagrams/s, %.2f us CPU per datagram\r\n",
+			total, elapsed, 2 * total / elapsed, cpu * 1e6 / (2 * total));
+
+	return ret;
+
+}
@@ -0,0 +1,153 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* XTEA known answer test and benchmark
+ *
+ * The known answers were produced by the original bytewise csp_xtea.c, so
+ * they pin down the packet format as it is on the wire, including the
+ * first two blocks sharing counter value iv[1]. Every length from 1 to 100
+ * bytes is checked against a prefix of the 100 byte answer, which covers
+ * the partial blocks and the batched keystream. A second answer checks
+ * the counter wrapping. Reports encrypt and decrypt MB/s per packet size.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <csp/csp.h>
+
+/* Using un-exported header file.
+ * This is allowed since we are still in libcsp */
+#include "crypto/csp_xtea.h"
+
+#define BYTES		(16 * 1024 * 1024)
+
+#ifdef CSP_USE_XTEA
+
+/* Key "xtea known answer", plain text 0, 1, 2, ..., iv {0x01020304, 1} */
+static const uint8_t kat[100] = {
+	0xba, 0x66, 0xea, 0x9b, 0x49, 0x15, 0x7b, 0x09, 0xb2, 0x6e, 0xe2, 0x93,
+	0x41, 0x1d, 0x73, 0x01, 0x4f, 0x5b, 0x6a, 0x8e, 0x2f, 0xcf, 0x02, 0x8a,
+	0xf2, 0x87, 0x89, 0xa2, 0xf5, 0x9f, 0x1d, 0x8f, 0xeb, 0x2a, 0x83, 0x3c,
+	0x5e, 0xbd, 0x30, 0xf1, 0x15, 0x83, 0xab, 0x39, 0xa7, 0xd1, 0x30, 0xd3,
+	0x82, 0xcb, 0x50, 0xe7, 0x56, 0x34, 0x40, 0xa9, 0x9c, 0x88, 0x5e, 0xdd,
+	0x65, 0x6e, 0x4c, 0x8d, 0x69, 0xa2, 0xc4, 0x39, 0x13, 0x0c, 0xf4, 0x2b,
+	0x9a, 0xc3, 0xc4, 0xa3, 0xf8, 0xa9, 0x14, 0xc8, 0xef, 0xe1, 0xe7, 0xc0,
+	0x70, 0x33, 0x88, 0x61, 0x28, 0xb8, 0x41, 0x3c, 0x00, 0xd7, 0x55, 0xd1,
+	0x90, 0xd3, 0xca, 0x78,
+};
+
+/* Same key and plain text, iv {0xDEADBEEF, 0xFFFFFFFF} */
+static const uint8_t kat_wrap[33] = {
+	0x53, 0xa9, 0xab, 0x5d, 0x3a, 0xd0, 0x8c, 0x6d, 0x5b, 0xa1, 0xa3, 0x55,
+	0x32, 0xd8, 0x84, 0x65, 0x62, 0xbb, 0x0a, 0x1c, 0xec, 0xf9, 0xd6, 0xd2,
+	0x66, 0xbc, 0x4a, 0x52, 0x3f, 0x83, 0x89, 0xd8, 0x16,
+};
+
+static uint8_t buf[1024];
+
+static unsigned int check(const uint8_t * answer, uint32_t len, uint32_t iv0, uint32_t iv1) {
+
+	uint32_t i, iv[2];
+	unsigned int errors = 0;
+
+	for (i = 0; i < len; i++)
+		buf[i] = i;
+
+	iv[0] = iv0;
+	iv[1] = iv1;
+	csp_xtea_encrypt(buf, len, iv);
+	if (memcmp(buf, answer, len) != 0) {
+		printf("Encrypt of %"PRIu32" bytes with iv %#010"PRIx32" %#010"PRIx32" differs\r\n", len, iv0, iv1);
+		errors++;
+	}
+
+	iv[0] = iv0;
+	iv[1] = iv1;
+	csp_xtea_decrypt(buf, len, iv);
+	for (i = 0; i < len; i++) {
+		if (buf[i] != (uint8_t) i) {
+			printf("Decrypt of %"PRIu32" bytes with iv %#010"PRIx32" %#010"PRIx32" differs\r\n", len, iv0, iv1);
+			errors++;
+			break;
+		}
+	}
+
+	return errors;
+
+}
+
+static double now(void) {
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+
+}
+
+static double rate(int (*func)(uint8_t *, const uint32_t, uint32_t *), uint32_t size) {
+
+	uint32_t r, rounds = BYTES / size, iv[2];
+	double start = now();
+
+	for (r = 0; r < rounds; r++) {
+		iv[0] = r;
+		iv[1] = 1;
+		func(buf, size, iv);
+	}
+
+	return (double) rounds * size / (now() - start) / 1e6;
+
+}
+
+#endif
+
+int main(int argc, char * argv[]) {
+
+#ifdef CSP_USE_XTEA
+	static const uint32_t sizes[] = {16, 64, 256, 1024};
+	unsigned int i, errors = 0;
+	uint32_t len;
+
+	csp_xtea_set_key("xtea known answer", 17);
+
+	for (len = 1; len <= sizeof(kat); len++)
+		errors += check(kat, len, 0x01020304, 1);
+	errors += check(kat_wrap, sizeof(kat_wrap), 0xDEADBEEF, 0xFFFFFFFF);
+
+	printf("Known answers for 1 to %u bytes checked\r\n", (unsigned int) sizeof(kat));
+
+	printf("Size       Encrypt       Decrypt\r\n");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		printf("%4"PRIu32"  %7.1f MB/s  %7.1f MB/s\r\n", sizes[i],
+				rate(csp_xtea_encrypt, sizes[i]), rate(csp_xtea_decrypt, sizes[i]));
+	}
+
+	printf("Errors: %u\r\n", errors);
+
+	return errors ? 1 : 0;
+#else
+	printf("Build with --enable-xtea\r\n");
+	return 0;
+#endif
+
+}
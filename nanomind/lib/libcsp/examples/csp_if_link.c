@@ -0,0 +1,235 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* Emulated link for the loopback tests
+ *
+ * Packets are serialised at the configured rate, wait in a drop-tail queue
+ * while the link is busy, and are delivered back to the router after the
+ * propagation delay plus a random jitter. Every flow routed through the
+ * link shares its rate and queue, so it also serves as a shared
+ * bottleneck.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "csp_if_link.h"
+
+/* Packets held by the link at once, queued or in flight */
+#define LINK_SLOTS		1024
+
+typedef struct {
+	csp_packet_t * packet;
+	uint64_t depart;			/* Time the last bit leaves the sender, ns */
+	uint64_t arrive;			/* Time of delivery, ns */
+} link_slot_t;
+
+static link_slot_t slots[LINK_SLOTS];
+static unsigned int used;
+static uint64_t busy_until;
+static csp_link_conf_t link_conf;
+static csp_link_stats_t link_stats;
+static unsigned int link_seed;
+static pthread_mutex_t link_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t link_cond;
+static pthread_t link_thread;
+static void (* link_tap)(csp_packet_t * packet, int event);
+/* Copy of the packet being delivered, for the tap if the router drops it */
+static csp_packet_t * link_copy;
+/* Interface drop counter at the last csp_link_stats */
+static uint32_t link_drop_base;
+
+static int csp_link_tx(csp_iface_t * interface, csp_packet_t * packet, uint32_t timeout);
+
+csp_iface_t csp_if_link = {
+	.name = "LINK",
+	.nexthop = csp_link_tx,
+};
+
+static uint64_t csp_link_now(void) {
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+}
+
+static int csp_link_tx(csp_iface_t * interface, csp_packet_t * packet, uint32_t timeout) {
+
+	unsigned int i, queued = 0;
+	uint64_t now = csp_link_now();
+	/* Header and length as they would go on the wire */
+	uint32_t bytes = packet->length + sizeof(packet->id);
+
+	pthread_mutex_lock(&link_lock);
+
+	link_stats.sent++;
+
+	if ((unsigned int) rand_r(&link_seed) % 1000 < link_conf.loss) {
+		link_stats.lost++;
+		goto drop;
+	}
+
+	/* Packets not yet sent in full */
+	for (i = 0; i < used; i++)
+		if (slots[i].depart > now)
+			queued++;
+
+	if (used == LINK_SLOTS || (link_conf.queue && queued >= link_conf.queue)) {
+		link_stats.queue_drops++;
+		goto drop;
+	}
+
+	if (link_tap)
+		link_tap(packet, CSP_LINK_SENT);
+
+	if (busy_until < now)
+		busy_until = now;
+	if (link_conf.rate)
+		busy_until += (uint64_t) bytes * 1000000000 / link_conf.rate;
+
+	slots[used].packet = packet;
+	slots[used].depart = busy_until;
+	slots[used].arrive = busy_until + (uint64_t) link_conf.delay * 1000000;
+	if (link_conf.jitter)
+		slots[used].arrive += (uint64_t) (rand_r(&link_seed) % (link_conf.jitter * 1000)) * 1000;
+	used++;
+
+	pthread_cond_signal(&link_cond);
+	pthread_mutex_unlock(&link_lock);
+
+	return CSP_ERR_NONE;
+
+drop:
+	if (link_tap)
+		link_tap(packet, CSP_LINK_LOST);
+	pthread_mutex_unlock(&link_lock);
+	csp_buffer_free(packet);
+	return CSP_ERR_NONE;
+
+}
+
+static void * csp_link_task(void * param) {
+
+	unsigned int i, next;
+	uint32_t drop;
+	uint64_t now;
+	csp_packet_t * packet;
+	struct timespec ts;
+
+	pthread_mutex_lock(&link_lock);
+
+	while (1) {
+
+		if (used == 0) {
+			pthread_cond_wait(&link_cond, &link_lock);
+			continue;
+		}
+
+		next = 0;
+		for (i = 1; i < used; i++)
+			if (slots[i].arrive < slots[next].arrive)
+				next = i;
+
+		now = csp_link_now();
+		if (slots[next].arrive > now) {
+			ts.tv_sec = slots[next].arrive / 1000000000;
+			ts.tv_nsec = slots[next].arrive % 1000000000;
+			pthread_cond_timedwait(&link_cond, &link_lock, &ts);
+			continue;
+		}
+
+		packet = slots[next].packet;
+		slots[next] = slots[--used];
+		link_stats.delivered++;
+
+		if (link_tap)
+			memcpy(link_copy, packet, CSP_BUFFER_PACKET_OVERHEAD + packet->length);
+
+		/* Only this task delivers on the interface, so a change of the drop
+		 * counter is this packet. Drops by the router workers happen later
+		 * and are only counted in the stats */
+		drop = csp_if_link.drop;
+		pthread_mutex_unlock(&link_lock);
+		csp_new_packet(packet, &csp_if_link, NULL);
+		pthread_mutex_lock(&link_lock);
+
+		if (csp_if_link.drop != drop && link_tap)
+			link_tap(link_copy, CSP_LINK_REJECTED);
+
+	}
+
+	return NULL;
+
+}
+
+int csp_link_init(const csp_link_conf_t * conf, unsigned int seed) {
+
+	pthread_condattr_t attr;
+
+	link_conf = *conf;
+	link_seed = seed;
+
+	link_copy = malloc(csp_buffer_size());
+	if (link_copy == NULL)
+		return CSP_ERR_NOMEM;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&link_cond, &attr);
+
+	if (pthread_create(&link_thread, NULL, csp_link_task, NULL) != 0)
+		return CSP_ERR_NOMEM;
+
+	csp_route_add_if(&csp_if_link);
+
+	return CSP_ERR_NONE;
+
+}
+
+void csp_link_set(const csp_link_conf_t * conf) {
+
+	pthread_mutex_lock(&link_lock);
+	link_conf = *conf;
+	pthread_mutex_unlock(&link_lock);
+
+}
+
+void csp_link_tap(void (* tap)(csp_packet_t * packet, int event)) {
+
+	pthread_mutex_lock(&link_lock);
+	link_tap = tap;
+	pthread_mutex_unlock(&link_lock);
+
+}
+
+void csp_link_stats(csp_link_stats_t * stats) {
+
+	pthread_mutex_lock(&link_lock);
+	*stats = link_stats;
+	stats->router_drops = csp_if_link.drop - link_drop_base;
+	link_drop_base = csp_if_link.drop;
+	memset(&link_stats, 0, sizeof(link_stats));
+	pthread_mutex_unlock(&link_lock);
+
+}
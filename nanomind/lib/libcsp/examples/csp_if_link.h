@@ -0,0 +1,87 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef _CSP_IF_LINK_H_
+#define _CSP_IF_LINK_H_
+
+#include <stdint.h>
+
+#include <csp/csp.h>
+#include <csp/csp_interface.h>
+
+/**
+ * Emulated link, looped back into the local router.
+ * Route the own address through csp_if_link to send everything the node
+ * sends to itself, data and acknowledgements, over the link.
+ */
+
+/** Link parameters */
+typedef struct {
+	uint32_t delay;				/**< One way delay in ms */
+	uint32_t jitter;			/**< Random extra delay in ms, reorders packets */
+	uint32_t rate;				/**< Bytes per second, 0 for no limit */
+	uint32_t queue;				/**< Packets waiting for the link before tail drop, 0 for no limit */
+	uint32_t loss;				/**< Random loss in per mille */
+} csp_link_conf_t;
+
+/** Link counters */
+typedef struct {
+	uint32_t sent;				/**< Packets given to the link */
+	uint32_t delivered;			/**< Packets delivered to the router */
+	uint32_t lost;				/**< Packets dropped by random loss */
+	uint32_t queue_drops;		/**< Packets dropped by a full queue */
+	uint32_t router_drops;		/**< Packets delivered, but dropped by a full router input or worker queue */
+} csp_link_stats_t;
+
+/** Events reported to the tap */
+#define CSP_LINK_SENT		0	/**< Accepted by the link */
+#define CSP_LINK_LOST		1	/**< Dropped by random loss or a full link queue */
+#define CSP_LINK_REJECTED	2	/**< Delivered, but dropped by the router input queue */
+
+extern csp_iface_t csp_if_link;
+
+/**
+ * Start the link task
+ * @param conf link parameters, can be changed later with csp_link_set
+ * @param seed random seed for loss and jitter
+ * @return CSP_ERR_NONE on success
+ */
+int csp_link_init(const csp_link_conf_t * conf, unsigned int seed);
+
+/**
+ * Change link parameters
+ * @param conf link parameters
+ */
+void csp_link_set(const csp_link_conf_t * conf);
+
+/**
+ * Set a function called for each packet given to the link, and again for
+ * each packet the router drops on delivery
+ * @param tap called with the packet and a CSP_LINK_x event, or NULL
+ */
+void csp_link_tap(void (* tap)(csp_packet_t * packet, int event));
+
+/**
+ * Read and clear link counters
+ * @param stats counters since the last call
+ */
+void csp_link_stats(csp_link_stats_t * stats);
+
+#endif // _CSP_IF_LINK_H_
@@ -0,0 +1,300 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* CAN fragment reassembly with interleaved senders
+ *
+ * A raw CAN socket on the same interface plays many senders at once. In
+ * each round every sender starts a packet, and the fragments of all of them
+ * go out interleaved, one fragment per sender at a time, so the node has a
+ * packet from each sender in reassembly together. The node receives them on
+ * a connectionless socket and checks the contents.
+ *
+ * Reports the frame rate, the share of packets reassembled and the CAN
+ * reassembly statistics. With more senders than reassembly buffers, see
+ * --with-can-buffers, the remaining packets are counted as full. All packets
+ * of a round complete together, so the router input queue and the socket
+ * queue must hold one round too, or the router drops what the interface
+ * reassembled. Needs the socketcan driver and a CAN interface, e.g. a
+ * virtual one:
+ *
+ *   ip link add dev vcan0 type vcan && ip link set up vcan0
+ *
+ * usage: test_can [-i interface] [-n senders] [-r rounds] [-s size]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <linux/can.h>
+
+#include <csp/csp.h>
+#include <csp/csp_endian.h>
+#include <csp/interfaces/csp_if_can.h>
+
+/* Using un-exported header file.
+ * This is allowed since we are still in libcsp */
+#include <csp/arch/csp_thread.h>
+
+#define MY_ADDRESS	1
+#define MY_PORT		10
+#define PEER_PORT	20
+#define MAX_SENDERS	1000
+
+/* CFP identifier fields, see csp_if_can.c */
+#define CFP_BEGIN	0
+#define CFP_MORE	1
+#define CFP_MAKE_ID(src, dst, type, remain, ident) \
+	(((uint32_t)(src) << 24) | ((uint32_t)(dst) << 19) | ((uint32_t)(type) << 18) \
+	| ((uint32_t)(remain) << 10) | ((uint32_t)(ident) & 0x3ff))
+
+/* Sender addresses, every host but the node and broadcast */
+#define HOSTS		29
+
+static unsigned int senders = 100, rounds = 100, size = 100;
+static volatile unsigned int received;
+static unsigned int corrupt;
+
+static double now(void) {
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+
+}
+
+static uint8_t host(unsigned int sender) {
+
+	return 2 + sender % HOSTS;
+
+}
+
+/* Contents of the packet from a sender in a round */
+static uint8_t pattern(unsigned int sender, unsigned int round, unsigned int i) {
+
+	return (uint8_t) (sender * 7 + round * 3 + i);
+
+}
+
+CSP_DEFINE_TASK(task_server) {
+
+	unsigned int i, sender, round;
+	csp_packet_t * packet;
+	csp_socket_t * sock = csp_socket(CSP_SO_CONN_LESS);
+
+	csp_bind(sock, MY_PORT);
+
+	while (1) {
+		packet = csp_recvfrom(sock, CSP_MAX_DELAY);
+		if (packet == NULL)
+			continue;
+		if (packet->length != size) {
+			corrupt++;
+		} else {
+			sender = packet->data[0] | (packet->data[1] << 8);
+			round = packet->data[2] | (packet->data[3] << 8);
+			for (i = 4; i < size; i++) {
+				if (packet->data[i] != pattern(sender, round, i)) {
+					corrupt++;
+					break;
+				}
+			}
+		}
+		csp_buffer_free(packet);
+		received++;
+	}
+
+	return CSP_TASK_RETURN;
+
+}
+
+/* Write a frame, wait for room when the interface queue is full */
+static int peer_send(int sock, struct can_frame * frame) {
+
+	while (write(sock, frame, sizeof(*frame)) != sizeof(*frame)) {
+		if (errno != ENOBUFS && errno != EAGAIN && errno != EINTR)
+			return -1;
+		poll(NULL, 0, 1);
+	}
+
+	return 0;
+
+}
+
+/* Build fragment f of the packet from a sender in a round */
+static void fragment(struct can_frame * frame, unsigned int sender, unsigned int round, unsigned int f) {
+
+	unsigned int overhead = sizeof(csp_id_t) + sizeof(uint16_t);
+	unsigned int frames = (size + overhead + 7) / 8;
+	unsigned int ident = sender / HOSTS + round * (senders / HOSTS + 1);
+	unsigned int offset, start, bytes, i;
+	uint8_t data[4];
+	csp_id_t id;
+	uint16_t length;
+
+	memset(frame, 0, sizeof(*frame));
+	frame->can_id = CFP_MAKE_ID(host(sender), MY_ADDRESS, f ? CFP_MORE : CFP_BEGIN, frames - 1 - f, ident) | CAN_EFF_FLAG;
+
+	if (f == 0) {
+		id.ext = 0;
+		id.pri = CSP_PRIO_NORM;
+		id.src = host(sender);
+		id.dst = MY_ADDRESS;
+		id.dport = MY_PORT;
+		id.sport = PEER_PORT;
+		id.ext = csp_hton32(id.ext);
+		length = csp_hton16(size);
+		memcpy(frame->data, &id, sizeof(id));
+		memcpy(frame->data + sizeof(id), &length, sizeof(length));
+		offset = overhead;
+		start = 0;
+	} else {
+		offset = 0;
+		start = f * 8 - overhead;
+	}
+
+	bytes = size - start < 8 - offset ? size - start : 8 - offset;
+
+	/* The first four bytes name the sender and the round */
+	data[0] = sender;
+	data[1] = sender >> 8;
+	data[2] = round;
+	data[3] = round >> 8;
+	for (i = 0; i < bytes; i++) {
+		if (start + i < 4)
+			frame->data[offset + i] = data[start + i];
+		else
+			frame->data[offset + i] = pattern(sender, round, start + i);
+	}
+	frame->can_dlc = offset + bytes;
+
+}
+
+int main(int argc, char * argv[]) {
+
+	int opt, sock;
+	char * ifc = "vcan0";
+	unsigned int r, f, k, frames, expected, sent_frames = 0, last;
+	double start, elapsed, progress;
+	struct ifreq ifr;
+	struct sockaddr_can addr;
+	struct can_frame frame;
+	struct csp_can_config conf = {0};
+	csp_can_stats_t stats;
+	csp_thread_handle_t handle;
+
+	while ((opt = getopt(argc, argv, "i:n:r:s:")) != -1) {
+		switch (opt) {
+		case 'i': ifc = optarg; break;
+		case 'n': senders = atoi(optarg); break;
+		case 'r': rounds = atoi(optarg); break;
+		case 's': size = atoi(optarg); break;
+		default:
+			printf("usage: %s [-i interface] [-n senders] [-r rounds] [-s size]\r\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (senders < 1 || senders > MAX_SENDERS || size < 4 || size > 256) {
+		printf("Need 1 to %d senders and packets of 4 to 256 bytes\r\n", MAX_SENDERS);
+		return 1;
+	}
+
+	csp_buffer_init(senders + 40, size + 16);
+	csp_init(MY_ADDRESS);
+	csp_debug_set_level(CSP_ERROR, false);
+	csp_debug_set_level(CSP_WARN, false);
+
+	conf.ifc = ifc;
+	if (csp_can_init(CSP_CAN_MASKED, &conf) != CSP_ERR_NONE) {
+		printf("Failed to open %s\r\n", ifc);
+		return 1;
+	}
+	csp_route_start_task(1000, 1);
+	csp_thread_create(task_server, (signed char *) "SERVER", 1000, NULL, 0, &handle);
+
+	/* The senders share one raw socket on the interface */
+	sock = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, ifc, IFNAMSIZ - 1);
+	if (sock < 0 || ioctl(sock, SIOCGIFINDEX, &ifr) < 0) {
+		printf("Failed to open %s: %s\r\n", ifc, strerror(errno));
+		return 1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = ifr.ifr_ifindex;
+	if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		printf("Failed to bind to %s: %s\r\n", ifc, strerror(errno));
+		return 1;
+	}
+
+	frames = (size + sizeof(csp_id_t) + sizeof(uint16_t) + 7) / 8;
+	expected = 0;
+	start = now();
+
+	for (r = 0; r < rounds; r++) {
+		for (f = 0; f < frames; f++) {
+			for (k = 0; k < senders; k++) {
+				fragment(&frame, k, r, f);
+				if (peer_send(sock, &frame) != 0) {
+					printf("write: %s\r\n", strerror(errno));
+					return 1;
+				}
+				sent_frames++;
+			}
+		}
+		expected += senders;
+
+		/* Let the node catch up before the next round, until it stops making progress */
+		last = received;
+		progress = now();
+		while (received < expected && now() - progress < 0.1) {
+			csp_sleep_ms(1);
+			if (received != last) {
+				last = received;
+				progress = now();
+			}
+		}
+	}
+
+	elapsed = now() - start;
+	csp_can_get_stats(&stats);
+
+	printf("%u senders, %u rounds, %u byte packets, %u frames each\r\n", senders, rounds, size, frames);
+	printf("%u frames in %.2f s, %.0f frames/s\r\n", sent_frames, elapsed, sent_frames / elapsed);
+	printf("reassembled %"PRIu32" of %u packets, %.1f%%, %u delivered, %u corrupt, %"PRIu32" router drops\r\n",
+			stats.reassembled, expected, 100.0 * stats.reassembled / expected, received, corrupt, csp_if_can.drop);
+	printf("buffers %"PRIu32", in use %"PRIu32", full %"PRIu32", timeout %"PRIu32", lost %"PRIu32", rx errors %"PRIu32", frame errors %"PRIu32"\r\n",
+			stats.pbuf_count, stats.pbuf_in_use, stats.pbuf_full, stats.pbuf_timeout, stats.lost,
+			csp_if_can.rx_error, csp_if_can.frame);
+
+	close(sock);
+
+	return (received == expected && corrupt == 0) ? 0 : 1;
+
+}
@@ -0,0 +1,172 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* Loopback latency next to a saturated CAN bus
+ *
+ * One task sends, once per millisecond, a packet to a host on the CAN bus
+ * and then a packet to itself through the loopback interface. Reports the
+ * loopback latency, counted from the start of the round, and the CAN
+ * packets the interface refused, followed by the interface statistics with
+ * the CAN TX queue depth and drops. Without a TX queue, see
+ * --with-can-tx-queue, the CAN send holds up the loopback packet behind it
+ * whenever the bus is slower than the offered load.
+ *
+ * Needs the socketcan driver. A virtual CAN interface never runs out of
+ * bandwidth, so limit it to a bus rate first, e.g.:
+ *
+ *   ip link add dev vcan0 type vcan && ip link set up vcan0
+ *   tc qdisc add dev vcan0 root tbf rate 125kbit burst 1kb limit 2kb
+ *
+ * usage: test_can_queue [-i interface] [-n rounds] [-s size]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <csp/csp.h>
+#include <csp/interfaces/csp_if_can.h>
+
+/* Using un-exported header file.
+ * This is allowed since we are still in libcsp */
+#include <csp/arch/csp_thread.h>
+
+#define MY_ADDRESS		1
+#define PEER_ADDRESS	2
+#define MY_PORT			10
+#define PEER_PORT		20
+
+static volatile unsigned int received;
+static double latency_sum, latency_max;
+
+static double now(void) {
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+
+}
+
+CSP_DEFINE_TASK(task_server) {
+
+	double sent, latency;
+	csp_packet_t * packet;
+	csp_socket_t * sock = csp_socket(CSP_SO_CONN_LESS);
+
+	csp_bind(sock, MY_PORT);
+
+	while (1) {
+		packet = csp_recvfrom(sock, CSP_MAX_DELAY);
+		if (packet == NULL)
+			continue;
+		memcpy(&sent, packet->data, sizeof(sent));
+		csp_buffer_free(packet);
+		latency = (now() - sent) * 1e6;
+		latency_sum += latency;
+		if (latency > latency_max)
+			latency_max = latency;
+		received++;
+	}
+
+	return CSP_TASK_RETURN;
+
+}
+
+int main(int argc, char * argv[]) {
+
+	int opt;
+	char * ifc = "vcan0";
+	unsigned int i, rounds = 1000, size = 200, refused = 0;
+	double start, stamp;
+	struct csp_can_config conf = {0};
+	csp_packet_t * packet;
+	csp_thread_handle_t handle;
+
+	while ((opt = getopt(argc, argv, "i:n:s:")) != -1) {
+		switch (opt) {
+		case 'i': ifc = optarg; break;
+		case 'n': rounds = atoi(optarg); break;
+		case 's': size = atoi(optarg); break;
+		default:
+			printf("usage: %s [-i interface] [-n rounds] [-s size]\r\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (rounds < 1 || size < sizeof(double) || size > 256) {
+		printf("Need at least one round and packets of 8 to 256 bytes\r\n");
+		return 1;
+	}
+
+	csp_buffer_init(100, 256);
+	csp_init(MY_ADDRESS);
+	csp_debug_set_level(CSP_ERROR, false);
+	csp_debug_set_level(CSP_WARN, false);
+
+	conf.ifc = ifc;
+	if (csp_can_init(CSP_CAN_MASKED, &conf) != CSP_ERR_NONE) {
+		printf("Failed to open %s\r\n", ifc);
+		return 1;
+	}
+	csp_route_set(PEER_ADDRESS, &csp_if_can, CSP_NODE_MAC);
+	csp_route_start_task(1000, 1);
+	csp_thread_create(task_server, (signed char *) "SERVER", 1000, NULL, 0, &handle);
+	csp_sleep_ms(100);
+
+	start = now();
+	for (i = 0; i < rounds; i++) {
+		/* The loopback packet is due now, whatever the CAN send costs */
+		stamp = now();
+
+		packet = csp_buffer_get(size);
+		if (packet != NULL) {
+			memset(packet->data, 0x55, size);
+			packet->length = size;
+			if (csp_sendto(CSP_PRIO_NORM, PEER_ADDRESS, PEER_PORT, MY_PORT, CSP_O_NONE, packet, 1000) != CSP_ERR_NONE) {
+				csp_buffer_free(packet);
+				refused++;
+			}
+		} else {
+			refused++;
+		}
+
+		packet = csp_buffer_get(sizeof(stamp));
+		if (packet != NULL) {
+			memcpy(packet->data, &stamp, sizeof(stamp));
+			packet->length = sizeof(stamp);
+			if (csp_sendto(CSP_PRIO_NORM, MY_ADDRESS, MY_PORT, PEER_PORT, CSP_O_NONE, packet, 1000) != CSP_ERR_NONE)
+				csp_buffer_free(packet);
+		}
+
+		csp_sleep_ms(1);
+	}
+	csp_sleep_ms(200);
+
+	printf("CAN TX queue %d, %u rounds in %.2f s, %u byte CAN packets, %u refused\r\n",
+			CSP_CAN_TX_QUEUE, rounds, now() - start, size, refused);
+	printf("Loopback: %u of %u packets, mean latency %.1f us, max %.1f us\r\n",
+			received, rounds, received ? latency_sum / received : 0, latency_max);
+	csp_route_print_interfaces();
+
+	return received == rounds ? 0 : 1;
+
+}
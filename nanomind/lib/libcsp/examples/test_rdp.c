@@ -0,0 +1,331 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* RDP transfer over an emulated link
+ *
+ * One or more flows send numbered packets over RDP connections to a server
+ * on the same node. Everything, data and acknowledgements, goes through
+ * csp_if_link with the given delay, jitter, rate, queue and loss. The
+ * server checks that each flow arrives complete and in order. With a gap,
+ * each flow starts that long after the previous one, so later flows have
+ * to take their share of the link from those already running.
+ *
+ * Reports per flow goodput with the round trip time and retransmission
+ * timeout the sender ended with, the fairness index of the flows, and the
+ * data segments retransmitted by the senders. A retransmission is spurious when
+ * neither the link nor the receiving router had dropped an earlier copy of
+ * the segment. Fails if any segment is retransmitted although the link had
+ * no loss, jitter or drops.
+ *
+ * usage: test_rdp [-w window] [-n packets] [-s size] [-f flows]
+ *                 [-d delay] [-j jitter] [-r rate] [-q queue] [-l loss]
+ *                 [-t packet timeout] [-a delayed acks] [-g gap] [-e seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <csp/csp.h>
+
+/* Using un-exported header file.
+ * This is allowed since we are still in libcsp */
+#include <csp/arch/csp_thread.h>
+#include "csp_conn.h"
+
+#include "csp_if_link.h"
+
+#define MY_ADDRESS	1
+#define MY_PORT		10
+#define MAX_FLOWS	4
+
+/* RDP flag bits in the header the sender appends to each segment */
+#define RDP_FLAG_RST	0x01
+#define RDP_FLAG_EAK	0x02
+#define RDP_FLAG_SYN	0x08
+#define RDP_FLAG_WND	0x10
+#define RDP_HEADER		5
+
+typedef struct {
+	unsigned int index;
+	unsigned int received;
+	unsigned int errors;
+	double start;
+	double end;
+	uint32_t srtt;
+	uint32_t rto;
+} flow_t;
+
+static flow_t flows[MAX_FLOWS];
+static unsigned int flow_count = 1, packets = 1000, size = 200, window = 10;
+static unsigned int packet_timeout = 1000, delayed_acks = 1, gap = 0;
+static volatile unsigned int finished;
+
+/* Copies of each data segment seen and dropped, per source port */
+static uint8_t seen[MAX_FLOWS][65536];
+static uint8_t lost[MAX_FLOWS][65536];
+static unsigned int retransmitted, spurious;
+
+static double now(void) {
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+
+}
+
+/* Count retransmitted data segments, called by the link for each packet */
+static void tap(csp_packet_t * packet, int event) {
+
+	unsigned int flow;
+	uint8_t * header;
+	uint16_t seq;
+
+	/* Data segments from the clients, which send to MY_PORT */
+	if (!(packet->id.flags & CSP_FRDP) || packet->id.dport != MY_PORT || packet->length <= RDP_HEADER)
+		return;
+
+	header = &packet->data[packet->length - RDP_HEADER];
+	if (header[0] & (RDP_FLAG_RST | RDP_FLAG_EAK | RDP_FLAG_SYN | RDP_FLAG_WND))
+		return;
+
+	flow = packet->id.sport % MAX_FLOWS;
+	seq = (header[1] << 8) | header[2];
+
+	if (event == CSP_LINK_REJECTED) {
+		if (lost[flow][seq] < 255)
+			lost[flow][seq]++;
+		return;
+	}
+
+	if (seen[flow][seq]) {
+		retransmitted++;
+		if (lost[flow][seq] < seen[flow][seq])
+			spurious++;
+	}
+	if (seen[flow][seq] < 255)
+		seen[flow][seq]++;
+	if (event == CSP_LINK_LOST && lost[flow][seq] < 255)
+		lost[flow][seq]++;
+
+}
+
+CSP_DEFINE_TASK(task_reader) {
+
+	csp_conn_t * conn = param;
+	csp_packet_t * packet;
+	flow_t * flow = NULL;
+	uint32_t expect = 0, index;
+
+	while ((packet = csp_read(conn, 10000)) != NULL) {
+		index = packet->data32[0];
+		if (flow == NULL) {
+			if (packet->data32[1] >= MAX_FLOWS) {
+				csp_buffer_free(packet);
+				break;
+			}
+			flow = &flows[packet->data32[1]];
+		}
+		if (index != expect || packet->length != size)
+			flow->errors++;
+		expect = index + 1;
+		csp_buffer_free(packet);
+		flow->received++;
+		if (flow->received == packets) {
+			flow->end = now();
+			break;
+		}
+	}
+
+	csp_close(conn);
+	__sync_fetch_and_add(&finished, 1);
+
+	return CSP_TASK_RETURN;
+
+}
+
+CSP_DEFINE_TASK(task_server) {
+
+	csp_conn_t * conn;
+	csp_thread_handle_t handle;
+	csp_socket_t * sock = csp_socket(CSP_SO_RDPREQ);
+
+	csp_bind(sock, MY_PORT);
+	csp_listen(sock, MAX_FLOWS);
+
+	while (1) {
+		conn = csp_accept(sock, CSP_MAX_DELAY);
+		if (conn != NULL)
+			csp_thread_create(task_reader, (signed char *) "READER", 1000, conn, 0, &handle);
+	}
+
+	return CSP_TASK_RETURN;
+
+}
+
+CSP_DEFINE_TASK(task_client) {
+
+	flow_t * flow = param;
+	csp_packet_t * packet;
+	csp_conn_t * conn;
+	unsigned int i;
+
+	csp_sleep_ms(flow->index * gap);
+
+	conn = csp_connect(CSP_PRIO_NORM, MY_ADDRESS, MY_PORT, 10000, CSP_O_RDP);
+	if (conn == NULL) {
+		printf("Flow %u: connection failed\r\n", flow->index);
+		flow->errors++;
+		__sync_fetch_and_add(&finished, 1);
+		return CSP_TASK_RETURN;
+	}
+
+	flow->start = now();
+	for (i = 0; i < packets; i++) {
+		packet = csp_buffer_get(size);
+		if (packet == NULL) {
+			csp_sleep_ms(1);
+			i--;
+			continue;
+		}
+		memset(packet->data, 0, size);
+		packet->data32[0] = i;
+		packet->data32[1] = flow->index;
+		packet->length = size;
+		if (!csp_send(conn, packet, 10000)) {
+			printf("Flow %u: send failed at packet %u\r\n", flow->index, i);
+			csp_buffer_free(packet);
+			flow->errors++;
+			break;
+		}
+	}
+
+	/* Keep the connection until the server has read everything */
+	while (flow->received < packets && flow->errors == 0 && now() - flow->start < 600)
+		csp_sleep_ms(10);
+#ifdef CSP_USE_RDP
+	flow->srtt = conn->rdp.srtt;
+	flow->rto = conn->rdp.rto;
+#endif
+	csp_close(conn);
+
+	return CSP_TASK_RETURN;
+
+}
+
+int main(int argc, char * argv[]) {
+
+	int opt;
+	unsigned int i, seed = 1, errors = 0;
+	double sum = 0, sum2 = 0, goodput, elapsed = 0;
+	csp_link_conf_t link = {0};
+	csp_link_stats_t stats;
+	csp_thread_handle_t handle;
+
+#ifndef CSP_USE_RDP
+	printf("Build with --enable-rdp\r\n");
+	return 0;
+#endif
+
+	while ((opt = getopt(argc, argv, "w:n:s:f:d:j:r:q:l:t:a:g:e:")) != -1) {
+		switch (opt) {
+		case 'w': window = atoi(optarg); break;
+		case 'n': packets = atoi(optarg); break;
+		case 's': size = atoi(optarg); break;
+		case 'f': flow_count = atoi(optarg); break;
+		case 'd': link.delay = atoi(optarg); break;
+		case 'j': link.jitter = atoi(optarg); break;
+		case 'r': link.rate = atoi(optarg); break;
+		case 'q': link.queue = atoi(optarg); break;
+		case 'l': link.loss = atoi(optarg); break;
+		case 't': packet_timeout = atoi(optarg); break;
+		case 'a': delayed_acks = atoi(optarg); break;
+		case 'g': gap = atoi(optarg); break;
+		case 'e': seed = atoi(optarg); break;
+		default:
+			printf("usage: %s [-w window] [-n packets] [-s size] [-f flows] [-d delay] [-j jitter]"
+					" [-r rate] [-q queue] [-l loss] [-t packet timeout] [-a delayed acks] [-g gap] [-e seed]\r\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (flow_count < 1 || flow_count > MAX_FLOWS || size < 2 * sizeof(uint32_t) || window > CSP_RDP_MAX_WINDOW) {
+		printf("Need 1 to %d flows, packets of at least 8 bytes and a window of at most %d\r\n", MAX_FLOWS, CSP_RDP_MAX_WINDOW);
+		return 1;
+	}
+
+	csp_buffer_init(flow_count * (CSP_RDP_MAX_WINDOW * 4 + 20) + 40, size + 40);
+	csp_init(MY_ADDRESS);
+	csp_debug_set_level(CSP_ERROR, false);
+	csp_debug_set_level(CSP_WARN, false);
+
+	/* Send to ourselves over the emulated link */
+	csp_link_init(&link, seed);
+	csp_link_tap(tap);
+	csp_route_set(MY_ADDRESS, &csp_if_link, CSP_NODE_MAC);
+	csp_route_start_task(1000, 1);
+
+	csp_rdp_set_opt(window, 30000, packet_timeout, delayed_acks, packet_timeout / 4, window / 2 ? window / 2 : 1);
+
+	csp_thread_create(task_server, (signed char *) "SERVER", 1000, NULL, 0, &handle);
+
+	for (i = 0; i < flow_count; i++) {
+		flows[i].index = i;
+		csp_thread_create(task_client, (signed char *) "CLIENT", 1000, &flows[i], 0, &handle);
+	}
+
+	while (finished < flow_count)
+		csp_sleep_ms(10);
+	csp_sleep_ms(100);
+
+	csp_link_stats(&stats);
+
+	printf("window %u, delay %u ms, jitter %u ms, rate %u B/s, queue %u, loss %u/1000\r\n",
+			window, link.delay, link.jitter, link.rate, link.queue, link.loss);
+
+	for (i = 0; i < flow_count; i++) {
+		if (flows[i].received < packets || flows[i].errors)
+			errors++;
+		elapsed = flows[i].end - flows[i].start;
+		goodput = flows[i].received * (double) size / elapsed / 1000;
+		sum += goodput;
+		sum2 += goodput * goodput;
+		printf("flow %u: %u of %u packets in %.2f s, %.1f kB/s, srtt %"PRIu32" ms, rto %"PRIu32" ms, %u errors\r\n",
+				i, flows[i].received, packets, elapsed, goodput, flows[i].srtt, flows[i].rto, flows[i].errors);
+	}
+
+	if (flow_count > 1)
+		printf("fairness %.3f, total %.1f kB/s\r\n", sum * sum / (flow_count * sum2), sum);
+
+	printf("link: %"PRIu32" sent, %"PRIu32" lost, %"PRIu32" queue drops, %"PRIu32" router drops; %u retransmitted, %u spurious\r\n",
+			stats.sent, stats.lost, stats.queue_drops, stats.router_drops, retransmitted, spurious);
+
+	/* Nothing was lost or reordered, so a retransmission means an RTO
+	 * shorter than the round trip */
+	if (link.loss == 0 && link.jitter == 0 && stats.queue_drops == 0 && stats.router_drops == 0 && retransmitted) {
+		printf("Retransmissions on a lossless link\r\n");
+		errors++;
+	}
+
+	return errors ? 1 : 0;
+
+}
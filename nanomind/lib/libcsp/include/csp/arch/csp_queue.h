@@ -39,6 +39,19 @@ int csp_queue_enqueue(csp_queue_handle_t handle, void *value, uint32_t timeout);
 int csp_queue_enqueue_isr(csp_queue_handle_t handle, void * value, CSP_BASE_TYPE * task_woken);
 int csp_queue_dequeue(csp_queue_handle_t handle, void *buf, uint32_t timeout);
 int csp_queue_dequeue_isr(csp_queue_handle_t handle, void * buf, CSP_BASE_TYPE * task_woken);
+
+/**
+ * Dequeue up to max items in one call.
+ * Blocks up to timeout for the first item, then takes whatever else is
+ * already queued without blocking again.
+ * @param handle queue handle
+ * @param buf array with room for max items
+ * @param item_size item size the queue was created with
+ * @param max maximum number of items to dequeue
+ * @param timeout timeout in ms for the first item
+ * @return number of items dequeued, 0 on timeout
+ */
+int csp_queue_dequeue_batch(csp_queue_handle_t handle, void * buf, size_t item_size, int max, uint32_t timeout);
 int csp_queue_size(csp_queue_handle_t handle);
 int csp_queue_size_isr(csp_queue_handle_t handle);
 
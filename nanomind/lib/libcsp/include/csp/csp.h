@@ -196,6 +196,12 @@ typedef struct __attribute__((__packed__)) {
 	};
 } csp_packet_t;
 
+/** Payload fragment for scatter-gather send */
+typedef struct {
+	const void * base;					/**< Start of fragment */
+	uint16_t len;						/**< Length of fragment in bytes */
+} csp_iovec_t;
+
 /** Interface struct */
 typedef struct csp_iface_s {
 	const char *name;			/**< Interface name (keep below 10 bytes) */
@@ -214,11 +220,18 @@ typedef struct csp_iface_s {
 	uint32_t txbytes;			/**< Transmitted bytes */
 	uint32_t rxbytes;			/**< Received bytes */
 	uint32_t irq;				/**< Interrupts */
+	uint16_t tx_queue_size;		/**< Length of the interface TX queue, 0 if it has none */
+	uint16_t tx_queue;			/**< Packets waiting in the TX queue */
+	uint16_t tx_queue_max;		/**< Highest number of packets seen waiting in the TX queue */
+	uint32_t tx_queue_drop;		/**< Packets dropped because the TX queue was full */
 	struct csp_iface_s *next;	/**< Next interface */
 } csp_iface_t;
 
 /* Nexthop typedef:
- * Note this has to match the nexthop type in the iface structure */
+ * Note this has to match the nexthop type in the iface structure.
+ * On CSP_ERR_NONE the interface owns the packet. On CSP_ERR_TIMEDOUT it also
+ * keeps the packet, but could not confirm the transmission within the
+ * timeout. On any other error the packet is returned to the caller */
 typedef int (*nexthop_t)(csp_iface_t * interface, csp_packet_t *packet, uint32_t timeout);
 
 /**
@@ -302,6 +315,58 @@ csp_packet_t *csp_read(csp_conn_t *conn, uint32_t timeout);
  */
 int csp_send(csp_conn_t *conn, csp_packet_t *packet, uint32_t timeout);
 
+#ifdef CSP_USE_RDP
+/**
+ * Send a packet built from several payload fragments on an established connection
+ * The fragments are copied once into a buffer that also has room for the
+ * RDP header and the HMAC, CRC32 and XTEA trailers of the connection, so the
+ * caller does not need to assemble the payload in a packet first.
+ * @param conn pointer to connection
+ * @param iov array of payload fragments
+ * @param iovcnt number of fragments
+ * @param timeout a timeout to wait for TX to complete. NOTE: not all underlying drivers supports flow-control.
+ * @return returns 1 if successful and 0 otherwise. The fragments are never owned by CSP.
+ */
+int csp_sendv(csp_conn_t *conn, const csp_iovec_t *iov, int iovcnt, uint32_t timeout);
+
+/**
+ * Write a byte stream to an RDP connection
+ * The data is copied into as many packets as needed, each as large as the
+ * buffers and the route MTU allow, and queued as long as the RDP window has
+ * room. The call only blocks while the window is full, so the window is kept
+ * full without per-packet round trips from the caller.
+ * @param conn pointer to an RDP connection
+ * @param data bytes to write
+ * @param len number of bytes
+ * @param timeout total time to wait for window space, use 0 to only queue what fits the window now
+ * @return number of bytes queued, or CSP_ERR_TIMEDOUT if the timeout expired before anything was queued.
+ * Like a POSIX write(), the count is less than len only when the timeout expired; call again with the rest.
+ * Any other error is returned as CSP_ERR_*, even when part of the data was queued. The stream is then
+ * broken and the connection should be closed.
+ */
+int csp_stream_write(csp_conn_t *conn, const void *data, size_t len, uint32_t timeout);
+
+/**
+ * Read bytes from an RDP connection
+ * Waits for the first packet only, then returns what is available without
+ * blocking. A packet that does not fit is kept for the next call.
+ * @param conn pointer to an RDP connection
+ * @param data destination buffer
+ * @param len size of destination buffer
+ * @param timeout timeout in ms to wait for the first packet
+ * @return number of bytes read, 0 on timeout or when the connection closed, or CSP_ERR_INVAL
+ */
+int csp_stream_read(csp_conn_t *conn, void *data, size_t len, uint32_t timeout);
+
+/**
+ * Wait until everything written to an RDP connection has been acknowledged
+ * @param conn pointer to an RDP connection
+ * @param timeout timeout in ms
+ * @return CSP_ERR_NONE when all data is acknowledged, CSP_ERR_TIMEDOUT or CSP_ERR_RESET otherwise
+ */
+int csp_stream_flush(csp_conn_t *conn, uint32_t timeout);
+#endif
+
 /**
  * Send a packet on an already established connection, and change the default priority of the connection
  *
@@ -367,6 +432,20 @@ csp_packet_t *csp_recvfrom(csp_socket_t *socket, uint32_t timeout);
  */
 int csp_sendto(uint8_t prio, uint8_t dest, uint8_t dport, uint8_t src_port, uint32_t opts, csp_packet_t *packet, uint32_t timeout);
 
+/**
+ * Send a packet built from several payload fragments without previously opening a connection
+ * @param prio CSP_PRIO_x
+ * @param dest destination node
+ * @param dport destination port
+ * @param src_port source port
+ * @param opts CSP_O_x
+ * @param iov array of payload fragments
+ * @param iovcnt number of fragments
+ * @param timeout timeout used by interfaces with blocking send
+ * @return CSP_ERR_NONE if OK, otherwise an error code. The fragments are never owned by CSP.
+ */
+int csp_sendto_v(uint8_t prio, uint8_t dest, uint8_t dport, uint8_t src_port, uint32_t opts, const csp_iovec_t *iov, int iovcnt, uint32_t timeout);
+
 /**
  * Send a packet as a direct reply to the source of an incoming packet,
  * but still without holding an entire connection
@@ -489,6 +568,9 @@ void csp_route_table_save(uint8_t route_table_out[CSP_ROUTE_TABLE_SIZE]);
 
 /**
  * Start the router task.
+ * If CSP is compiled with router workers (CSP_ROUTER_WORKERS > 0), the worker
+ * tasks are started as well, using the same stack size and priority. Packets
+ * on one connection are always processed by the same worker, in order.
  * @param task_stack_size The number of portStackType to allocate. This only affects FreeRTOS systems.
  * @param priority The OS task priority of the router
  */
@@ -518,6 +600,9 @@ void csp_promisc_disable(void);
  * The queue is FIFO, so the returned packet is the oldest one
  * in the queue.
  *
+ * The packet may share its buffer with the router, call
+ * csp_buffer_writable() before modifying it.
+ *
  * @param timeout Timeout in ms to wait for a new packet
  */
 csp_packet_t *csp_promisc_read(uint32_t timeout);
@@ -590,9 +675,9 @@ void csp_uptime(uint8_t node, uint32_t timeout);
  * Set RDP options
  * @param window_size Window size
  * @param conn_timeout_ms Connection timeout in ms
- * @param packet_timeout_ms Packet timeout in ms
+ * @param packet_timeout_ms Upper bound in ms for the adaptive retransmission timeout
  * @param delayed_acks Enable/disable delayed acknowledgements
- * @param ack_timeout Acknowledgement timeout when delayed ACKs is enabled
+ * @param ack_timeout Acknowledgement timeout when delayed ACKs is enabled, also the lower bound for the retransmission timeout
  * @param ack_delay_count Send acknowledgement for every ack_delay_count packets
  */
 void csp_rdp_set_opt(unsigned int window_size, unsigned int conn_timeout_ms,
@@ -603,9 +688,9 @@ void csp_rdp_set_opt(unsigned int window_size, unsigned int conn_timeout_ms,
  * Get RDP options
  * @param window_size Window size
  * @param conn_timeout_ms Connection timeout in ms
- * @param packet_timeout_ms Packet timeout in ms
+ * @param packet_timeout_ms Upper bound in ms for the adaptive retransmission timeout
  * @param delayed_acks Enable/disable delayed acknowledgements
- * @param ack_timeout Acknowledgement timeout when delayed ACKs is enabled
+ * @param ack_timeout Acknowledgement timeout when delayed ACKs is enabled, also the lower bound for the retransmission timeout
  * @param ack_delay_count Send acknowledgement for every ack_delay_count packets
  */
 void csp_rdp_get_opt(unsigned int *window_size, unsigned int *conn_timeout_ms,
@@ -25,6 +25,26 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 extern "C" {
 #endif
 
+#include <stddef.h>
+
+/** Maximum number of buffer size classes */
+#define CSP_BUFFER_MAX_CLASSES	4
+
+/** Buffer size class */
+typedef struct {
+	unsigned int size;			/**< Buffer size in bytes */
+	unsigned int count;			/**< Number of buffers of this size */
+} csp_buffer_class_t;
+
+/** Buffer size class statistics */
+typedef struct {
+	unsigned int size;			/**< Buffer size in bytes */
+	unsigned int count;			/**< Number of buffers of this size */
+	unsigned int in_use;		/**< Buffers currently allocated */
+	unsigned int high_watermark;/**< Highest number of buffers allocated at once */
+	unsigned int failed;		/**< Allocations that found no free buffer */
+} csp_buffer_stats_t;
+
 /**
  * Start the buffer handling system
  * You must specify the number for buffers and the size. All buffers are fixed
@@ -37,6 +57,24 @@ extern "C" {
  */
 int csp_buffer_init(int count, int size);
 
+/**
+ * Start the buffer handling system with several buffer sizes
+ * A buffer is taken from the smallest class that fits the requested size,
+ * or from a larger class if that one is exhausted. The last class must be
+ * large enough for the largest packet (normally the interface MTU).
+ *
+ * @note A buffer can only hold what was requested from csp_buffer_get(),
+ * plus room for the RDP, HMAC, CRC32 and XTEA trailers. Code that reuses a
+ * received packet for a larger reply must call csp_buffer_resize() first.
+ *
+ * @param class_count Number of entries in class_list (max CSP_BUFFER_MAX_CLASSES)
+ * @param class_list Size classes in ascending size order, with less than
+ * 65535 buffers per class on POSIX
+ *
+ * @return CSP_ERR_NONE if malloc() succeeded, CSP_ERR message otherwise.
+ */
+int csp_buffer_init_classes(int class_count, const csp_buffer_class_t * class_list);
+
 /**
  * Get a reference to a free buffer. This function can only be called
  * from task context.
@@ -74,17 +112,55 @@ void csp_buffer_free_isr(void *packet);
 void * csp_buffer_clone(void *buffer);
 
 /**
- * Return how many buffers that are currently free.
+ * Clone an existing packet by reference.
+ * No data is copied, the buffer is shared and only returned to the pool
+ * once every holder has called csp_buffer_free(). A holder of a shared
+ * packet must not modify it without calling csp_buffer_writable() first.
+ * @param buffer Existing buffer to clone.
+ * @return buffer with an extra reference, or NULL on invalid buffer
+ */
+void * csp_buffer_clone_ref(void *buffer);
+
+/**
+ * Get a version of a packet that can be modified.
+ * If the buffer is not shared it is returned as is, otherwise a private copy
+ * is made. The caller keeps its reference to the original buffer and must
+ * free it once it has switched to the copy.
+ * @param buffer Existing buffer
+ * @return buffer that may be written, or NULL if out of memory
+ */
+void * csp_buffer_writable(void *buffer);
+
+/**
+ * Ensure a packet can hold a given amount of data.
+ * If the buffer is too small, the packet is copied to a larger buffer and
+ * the old buffer is freed. Sizes above the largest buffer are truncated to it.
+ * @param buffer Existing buffer
+ * @param buf_size Specify what data-size you will put in the buffer
+ * @return pointer to the packet to use, or NULL if out of memory (the original buffer is untouched)
+ */
+void * csp_buffer_resize(void *buffer, size_t buf_size);
+
+/**
+ * Return how many buffers that are currently free, in all size classes.
  * @return number of free buffers
  */
 int csp_buffer_remaining(void);
 
 /**
  * Return the size of the CSP buffers
- * @return size of CSP buffers
+ * @return size of the largest CSP buffers
  */
 int csp_buffer_size(void);
 
+/**
+ * Get usage statistics for a buffer size class
+ * @param index Size class index, 0 is the smallest class
+ * @param stats Pointer to statistics struct to fill
+ * @return CSP_ERR_NONE on success, CSP_ERR_INVAL if index is not a configured class
+ */
+int csp_buffer_stats(int index, csp_buffer_stats_t * stats);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
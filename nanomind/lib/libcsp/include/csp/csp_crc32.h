@@ -26,10 +26,30 @@ extern "C" {
 #endif
 
 /**
- * Generate precomputed CRC32 table
+ * Generate precomputed CRC32 tables
+ * With the slice-by-8 implementation this builds the extra tables and selects
+ * the SSE4.2 instruction if the CPU has it. It is called by csp_init(), and
+ * on first use otherwise. The bytewise implementation needs no setup.
  */
 void csp_crc32_gentab(void);
 
+/**
+ * Calculate CRC32 (Castagnoli) of a memory area
+ * @param data pointer to data
+ * @param length length of data in bytes
+ * @return CRC32 checksum
+ */
+uint32_t csp_crc32_memory(const uint8_t * data, uint32_t length);
+
+/**
+ * Continue a CRC32 checksum over more data
+ * @param crc Checksum of the data before, 0 to start a new one
+ * @param data Pointer to data
+ * @param length Length of data
+ * @return Checksum of all data so far
+ */
+uint32_t csp_crc32_update(uint32_t crc, const uint8_t * data, uint32_t length);
+
 /**
  * Append CRC32 checksum to packet
  * @param packet Packet to append checksum
@@ -43,6 +43,23 @@ struct csp_can_config {
 	char *ifc;
 };
 
+/** CAN fragment reassembly statistics */
+typedef struct {
+	uint32_t pbuf_count;		/**< Number of packet buffer elements */
+	uint32_t pbuf_in_use;		/**< Packet buffer elements currently in use */
+	uint32_t pbuf_full;			/**< Packets dropped because all packet buffer elements were in use */
+	uint32_t pbuf_timeout;		/**< Packet buffer elements that timed out */
+	uint32_t lost;				/**< Packets dropped because a fragment was lost */
+	uint32_t reassembled;		/**< Packets reassembled */
+} csp_can_stats_t;
+
+/**
+ * Get CAN fragment reassembly statistics
+ * @param stats Pointer to statistics struct to fill
+ * @return CSP_ERR_NONE on success, CSP_ERR_INVAL if stats is NULL
+ */
+int csp_can_get_stats(csp_can_stats_t *stats);
+
 /**
  * Init CAN interface
  * @param mode Must be either CSP_CAN_MASKED or CSP_CAN_PROMISC
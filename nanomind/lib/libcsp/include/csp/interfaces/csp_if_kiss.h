@@ -29,6 +29,14 @@ extern "C" {
 
 #include <csp/csp.h>
 #include <csp/csp_interface.h>
+#include <csp/arch/csp_semaphore.h>
+
+/** Maximum Transmission Unit for CSP over KISS */
+#define CSP_KISS_MTU 256
+
+/** Size of the TX frame buffer. Fits FEND, TNC_DATA, a fully escaped
+ * CSP header, data and CRC32, and the closing FEND */
+#define CSP_KISS_TX_BUF_SIZE (2 * (CSP_HEADER_LENGTH + CSP_KISS_MTU + sizeof(uint32_t)) + 3)
 
 /**
  * The KISS interface relies on the USART callback in order to parse incoming
@@ -49,6 +57,19 @@ extern "C" {
  */
 void csp_kiss_rx(csp_iface_t * interface, uint8_t *buf, int len, void *pxTaskWoken);
 
+/**
+ * Decode a whole buffer of received bytes in one pass. Runs of plain data
+ * are copied in bulk, and all decoder state is kept in the interface
+ * handle, so several KISS interfaces can receive at the same time.
+ * csp_kiss_rx is the same function kept for existing callers.
+ *
+ * @param csp_iface pointer to interface
+ * @param buf pointer to incoming data
+ * @param len length of incoming data
+ * @param pxTaskWoken NULL if task context, pointer to variable if ISR
+ */
+void csp_kiss_rx_buf(csp_iface_t * interface, const uint8_t *buf, int len, void *pxTaskWoken);
+
 /**
  * The putc function is used by the kiss interface to send
  * a string of data to the serial port. This function must
@@ -58,6 +79,17 @@ void csp_kiss_rx(csp_iface_t * interface, uint8_t *buf, int len, void *pxTaskWok
  */
 typedef void (*csp_kiss_putc_f)(char buf);
 
+/**
+ * The write function is used by the kiss interface to send a
+ * whole frame to the serial port in one call. It is optional,
+ * and is passed to the kiss interface through the
+ * csp_kiss_set_write function. Without it, frames are sent
+ * one byte at a time with the putc function.
+ * @param buf pointer to frame
+ * @param len length of frame
+ */
+typedef void (*csp_kiss_write_f)(char *buf, int len);
+
 /**
  * The characters not accepted by the kiss interface, are discarded
  * using this function, which must be implemented by the user
@@ -86,7 +118,10 @@ typedef enum {
  */
 typedef struct csp_kiss_handle_s {
 	csp_kiss_putc_f kiss_putc;
+	csp_kiss_write_f kiss_write;
 	csp_kiss_discard_f kiss_discard;
+	csp_bin_sem_handle_t tx_lock;
+	uint8_t tx_buf[CSP_KISS_TX_BUF_SIZE];
 	unsigned int rx_length;
 	kiss_mode_e rx_mode;
 	unsigned int rx_first;
@@ -96,6 +131,13 @@ typedef struct csp_kiss_handle_s {
 
 void csp_kiss_init(csp_iface_t * csp_iface, csp_kiss_handle_t * csp_kiss_handle, csp_kiss_putc_f kiss_putc_f, csp_kiss_discard_f kiss_discard_f, const char * name);
 
+/**
+ * Send whole frames through a write function instead of the putc function
+ * @param csp_kiss_handle handle passed to csp_kiss_init
+ * @param kiss_write_f write function, or NULL to go back to putc
+ */
+void csp_kiss_set_write(csp_kiss_handle_t * csp_kiss_handle, csp_kiss_write_f kiss_write_f);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
@@ -0,0 +1,69 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef _CSP_IF_UDP_H_
+#define _CSP_IF_UDP_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include <csp/csp.h>
+#include <csp/csp_interface.h>
+
+/**
+ * CSP over UDP/IP.
+ *
+ * Each datagram carries one CSP packet: the 32 bit CSP header in network
+ * byte order followed by the data. CSP hosts are mapped to UDP endpoints
+ * with csp_udp_peer_set. A single task waits on the socket with epoll,
+ * receives with recvmmsg and sends queued packets with sendmmsg.
+ */
+
+extern csp_iface_t csp_if_udp;
+
+/**
+ * Open the UDP socket and start the UDP task.
+ * Call after csp_buffer_init, the MTU follows the largest CSP buffer.
+ * @param address local address to bind, or NULL for any
+ * @param port local UDP port
+ * @return CSP_ERR_NONE on success, CSP_ERR_DRIVER or CSP_ERR_NOMEM on error
+ */
+int csp_udp_init(const char * address, uint16_t port);
+
+/**
+ * Map a CSP host to a UDP endpoint.
+ * Packets to hosts without a mapping go to the CSP_DEFAULT_ROUTE mapping,
+ * broadcasts go to every mapped endpoint once, also when several hosts
+ * share it.
+ * @param node CSP host, or CSP_DEFAULT_ROUTE
+ * @param host IP address or host name, or NULL to remove the mapping
+ * @param port UDP port
+ * @return CSP_ERR_NONE on success, CSP_ERR_INVAL if the node or host is invalid
+ */
+int csp_udp_peer_set(uint8_t node, const char * host, uint16_t port);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* _CSP_IF_UDP_H_ */
@@ -57,6 +57,19 @@ int csp_queue_dequeue_isr(csp_queue_handle_t handle, void * buf, CSP_BASE_TYPE *
 	return xQueueReceiveFromISR(handle, buf, (signed CSP_BASE_TYPE *)task_woken);
 }
 
+int csp_queue_dequeue_batch(csp_queue_handle_t handle, void * buf, size_t item_size, int max, uint32_t timeout) {
+	int count = 0;
+	if (max < 1)
+		return 0;
+	if (csp_queue_dequeue(handle, buf, timeout) != pdTRUE)
+		return 0;
+	count++;
+	/* FreeRTOS has no bulk receive, but the remaining calls never block */
+	while (count < max && xQueueReceive(handle, (char *) buf + count * item_size, 0) == pdTRUE)
+		count++;
+	return count;
+}
+
 int csp_queue_size(csp_queue_handle_t handle) {
 	return uxQueueMessagesWaiting(handle);
 }
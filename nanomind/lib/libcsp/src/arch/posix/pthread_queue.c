@@ -158,6 +158,54 @@ int pthread_queue_dequeue(pthread_queue_t * queue, void * buf, uint32_t timeout)
 	
 }
 
+int pthread_queue_dequeue_batch(pthread_queue_t * queue, void * buf, int max, uint32_t timeout) {
+
+	int ret, count, first;
+	
+	/* Calculate timeout */
+	struct timespec ts;
+	if (clock_gettime(CLOCK_REALTIME, &ts))
+		return 0;
+	
+	uint32_t sec = timeout / 1000;
+	uint32_t nsec = (timeout - 1000 * sec) * 1000000;
+
+	ts.tv_sec += sec;
+	
+	if (ts.tv_nsec + nsec > 1000000000)
+		ts.tv_sec++;
+
+	ts.tv_nsec = (ts.tv_nsec + nsec) % 1000000000;
+	
+	/* Get queue lock */
+	pthread_mutex_lock(&(queue->mutex));
+	while (queue->items == 0) {
+		ret = pthread_cond_timedwait(&(queue->cond_empty), &(queue->mutex), &ts);
+		if (ret != 0) {
+			pthread_mutex_unlock(&(queue->mutex));
+			return 0;
+		}
+	}
+
+	/* Copy everything available in at most two runs, the second one after wrapping */
+	count = (queue->items < max) ? queue->items : max;
+	first = queue->size - queue->out;
+	if (first > count)
+		first = count;
+	memcpy(buf, queue->buffer+(queue->out * queue->item_size), first * queue->item_size);
+	if (count > first)
+		memcpy((char *) buf + first * queue->item_size, queue->buffer, (count - first) * queue->item_size);
+	queue->items -= count;
+	queue->out = (queue->out + count) % queue->size;
+	pthread_mutex_unlock(&(queue->mutex));
+	
+	/* Nofify blocked threads */
+	pthread_cond_broadcast(&(queue->cond_full));
+
+	return count;
+	
+}
+
 int pthread_queue_items(pthread_queue_t * queue) {
 
 	pthread_mutex_lock(&(queue->mutex));
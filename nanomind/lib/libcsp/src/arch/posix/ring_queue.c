@@ -0,0 +1,315 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 Gomspace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk) 
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/* CSP includes */
+#include <csp/csp.h>
+
+#include "ring_queue.h"
+
+static int ring_futex_wait(volatile int * addr, int val, const struct timespec * timeout) {
+	return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+}
+
+static void ring_futex_wake(volatile int * addr, int count) {
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+ring_queue_t * ring_queue_create(int length, size_t item_size) {
+
+	int i;
+	ring_queue_t * q = calloc(1, sizeof(ring_queue_t));
+
+	if (q == NULL)
+		return NULL;
+
+	q->buffer = malloc(length * item_size);
+	q->seq = malloc(length * sizeof(uint64_t));
+	if (q->buffer == NULL || q->seq == NULL) {
+		free(q->buffer);
+		free((void *) q->seq);
+		free(q);
+		return NULL;
+	}
+
+	q->size = length;
+	q->item_size = item_size;
+
+	/* Slot i is free for the write at position i */
+	for (i = 0; i < length; i++)
+		q->seq[i] = i;
+
+	return q;
+
+}
+
+void ring_queue_delete(ring_queue_t * q) {
+
+	if (q == NULL)
+		return;
+
+	free(q->buffer);
+	free((void *) q->seq);
+	free(q);
+
+}
+
+static int ring_queue_try_enqueue(ring_queue_t * q, void * value) {
+
+	uint64_t pos = q->tail;
+	uint64_t seq;
+	int64_t diff;
+	unsigned int slot;
+
+	while (1) {
+		slot = pos % q->size;
+		seq = q->seq[slot];
+		__sync_synchronize();
+		diff = (int64_t) (seq - pos);
+
+		if (diff == 0) {
+			/* Slot is free, try to claim the position */
+			if (__sync_bool_compare_and_swap(&q->tail, pos, pos + 1))
+				break;
+			pos = q->tail;
+		} else if (diff < 0) {
+			/* Slot still holds the item from one lap ago */
+			return RING_QUEUE_FULL;
+		} else {
+			/* Another producer claimed the position */
+			pos = q->tail;
+		}
+	}
+
+	memcpy(q->buffer + slot * q->item_size, value, q->item_size);
+
+	/* Publish the item to consumers */
+	__sync_synchronize();
+	q->seq[slot] = pos + 1;
+
+	return RING_QUEUE_OK;
+
+}
+
+static int ring_queue_try_dequeue(ring_queue_t * q, void * buf) {
+
+	uint64_t pos = q->head;
+	uint64_t seq;
+	int64_t diff;
+	unsigned int slot;
+
+	while (1) {
+		slot = pos % q->size;
+		seq = q->seq[slot];
+		__sync_synchronize();
+		diff = (int64_t) (seq - (pos + 1));
+
+		if (diff == 0) {
+			/* Slot holds an item, try to claim the position */
+			if (__sync_bool_compare_and_swap(&q->head, pos, pos + 1))
+				break;
+			pos = q->head;
+		} else if (diff < 0) {
+			/* Slot not written yet */
+			return RING_QUEUE_EMPTY;
+		} else {
+			/* Another consumer claimed the position */
+			pos = q->head;
+		}
+	}
+
+	memcpy(buf, q->buffer + slot * q->item_size, q->item_size);
+
+	/* Hand the slot back to producers for the next lap */
+	__sync_synchronize();
+	q->seq[slot] = pos + q->size;
+
+	return RING_QUEUE_OK;
+
+}
+
+/* Wake up to count threads sleeping on a futex word, if anybody is */
+static inline void ring_queue_signal_n(volatile int * word, volatile int * waiters, int count) {
+
+	/* Order the ring update before reading the waiter count */
+	__sync_synchronize();
+
+	if (*waiters > 0) {
+		__sync_fetch_and_add(word, 1);
+		ring_futex_wake(word, count);
+	}
+
+}
+
+static inline void ring_queue_signal(volatile int * word, volatile int * waiters) {
+	ring_queue_signal_n(word, waiters, 1);
+}
+
+/* Sleep on a futex word until it changes or the deadline passes.
+ * Returns 0 if the caller should retry and -1 on timeout. */
+static int ring_queue_wait(volatile int * word, volatile int * waiters, int val, uint32_t timeout, const struct timespec * deadline) {
+
+	struct timespec now, rel, * relp = NULL;
+
+	if (timeout != CSP_MAX_DELAY) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		rel.tv_sec = deadline->tv_sec - now.tv_sec;
+		rel.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+		if (rel.tv_nsec < 0) {
+			rel.tv_sec--;
+			rel.tv_nsec += 1000000000;
+		}
+		if (rel.tv_sec < 0)
+			return -1;
+		relp = &rel;
+	}
+
+	ring_futex_wait(word, val, relp);
+	__sync_fetch_and_sub(waiters, 1);
+
+	return 0;
+
+}
+
+static void ring_queue_deadline(struct timespec * ts, uint32_t timeout) {
+
+	clock_gettime(CLOCK_MONOTONIC, ts);
+
+	ts->tv_sec += timeout / 1000;
+	ts->tv_nsec += (timeout % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+
+}
+
+int ring_queue_enqueue(ring_queue_t * queue, void * value, uint32_t timeout) {
+
+	int val;
+	struct timespec deadline;
+
+	if (timeout != 0 && timeout != CSP_MAX_DELAY)
+		ring_queue_deadline(&deadline, timeout);
+
+	while (1) {
+		if (ring_queue_try_enqueue(queue, value) == RING_QUEUE_OK) {
+			ring_queue_signal(&queue->not_empty, &queue->empty_waiters);
+			return RING_QUEUE_OK;
+		}
+
+		if (timeout == 0)
+			return RING_QUEUE_FULL;
+
+		/* Register as waiter before checking the ring again, so a
+		 * consumer that frees a slot after the check will wake us */
+		val = queue->not_full;
+		__sync_fetch_and_add(&queue->full_waiters, 1);
+
+		if (ring_queue_try_enqueue(queue, value) == RING_QUEUE_OK) {
+			__sync_fetch_and_sub(&queue->full_waiters, 1);
+			ring_queue_signal(&queue->not_empty, &queue->empty_waiters);
+			return RING_QUEUE_OK;
+		}
+
+		if (ring_queue_wait(&queue->not_full, &queue->full_waiters, val, timeout, &deadline) < 0) {
+			__sync_fetch_and_sub(&queue->full_waiters, 1);
+			return RING_QUEUE_FULL;
+		}
+	}
+
+}
+
+int ring_queue_dequeue(ring_queue_t * queue, void * buf, uint32_t timeout) {
+
+	int val;
+	struct timespec deadline;
+
+	if (timeout != 0 && timeout != CSP_MAX_DELAY)
+		ring_queue_deadline(&deadline, timeout);
+
+	while (1) {
+		if (ring_queue_try_dequeue(queue, buf) == RING_QUEUE_OK) {
+			ring_queue_signal(&queue->not_full, &queue->full_waiters);
+			return RING_QUEUE_OK;
+		}
+
+		if (timeout == 0)
+			return RING_QUEUE_EMPTY;
+
+		/* Register as waiter before checking the ring again, so a
+		 * producer that adds an item after the check will wake us */
+		val = queue->not_empty;
+		__sync_fetch_and_add(&queue->empty_waiters, 1);
+
+		if (ring_queue_try_dequeue(queue, buf) == RING_QUEUE_OK) {
+			__sync_fetch_and_sub(&queue->empty_waiters, 1);
+			ring_queue_signal(&queue->not_full, &queue->full_waiters);
+			return RING_QUEUE_OK;
+		}
+
+		if (ring_queue_wait(&queue->not_empty, &queue->empty_waiters, val, timeout, &deadline) < 0) {
+			__sync_fetch_and_sub(&queue->empty_waiters, 1);
+			return RING_QUEUE_EMPTY;
+		}
+	}
+
+}
+
+int ring_queue_dequeue_batch(ring_queue_t * queue, void * buf, int max, uint32_t timeout) {
+
+	int count = 1;
+
+	if (max < 1 || ring_queue_dequeue(queue, buf, timeout) != RING_QUEUE_OK)
+		return 0;
+
+	/* Take what is already there and wake producers once for the lot */
+	while (count < max && ring_queue_try_dequeue(queue, (char *) buf + count * queue->item_size) == RING_QUEUE_OK)
+		count++;
+
+	if (count > 1)
+		ring_queue_signal_n(&queue->not_full, &queue->full_waiters, count - 1);
+
+	return count;
+
+}
+
+int ring_queue_items(ring_queue_t * queue) {
+
+	int64_t items = (int64_t) (queue->tail - queue->head);
+
+	/* Positions are read separately, so clamp transient values */
+	if (items < 0)
+		return 0;
+	if (items > queue->size)
+		return queue->size;
+
+	return items;
+
+}
@@ -0,0 +1,69 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 Gomspace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk) 
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef _RING_QUEUE_H_
+#define _RING_QUEUE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <csp/arch/csp_queue.h>
+
+#define RING_QUEUE_ERROR CSP_QUEUE_ERROR
+#define RING_QUEUE_EMPTY CSP_QUEUE_ERROR
+#define RING_QUEUE_FULL CSP_QUEUE_ERROR
+#define RING_QUEUE_OK CSP_QUEUE_OK
+
+/**
+ * Bounded multi-producer/multi-consumer ring.
+ * Each slot carries a sequence number telling whether it is ready to be
+ * written or read at a given position, so the fast path is a single
+ * compare-and-swap. Threads only sleep (on a futex) when the ring is
+ * empty or full.
+ */
+typedef struct ring_queue_s {
+	char * buffer;
+	volatile uint64_t * seq;
+	int size;
+	int item_size;
+	volatile uint64_t head;			/* Next position to read */
+	volatile uint64_t tail;			/* Next position to write */
+	volatile int not_empty;			/* Futex word bumped when an item is added */
+	volatile int not_full;			/* Futex word bumped when an item is removed */
+	volatile int empty_waiters;
+	volatile int full_waiters;
+} ring_queue_t;
+
+ring_queue_t * ring_queue_create(int length, size_t item_size);
+void ring_queue_delete(ring_queue_t * q);
+int ring_queue_enqueue(ring_queue_t * queue, void * value, uint32_t timeout);
+int ring_queue_dequeue(ring_queue_t * queue, void * buf, uint32_t timeout);
+int ring_queue_dequeue_batch(ring_queue_t * queue, void * buf, int max, uint32_t timeout);
+int ring_queue_items(ring_queue_t * queue);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif // _RING_QUEUE_H_
@@ -31,6 +31,18 @@ int csp_queue_dequeue_isr(csp_queue_handle_t handle, void * buf, CSP_BASE_TYPE *
 	return windows_queue_dequeue(handle, buf, 0);
 }
 
+int csp_queue_dequeue_batch(csp_queue_handle_t handle, void * buf, size_t item_size, int max, uint32_t timeout) {
+	int count = 0;
+	if (max < 1)
+		return 0;
+	if (windows_queue_dequeue(handle, buf, timeout) != CSP_QUEUE_OK)
+		return 0;
+	count++;
+	while (count < max && windows_queue_dequeue(handle, (char *) buf + count * item_size, 0) == CSP_QUEUE_OK)
+		count++;
+	return count;
+}
+
 int csp_queue_size(csp_queue_handle_t handle) {
 	return windows_queue_items(handle);
 }
@@ -42,6 +42,13 @@ typedef struct {
 	uint8_t		key[SHA1_BLOCKSIZE];
 } hmac_state;
 
+/* SHA1 states after absorbing the inner and outer padded key. Packets
+ * resume from copies of these instead of hashing the key blocks again.
+ * They are only written by csp_hmac_set_key() */
+static csp_sha1_state csp_hmac_inner;
+static csp_sha1_state csp_hmac_outer;
+static volatile int csp_hmac_ready = 0;
+
 int csp_hmac_init(hmac_state * hmac, const uint8_t * key, uint32_t keylen) {
 	uint32_t i;
 	uint8_t buf[SHA1_BLOCKSIZE];
@@ -135,6 +142,60 @@ int csp_hmac_memory(const uint8_t * key, uint32_t keylen, const uint8_t * data,
 	return CSP_ERR_NONE;
 }
 
+/* Absorb the padded key into inner and outer SHA1 states */
+static void csp_hmac_precompute(csp_sha1_state * inner, csp_sha1_state * outer) {
+
+	uint32_t i;
+	uint8_t buf[SHA1_BLOCKSIZE];
+
+	memset(buf, 0, sizeof(buf));
+	memcpy(buf, csp_hmac_key, HMAC_KEY_LENGTH);
+
+	for (i = 0; i < SHA1_BLOCKSIZE; i++)
+		buf[i] ^= 0x36;
+	csp_sha1_init(inner);
+	csp_sha1_process(inner, buf, SHA1_BLOCKSIZE);
+
+	/* 0x36 ^ 0x5C turns the inner pad into the outer pad */
+	for (i = 0; i < SHA1_BLOCKSIZE; i++)
+		buf[i] ^= 0x36 ^ 0x5C;
+	csp_sha1_init(outer);
+	csp_sha1_process(outer, buf, SHA1_BLOCKSIZE);
+
+}
+
+/* Key states for one packet. Until a key is set they are built from the
+ * all-zero key on the caller's stack, so concurrent senders never write
+ * the cached states */
+static void csp_hmac_states(csp_sha1_state * inner, csp_sha1_state * outer) {
+
+	if (csp_hmac_ready) {
+		/* Pairs with the barrier in csp_hmac_set_key() */
+		__sync_synchronize();
+		*inner = csp_hmac_inner;
+		*outer = csp_hmac_outer;
+	} else {
+		csp_hmac_precompute(inner, outer);
+	}
+
+}
+
+/* HMAC of data with the current key, using the cached key states */
+static void csp_hmac_packet(const uint8_t * data, uint32_t datalen, uint8_t * hmac) {
+
+	csp_sha1_state md, outer;
+	uint8_t isha[SHA1_DIGESTSIZE];
+
+	csp_hmac_states(&md, &outer);
+
+	csp_sha1_process(&md, data, datalen);
+	csp_sha1_done(&md, isha);
+
+	csp_sha1_process(&outer, isha, SHA1_DIGESTSIZE);
+	csp_sha1_done(&outer, hmac);
+
+}
+
 int csp_hmac_set_key(char * key, uint32_t keylen) {
 
 	/* Use SHA1 as KDF */
@@ -144,10 +205,42 @@ int csp_hmac_set_key(char * key, uint32_t keylen) {
 	/* Copy key */
 	memcpy(csp_hmac_key, hash, HMAC_KEY_LENGTH);
 
+	/* Derive the key states once, not per packet. They must be complete
+	 * before other tasks can see csp_hmac_ready */
+	csp_hmac_precompute(&csp_hmac_inner, &csp_hmac_outer);
+	__sync_synchronize();
+	csp_hmac_ready = 1;
+
 	return CSP_ERR_NONE;
 
 }
 
+void csp_hmac_stream_init(csp_hmac_stream_t * stream) {
+
+	csp_hmac_states(&stream->md, &stream->outer);
+
+}
+
+void csp_hmac_stream_process(csp_hmac_stream_t * stream, const uint8_t * data, uint32_t length) {
+
+	csp_sha1_process(&stream->md, data, length);
+
+}
+
+void csp_hmac_stream_done(csp_hmac_stream_t * stream, uint8_t * out) {
+
+	uint8_t isha[SHA1_DIGESTSIZE];
+
+	csp_sha1_done(&stream->md, isha);
+
+	csp_sha1_process(&stream->outer, isha, SHA1_DIGESTSIZE);
+	csp_sha1_done(&stream->outer, isha);
+
+	/* Truncated like the packet trailer */
+	memcpy(out, isha, CSP_HMAC_LENGTH);
+
+}
+
 int csp_hmac_append(csp_packet_t * packet) {
 
 	/* NULL pointer check */
@@ -157,7 +250,7 @@ int csp_hmac_append(csp_packet_t * packet) {
 	uint8_t hmac[SHA1_DIGESTSIZE];
 
 	/* Calculate HMAC */
-	csp_hmac_memory(csp_hmac_key, HMAC_KEY_LENGTH, packet->data, packet->length, hmac);
+	csp_hmac_packet(packet->data, packet->length, hmac);
 
 	/* Truncate hash and copy to packet */
 	memcpy(&packet->data[packet->length], hmac, CSP_HMAC_LENGTH);
@@ -176,7 +269,7 @@ int csp_hmac_verify(csp_packet_t * packet) {
 	uint8_t hmac[SHA1_DIGESTSIZE];
 
 	/* Calculate HMAC */
-	csp_hmac_memory(csp_hmac_key, HMAC_KEY_LENGTH, packet->data, packet->length - CSP_HMAC_LENGTH, hmac);
+	csp_hmac_packet(packet->data, packet->length - CSP_HMAC_LENGTH, hmac);
 
 	/* Compare calculated HMAC with packet header */
 	if (memcmp(&packet->data[packet->length] - CSP_HMAC_LENGTH, hmac, CSP_HMAC_LENGTH) != 0) {
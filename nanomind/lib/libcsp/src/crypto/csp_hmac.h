@@ -27,8 +27,48 @@ extern "C" {
 
 #include <stdint.h>
 
+#include "csp_sha1.h"
+
 #define CSP_HMAC_LENGTH	4
 
+/**
+ * Calculate HMAC-SHA1 of a memory area
+ * @param key Pointer to key
+ * @param keylen Length of key
+ * @param data Pointer to data
+ * @param datalen Length of data
+ * @param hmac Output for the SHA1_DIGESTSIZE byte HMAC
+ * @return 0 on success, error code on failure
+ */
+int csp_hmac_memory(const uint8_t * key, uint32_t keylen, const uint8_t * data, uint32_t datalen, uint8_t * hmac);
+
+/** HMAC of a payload that is processed in pieces, with the key from csp_hmac_set_key() */
+typedef struct {
+	csp_sha1_state md;
+	csp_sha1_state outer;
+} csp_hmac_stream_t;
+
+/**
+ * Start an HMAC
+ * @param stream Pointer to stream state
+ */
+void csp_hmac_stream_init(csp_hmac_stream_t * stream);
+
+/**
+ * Add data to an HMAC
+ * @param stream Pointer to stream state
+ * @param data Pointer to data
+ * @param length Length of data
+ */
+void csp_hmac_stream_process(csp_hmac_stream_t * stream, const uint8_t * data, uint32_t length);
+
+/**
+ * Finish an HMAC
+ * @param stream Pointer to stream state
+ * @param out Output for the CSP_HMAC_LENGTH bytes that csp_hmac_append() would add
+ */
+void csp_hmac_stream_done(csp_hmac_stream_t * stream, uint8_t * out);
+
 /**
  * Append HMAC to packet
  * @param packet Pointer to packet
@@ -55,24 +55,32 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
 
-/* SHA1 macros */
-#define F0(x,y,z)  (z ^ (x & (y ^ z)))
-#define F1(x,y,z)  (x ^ y ^ z)
-#define F2(x,y,z)  ((x & y) | (z & (x | y)))
-#define F3(x,y,z)  (x ^ y ^ z)
-
-#define FF_0(a, b, c, d, e, i) do {e = (ROL(a, 5) + F0(b,c,d) + e + W[i] + 0x5a827999UL); b = ROL(b, 30);} while (0)
-#define FF_1(a, b, c, d, e, i) do {e = (ROL(a, 5) + F1(b,c,d) + e + W[i] + 0x6ed9eba1UL); b = ROL(b, 30);} while (0)
-#define FF_2(a, b, c, d, e, i) do {e = (ROL(a, 5) + F2(b,c,d) + e + W[i] + 0x8f1bbcdcUL); b = ROL(b, 30);} while (0)
-#define FF_3(a, b, c, d, e, i) do {e = (ROL(a, 5) + F3(b,c,d) + e + W[i] + 0xca62c1d6UL); b = ROL(b, 30);} while (0)
+/* Load a big endian word from a possibly unaligned buffer */
+#if defined(__GNUC__) && defined(CSP_LITTLE_ENDIAN)
+#define LOAD32W(x, y) do { uint32_t _w; memcpy(&_w, (y), 4); (x) = __builtin_bswap32(_w); } while (0)
+#elif defined(CSP_BIG_ENDIAN)
+#define LOAD32W(x, y) do { memcpy(&(x), (y), 4); } while (0)
+#else
+#define LOAD32W(x, y) LOAD32H(x, y)
+#endif
+
+/* SHA1 round macros. The message schedule is kept in a 16 word ring, each
+ * round past 15 computes the word it needs in place */
+#define BLK(i)	(W[(i) & 15] = ROL(W[((i) + 13) & 15] ^ W[((i) + 8) & 15] ^ W[((i) + 2) & 15] ^ W[(i) & 15], 1))
+
+#define R0(v, w, x, y, z, i) do { z += ((w & (x ^ y)) ^ y) + W[i] + 0x5a827999UL + ROL(v, 5); w = ROL(w, 30); } while (0)
+#define R1(v, w, x, y, z, i) do { z += ((w & (x ^ y)) ^ y) + BLK(i) + 0x5a827999UL + ROL(v, 5); w = ROL(w, 30); } while (0)
+#define R2(v, w, x, y, z, i) do { z += (w ^ x ^ y) + BLK(i) + 0x6ed9eba1UL + ROL(v, 5); w = ROL(w, 30); } while (0)
+#define R3(v, w, x, y, z, i) do { z += (((w | x) & y) | (w & x)) + BLK(i) + 0x8f1bbcdcUL + ROL(v, 5); w = ROL(w, 30); } while (0)
+#define R4(v, w, x, y, z, i) do { z += (w ^ x ^ y) + BLK(i) + 0xca62c1d6UL + ROL(v, 5); w = ROL(w, 30); } while (0)
 
 static void csp_sha1_compress(csp_sha1_state * sha1, const uint8_t * buf) {
 
-	uint32_t a, b, c, d, e, W[80], i;
+	uint32_t a, b, c, d, e, W[16], i;
 
-	/* Copy the state into 512-bits into W[0..15] */
+	/* Copy the 512-bit block into W[0..15] */
 	for (i = 0; i < 16; i++)
-		LOAD32H(W[i], buf + (4*i));
+		LOAD32W(W[i], buf + (4*i));
 
 	/* Copy state */
 	a = sha1->state[0];
@@ -81,48 +89,94 @@ static void csp_sha1_compress(csp_sha1_state * sha1, const uint8_t * buf) {
 	d = sha1->state[3];
 	e = sha1->state[4];
 
-	/* Expand it */
-	for (i = 16; i < 80; i++)
-		W[i] = ROL(W[i-3] ^ W[i-8] ^ W[i-14] ^ W[i-16], 1);
-
-	/* Compress */
-	i = 0;
-
-	/* Round one */
-	for (; i < 20;) {
-	   FF_0(a, b, c, d, e, i++);
-	   FF_0(e, a, b, c, d, i++);
-	   FF_0(d, e, a, b, c, i++);
-	   FF_0(c, d, e, a, b, i++);
-	   FF_0(b, c, d, e, a, i++);
-	}
+	/* Round one, W[0..15] straight from the block */
+	R0(a, b, c, d, e,  0);
+	R0(e, a, b, c, d,  1);
+	R0(d, e, a, b, c,  2);
+	R0(c, d, e, a, b,  3);
+	R0(b, c, d, e, a,  4);
+	R0(a, b, c, d, e,  5);
+	R0(e, a, b, c, d,  6);
+	R0(d, e, a, b, c,  7);
+	R0(c, d, e, a, b,  8);
+	R0(b, c, d, e, a,  9);
+	R0(a, b, c, d, e, 10);
+	R0(e, a, b, c, d, 11);
+	R0(d, e, a, b, c, 12);
+	R0(c, d, e, a, b, 13);
+	R0(b, c, d, e, a, 14);
+	R0(a, b, c, d, e, 15);
+	/* Round one, expanding the schedule from here on */
+	R1(e, a, b, c, d, 16);
+	R1(d, e, a, b, c, 17);
+	R1(c, d, e, a, b, 18);
+	R1(b, c, d, e, a, 19);
 
 	/* Round two */
-	for (; i < 40;)  {
-	   FF_1(a, b, c, d, e, i++);
-	   FF_1(e, a, b, c, d, i++);
-	   FF_1(d, e, a, b, c, i++);
-	   FF_1(c, d, e, a, b, i++);
-	   FF_1(b, c, d, e, a, i++);
-	}
+	R2(a, b, c, d, e, 20);
+	R2(e, a, b, c, d, 21);
+	R2(d, e, a, b, c, 22);
+	R2(c, d, e, a, b, 23);
+	R2(b, c, d, e, a, 24);
+	R2(a, b, c, d, e, 25);
+	R2(e, a, b, c, d, 26);
+	R2(d, e, a, b, c, 27);
+	R2(c, d, e, a, b, 28);
+	R2(b, c, d, e, a, 29);
+	R2(a, b, c, d, e, 30);
+	R2(e, a, b, c, d, 31);
+	R2(d, e, a, b, c, 32);
+	R2(c, d, e, a, b, 33);
+	R2(b, c, d, e, a, 34);
+	R2(a, b, c, d, e, 35);
+	R2(e, a, b, c, d, 36);
+	R2(d, e, a, b, c, 37);
+	R2(c, d, e, a, b, 38);
+	R2(b, c, d, e, a, 39);
 
 	/* Round three */
-	for (; i < 60;)  {
-	   FF_2(a, b, c, d, e, i++);
-	   FF_2(e, a, b, c, d, i++);
-	   FF_2(d, e, a, b, c, i++);
-	   FF_2(c, d, e, a, b, i++);
-	   FF_2(b, c, d, e, a, i++);
-	}
+	R3(a, b, c, d, e, 40);
+	R3(e, a, b, c, d, 41);
+	R3(d, e, a, b, c, 42);
+	R3(c, d, e, a, b, 43);
+	R3(b, c, d, e, a, 44);
+	R3(a, b, c, d, e, 45);
+	R3(e, a, b, c, d, 46);
+	R3(d, e, a, b, c, 47);
+	R3(c, d, e, a, b, 48);
+	R3(b, c, d, e, a, 49);
+	R3(a, b, c, d, e, 50);
+	R3(e, a, b, c, d, 51);
+	R3(d, e, a, b, c, 52);
+	R3(c, d, e, a, b, 53);
+	R3(b, c, d, e, a, 54);
+	R3(a, b, c, d, e, 55);
+	R3(e, a, b, c, d, 56);
+	R3(d, e, a, b, c, 57);
+	R3(c, d, e, a, b, 58);
+	R3(b, c, d, e, a, 59);
 
 	/* Round four */
-	for (; i < 80;)  {
-	   FF_3(a, b, c, d, e, i++);
-	   FF_3(e, a, b, c, d, i++);
-	   FF_3(d, e, a, b, c, i++);
-	   FF_3(c, d, e, a, b, i++);
-	   FF_3(b, c, d, e, a, i++);
-	}
+	R4(a, b, c, d, e, 60);
+	R4(e, a, b, c, d, 61);
+	R4(d, e, a, b, c, 62);
+	R4(c, d, e, a, b, 63);
+	R4(b, c, d, e, a, 64);
+	R4(a, b, c, d, e, 65);
+	R4(e, a, b, c, d, 66);
+	R4(d, e, a, b, c, 67);
+	R4(c, d, e, a, b, 68);
+	R4(b, c, d, e, a, 69);
+	R4(a, b, c, d, e, 70);
+	R4(e, a, b, c, d, 71);
+	R4(d, e, a, b, c, 72);
+	R4(c, d, e, a, b, 73);
+	R4(b, c, d, e, a, 74);
+	R4(a, b, c, d, e, 75);
+	R4(e, a, b, c, d, 76);
+	R4(d, e, a, b, c, 77);
+	R4(c, d, e, a, b, 78);
+	R4(b, c, d, e, a, 79);
 
 	/* Store */
 	sha1->state[0] += a;
@@ -21,11 +21,15 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 /* Simple implementation of XTEA in CTR mode */
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 /* CSP includes */
 #include <csp/csp.h>
 #include <csp/csp_endian.h>
+#include <csp/csp_platform.h>
+#include <csp/arch/csp_semaphore.h>
+#include <csp/arch/csp_time.h>
 
 #include "csp_sha1.h"
 #include "csp_xtea.h"
@@ -35,9 +39,20 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #define XTEA_BLOCKSIZE 	8
 #define XTEA_ROUNDS 	32
 #define XTEA_KEY_LENGTH	16
+#define XTEA_DELTA		0x9E3779B9
 
-/* XTEA key */
-static uint32_t csp_xtea_key[XTEA_KEY_LENGTH/sizeof(uint32_t)] __attribute__ ((aligned(sizeof(uint32_t))));
+/* Keystream is generated this many blocks at a time */
+#define XTEA_STREAM_BLOCKS	8
+
+/* XTEA key as host order words, loaded once by csp_xtea_set_key() */
+static uint32_t csp_xtea_k[XTEA_KEY_LENGTH/sizeof(uint32_t)];
+
+/* Packet nonce counter */
+static uint32_t csp_xtea_nonce_ctr;
+#ifndef CSP_POSIX
+CSP_DEFINE_CRITICAL(csp_xtea_nonce_lock);
+static int csp_xtea_nonce_lock_init = 0;
+#endif
 
 #define STORE32L(x, y) do { (y)[3] = (uint8_t)(((x) >> 24) & 0xff); \
 							(y)[2] = (uint8_t)(((x) >> 16) & 0xff); \
@@ -49,76 +64,129 @@ static uint32_t csp_xtea_key[XTEA_KEY_LENGTH/sizeof(uint32_t)] __attribute__ ((a
 								 ((uint32_t)((y)[1] & 0xff) << 8)  | \
 								 ((uint32_t)((y)[0] & 0xff) << 0); } while (0)
 
-/* This function takes 64 bits of data in block and the 128 bits key in key */
-static inline void csp_xtea_encrypt_block(uint8_t *block, uint8_t const *key) {
-
-	uint32_t i, v0, v1, delta = 0x9E3779B9, sum = 0, k[4];
+#define SWAP32(x) ((((x) >> 24) & 0xff) | (((x) >> 8) & 0xff00) | \
+				   (((x) << 8) & 0xff0000) | (((x) << 24) & 0xff000000))
 
-	LOAD32L(k[0], &key[0]);
-	LOAD32L(k[1], &key[4]);
-	LOAD32L(k[2], &key[8]);
-	LOAD32L(k[3], &key[12]);
+/* Encrypt two independent 64 bit blocks held in words. XTEA rounds form a
+ * long dependency chain, so running two blocks side by side keeps more of
+ * the pipeline busy than one block at a time */
+static inline void csp_xtea_encrypt_block2(uint32_t v[4]) {
 
-	LOAD32L(v0, &block[0]);
-	LOAD32L(v1, &block[4]);
+	uint32_t a0 = v[0], a1 = v[1], b0 = v[2], b1 = v[3];
+	uint32_t sum = 0, rk;
+	const uint32_t k[4] = {csp_xtea_k[0], csp_xtea_k[1], csp_xtea_k[2], csp_xtea_k[3]};
+	unsigned int i;
 
 	for (i = 0; i < XTEA_ROUNDS; i++) {
-		v0 += (((v1 << 4) ^ (v1 >> 5)) + v1) ^ (sum + k[sum & 3]);
-		sum += delta;
-		v1 += (((v0 << 4) ^ (v0 >> 5)) + v0) ^ (sum + k[(sum >> 11) & 3]);
+		rk = sum + k[sum & 3];
+		a0 += (((a1 << 4) ^ (a1 >> 5)) + a1) ^ rk;
+		b0 += (((b1 << 4) ^ (b1 >> 5)) + b1) ^ rk;
+		sum += XTEA_DELTA;
+		rk = sum + k[(sum >> 11) & 3];
+		a1 += (((a0 << 4) ^ (a0 >> 5)) + a0) ^ rk;
+		b1 += (((b0 << 4) ^ (b0 >> 5)) + b0) ^ rk;
 	}
 
-	STORE32L(v0, &block[0]);
-	STORE32L(v1, &block[4]);
+	v[0] = a0;
+	v[1] = a1;
+	v[2] = b0;
+	v[3] = b1;
 
 }
 
-static inline void csp_xtea_xor_byte(uint8_t * dst, uint8_t * src, uint32_t len) {
+static inline void csp_xtea_xor(uint8_t * dst, const uint8_t * src, uint32_t len) {
 
-	unsigned int i;
-	for (i = 0; i < len; i++)
+	uint32_t a, b;
+	unsigned int i = 0;
+
+	/* Word at a time, the buffers need not be aligned */
+	for (; i + sizeof(uint32_t) <= len; i += sizeof(uint32_t)) {
+		memcpy(&a, &dst[i], sizeof(a));
+		memcpy(&b, &src[i], sizeof(b));
+		a ^= b;
+		memcpy(&dst[i], &a, sizeof(a));
+	}
+
+	for (; i < len; i++)
 		dst[i] ^= src[i];
 
 }
 
 int csp_xtea_set_key(char * key, uint32_t keylen) {
 
+	unsigned int i;
+
 	/* Use SHA1 as KDF */
 	uint8_t hash[SHA1_DIGESTSIZE];
 	csp_sha1_memory((uint8_t *)key, keylen, hash);
 
-	/* Copy key */
-	memcpy(csp_xtea_key, hash, XTEA_KEY_LENGTH);
+	/* Keep the first XTEA_KEY_LENGTH bytes as key words */
+	for (i = 0; i < XTEA_KEY_LENGTH / sizeof(uint32_t); i++)
+		LOAD32L(csp_xtea_k[i], &hash[i * 4]);
+
+	/* Start nonces at an unpredictable point */
+#ifndef CSP_POSIX
+	if (!csp_xtea_nonce_lock_init) {
+		if (CSP_INIT_CRITICAL(csp_xtea_nonce_lock) != CSP_ERR_NONE)
+			return CSP_ERR_NOMEM;
+		csp_xtea_nonce_lock_init = 1;
+	}
+#endif
+	csp_xtea_nonce_ctr = (uint32_t) rand() ^ csp_get_ms();
 
 	return CSP_ERR_NONE;
 
 }
 
-int csp_xtea_encrypt(uint8_t * plain, const uint32_t len, uint32_t iv[2]) {
+uint32_t csp_xtea_nonce(void) {
 
-	unsigned int i;
-	uint32_t stream[2];
+#ifdef CSP_POSIX
+	return __sync_add_and_fetch(&csp_xtea_nonce_ctr, 1);
+#else
+	uint32_t nonce;
+	CSP_ENTER_CRITICAL(csp_xtea_nonce_lock);
+	nonce = ++csp_xtea_nonce_ctr;
+	CSP_EXIT_CRITICAL(csp_xtea_nonce_lock);
+	return nonce;
+#endif
 
-	uint32_t blocks = (len + XTEA_BLOCKSIZE - 1)/ XTEA_BLOCKSIZE;
-	uint32_t remain;
-
-	/* Initialize stream */
-	stream[0] = csp_htobe32(iv[0]);
-	stream[1] = csp_htobe32(iv[1]);
+}
 
-	for (i = 0; i < blocks; i++) {
-		/* Create stream */
-		csp_xtea_encrypt_block((uint8_t *)stream, (uint8_t *)csp_xtea_key);
+int csp_xtea_encrypt(uint8_t * plain, const uint32_t len, uint32_t iv[2]) {
 
-		/* Calculate remaining bytes */
-		remain = len - i * XTEA_BLOCKSIZE;
+	unsigned int i, blocks;
+	uint32_t done = 0, bytes, block = 0;
+	uint8_t stream[XTEA_STREAM_BLOCKS * XTEA_BLOCKSIZE];
+
+	/* The IV words are fed to the cipher byte reversed */
+	const uint32_t nonce = SWAP32(iv[0]);
+
+	while (done < len) {
+		blocks = (len - done + XTEA_BLOCKSIZE - 1) / XTEA_BLOCKSIZE;
+		if (blocks > XTEA_STREAM_BLOCKS)
+			blocks = XTEA_STREAM_BLOCKS;
+
+		/* Generate keystream for a run of blocks, two at a time. The first
+		 * two blocks share counter value iv[1], as they always have on the wire */
+		for (i = 0; i < blocks; i += 2, block += 2) {
+			uint32_t v[4];
+			v[0] = nonce;
+			v[1] = SWAP32((block == 0) ? iv[1] : iv[1] + block - 1);
+			v[2] = nonce;
+			v[3] = SWAP32(iv[1] + block);
+			csp_xtea_encrypt_block2(v);
+			STORE32L(v[0], &stream[i * XTEA_BLOCKSIZE]);
+			STORE32L(v[1], &stream[i * XTEA_BLOCKSIZE + 4]);
+			STORE32L(v[2], &stream[i * XTEA_BLOCKSIZE + 8]);
+			STORE32L(v[3], &stream[i * XTEA_BLOCKSIZE + 12]);
+		}
 
 		/* XOR plain text with stream to generate cipher text */
-		csp_xtea_xor_byte(&plain[len - remain], (uint8_t *)stream, remain < XTEA_BLOCKSIZE ? remain : XTEA_BLOCKSIZE);
-
-		/* Increment counter */
-		stream[0] = csp_htobe32(iv[0]);
-		stream[1] = csp_htobe32(iv[1]++);
+		bytes = len - done;
+		if (bytes > blocks * XTEA_BLOCKSIZE)
+			bytes = blocks * XTEA_BLOCKSIZE;
+		csp_xtea_xor(&plain[done], stream, bytes);
+		done += bytes;
 	}
 
 	return CSP_ERR_NONE;
@@ -29,6 +29,14 @@ extern "C" {
 
 #define CSP_XTEA_IV_LENGTH	8
 
+/**
+ * Get a nonce for the next encrypted packet
+ * Nonces come from a counter started at a random point by csp_xtea_set_key(),
+ * so they do not repeat for 2^32 packets under one key.
+ * @return nonce
+ */
+uint32_t csp_xtea_nonce(void);
+
 /**
  * XTEA encrypt byte array
  * @param plain Pointer to plain text
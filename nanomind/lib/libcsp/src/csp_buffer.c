@@ -21,6 +21,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <inttypes.h>
 
 /* CSP includes */
 #include <csp/csp.h>
@@ -31,77 +32,341 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 #define CSP_BUFFER_ALIGN	(sizeof(int *))
 
+/* Room left for RDP header, HMAC, CRC32 and XTEA nonce when picking a size class */
+#define CSP_BUFFER_TAILROOM	20
+
 typedef struct csp_skbf_s {
 	unsigned int refcount;
+	uint16_t pool_index;		/* Index of the size class owning the buffer */
+	uint16_t reserved;
+	uint32_t next;				/* Free stack link, index + 1 of next buffer or 0 */
 	void * skbf_addr;
 	char skbf_data[];
 } csp_skbf_t;
 
-static csp_queue_handle_t csp_buffers;
-static char * csp_buffer_pool;
-static unsigned int count, size;
+typedef struct {
+	unsigned int size;			/* Buffer size, including packet overhead */
+	unsigned int count;			/* Number of buffers in class */
+	unsigned int skbfsize;		/* Aligned element size, including skbf header */
+	char * pool;				/* Element memory */
+#if defined(CSP_POSIX)
+	volatile uint32_t head;		/* Free stack top: ABA tag in upper half, index + 1 in lower */
+	volatile unsigned int free;	/* Number of free buffers */
+#else
+	csp_queue_handle_t queue;	/* Free buffer queue */
+#endif
+	volatile unsigned int high_watermark;
+	volatile unsigned int failed;
+} csp_buffer_pool_t;
+
+static csp_buffer_pool_t pools[CSP_BUFFER_MAX_CLASSES];
+static unsigned int classes;
 
 CSP_DEFINE_CRITICAL(csp_critical_lock);
 
-int csp_buffer_init(int buf_count, int buf_size) {
+static inline csp_skbf_t * csp_buffer_element(csp_buffer_pool_t * pool, unsigned int i) {
+	/* The element size is an integer multiple of sizeof(int *), but the
+	 * explicit cast to a void * is still necessary to tell the compiler so. */
+	return (void *) &pool->pool[i * pool->skbfsize];
+}
+
+#if defined(CSP_POSIX)
+/* Free stack head: element index + 1 in the lower half, tag in the upper */
+#define CSP_BUFFER_INDEX_MASK	0xFFFF
+#define CSP_BUFFER_TAG_ONE		0x10000
+
+/**
+ * The POSIX free-list is a Treiber stack. The head word carries a
+ * modification tag next to the element index, so a buffer that is popped
+ * and pushed back between a load and the compare-and-swap cannot corrupt it.
+ * Index and tag share one 32-bit word, as 32-bit targets may have no 64-bit
+ * compare-and-swap. The 16-bit tag wraps after 65536 pushes and pops, which
+ * is far more than can happen between the load and the swap.
+ */
+static int csp_buffer_push(csp_buffer_pool_t * pool, csp_skbf_t * buf, int isr) {
+
+	uint32_t head, new_head;
+	uint32_t index = (((char *) buf - pool->pool) / pool->skbfsize) + 1;
+
+	do {
+		head = pool->head;
+		buf->next = head & CSP_BUFFER_INDEX_MASK;
+		new_head = ((head & ~CSP_BUFFER_INDEX_MASK) + CSP_BUFFER_TAG_ONE) | index;
+	} while (!__sync_bool_compare_and_swap(&pool->head, head, new_head));
+
+	__sync_fetch_and_add(&pool->free, 1);
+
+	return CSP_ERR_NONE;
 
-	unsigned int i;
+}
+
+static csp_skbf_t * csp_buffer_pop(csp_buffer_pool_t * pool, int isr) {
+
+	uint32_t head, new_head;
 	csp_skbf_t * buf;
 
-	count = buf_count;
-	size = buf_size;
-	unsigned int skbfsize = (sizeof(csp_skbf_t) + size);
-	skbfsize = skbfsize + CSP_BUFFER_ALIGN - (skbfsize % CSP_BUFFER_ALIGN);
-	unsigned int poolsize = count * skbfsize;
+	do {
+		head = pool->head;
+		if ((head & CSP_BUFFER_INDEX_MASK) == 0)
+			return NULL;
+		buf = csp_buffer_element(pool, (head & CSP_BUFFER_INDEX_MASK) - 1);
+		new_head = ((head & ~CSP_BUFFER_INDEX_MASK) + CSP_BUFFER_TAG_ONE) | buf->next;
+	} while (!__sync_bool_compare_and_swap(&pool->head, head, new_head));
 
-	csp_buffer_pool = csp_malloc(poolsize);
-	if (csp_buffer_pool == NULL)
-		goto fail_malloc;
+	__sync_fetch_and_sub(&pool->free, 1);
 
-	csp_buffers = csp_queue_create(count, sizeof(void *));
-	if (!csp_buffers)
-		goto fail_queue;
+	return buf;
+
+}
+
+static inline unsigned int csp_buffer_free_count(csp_buffer_pool_t * pool) {
+	/* The counter trails the stack, so a pop racing a push can briefly
+	 * take it below zero. Clamp to what the pool can hold. */
+	int free = (int) pool->free;
+	if (free < 0)
+		return 0;
+	if ((unsigned int) free > pool->count)
+		return pool->count;
+	return free;
+}
+
+static int csp_buffer_pool_create(csp_buffer_pool_t * pool) {
+	pool->head = 0;
+	pool->free = 0;
+	return CSP_ERR_NONE;
+}
+
+static void csp_buffer_pool_remove(csp_buffer_pool_t * pool) {
+}
+#else
+static int csp_buffer_push(csp_buffer_pool_t * pool, csp_skbf_t * buf, int isr) {
+
+	CSP_BASE_TYPE task_woken = 0;
+
+	if (isr)
+		return (csp_queue_enqueue_isr(pool->queue, &buf, &task_woken) == CSP_QUEUE_OK) ? CSP_ERR_NONE : CSP_ERR_NOBUFS;
+
+	return (csp_queue_enqueue(pool->queue, &buf, 0) == CSP_QUEUE_OK) ? CSP_ERR_NONE : CSP_ERR_NOBUFS;
+
+}
+
+static csp_skbf_t * csp_buffer_pop(csp_buffer_pool_t * pool, int isr) {
+
+	csp_skbf_t * buf = NULL;
+	CSP_BASE_TYPE task_woken = 0;
+
+	if (isr)
+		csp_queue_dequeue_isr(pool->queue, &buf, &task_woken);
+	else
+		csp_queue_dequeue(pool->queue, &buf, 0);
+
+	return buf;
+
+}
+
+static inline unsigned int csp_buffer_free_count(csp_buffer_pool_t * pool) {
+	return csp_queue_size(pool->queue);
+}
+
+static int csp_buffer_pool_create(csp_buffer_pool_t * pool) {
+	pool->queue = csp_queue_create(pool->count, sizeof(void *));
+	return (pool->queue != NULL) ? CSP_ERR_NONE : CSP_ERR_NOMEM;
+}
+
+static void csp_buffer_pool_remove(csp_buffer_pool_t * pool) {
+	csp_queue_remove(pool->queue);
+}
+#endif
+
+/* Take an extra reference to a buffer */
+static inline void csp_buffer_ref(csp_skbf_t * buf) {
+#if defined(CSP_POSIX)
+	__sync_fetch_and_add(&buf->refcount, 1);
+#else
+	CSP_ENTER_CRITICAL(csp_critical_lock);
+	buf->refcount++;
+	CSP_EXIT_CRITICAL(csp_critical_lock);
+#endif
+}
+
+/* Count an allocation that found every fitting class empty */
+static inline void csp_buffer_count_failed(csp_buffer_pool_t * pool, int isr) {
+#if defined(CSP_POSIX)
+	__sync_fetch_and_add(&pool->failed, 1);
+#else
+	if (!isr)
+		CSP_ENTER_CRITICAL(csp_critical_lock);
+	pool->failed++;
+	if (!isr)
+		CSP_EXIT_CRITICAL(csp_critical_lock);
+#endif
+}
+
+/* Raise the high watermark of a class to used, if that is higher */
+static inline void csp_buffer_watermark(csp_buffer_pool_t * pool, unsigned int used, int isr) {
+#if defined(CSP_POSIX)
+	unsigned int peak;
+	do {
+		peak = pool->high_watermark;
+		if (used <= peak)
+			return;
+	} while (!__sync_bool_compare_and_swap(&pool->high_watermark, peak, used));
+#else
+	if (!isr)
+		CSP_ENTER_CRITICAL(csp_critical_lock);
+	if (used > pool->high_watermark)
+		pool->high_watermark = used;
+	if (!isr)
+		CSP_EXIT_CRITICAL(csp_critical_lock);
+#endif
+}
+
+/* Drop a reference to a buffer and return the number of references left */
+static inline unsigned int csp_buffer_unref(csp_skbf_t * buf, int isr) {
+#if defined(CSP_POSIX)
+	return __sync_sub_and_fetch(&buf->refcount, 1);
+#else
+	unsigned int refcount;
+	/* Tasks cannot preempt an ISR, so only task context needs the lock */
+	if (!isr)
+		CSP_ENTER_CRITICAL(csp_critical_lock);
+	refcount = --buf->refcount;
+	if (!isr)
+		CSP_EXIT_CRITICAL(csp_critical_lock);
+	return refcount;
+#endif
+}
+
+int csp_buffer_init_classes(int class_count, const csp_buffer_class_t * class_list) {
+
+	unsigned int i, c;
+	csp_buffer_pool_t * pool;
+	csp_skbf_t * buf;
+
+	if (class_count < 1 || class_count > CSP_BUFFER_MAX_CLASSES)
+		return CSP_ERR_INVAL;
+
+	/* Size classes must be given in ascending order */
+	for (c = 1; c < (unsigned int) class_count; c++)
+		if (class_list[c].size <= class_list[c - 1].size)
+			return CSP_ERR_INVAL;
+
+#if defined(CSP_POSIX)
+	/* The free stack head holds a 16-bit element index */
+	for (c = 0; c < (unsigned int) class_count; c++)
+		if (class_list[c].count >= CSP_BUFFER_INDEX_MASK)
+			return CSP_ERR_INVAL;
+#endif
 
 	if (CSP_INIT_CRITICAL(csp_critical_lock) != CSP_ERR_NONE)
-		goto fail_critical;
+		return CSP_ERR_NOMEM;
 
-	memset(csp_buffer_pool, 0, poolsize);
+	for (classes = 0; classes < (unsigned int) class_count; classes++) {
 
-	for (i = 0; i < count; i++) {
+		pool = &pools[classes];
+		pool->size = class_list[classes].size;
+		pool->count = class_list[classes].count;
+		pool->high_watermark = 0;
+		pool->failed = 0;
 
-		/* We have already taken care of pointer alignment since
-		 * skbfsize is an integer multiple of sizeof(int *)
-		 * but the explicit cast to a void * is still necessary
-		 * to tell the compiler so.
-		 */
-		buf = (void *) &csp_buffer_pool[i * skbfsize];
-		buf->refcount = 0;
-		buf->skbf_addr = buf;
+		pool->skbfsize = (sizeof(csp_skbf_t) + pool->size);
+		pool->skbfsize = pool->skbfsize + CSP_BUFFER_ALIGN - (pool->skbfsize % CSP_BUFFER_ALIGN);
 
-		csp_queue_enqueue(csp_buffers, &buf, 0);
+		pool->pool = csp_malloc(pool->count * pool->skbfsize);
+		if (pool->pool == NULL)
+			goto fail;
+
+		if (csp_buffer_pool_create(pool) != CSP_ERR_NONE) {
+			csp_free(pool->pool);
+			goto fail;
+		}
+
+		memset(pool->pool, 0, pool->count * pool->skbfsize);
+
+		for (i = 0; i < pool->count; i++) {
+			buf = csp_buffer_element(pool, i);
+			buf->refcount = 0;
+			buf->pool_index = classes;
+			buf->skbf_addr = buf;
+			csp_buffer_push(pool, buf, 0);
+		}
 
 	}
 
 	return CSP_ERR_NONE;
 
-fail_critical:
-	csp_queue_remove(csp_buffers);
-fail_queue:
-	csp_free(csp_buffer_pool);
-fail_malloc:
+fail:
+	while (classes-- > 0) {
+		csp_buffer_pool_remove(&pools[classes]);
+		csp_free(pools[classes].pool);
+	}
+	classes = 0;
 	return CSP_ERR_NOMEM;
 
 }
 
-void *csp_buffer_get_isr(size_t buf_size) {
+int csp_buffer_init(int buf_count, int buf_size) {
+
+	csp_buffer_class_t class_list[1] = {{.size = buf_size, .count = buf_count}};
+
+	return csp_buffer_init_classes(1, class_list);
+
+}
+
+/* Return the smallest class able to hold buf_size bytes of data, or -1 */
+static int csp_buffer_class_fit(size_t buf_size) {
+
+	unsigned int c;
+	size_t need = buf_size + CSP_BUFFER_PACKET_OVERHEAD;
+
+	if (classes == 0 || need > pools[classes - 1].size)
+		return -1;
+
+	/* Leave room for trailers appended on transmit, unless the
+	 * request only fits in the largest class */
+	need += CSP_BUFFER_TAILROOM;
+
+	for (c = 0; c < classes - 1; c++)
+		if (pools[c].size >= need)
+			break;
+
+	return c;
+
+}
 
+static csp_skbf_t * csp_buffer_alloc(int fit, int isr) {
+
+	unsigned int c, used;
 	csp_skbf_t * buffer = NULL;
-	CSP_BASE_TYPE task_woken = 0;
 
-	if (buf_size + CSP_BUFFER_PACKET_OVERHEAD > size)
+	/* Fall back to larger classes if the best fit is exhausted */
+	for (c = fit; c < classes; c++) {
+		buffer = csp_buffer_pop(&pools[c], isr);
+		if (buffer != NULL)
+			break;
+	}
+
+	if (buffer == NULL) {
+		csp_buffer_count_failed(&pools[fit], isr);
 		return NULL;
+	}
+
+	used = pools[c].count - csp_buffer_free_count(&pools[c]);
+	csp_buffer_watermark(&pools[c], used, isr);
+
+	return buffer;
+
+}
 
-	csp_queue_dequeue_isr(csp_buffers, &buffer, &task_woken);
+void *csp_buffer_get_isr(size_t buf_size) {
+
+	csp_skbf_t * buffer;
+	int fit = csp_buffer_class_fit(buf_size);
+
+	if (fit < 0)
+		return NULL;
+
+	buffer = csp_buffer_alloc(fit, 1);
 	if (buffer == NULL)
 		return NULL;
 
@@ -119,14 +384,15 @@ void *csp_buffer_get_isr(size_t buf_size) {
 
 void *csp_buffer_get(size_t buf_size) {
 
-	csp_skbf_t * buffer = NULL;
+	csp_skbf_t * buffer;
+	int fit = csp_buffer_class_fit(buf_size);
 
-	if (buf_size + CSP_BUFFER_PACKET_OVERHEAD > size) {
+	if (fit < 0) {
 		csp_log_error("Attempt to allocate too large block %u\r\n", buf_size);
 		return NULL;
 	}
 
-	csp_queue_dequeue(csp_buffers, &buffer, 0);
+	buffer = csp_buffer_alloc(fit, 0);
 	if (buffer == NULL) {
 		csp_log_error("Out of buffers\r\n");
 		return NULL;
@@ -144,7 +410,6 @@ void *csp_buffer_get(size_t buf_size) {
 }
 
 void csp_buffer_free_isr(void *packet) {
-	CSP_BASE_TYPE task_woken = 0;
 	if (!packet)
 		return;
 
@@ -158,14 +423,12 @@ void csp_buffer_free_isr(void *packet) {
 	if (buf->refcount == 0) {
 		//csp_log_error("FREE ISR: Buffer already free %p\r\n", buf);
 		return;
-	} else if (buf->refcount > 1) {
-		buf->refcount--;
-		//csp_log_error("FREE ISR: Buffer %p in use by %u users\r\n", buf, buf->refcount);
+	} else if (csp_buffer_unref(buf, 1) > 0) {
+		//csp_log_buffer("FREE ISR: Buffer %p in use by %u users\r\n", buf, buf->refcount);
 		return;
 	} else {
-		buf->refcount = 0;
 		//csp_log_buffer("FREE: %p\r\n", buf);
-		csp_queue_enqueue_isr(csp_buffers, &buf, &task_woken);
+		csp_buffer_push(&pools[buf->pool_index], buf, 1);
 	}
 
 }
@@ -186,14 +449,12 @@ void csp_buffer_free(void *packet) {
 	if (buf->refcount == 0) {
 		csp_log_error("FREE: Buffer already free %p\r\n", buf);
 		return;
-	} else if (buf->refcount > 1) {
-		buf->refcount--;
-		csp_log_error("FREE: Buffer %p in use by %u users\r\n", buf, buf->refcount);
+	} else if (csp_buffer_unref(buf, 0) > 0) {
+		csp_log_buffer("FREE: Buffer %p in use by %u users\r\n", buf, buf->refcount);
 		return;
 	} else {
-		buf->refcount = 0;
 		csp_log_buffer("FREE: %p\r\n", buf);
-		csp_queue_enqueue(csp_buffers, &buf, 0);
+		csp_buffer_push(&pools[buf->pool_index], buf, 0);
 	}
 
 }
@@ -207,17 +468,130 @@ void *csp_buffer_clone(void *buffer) {
 
 	csp_packet_t *clone = csp_buffer_get(packet->length);
 
-	if (clone)
-		memcpy(clone, packet, size);
+	if (clone) {
+		csp_skbf_t * src = buffer - sizeof(csp_skbf_t);
+		csp_skbf_t * dst = (void *) clone - sizeof(csp_skbf_t);
+		unsigned int copy = pools[src->pool_index].size;
+		if (pools[dst->pool_index].size < copy)
+			copy = pools[dst->pool_index].size;
+		memcpy(clone, packet, copy);
+	}
 
 	return clone;
 
 }
 
+void *csp_buffer_clone_ref(void *buffer) {
+
+	if (!buffer)
+		return NULL;
+
+	csp_skbf_t * buf = buffer - sizeof(csp_skbf_t);
+
+	if (buf->skbf_addr != buf) {
+		csp_log_error("CLONE: Invalid CSP buffer pointer %p\r\n", buffer);
+		return NULL;
+	}
+
+	csp_buffer_ref(buf);
+
+	return buffer;
+
+}
+
+void *csp_buffer_writable(void *buffer) {
+
+	if (!buffer)
+		return NULL;
+
+	csp_skbf_t * buf = buffer - sizeof(csp_skbf_t);
+
+	/* Sole owner, no need to copy */
+	if (buf->refcount <= 1)
+		return buffer;
+
+	return csp_buffer_clone(buffer);
+
+}
+
+void *csp_buffer_resize(void *buffer, size_t buf_size) {
+
+	csp_packet_t *packet = (csp_packet_t *) buffer;
+
+	if (!packet)
+		return NULL;
+
+	csp_skbf_t * buf = buffer - sizeof(csp_skbf_t);
+	size_t max = csp_buffer_size() - CSP_BUFFER_PACKET_OVERHEAD;
+
+	/* Never ask for more than the largest buffer can hold */
+	if (buf_size > max)
+		buf_size = max;
+
+	int fit = csp_buffer_class_fit(buf_size);
+	if (fit < 0)
+		return NULL;
+
+	/* Buffer is already large enough */
+	if (buf->pool_index >= fit)
+		return packet;
+
+	csp_packet_t *resized = csp_buffer_get(buf_size);
+	if (resized == NULL)
+		return NULL;
+
+	memcpy(resized, packet, CSP_BUFFER_PACKET_OVERHEAD + packet->length);
+	csp_buffer_free(packet);
+
+	return resized;
+
+}
+
 int csp_buffer_remaining(void) {
-	return csp_queue_size(csp_buffers);
+
+	unsigned int c;
+	int remaining = 0;
+
+	for (c = 0; c < classes; c++)
+		remaining += csp_buffer_free_count(&pools[c]);
+
+	return remaining;
+
 }
 
 int csp_buffer_size(void) {
-	return size;
+	return (classes > 0) ? pools[classes - 1].size : 0;
+}
+
+int csp_buffer_stats(int index, csp_buffer_stats_t * stats) {
+
+	if (index < 0 || (unsigned int) index >= classes || stats == NULL)
+		return CSP_ERR_INVAL;
+
+	csp_buffer_pool_t * pool = &pools[index];
+
+	stats->size = pool->size;
+	stats->count = pool->count;
+	stats->in_use = pool->count - csp_buffer_free_count(pool);
+	stats->high_watermark = pool->high_watermark;
+	stats->failed = pool->failed;
+
+	return CSP_ERR_NONE;
+
+}
+
+#ifdef CSP_DEBUG
+void csp_buffer_print_table(void) {
+
+	unsigned int c;
+	csp_buffer_stats_t stats;
+
+	printf("Size  Count  Used  Peak  Failed\r\n");
+	for (c = 0; c < classes; c++) {
+		csp_buffer_stats(c, &stats);
+		printf("%4u  %5u  %4u  %4u  %6u\r\n", stats.size, stats.count,
+				stats.in_use, stats.high_watermark, stats.failed);
+	}
+
 }
+#endif
@@ -42,20 +42,37 @@ static csp_conn_t arr_conn[CSP_CONN_MAX];
 /* Connection pool lock */
 static csp_bin_sem_handle_t conn_lock;
 
+#ifdef CSP_USE_CONN_HASH
+/* Connection index, keyed on (src, dst, dport, sport). Updated under
+ * conn_lock, read by the router without it like the linear scan was. */
+#define CSP_CONN_HASH_SIZE CSP_CONN_MAX
+static csp_conn_t * conn_hash[CSP_CONN_HASH_SIZE];
+#endif
+
 /* Source port */
 static uint8_t sport;
 
 /* Source port lock */
 static csp_bin_sem_handle_t sport_lock;
 
-void csp_conn_check_timeouts(void) {
+/**
+ * Run timeouts of all connections
+ * @param deadline latest time of the next check
+ * @return time of the next check, no later than deadline
+ */
+uint32_t csp_conn_check_timeouts(uint32_t deadline) {
 #ifdef CSP_USE_RDP
 	int i;
 	for (i = 0; i < CSP_CONN_MAX; i++)
 		if (arr_conn[i].state == CONN_OPEN)
-			if (arr_conn[i].idin.flags & CSP_FRDP)
-				csp_rdp_check_timeouts(&arr_conn[i]);
+			if (arr_conn[i].idin.flags & CSP_FRDP) {
+				/* Router workers may be delivering to this connection */
+				csp_conn_lock(&arr_conn[i], CSP_MAX_DELAY);
+				deadline = csp_rdp_check_timeouts(&arr_conn[i], deadline);
+				csp_conn_unlock(&arr_conn[i]);
+			}
 #endif
+	return deadline;
 }
 
 int csp_conn_get_rxq(int prio) {
@@ -97,6 +114,15 @@ int csp_conn_enqueue_packet(csp_conn_t * conn, csp_packet_t * packet) {
 		rxq = CSP_RX_QUEUES - 1;
 	}
 
+#ifdef CSP_USE_QOS
+	/* Check for an event slot first, the packet belongs to the connection
+	 * as soon as it is queued */
+	if (csp_queue_size(conn->rx_event) >= CSP_CONN_QUEUE_LENGTH) {
+		csp_log_error("QOS event queue full\r\n");
+		return CSP_ERR_NOMEM;
+	}
+#endif
+
 	if (csp_queue_enqueue(conn->rx_queue[rxq], &packet, 0) != CSP_QUEUE_OK) {
 		csp_log_error("RX queue %p full with %u items\r\n", conn->rx_queue[rxq], csp_queue_size(conn->rx_queue[rxq]));
 		return CSP_ERR_NOMEM;
@@ -104,10 +130,8 @@ int csp_conn_enqueue_packet(csp_conn_t * conn, csp_packet_t * packet) {
 
 #ifdef CSP_USE_QOS
 	int event = 0;
-	if (csp_queue_enqueue(conn->rx_event, &event, 0) != CSP_QUEUE_OK) {
+	if (csp_queue_enqueue(conn->rx_event, &event, 0) != CSP_QUEUE_OK)
 		csp_log_error("QOS event queue full\r\n");
-		return CSP_ERR_NOMEM;
-	}
 #endif
 
 	return CSP_ERR_NONE;
@@ -139,6 +163,10 @@ int csp_conn_init(void) {
 			return CSP_ERR_NOMEM;
 		}
 
+#ifdef CSP_USE_CONN_HASH
+		arr_conn[i].hash_next = NULL;
+#endif
+
 #ifdef CSP_USE_RDP
 		if (csp_rdp_allocate(&arr_conn[i]) != CSP_ERR_NONE) {
 			csp_log_error("Failed to create queues for RDP in csp_conn_init\r\n");
@@ -156,12 +184,76 @@ int csp_conn_init(void) {
 
 }
 
+#ifdef CSP_USE_CONN_HASH
+static inline unsigned int csp_conn_hash_key(uint32_t id) {
+
+	/* Multiplicative hash of the 22-bit connection tuple */
+	uint32_t key = (id & CSP_ID_CONN_MASK) >> CSP_ID_FLAGS_SIZE;
+	return ((key * 2654435761UL) >> 10) % CSP_CONN_HASH_SIZE;
+
+}
+
+/* Must be called with conn_lock held */
+static void csp_conn_hash_insert(csp_conn_t * conn) {
+
+	unsigned int key = csp_conn_hash_key(conn->idin.ext);
+
+	/* Link before publishing, for readers without the lock. The barrier
+	 * orders the stores to conn before the store of the bucket head */
+	conn->hash_next = conn_hash[key];
+	__sync_synchronize();
+	conn_hash[key] = conn;
+
+}
+
+/* Must be called with conn_lock held */
+static void csp_conn_hash_remove(csp_conn_t * conn) {
+
+	csp_conn_t ** pp = &conn_hash[csp_conn_hash_key(conn->idin.ext)];
+
+	/* Unlink, but leave hash_next alone, so a reader standing on conn
+	 * still reaches the end of the chain. Connections are never freed */
+	while (*pp != NULL) {
+		if (*pp == conn) {
+			*pp = conn->hash_next;
+			break;
+		}
+		pp = &(*pp)->hash_next;
+	}
+
+}
+
+/* Runs without conn_lock. A reader racing csp_close may miss or see a closing
+ * connection, as with the linear scan, but always sees a terminated chain */
+static csp_conn_t * csp_conn_hash_find(uint32_t id) {
+
+	csp_conn_t * conn;
+	int hops = 0;
+
+	/* Each load depends on the pointer read before it, which orders it after
+	 * the barrier in csp_conn_hash_insert. The walk is bounded in case
+	 * concurrent updates relink the chain */
+	for (conn = conn_hash[csp_conn_hash_key(id)]; conn != NULL && hops < CSP_CONN_MAX; conn = conn->hash_next, hops++)
+		if ((conn->state != CONN_CLOSED) && ((conn->idin.ext & CSP_ID_CONN_MASK) == (id & CSP_ID_CONN_MASK)))
+			return conn;
+
+	return NULL;
+
+}
+#endif
+
 csp_conn_t * csp_conn_find(uint32_t id, uint32_t mask) {
 
 	/* Search for matching connection */
 	int i;
 	csp_conn_t * conn;
 
+#ifdef CSP_USE_CONN_HASH
+	/* Only full tuple lookups can use the index */
+	if (mask == CSP_ID_CONN_MASK)
+		return csp_conn_hash_find(id);
+#endif
+
 	for (i = 0; i < CSP_CONN_MAX; i++) {
 		conn = &arr_conn[i];
 		if ((conn->state != CONN_CLOSED) && (conn->type == CONN_CLIENT) && (conn->idin.ext & mask) == (id & mask))
@@ -198,7 +290,7 @@ int csp_conn_flush_rx_queue(csp_conn_t * conn) {
 csp_conn_t * csp_conn_allocate(csp_conn_type_t type) {
 
 	int i, j;
-	static uint8_t csp_conn_last_given = 0;
+	static int csp_conn_last_given = 0;
 	csp_conn_t * conn;
 
 	if (csp_bin_sem_wait(&conn_lock, 100) != CSP_SEMAPHORE_OK) {
@@ -247,6 +339,17 @@ csp_conn_t * csp_conn_new(csp_id_t idin, csp_id_t idout) {
 
 		/* Ensure connection queue is empty */
 		csp_conn_flush_rx_queue(conn);
+
+#ifdef CSP_USE_CONN_HASH
+		/* Make connection visible to csp_conn_find */
+		if (csp_bin_sem_wait(&conn_lock, 100) != CSP_SEMAPHORE_OK) {
+			csp_log_error("Failed to lock conn array\r\n");
+			conn->state = CONN_CLOSED;
+			return NULL;
+		}
+		csp_conn_hash_insert(conn);
+		csp_bin_sem_post(&conn_lock);
+#endif
 	}
 
 	return conn;
@@ -281,6 +384,11 @@ int csp_close(csp_conn_t * conn) {
 	/* Set to closed */
 	conn->state = CONN_CLOSED;
 
+#ifdef CSP_USE_CONN_HASH
+	if (conn->type == CONN_CLIENT)
+		csp_conn_hash_remove(conn);
+#endif
+
 	/* Ensure connection queue is empty */
 	csp_conn_flush_rx_queue(conn);
 
@@ -52,12 +52,16 @@ typedef enum {
 	RDP_CLOSE_WAIT,
 } csp_rdp_state_t;
 
+/** Size of the RDP reorder ring, the receiver accepts up to two windows ahead of rcv_cur */
+#define CSP_RDP_RX_RING			(CSP_RDP_MAX_WINDOW * 2)
+
 /** @brief RDP Connection header
  *  @note Do not try to pack this struct, the posix sem handle will stop working */
 typedef struct {
 	csp_rdp_state_t state;				/**< Connection state */
 	uint16_t snd_nxt; 					/**< The sequence number of the next segment that is to be sent */
 	uint16_t snd_una; 					/**< The sequence number of the oldest unacknowledged segment */
+	uint16_t snd_eack;					/**< The highest sequence number the receiver reported holding in an EACK */
 	uint16_t snd_iss; 					/**< The initial send sequence number */
 	uint16_t rcv_cur; 					/**< The sequence number of the last segment received correctly and in sequence */
 	uint16_t rcv_irs; 					/**< The initial receive sequence number */
@@ -69,9 +73,29 @@ typedef struct {
 	uint32_t ack_timeout;
 	uint32_t ack_delay_count;
 	uint32_t ack_timestamp;
+	uint32_t features;					/**< RDP extensions supported by both ends */
+	uint32_t srtt;						/**< Smoothed round trip time in ms, 0 until the first sample */
+	uint32_t rttvar;					/**< Round trip time variation in ms */
+	uint32_t rto;						/**< Current retransmission timeout in ms */
+	uint32_t rtt_timestamp;				/**< Time the timed segment was sent */
+	uint16_t rtt_seq;					/**< Sequence number of the timed segment */
+	uint16_t rtt_active;				/**< A segment is being timed */
+	uint32_t una_timestamp;				/**< Time snd_una last advanced, restarts the retransmission timers */
+	uint16_t rcv_wnd;					/**< Receive window last advertised to the peer */
+	uint16_t snd_wnd_end;				/**< First sequence number beyond the receive window advertised by the peer */
+#ifdef CSP_USE_RDP_CC
+	uint16_t cwnd;						/**< Congestion window in segments */
+	uint16_t ssthresh;					/**< Slow start threshold in segments */
+	uint16_t cwnd_acc;					/**< Segments ACKed towards the next additive increase */
+	uint16_t cc_recover;				/**< No further window reduction until this is ACKed */
+#endif
 	csp_bin_sem_handle_t tx_wait;
 	csp_queue_handle_t tx_queue;
-	csp_queue_handle_t rx_queue;
+	uint16_t rx_head;					/**< Ring slot holding sequence number rcv_cur + 1 */
+	uint16_t rx_count;					/**< Number of out-of-sequence segments held in rx_ring */
+	csp_packet_t * rx_ring[CSP_RDP_RX_RING];	/**< Out-of-sequence segments indexed by sequence number */
+	csp_packet_t * stream_rx;			/**< Partially consumed packet of csp_stream_read */
+	uint16_t stream_off;				/**< Bytes of stream_rx already consumed */
 } csp_rdp_t;
 
 /** @brief Connection struct */
@@ -91,6 +115,9 @@ struct csp_conn_s {
 #ifdef CSP_USE_RDP
 	csp_rdp_t rdp;					/* RDP state */
 #endif
+#ifdef CSP_USE_CONN_HASH
+	struct csp_conn_s * hash_next;	/* Next connection in hash bucket */
+#endif
 };
 
 int csp_conn_lock(csp_conn_t * conn, uint32_t timeout);
@@ -100,7 +127,7 @@ int csp_conn_init(void);
 csp_conn_t * csp_conn_allocate(csp_conn_type_t type);
 csp_conn_t * csp_conn_find(uint32_t id, uint32_t mask);
 csp_conn_t * csp_conn_new(csp_id_t idin, csp_id_t idout);
-void csp_conn_check_timeouts(void);
+uint32_t csp_conn_check_timeouts(uint32_t deadline);
 int csp_conn_get_rxq(int prio);
 
 #ifdef __cplusplus
@@ -66,18 +66,136 @@ static const uint32_t crc_tab[256] = {
 		0xF36E6F75, 0x0105EC76, 0x12551F82, 0xE03E9C81, 0x34F4F86A, 0xC69F7B69, 0xD5CF889D, 0x27A40B9E,
 		0x79B737BA, 0x8BDCB4B9, 0x988C474D, 0x6AE7C44E, 0xBE2DA0A5, 0x4C4623A6, 0x5F16D052, 0xAD7D5351 };
 
-uint32_t csp_crc32_memory(const uint8_t * data, uint32_t length) {
-   uint32_t crc;
+#ifdef CSP_CRC32_SLICE8
+/* Tables for slice-by-8, crc_tab is the first one */
+static uint32_t crc_tab8[7][256];
+static volatile int crc_tab8_ready = 0;
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CSP_CRC32_SSE42
+static int crc_sse42 = 0;
+#endif
+#endif
+
+void csp_crc32_gentab(void) {
+
+#ifdef CSP_CRC32_SLICE8
+	unsigned int i, k;
+	uint32_t crc;
+
+	for (i = 0; i < 256; i++) {
+		crc = crc_tab[i];
+		for (k = 0; k < 7; k++) {
+			crc = crc_tab[crc & 0xFF] ^ (crc >> 8);
+			crc_tab8[k][i] = crc;
+		}
+	}
+
+#ifdef CSP_CRC32_SSE42
+	/* The SSE4.2 crc32 instruction uses the same Castagnoli polynomial */
+	__builtin_cpu_init();
+	crc_sse42 = __builtin_cpu_supports("sse4.2");
+#endif
+
+	__sync_synchronize();
+	crc_tab8_ready = 1;
+#endif
 
-   crc = 0xFFFFFFFF;
-   while (length--)
+}
+
+static inline uint32_t csp_crc32_bytewise(uint32_t crc, const uint8_t * data, uint32_t length) {
+
+	while (length--)
 #ifdef __AVR__
-	   crc = pgm_read_dword(&crc_tab[(crc ^ *data++) & 0xFFL]) ^ (crc >> 8);
+		crc = pgm_read_dword(&crc_tab[(crc ^ *data++) & 0xFFL]) ^ (crc >> 8);
+#else
+		crc = crc_tab[(crc ^ *data++) & 0xFFL] ^ (crc >> 8);
+#endif
+
+	return crc;
+
+}
+
+#ifdef CSP_CRC32_SLICE8
+static uint32_t csp_crc32_slice8(uint32_t crc, const uint8_t * data, uint32_t length) {
+
+	uint32_t one, two;
+
+	while (length >= 8) {
+		memcpy(&one, data, sizeof(one));
+		memcpy(&two, data + 4, sizeof(two));
+		one ^= crc;
+		crc = crc_tab8[6][one & 0xFF] ^
+			  crc_tab8[5][(one >> 8) & 0xFF] ^
+			  crc_tab8[4][(one >> 16) & 0xFF] ^
+			  crc_tab8[3][one >> 24] ^
+			  crc_tab8[2][two & 0xFF] ^
+			  crc_tab8[1][(two >> 8) & 0xFF] ^
+			  crc_tab8[0][(two >> 16) & 0xFF] ^
+			  crc_tab[two >> 24];
+		data += 8;
+		length -= 8;
+	}
+
+	return csp_crc32_bytewise(crc, data, length);
+
+}
+
+#ifdef CSP_CRC32_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t csp_crc32_sse42(uint32_t crc, const uint8_t * data, uint32_t length) {
+
+#ifdef __x86_64__
+	uint64_t q;
+	while (length >= 8) {
+		memcpy(&q, data, sizeof(q));
+		crc = (uint32_t) __builtin_ia32_crc32di(crc, q);
+		data += 8;
+		length -= 8;
+	}
+#endif
+
+	uint32_t w;
+	while (length >= 4) {
+		memcpy(&w, data, sizeof(w));
+		crc = __builtin_ia32_crc32si(crc, w);
+		data += 4;
+		length -= 4;
+	}
+
+	while (length--)
+		crc = __builtin_ia32_crc32qi(crc, *data++);
+
+	return crc;
+
+}
+#endif
+#endif
+
+uint32_t csp_crc32_update(uint32_t crc, const uint8_t * data, uint32_t length) {
+
+	crc ^= 0xFFFFFFFF;
+
+#ifdef CSP_CRC32_SLICE8
+	if (!crc_tab8_ready)
+		csp_crc32_gentab();
+
+#ifdef CSP_CRC32_SSE42
+	if (crc_sse42)
+		return csp_crc32_sse42(crc, data, length) ^ 0xFFFFFFFF;
+#endif
+
+	crc = csp_crc32_slice8(crc, data, length);
 #else
-	   crc = crc_tab[(crc ^ *data++) & 0xFFL] ^ (crc >> 8);
+	crc = csp_crc32_bytewise(crc, data, length);
 #endif
 
-   return (crc ^ 0xFFFFFFFF);
+	return (crc ^ 0xFFFFFFFF);
+
+}
+
+uint32_t csp_crc32_memory(const uint8_t * data, uint32_t length) {
+	return csp_crc32_update(0, data, length);
 }
 
 int csp_crc32_append(csp_packet_t * packet) {
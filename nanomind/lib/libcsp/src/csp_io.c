@@ -22,6 +22,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <inttypes.h>
 
 /* CSP includes */
 #include <csp/csp.h>
@@ -79,6 +80,10 @@ int csp_init(unsigned char address) {
 	/* Initialize CSP */
 	my_address = address;
 
+#ifdef CSP_USE_CRC32
+	csp_crc32_gentab();
+#endif
+
 	ret = csp_conn_init();
 	if (ret != CSP_ERR_NONE)
 		return ret;
@@ -198,7 +203,18 @@ csp_packet_t * csp_read(csp_conn_t * conn, uint32_t timeout) {
 
 }
 
-int csp_send_direct(csp_id_t idout, csp_packet_t * packet, uint32_t timeout) {
+/**
+ * Send a packet on its route and add the trailers it needs
+ * @param idout CSP identifier to send with
+ * @param packet packet to send
+ * @param ready CSP_Fx trailers already written after the payload, these are only counted in the length
+ * @param timeout timeout used by interfaces with blocking send
+ * @return CSP_ERR_NONE if OK, otherwise CSP_ERR_TX
+ */
+static int csp_io_send(csp_id_t idout, csp_packet_t * packet, uint8_t ready, uint32_t timeout) {
+
+	/* Caller's packet, if a private copy had to be made */
+	csp_packet_t * shared = NULL;
 
 	if (packet == NULL) {
 		csp_log_error("csp_send_direct called with NULL packet\r\n");
@@ -225,11 +241,24 @@ int csp_send_direct(csp_id_t idout, csp_packet_t * packet, uint32_t timeout) {
 
 	/* Only encrypt packets from the current node */
 	if (idout.src == my_address) {
+		/* Trailers are added in place, so the buffer must not be shared */
+		if (idout.flags & (CSP_FHMAC | CSP_FCRC32 | CSP_FXTEA)) {
+			csp_packet_t * private = csp_buffer_writable(packet);
+			if (private == NULL)
+				goto tx_err;
+			if (private != packet) {
+				shared = packet;
+				packet = private;
+			}
+		}
+
 		/* Append HMAC */
 		if (idout.flags & CSP_FHMAC) {
 #ifdef CSP_USE_HMAC
-			/* Calculate and add HMAC */
-			if (csp_hmac_append(packet) != 0) {
+			if (ready & CSP_FHMAC) {
+				/* Already calculated while the payload was copied */
+				packet->length += CSP_HMAC_LENGTH;
+			} else if (csp_hmac_append(packet) != 0) {
 				/* HMAC append failed */
 				csp_log_warn("HMAC append failed!\r\n");
 				goto tx_err;
@@ -243,8 +272,10 @@ int csp_send_direct(csp_id_t idout, csp_packet_t * packet, uint32_t timeout) {
 		/* Append CRC32 */
 		if (idout.flags & CSP_FCRC32) {
 #ifdef CSP_USE_CRC32
-			/* Calculate and add CRC32 */
-			if (csp_crc32_append(packet) != 0) {
+			if (ready & CSP_FCRC32) {
+				/* Already calculated while the payload was copied */
+				packet->length += sizeof(uint32_t);
+			} else if (csp_crc32_append(packet) != 0) {
 				/* CRC32 append failed */
 				csp_log_warn("CRC32 append failed!\r\n");
 				goto tx_err;
@@ -259,7 +290,7 @@ int csp_send_direct(csp_id_t idout, csp_packet_t * packet, uint32_t timeout) {
 #ifdef CSP_USE_XTEA
 			/* Create nonce */
 			uint32_t nonce, nonce_n;
-			nonce = (uint32_t)rand();
+			nonce = csp_xtea_nonce();
 			nonce_n = csp_hton32(nonce);
 			memcpy(&packet->data[packet->length], &nonce_n, sizeof(nonce_n));
 
@@ -291,20 +322,42 @@ int csp_send_direct(csp_id_t idout, csp_packet_t * packet, uint32_t timeout) {
 	if (mtu > 0 && bytes > mtu)
 		goto tx_err;
 
-	if ((*ifout->interface->nexthop)(ifout->interface, packet, timeout) != CSP_ERR_NONE)
+	int ret = (*ifout->interface->nexthop)(ifout->interface, packet, timeout);
+	if (ret == CSP_ERR_TIMEDOUT) {
+		/* The interface took the packet but could not confirm it left in
+		 * time. It still owns the packet, so the caller must not free it */
+		csp_log_warn("Transmission on %s not confirmed in time\r\n", ifout->interface->name);
+		ifout->interface->tx_error++;
+		if (shared != NULL)
+			csp_buffer_free(shared);
+		return CSP_ERR_NONE;
+	}
+	if (ret != CSP_ERR_NONE)
 		goto tx_err;
 
 	ifout->interface->tx++;
 	ifout->interface->txbytes += bytes;
+
+	/* The interface owns the private copy, release the caller's packet */
+	if (shared != NULL)
+		csp_buffer_free(shared);
+
 	return CSP_ERR_NONE;
 
 tx_err:
 	ifout->interface->tx_error++;
+	/* The caller frees its own packet on error */
+	if (shared != NULL)
+		csp_buffer_free(packet);
 err:
 	return CSP_ERR_TX;
 
 }
 
+int csp_send_direct(csp_id_t idout, csp_packet_t * packet, uint32_t timeout) {
+	return csp_io_send(idout, packet, 0, timeout);
+}
+
 int csp_send(csp_conn_t * conn, csp_packet_t * packet, uint32_t timeout) {
 
 	int ret;
@@ -332,6 +385,268 @@ int csp_send(csp_conn_t * conn, csp_packet_t * packet, uint32_t timeout) {
 
 }
 
+/**
+ * Room needed after the payload for the headers and trailers that are
+ * appended on transmit
+ * @param flags CSP_Fx flags the packet will be sent with
+ * @return bytes to reserve after the payload
+ */
+static uint32_t csp_io_tailroom(uint8_t flags) {
+
+	uint32_t tailroom = 0;
+
+	if (flags & CSP_FRDP)
+		tailroom += CSP_RDP_HEADER_MAX;
+	if (flags & CSP_FHMAC)
+		tailroom += CSP_HMAC_LENGTH;
+	if (flags & CSP_FCRC32)
+		tailroom += sizeof(uint32_t);
+	if (flags & CSP_FXTEA)
+		tailroom += sizeof(uint32_t);
+
+	return tailroom;
+
+}
+
+/**
+ * Copy payload fragments into a new buffer with room for the headers and
+ * trailers that will be appended on transmit. HMAC and CRC32 are calculated
+ * over the fragments while they are copied and written after the payload.
+ * @param flags CSP_Fx flags the packet will be sent with
+ * @param iov array of payload fragments
+ * @param iovcnt number of fragments
+ * @param ready returns the CSP_Fx trailers that were written after the payload
+ * @return packet or NULL if out of buffers or the payload is too large
+ */
+static csp_packet_t * csp_io_gather(uint8_t flags, const csp_iovec_t * iov, int iovcnt, uint8_t * ready) {
+
+	int i;
+	uint32_t length = 0, tailroom;
+	csp_packet_t * packet;
+#ifdef CSP_USE_HMAC
+	csp_hmac_stream_t hmac;
+#endif
+#ifdef CSP_USE_CRC32
+	uint32_t crc = 0;
+#endif
+
+	*ready = 0;
+
+	if (iov == NULL || iovcnt < 0)
+		return NULL;
+
+	for (i = 0; i < iovcnt; i++)
+		length += iov[i].len;
+
+	tailroom = csp_io_tailroom(flags);
+	if (length + tailroom + CSP_BUFFER_PACKET_OVERHEAD > (uint32_t) csp_buffer_size()) {
+		csp_log_error("Payload of %"PRIu32" bytes too large\r\n", length);
+		return NULL;
+	}
+
+	packet = csp_buffer_get(length + tailroom);
+	if (packet == NULL)
+		return NULL;
+
+	/* The RDP header is covered by HMAC and CRC32, so RDP segments get theirs on transmit */
+	if (!(flags & CSP_FRDP)) {
+#ifdef CSP_USE_HMAC
+		if (flags & CSP_FHMAC) {
+			csp_hmac_stream_init(&hmac);
+			*ready |= CSP_FHMAC;
+		}
+#endif
+#ifdef CSP_USE_CRC32
+		if (flags & CSP_FCRC32)
+			*ready |= CSP_FCRC32;
+#endif
+	}
+
+	packet->length = 0;
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(&packet->data[packet->length], iov[i].base, iov[i].len);
+#ifdef CSP_USE_HMAC
+		if (*ready & CSP_FHMAC)
+			csp_hmac_stream_process(&hmac, iov[i].base, iov[i].len);
+#endif
+#ifdef CSP_USE_CRC32
+		if (*ready & CSP_FCRC32)
+			crc = csp_crc32_update(crc, iov[i].base, iov[i].len);
+#endif
+		packet->length += iov[i].len;
+	}
+
+	/* Trailers go after the payload in the order csp_send_direct() adds them */
+	length = packet->length;
+
+#ifdef CSP_USE_HMAC
+	if (*ready & CSP_FHMAC) {
+		csp_hmac_stream_done(&hmac, &packet->data[length]);
+#ifdef CSP_USE_CRC32
+		/* CRC32 also covers the HMAC */
+		if (*ready & CSP_FCRC32)
+			crc = csp_crc32_update(crc, &packet->data[length], CSP_HMAC_LENGTH);
+#endif
+		length += CSP_HMAC_LENGTH;
+	}
+#endif
+
+#ifdef CSP_USE_CRC32
+	if (*ready & CSP_FCRC32) {
+		crc = csp_hton32(crc);
+		memcpy(&packet->data[length], &crc, sizeof(uint32_t));
+	}
+#endif
+
+	return packet;
+
+}
+
+int csp_sendv(csp_conn_t * conn, const csp_iovec_t * iov, int iovcnt, uint32_t timeout) {
+
+	csp_packet_t * packet;
+	uint8_t ready;
+	int ret;
+
+	if ((conn == NULL) || (conn->state != CONN_OPEN)) {
+		csp_log_error("Invalid call to csp_sendv\r\n");
+		return 0;
+	}
+
+	packet = csp_io_gather(conn->idout.flags, iov, iovcnt, &ready);
+	if (packet == NULL)
+		return 0;
+
+#ifdef CSP_USE_RDP
+	/* RDP appends its header first, the trailers are added on transmit */
+	if (conn->idout.flags & CSP_FRDP) {
+		ret = csp_send(conn, packet, timeout);
+		if (!ret)
+			csp_buffer_free(packet);
+		return ret;
+	}
+#endif
+
+	ret = csp_io_send(conn->idout, packet, ready, timeout);
+	if (ret != CSP_ERR_NONE) {
+		csp_buffer_free(packet);
+		return 0;
+	}
+
+	return 1;
+
+}
+
+#ifdef CSP_USE_RDP
+int csp_stream_write(csp_conn_t * conn, const void * data, size_t len, uint32_t timeout) {
+
+	const uint8_t * src = data;
+	size_t written = 0;
+	uint32_t tailroom, segment;
+	int ret = CSP_ERR_NONE;
+
+	if ((conn == NULL) || (conn->state != CONN_OPEN) || !(conn->idout.flags & CSP_FRDP)) {
+		csp_log_error("Invalid call to csp_stream_write\r\n");
+		return CSP_ERR_INVAL;
+	}
+
+	/* Largest payload that fits a buffer and the outgoing interface with all trailers */
+	tailroom = csp_io_tailroom(conn->idout.flags);
+	segment = csp_buffer_size() - CSP_BUFFER_PACKET_OVERHEAD - tailroom;
+	csp_route_t * ifout = csp_route_if(conn->idout.dst);
+	if (ifout != NULL && ifout->interface != NULL && ifout->interface->mtu > 0)
+		if (ifout->interface->mtu < segment + tailroom)
+			segment = (ifout->interface->mtu > tailroom) ? ifout->interface->mtu - tailroom : 0;
+	if (segment == 0 || segment > (uint32_t) csp_buffer_size())
+		return CSP_ERR_INVAL;
+
+	uint32_t start = csp_get_ms();
+	while (written < len) {
+
+		/* Wait for room in the window, the rest of the timeout is shared by all segments */
+		uint32_t elapsed = csp_get_ms() - start;
+		ret = csp_rdp_send_wait(conn, (elapsed < timeout) ? timeout - elapsed : 0);
+		if (ret != CSP_ERR_NONE)
+			break;
+
+		uint32_t size = (len - written < segment) ? len - written : segment;
+		csp_packet_t * packet = csp_buffer_get(size + tailroom);
+		if (packet == NULL) {
+			ret = CSP_ERR_NOMEM;
+			break;
+		}
+
+		memcpy(packet->data, &src[written], size);
+		packet->length = size;
+		if (!csp_send(conn, packet, timeout)) {
+			csp_buffer_free(packet);
+			ret = CSP_ERR_TX;
+			break;
+		}
+
+		written += size;
+
+	}
+
+	/* Running out of time after some data was queued is a short write */
+	if (ret == CSP_ERR_NONE || (ret == CSP_ERR_TIMEDOUT && written > 0))
+		return written;
+
+	return ret;
+
+}
+
+int csp_stream_read(csp_conn_t * conn, void * data, size_t len, uint32_t timeout) {
+
+	uint8_t * dst = data;
+	size_t copied = 0;
+
+	if ((conn == NULL) || !(conn->idin.flags & CSP_FRDP)) {
+		csp_log_error("Invalid call to csp_stream_read\r\n");
+		return CSP_ERR_INVAL;
+	}
+
+	while (copied < len) {
+
+		/* Continue a partially read packet, or wait for the first one only */
+		csp_packet_t * packet = conn->rdp.stream_rx;
+		if (packet == NULL) {
+			packet = csp_read(conn, copied ? 0 : timeout);
+			if (packet == NULL)
+				break;
+			conn->rdp.stream_off = 0;
+		}
+
+		size_t size = packet->length - conn->rdp.stream_off;
+		if (size > len - copied)
+			size = len - copied;
+
+		memcpy(&dst[copied], &packet->data[conn->rdp.stream_off], size);
+		conn->rdp.stream_off += size;
+		copied += size;
+
+		if (conn->rdp.stream_off >= packet->length) {
+			csp_buffer_free(packet);
+			packet = NULL;
+		}
+		conn->rdp.stream_rx = packet;
+
+	}
+
+	return copied;
+
+}
+
+int csp_stream_flush(csp_conn_t * conn, uint32_t timeout) {
+
+	if ((conn == NULL) || (conn->state != CONN_OPEN) || !(conn->idout.flags & CSP_FRDP))
+		return CSP_ERR_INVAL;
+
+	return csp_rdp_ack_wait(conn, timeout);
+
+}
+#endif
+
 int csp_send_prio(uint8_t prio, csp_conn_t * conn, csp_packet_t * packet, uint32_t timeout) {
 	conn->idout.pri = prio;
 	return csp_send(conn, packet, timeout);
@@ -401,7 +716,12 @@ csp_packet_t * csp_recvfrom(csp_socket_t * socket, uint32_t timeout) {
 
 }
 
-int csp_sendto(uint8_t prio, uint8_t dest, uint8_t dport, uint8_t src_port, uint32_t opts, csp_packet_t * packet, uint32_t timeout) {
+/**
+ * Send a packet without a connection
+ * @param ready CSP_Fx trailers already written after the payload, see csp_io_send()
+ * @return CSP_ERR_NONE if OK, otherwise an error code
+ */
+static int csp_io_sendto(uint8_t prio, uint8_t dest, uint8_t dport, uint8_t src_port, uint32_t opts, csp_packet_t * packet, uint8_t ready, uint32_t timeout) {
 
 	packet->id.flags = 0;
 
@@ -443,13 +763,41 @@ int csp_sendto(uint8_t prio, uint8_t dest, uint8_t dport, uint8_t src_port, uint
 	packet->id.sport = src_port;
 	packet->id.pri = prio;
 
-	if (csp_send_direct(packet->id, packet, timeout) != CSP_ERR_NONE)
+	if (csp_io_send(packet->id, packet, ready, timeout) != CSP_ERR_NONE)
 		return CSP_ERR_NOTSUP;
 	
 	return CSP_ERR_NONE;
 
 }
 
+int csp_sendto(uint8_t prio, uint8_t dest, uint8_t dport, uint8_t src_port, uint32_t opts, csp_packet_t * packet, uint32_t timeout) {
+	return csp_io_sendto(prio, dest, dport, src_port, opts, packet, 0, timeout);
+}
+
+int csp_sendto_v(uint8_t prio, uint8_t dest, uint8_t dport, uint8_t src_port, uint32_t opts, const csp_iovec_t * iov, int iovcnt, uint32_t timeout) {
+
+	uint8_t flags = 0, ready;
+	int ret;
+
+	if (opts & CSP_O_HMAC)
+		flags |= CSP_FHMAC;
+	if (opts & CSP_O_XTEA)
+		flags |= CSP_FXTEA;
+	if (opts & CSP_O_CRC32)
+		flags |= CSP_FCRC32;
+
+	csp_packet_t * packet = csp_io_gather(flags, iov, iovcnt, &ready);
+	if (packet == NULL)
+		return CSP_ERR_NOMEM;
+
+	ret = csp_io_sendto(prio, dest, dport, src_port, opts, packet, ready, timeout);
+	if (ret != CSP_ERR_NONE)
+		csp_buffer_free(packet);
+
+	return ret;
+
+}
+
 int csp_sendto_reply(csp_packet_t * request_packet, csp_packet_t * reply_packet, uint32_t opts, uint32_t timeout) {
 	if (request_packet == NULL)
 		return CSP_ERR_INVAL;
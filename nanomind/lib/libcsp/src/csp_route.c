@@ -177,8 +177,9 @@ int csp_route_table_init(void) {
 	}
 
 #ifdef CSP_USE_QOS
-	/* Create QoS fifo notification queue */
-	router_input_event = csp_queue_create(CSP_FIFO_INPUT, sizeof(int));
+	/* Create QoS fifo notification queue, with a token for every packet the
+	 * fifos can hold. A lost token leaves its packet waiting for the next one */
+	router_input_event = csp_queue_create(CSP_ROUTE_FIFOS * CSP_FIFO_INPUT, sizeof(int));
 	if (!router_input_event)
 		return CSP_ERR_NOMEM;
 #endif
@@ -201,184 +202,281 @@ void csp_route_table_save(uint8_t route_table_out[CSP_ROUTE_TABLE_SIZE]) {
 	memcpy(route_table_out, routes, sizeof(csp_route_t) * CSP_ROUTE_COUNT);
 }
 
-int csp_route_next_packet(csp_route_queue_t * input) {
+/**
+ * Take up to max packets off the router input in priority order.
+ * Blocks up to timeout for the first packet only, so a burst is drained
+ * with a single wakeup.
+ * @param input array with room for max packets
+ * @param max maximum number of packets to return
+ * @param timeout timeout in ms
+ * @return number of packets returned, 0 on timeout
+ */
+static int csp_route_next_packets(csp_route_queue_t * input, int max, uint32_t timeout) {
 
 #ifdef CSP_USE_QOS
-	int prio, found, event;
+	int prio, found, events;
+	int event[CSP_ROUTER_BATCH];
 
-	/* Wait for packet in any queue */
-	if (csp_queue_dequeue(router_input_event, &event, CSP_ROUTER_RX_TIMEOUT) != CSP_QUEUE_OK)
-		return CSP_ERR_TIMEDOUT;
+	if (max > CSP_ROUTER_BATCH)
+		max = CSP_ROUTER_BATCH;
 
-	/* Find packet with highest priority */
+	/* Wait for packets in any queue. Every event token stands for one packet */
+	events = csp_queue_dequeue_batch(router_input_event, event, sizeof(int), max, timeout);
+	if (events == 0)
+		return 0;
+
+	/* Take packets with highest priority first */
 	found = 0;
-	for (prio = 0; prio < CSP_ROUTE_FIFOS; prio++) {
-		if (csp_queue_dequeue(router_input_fifo[prio], input, 0) == CSP_QUEUE_OK) {
-			found = 1;
-			break;
-		}
-	}
+	for (prio = 0; prio < CSP_ROUTE_FIFOS && found < events; prio++)
+		found += csp_queue_dequeue_batch(router_input_fifo[prio], &input[found], sizeof(csp_route_queue_t), events - found, 0);
 
-	if (!found) {
+	if (!found)
 		csp_log_warn("Spurious wakeup of router task. No packet found\r\n");
-		return CSP_ERR_TIMEDOUT;
-	}
+
+	return found;
 #else
-	if (csp_queue_dequeue(router_input_fifo[0], input, CSP_ROUTER_RX_TIMEOUT) != CSP_QUEUE_OK)
-		return CSP_ERR_TIMEDOUT;
+	return csp_queue_dequeue_batch(router_input_fifo[0], input, sizeof(csp_route_queue_t), max, timeout);
 #endif
 
-	return CSP_ERR_NONE;
-
 }
 
-CSP_DEFINE_TASK(csp_task_router) {
+/**
+ * Deliver or forward a single packet taken off the router input.
+ * With router workers enabled this runs concurrently in several tasks, but
+ * all packets of one connection are always handled by the same worker.
+ * @param input interface and packet to process
+ */
+static void csp_route_process(csp_route_queue_t * input) {
 
-	int prio;
-	csp_route_queue_t input;
-	csp_packet_t * packet;
+	csp_packet_t * packet = input->packet;
 	csp_conn_t * conn;
 	csp_socket_t * socket;
 	csp_route_t * dst;
 
-	for (prio = 0; prio < CSP_ROUTE_FIFOS; prio++) {
-		if (!router_input_fifo[prio]) {
-			csp_log_error("Router %d not initialized\r\n", prio);
-			csp_thread_exit();
+	/* If the message is not to me, route the message to the correct interface */
+	if ((packet->id.dst != my_address) && (packet->id.dst != CSP_BROADCAST_ADDR)) {
+
+		/* Find the destination interface */
+		dst = csp_route_if(packet->id.dst);
+
+		/* If the message resolves to the input interface, don't loop it back out */
+		if ((dst == NULL) || ((dst->interface == input->interface) && (input->interface->split_horizon_off == 0))) {
+			csp_buffer_free(packet);
+			return;
 		}
-	}
 
-	/* Here there be routing */
-	while (1) {
+		/* Otherwise, actually send the message */
+		if (csp_send_direct(packet->id, packet, 0) != CSP_ERR_NONE) {
+			csp_log_warn("Router failed to send\r\n");
+			csp_buffer_free(packet);
+		}
 
-#ifdef CSP_USE_RDP
-		/* Check connection timeouts (currently only for RDP) */
-		csp_conn_check_timeouts();
-#endif
+		/* Next message, please */
+		return;
 
-		/* Get next packet to route */
-		if (csp_route_next_packet(&input) != CSP_ERR_NONE)
-			continue;
+	}
 
-		packet = input.packet;
+	/* The message is to me and will be modified on delivery, so
+	 * make sure it does not share its buffer with a promiscuous copy */
+	csp_packet_t * private = csp_buffer_writable(packet);
+	if (private == NULL) {
+		csp_buffer_free(packet);
+		return;
+	}
+	if (private != packet) {
+		csp_buffer_free(packet);
+		packet = private;
+	}
 
-		csp_log_packet("Input: Src %u, Dst %u, Dport %u, Sport %u, Pri %u, Flags 0x%02X, Size %"PRIu16"\r\n",
-				packet->id.src, packet->id.dst, packet->id.dport,
-				packet->id.sport, packet->id.pri, packet->id.flags, packet->length);
+	/* The message is to me, search for incoming socket */
+	socket = csp_port_get_socket(packet->id.dport);
 
-		/* Here there be promiscuous mode */
-#ifdef CSP_USE_PROMISC
-		csp_promisc_add(packet, csp_promisc_queue);
-#endif
+	/* If the socket is connection-less, deliver now */
+	if (socket && (socket->opts & CSP_SO_CONN_LESS)) { 
+		if (csp_route_security_check(socket->opts, input->interface, packet) < 0) {
+			csp_buffer_free(packet);
+			return;
+		}
+		if (csp_queue_enqueue(socket->socket, &packet, 0) != CSP_QUEUE_OK) {
+			csp_log_error("Conn-less socket queue full\r\n");
+			csp_buffer_free(packet);
+		}
+		return;
+	}
 
-		/* If the message is not to me, route the message to the correct interface */
-		if ((packet->id.dst != my_address) && (packet->id.dst != CSP_BROADCAST_ADDR)) {
+	/* Search for an existing connection */
+	conn = csp_conn_find(packet->id.ext, CSP_ID_CONN_MASK);
 
-			/* Find the destination interface */
-			dst = csp_route_if(packet->id.dst);
+	/* If this is an incoming packet on a new connection */
+	if (conn == NULL) {
 
-			/* If the message resolves to the input interface, don't loop it back out */
-			if ((dst == NULL) || ((dst->interface == input.interface) && (input.interface->split_horizon_off == 0))) {
-				csp_buffer_free(packet);
-				continue;
-			}
+		/* Reject packet if no matching socket is found */
+		if (!socket) {
+			csp_buffer_free(packet);
+			return;
+		}
 
-			/* Otherwise, actually send the message */
-			if (csp_send_direct(packet->id, packet, 0) != CSP_ERR_NONE) {
-				csp_log_warn("Router failed to send\r\n");
-				csp_buffer_free(packet);
-			}
+		/* Run security check on incoming packet */
+		if (csp_route_security_check(socket->opts, input->interface, packet) < 0) {
+			csp_buffer_free(packet);
+			return;
+		}
+
+		/* New incoming connection accepted */
+		csp_id_t idout;
+		idout.pri   = packet->id.pri;
+		idout.src   = my_address;
 
-			/* Next message, please */
-			continue;
+		idout.dst   = packet->id.src;
+		idout.dport = packet->id.sport;
+		idout.sport = packet->id.dport;
+		idout.flags = packet->id.flags;
 
+		/* Create connection */
+		conn = csp_conn_new(packet->id, idout);
+
+		if (!conn) {
+			csp_log_error("No more connections available\r\n");
+			csp_buffer_free(packet);
+			return;
 		}
 
-		/* The message is to me, search for incoming socket */
-		socket = csp_port_get_socket(packet->id.dport);
+		/* Store the socket queue and options */
+		conn->socket = socket->socket;
+		conn->opts = socket->opts;
 
-		/* If the socket is connection-less, deliver now */
-		if (socket && (socket->opts & CSP_SO_CONN_LESS)) { 
-			if (csp_route_security_check(socket->opts, input.interface, packet) < 0) {
-				csp_buffer_free(packet);
-				continue;
-			}
-			if (csp_queue_enqueue(socket->socket, &packet, 0) != CSP_QUEUE_OK) {
-				csp_log_error("Conn-less socket queue full\r\n");
-				csp_buffer_free(packet);
-				continue;
-			}
-			continue;
+	/* Packet to existing connection */
+	} else {
+
+		/* Run security check on incoming packet */
+		if (csp_route_security_check(conn->opts, input->interface, packet) < 0) {
+			csp_buffer_free(packet);
+			return;
 		}
 
-		/* Search for an existing connection */
-		conn = csp_conn_find(packet->id.ext, CSP_ID_CONN_MASK);
+	}
 
-		/* If this is an incoming packet on a new connection */
-		if (conn == NULL) {
+	/* Pass packet to the right transport module */
+	if (packet->id.flags & CSP_FRDP) {
+#ifdef CSP_USE_RDP
+		/* Serialise RDP state changes with the timeout scan */
+		csp_conn_lock(conn, CSP_MAX_DELAY);
+		csp_rdp_new_packet(conn, packet);
+		csp_conn_unlock(conn);
+	} else if (conn->opts & CSP_SO_RDPREQ) {
+		csp_log_warn("Received packet without RDP header. Discarding packet\r\n");
+		input->interface->rx_error++;
+		csp_buffer_free(packet);
+#else
+		csp_log_error("Received RDP packet, but CSP was compiled without RDP support. Discarding packet\r\n");
+		input->interface->rx_error++;
+		csp_buffer_free(packet);
+#endif
+	} else {
+		/* Pass packet to UDP module */
+		csp_udp_new_packet(conn, packet);
+	}
 
-			/* Reject packet if no matching socket is found */
-			if (!socket) {
-				csp_buffer_free(packet);
-				continue;
-			}
+}
 
-			/* Run security check on incoming packet */
-			if (csp_route_security_check(socket->opts, input.interface, packet) < 0) {
-				csp_buffer_free(packet);
-				continue;
-			}
+#if (CSP_ROUTER_WORKERS > 0)
+static csp_thread_handle_t handle_worker[CSP_ROUTER_WORKERS];
+static csp_queue_handle_t router_worker_fifo[CSP_ROUTER_WORKERS];
+
+/**
+ * Select worker for a packet. The connection tuple (src, dst, dport, sport)
+ * is hashed, so packets on the same connection keep their relative order.
+ * @param id packet identifier
+ * @return worker index
+ */
+static inline unsigned int csp_route_worker_index(csp_id_t id) {
 
-			/* New incoming connection accepted */
-			csp_id_t idout;
-			idout.pri   = packet->id.pri;
-			idout.src   = my_address;
+	uint32_t key = (id.ext & CSP_ID_CONN_MASK) >> CSP_ID_FLAGS_SIZE;
+	key = key * 2654435761UL;
+	return (key >> 16) % CSP_ROUTER_WORKERS;
 
-			idout.dst   = packet->id.src;
-			idout.dport = packet->id.sport;
-			idout.sport = packet->id.dport;
-			idout.flags = packet->id.flags;
+}
 
-			/* Create connection */
-			conn = csp_conn_new(packet->id, idout);
+CSP_DEFINE_TASK(csp_task_router_worker) {
 
-			if (!conn) {
-				csp_log_error("No more connections available\r\n");
-				csp_buffer_free(packet);
-				continue;
-			}
+	csp_queue_handle_t fifo = (csp_queue_handle_t) param;
+	csp_route_queue_t input[CSP_ROUTER_BATCH];
+	int i, count;
 
-			/* Store the socket queue and options */
-			conn->socket = socket->socket;
-			conn->opts = socket->opts;
+	while (1) {
+		count = csp_queue_dequeue_batch(fifo, input, sizeof(csp_route_queue_t), CSP_ROUTER_BATCH, CSP_MAX_DELAY);
+		for (i = 0; i < count; i++)
+			csp_route_process(&input[i]);
+	}
 
-		/* Packet to existing connection */
-		} else {
+}
+#endif
 
-			/* Run security check on incoming packet */
-			if (csp_route_security_check(conn->opts, input.interface, packet) < 0) {
-				csp_buffer_free(packet);
-				continue;
-			}
+CSP_DEFINE_TASK(csp_task_router) {
 
+	int prio, i, count;
+	uint32_t timeout = CSP_ROUTER_RX_TIMEOUT;
+	csp_route_queue_t batch[CSP_ROUTER_BATCH];
+	csp_route_queue_t input;
+	csp_packet_t * packet;
+#ifdef CSP_USE_RDP
+	uint32_t now, rdp_deadline = csp_get_ms();
+#endif
+
+	for (prio = 0; prio < CSP_ROUTE_FIFOS; prio++) {
+		if (!router_input_fifo[prio]) {
+			csp_log_error("Router %d not initialized\r\n", prio);
+			csp_thread_exit();
 		}
+	}
+
+	/* Here there be routing */
+	while (1) {
 
-		/* Pass packet to the right transport module */
-		if (packet->id.flags & CSP_FRDP) {
 #ifdef CSP_USE_RDP
-			csp_rdp_new_packet(conn, packet);
-		} else if (conn->opts & CSP_SO_RDPREQ) {
-			csp_log_warn("Received packet without RDP header. Discarding packet\r\n");
-			input.interface->rx_error++;
-			csp_buffer_free(packet);
+		/* Check connection timeouts (currently only for RDP) on their own
+		 * deadline, not once per packet */
+		now = csp_get_ms();
+		if ((int32_t) (now - rdp_deadline) >= 0) {
+			rdp_deadline = csp_conn_check_timeouts(now + CSP_ROUTER_RX_TIMEOUT);
+			now = csp_get_ms();
+			/* Never spin on a timer that could not be served */
+			if ((int32_t) (rdp_deadline - now) <= 0)
+				rdp_deadline = now + 1;
+		}
+		timeout = ((int32_t) (rdp_deadline - now) > 0) ? rdp_deadline - now : 0;
+		if (timeout > CSP_ROUTER_RX_TIMEOUT)
+			timeout = CSP_ROUTER_RX_TIMEOUT;
+#endif
+
+		/* Get next packets to route */
+		count = csp_route_next_packets(batch, CSP_ROUTER_BATCH, timeout);
+
+		for (i = 0; i < count; i++) {
+
+			input = batch[i];
+			packet = input.packet;
+
+			csp_log_packet("Input: Src %u, Dst %u, Dport %u, Sport %u, Pri %u, Flags 0x%02X, Size %"PRIu16"\r\n",
+					packet->id.src, packet->id.dst, packet->id.dport,
+					packet->id.sport, packet->id.pri, packet->id.flags, packet->length);
+
+			/* Here there be promiscuous mode */
+#ifdef CSP_USE_PROMISC
+			csp_promisc_add(packet, csp_promisc_queue);
+#endif
+
+#if (CSP_ROUTER_WORKERS > 0)
+			/* Hand over to the worker owning this connection. Never wait
+			 * for a busy worker, it would stall every other connection */
+			if (csp_queue_enqueue(router_worker_fifo[csp_route_worker_index(packet->id)], &input, 0) != CSP_QUEUE_OK) {
+				csp_log_warn("Router worker queue full. Dropping packet.\r\n");
+				input.interface->drop++;
+				csp_buffer_free(packet);
+			}
 #else
-			csp_log_error("Received RDP packet, but CSP was compiled without RDP support. Discarding packet\r\n");
-			input.interface->rx_error++;
-			csp_buffer_free(packet);
+			csp_route_process(&input);
 #endif
-		} else {
-			/* Pass packet to UDP module */
-			csp_udp_new_packet(conn, packet);
 		}
 	}
 
@@ -386,6 +484,21 @@ CSP_DEFINE_TASK(csp_task_router) {
 
 int csp_route_start_task(unsigned int task_stack_size, unsigned int priority) {
 
+#if (CSP_ROUTER_WORKERS > 0)
+	int i;
+	for (i = 0; i < CSP_ROUTER_WORKERS; i++) {
+		router_worker_fifo[i] = csp_queue_create(CSP_FIFO_INPUT, sizeof(csp_route_queue_t));
+		if (router_worker_fifo[i] == NULL) {
+			csp_log_error("Failed to allocate router worker queue\r\n");
+			return CSP_ERR_NOMEM;
+		}
+		if (csp_thread_create(csp_task_router_worker, (signed char *) "RTEW", task_stack_size, router_worker_fifo[i], priority, &handle_worker[i]) != 0) {
+			csp_log_error("Failed to start router worker task\n");
+			return CSP_ERR_NOMEM;
+		}
+	}
+#endif
+
 	int ret = csp_thread_create(csp_task_router, (signed char *) "RTE", task_stack_size, NULL, priority, &handle_router);
 
 	if (ret != 0) {
@@ -577,9 +690,13 @@ void csp_route_print_interfaces(void) {
 		csp_bytesize(rxbuf, 25, i->rxbytes);
 		printf("%-5s   tx: %05"PRIu32" rx: %05"PRIu32" txe: %05"PRIu32" rxe: %05"PRIu32"\r\n"
 				"		drop: %05"PRIu32" autherr: %05"PRIu32 " frame: %05"PRIu32"\r\n"
-				"		txb: %"PRIu32" (%s) rxb: %"PRIu32" (%s)\r\n\r\n",
+				"		txb: %"PRIu32" (%s) rxb: %"PRIu32" (%s)\r\n",
 				i->name, i->tx, i->rx, i->tx_error, i->rx_error, i->drop,
 				i->autherr, i->frame, i->txbytes, txbuf, i->rxbytes, rxbuf);
+		if (i->tx_queue_size)
+			printf("		txq: %"PRIu16"/%"PRIu16" max: %"PRIu16" txq drop: %05"PRIu32"\r\n",
+				i->tx_queue, i->tx_queue_size, i->tx_queue_max, i->tx_queue_drop);
+		printf("\r\n");
 		i = i->next;
 	}
 
@@ -643,8 +760,8 @@ void csp_promisc_add(csp_packet_t * packet, csp_queue_handle_t queue) {
 		return;
 
 	if (queue != NULL) {
-		/* Make a copy of the message and queue it to the promiscuous task */
-		csp_packet_t *packet_copy = csp_buffer_clone(packet);
+		/* Share the message with the promiscuous task, without copying it */
+		csp_packet_t *packet_copy = csp_buffer_clone_ref(packet);
 		if (packet_copy != NULL) {
 			if (csp_queue_enqueue(queue, &packet_copy, 0) != CSP_QUEUE_OK) {
 				csp_log_error("Promiscuous mode input queue full\r\n");
@@ -162,11 +162,27 @@ int csp_cmp_handler(csp_conn_t * conn, csp_packet_t * packet) {
 	return ret;
 }
 
+/* Make room for a reply larger than the request */
+static csp_packet_t * csp_service_reply_buffer(csp_packet_t * packet, size_t size) {
+
+	csp_packet_t * reply = csp_buffer_resize(packet, size);
+
+	if (reply == NULL)
+		csp_buffer_free(packet);
+
+	return reply;
+
+}
+
 void csp_service_handler(csp_conn_t * conn, csp_packet_t * packet) {
 
 	switch (csp_conn_dport(conn)) {
 
 	case CSP_CMP:
+		packet = csp_service_reply_buffer(packet, sizeof(struct csp_cmp_message));
+		if (packet == NULL)
+			return;
+
 		/* Pass to CMP handler */
 		if (csp_cmp_handler(conn, packet) != CSP_ERR_NONE) {
 			csp_buffer_free(packet);
@@ -180,6 +196,10 @@ void csp_service_handler(csp_conn_t * conn, csp_packet_t * packet) {
 		break;
 
 	case CSP_PS: {
+		packet = csp_service_reply_buffer(packet, csp_buffer_size() - CSP_BUFFER_PACKET_OVERHEAD);
+		if (packet == NULL)
+			return;
+
 		csp_sys_tasklist((char *)packet->data);
 		packet->length = strlen((char *)packet->data);
 		packet->data[packet->length] = '\0';
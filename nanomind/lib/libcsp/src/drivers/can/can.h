@@ -65,6 +65,18 @@ typedef int (*can_rx_callback_t)(can_frame_t * frame, CSP_BASE_TYPE * task_woken
 int can_init(uint32_t id, uint32_t mask, can_tx_callback_t txcb, can_rx_callback_t rxcb, struct csp_can_config *conf);
 int can_send(can_id_t id, uint8_t * data, uint8_t dlc, CSP_BASE_TYPE * task_woken);
 
+#ifdef CSP_CAN_SEND_FRAMES
+/**
+ * Send a sequence of frames in order without going through the mailboxes.
+ * Blocks until every frame has been queued and does not call the TX callback.
+ * The driver may modify the frames to set controller specific flags.
+ * @param frames Frames to send
+ * @param count Number of frames
+ * @return 0 on success, -1 on error
+ */
+int can_send_frames(can_frame_t * frames, int count);
+#endif
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
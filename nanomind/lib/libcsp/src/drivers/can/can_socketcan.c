@@ -20,6 +20,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 /* SocketCAN driver */
 
+/* sendmmsg and recvmmsg */
+#define _GNU_SOURCE
+
 #include <stdint.h>
 #include <stdio.h>
 
@@ -30,6 +33,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include <time.h>
 #include <string.h>
 #include <errno.h>
+#include <poll.h>
 
 #include <pthread.h>
 #include <semaphore.h>
@@ -50,12 +54,23 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 #include <csp/csp.h>
 #include <csp/interfaces/csp_if_can.h>
+#include <csp/arch/csp_time.h>
 
 #include "can.h"
 
 /* Number of mailboxes */
 #define MBOX_NUM 5
 
+/* Number of frames per sendmmsg/recvmmsg call */
+#define MMSG_NUM 32
+
+/* Time to wait for room in the socket before a send fails, in ms */
+#define TX_TIMEOUT_MS 10000
+
+/* The kernel returns ENOBUFS without waking poll when the interface queue
+ * is full, so back off this long before trying again, in ms */
+#define TX_BACKOFF_MS 1
+
 /* These constants are not defined for Blackfin */
 #if !defined(PF_CAN) && !defined(AF_CAN)
 	#define PF_CAN 29
@@ -130,34 +145,50 @@ static void * mbox_tx_thread(void * parameters) {
 
 static void * mbox_rx_thread(void * parameters) {
 
-	struct can_frame frame;
-	int nbytes;
+	struct can_frame frames[MMSG_NUM];
+	struct iovec iov[MMSG_NUM];
+	struct mmsghdr msgs[MMSG_NUM];
+	int i, count;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < MMSG_NUM; i++) {
+		iov[i].iov_base = &frames[i];
+		iov[i].iov_len = sizeof(frames[i]);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
 
 	while (1) {
-		/* Read CAN frame */
-		nbytes = read(can_socket, &frame, sizeof(frame));
+		/* Block for the first frame, then drain what is queued */
+		count = recvmmsg(can_socket, msgs, MMSG_NUM, MSG_WAITFORONE, NULL);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			csp_log_error("recvmmsg: %s\r\n", strerror(errno));
+			break;
+		}
 
-	if (nbytes < 0) {
-		csp_log_error("read: %s\r\n", strerror(errno));
-		break;
-	}
+		for (i = 0; i < count; i++) {
+			struct can_frame * frame = &frames[i];
 
-		if (nbytes != sizeof(frame)) {
-			csp_log_warn("Read incomplete CAN frame\n");
-			continue;
-		}
+			if (msgs[i].msg_len != sizeof(*frame)) {
+				csp_log_warn("Read incomplete CAN frame\r\n");
+				continue;
+			}
+
+			/* Frame type */
+			if (frame->can_id & (CAN_ERR_FLAG | CAN_RTR_FLAG) || !(frame->can_id & CAN_EFF_FLAG)) {
+				/* Drop error and remote frames */
+				csp_log_warn("Discarding ERR/RTR/SFF frame\r\n");
+				continue;
+			}
 
-		/* Frame type */
-		if (frame.can_id & (CAN_ERR_FLAG | CAN_RTR_FLAG) || !(frame.can_id & CAN_EFF_FLAG)) {
-			/* Drop error and remote frames */
-			csp_log_warn("Discarding ERR/RTR/SFF frame\r\n");
-		} else {
 			/* Strip flags */
-			frame.can_id &= CAN_EFF_MASK;
-		}
+			frame->can_id &= CAN_EFF_MASK;
 
-		/* Call RX callback */
-		if (rxcb) rxcb((can_frame_t *)&frame, NULL);
+			/* Call RX callback */
+			if (rxcb) rxcb((can_frame_t *)frame, NULL);
+		}
 	}
 
 	/* We should never reach this point */
@@ -237,6 +268,62 @@ int can_send(can_id_t id, uint8_t data[], uint8_t dlc, CSP_BASE_TYPE * task_woke
 
 }
 
+int can_send_frames(can_frame_t * frames, int count) {
+
+	struct iovec iov[MMSG_NUM];
+	struct mmsghdr msgs[MMSG_NUM];
+	uint32_t start = csp_get_ms();
+	int i, sent = 0;
+
+	memset(msgs, 0, sizeof(msgs));
+
+	while (sent < count) {
+		/* Map the next batch onto the socket */
+		int batch = (count - sent < MMSG_NUM) ? count - sent : MMSG_NUM;
+		for (i = 0; i < batch; i++) {
+			struct can_frame * frame = (struct can_frame *)&frames[sent + i];
+			if (frame->can_dlc > 8)
+				return -1;
+			frame->can_id |= CAN_EFF_FLAG;
+			iov[i].iov_base = frame;
+			iov[i].iov_len = sizeof(*frame);
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		int ret = sendmmsg(can_socket, msgs, batch, MSG_DONTWAIT);
+		if (ret > 0) {
+			sent += ret;
+			continue;
+		}
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS) {
+			csp_log_error("sendmmsg: %s\r\n", strerror(errno));
+			return -1;
+		}
+
+		/* Wait for room in the socket buffer */
+		uint32_t elapsed = csp_get_ms() - start;
+		if (elapsed >= TX_TIMEOUT_MS) {
+			csp_log_error("sendmmsg: timeout after %d of %d frames\r\n", sent, count);
+			return -1;
+		}
+
+		struct pollfd pfd = {.fd = can_socket, .events = POLLOUT};
+		if (ret < 0 && errno == ENOBUFS) {
+			poll(NULL, 0, TX_BACKOFF_MS);
+		} else {
+			poll(&pfd, 1, TX_TIMEOUT_MS - elapsed);
+		}
+	}
+
+	return 0;
+
+}
+
 int can_init(uint32_t id, uint32_t mask, can_tx_callback_t atxcb, can_rx_callback_t arxcb, struct csp_can_config *conf) {
 
 	struct ifreq ifr;
@@ -33,6 +33,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include <csp/csp.h>
 #include <sys/time.h>
 
+/** Size of the RX chunk handed to the callback */
+#define USART_RX_BUF_SIZE 4096
+
 int fd;
 usart_callback_t usart_callback = NULL;
 
@@ -224,13 +227,17 @@ int usart_messages_waiting(int handle) {
 }
 
 static void *serial_rx_thread(void *vptr_args) {
-	unsigned int length;
-	uint8_t * cbuf = malloc(100000);
+
+	static uint8_t cbuf[USART_RX_BUF_SIZE];
+	int length;
 
 	// Receive loop
 	while (1) {
-		length = read(fd, cbuf, 300);
+		/* Blocks for the first byte, then returns everything the tty has buffered */
+		length = read(fd, cbuf, sizeof(cbuf));
 		if (length <= 0) {
+			if (length < 0 && errno == EINTR)
+				continue;
 			perror("Error: ");
 			exit(1);
 		}
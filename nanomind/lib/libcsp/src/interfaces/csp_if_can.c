@@ -91,11 +91,26 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #define CSP_CAN_RX_QUEUE_SIZE 100
 
 /** Number of packet buffer elements */
+#ifdef CSP_CAN_PBUF_ELEMENTS
+#define PBUF_ELEMENTS CSP_CAN_PBUF_ELEMENTS
+#else
 #define PBUF_ELEMENTS CSP_CONN_MAX
+#endif
+
+/** Number of hash buckets for CFP lookup */
+#define PBUF_HASH_SIZE PBUF_ELEMENTS
 
 /** Buffer element timeout in ms */
 #define PBUF_TIMEOUT_MS 10000
 
+/** Timer wheel for buffer expiry. An element is never due more than
+ * PBUF_WHEEL_SLOTS - 1 ticks ahead, so a slot is never shared by two rounds. */
+#define PBUF_WHEEL_SLOTS 16
+#define PBUF_WHEEL_TICK_MS ((PBUF_TIMEOUT_MS + PBUF_WHEEL_SLOTS - 3) / (PBUF_WHEEL_SLOTS - 2))
+
+/** End of list marker for buffer element indexes */
+#define PBUF_NONE -1
+
 /** CFP Frame Types */
 enum cfp_frame_t {
 	CFP_BEGIN = 0,
@@ -117,6 +132,9 @@ static csp_thread_handle_t can_rx_task;
 /** RX frame queue */
 static csp_queue_handle_t can_rx_queue;
 
+/** Reassembly statistics */
+static csp_can_stats_t can_stats;
+
 /* Identification number */
 static int id_init(void) {
 
@@ -160,10 +178,53 @@ typedef struct {
 	csp_packet_t *packet;			/**< Pointer to packet buffer */
 	pbuf_state_t state;				/**< Element state */
 	uint32_t last_used;				/**< Timestamp in ms for last use of buffer */
+	int16_t next;					/**< Next element in hash chain or free list */
+	int16_t wheel_prev;				/**< Previous element in timer wheel slot */
+	int16_t wheel_next;				/**< Next element in timer wheel slot */
+	uint8_t wheel_slot;				/**< Timer wheel slot holding the element */
 } pbuf_element_t;
 
 static pbuf_element_t pbuf[PBUF_ELEMENTS];
 
+/** Hash buckets, indexed by the connection part of the CFP identifier */
+static int16_t pbuf_hash[PBUF_HASH_SIZE];
+
+/** Free elements */
+static int16_t pbuf_free_list;
+
+/** Timer wheel slots and the last tick that was expired */
+static int16_t pbuf_wheel[PBUF_WHEEL_SLOTS];
+static uint32_t pbuf_wheel_tick;
+
+static inline unsigned int pbuf_hash_index(uint32_t id) {
+	return (((id & CFP_ID_CONN_MASK) * 2654435761UL) >> 16) % PBUF_HASH_SIZE;
+}
+
+static void pbuf_wheel_insert(int16_t i, uint32_t due_tick) {
+
+	pbuf_element_t *buf = &pbuf[i];
+	buf->wheel_slot = due_tick % PBUF_WHEEL_SLOTS;
+	buf->wheel_prev = PBUF_NONE;
+	buf->wheel_next = pbuf_wheel[buf->wheel_slot];
+	if (buf->wheel_next != PBUF_NONE)
+		pbuf[buf->wheel_next].wheel_prev = i;
+	pbuf_wheel[buf->wheel_slot] = i;
+
+}
+
+static void pbuf_wheel_remove(int16_t i) {
+
+	pbuf_element_t *buf = &pbuf[i];
+	if (buf->wheel_prev != PBUF_NONE) {
+		pbuf[buf->wheel_prev].wheel_next = buf->wheel_next;
+	} else {
+		pbuf_wheel[buf->wheel_slot] = buf->wheel_next;
+	}
+	if (buf->wheel_next != PBUF_NONE)
+		pbuf[buf->wheel_next].wheel_prev = buf->wheel_prev;
+
+}
+
 /** pbuf_init
  * Initialize packet buffer.
  * @return 0 on success, -1 on error.
@@ -183,12 +244,20 @@ static int pbuf_init(void) {
 		buf->state = BUF_FREE;
 		buf->last_used = 0;
 		buf->remain = 0;
+		buf->next = (i + 1 < PBUF_ELEMENTS) ? i + 1 : PBUF_NONE;
 		/* Create tx semaphore if blocking mode is enabled */
 		if (csp_bin_sem_create(&buf->tx_sem) != CSP_SEMAPHORE_OK) {
 			csp_log_error("Failed to allocate TX semaphore\r\n");
 			return CSP_ERR_NOMEM;
 		}
 	}
+	pbuf_free_list = 0;
+
+	for (i = 0; i < PBUF_HASH_SIZE; i++)
+		pbuf_hash[i] = PBUF_NONE;
+	for (i = 0; i < PBUF_WHEEL_SLOTS; i++)
+		pbuf_wheel[i] = PBUF_NONE;
+	pbuf_wheel_tick = csp_get_ms() / PBUF_WHEEL_TICK_MS;
 
     /* Initialize global lock */
 	if (CSP_INIT_CRITICAL(pbuf_sem) != CSP_ERR_NONE) {
@@ -202,6 +271,8 @@ static int pbuf_init(void) {
 
 /** pbuf_timestamp
  * Update packet buffer timestamp of last use.
+ * The element stays in its timer wheel slot, pbuf_cleanup moves it on when
+ * the slot comes due.
  * @param buf Buffer element to update
  * @param task_woken
  * @return
@@ -217,17 +288,27 @@ int pbuf_timestamp(pbuf_element_t *buf, CSP_BASE_TYPE *task_woken) {
 
 }
 
-/** pbuf_free
- * Free buffer element and associated CSP packet buffer element.
- * @param buf Buffer element to free
- * @return 0 on success, -1 on error.
+/** pbuf_release
+ * Release buffer element with the packet buffer lock held.
+ * @param buf Buffer element to release
  */
-static int pbuf_free(pbuf_element_t *buf, CSP_BASE_TYPE *task_woken) {
+static void pbuf_release(pbuf_element_t *buf, CSP_BASE_TYPE *task_woken) {
+
+	int16_t i = buf - pbuf;
+
+	if (buf->state == BUF_FREE)
+		return;
+
+	/* Unlink from hash chain */
+	int16_t *link = &pbuf_hash[pbuf_hash_index(buf->cfpid)];
+	while (*link != PBUF_NONE && *link != i)
+		link = &pbuf[*link].next;
+	if (*link == i)
+		*link = buf->next;
+
+	/* Unlink from timer wheel */
+	pbuf_wheel_remove(i);
 
-	/* Lock packet buffer */
-	if (task_woken == NULL)
-		CSP_ENTER_CRITICAL(pbuf_sem);
-		
 	/* Free CSP packet */
 	if (buf->packet != NULL) {
 		if (task_woken == NULL) {
@@ -245,6 +326,23 @@ static int pbuf_free(pbuf_element_t *buf, CSP_BASE_TYPE *task_woken) {
 	buf->cfpid = 0;
 	buf->last_used = 0;
 	buf->remain = 0;
+	buf->next = pbuf_free_list;
+	pbuf_free_list = i;
+
+}
+
+/** pbuf_free
+ * Free buffer element and associated CSP packet buffer element.
+ * @param buf Buffer element to free
+ * @return 0 on success, -1 on error.
+ */
+static int pbuf_free(pbuf_element_t *buf, CSP_BASE_TYPE *task_woken) {
+
+	/* Lock packet buffer */
+	if (task_woken == NULL)
+		CSP_ENTER_CRITICAL(pbuf_sem);
+
+	pbuf_release(buf, task_woken);
 
 	/* Unlock packet buffer */
 	if (task_woken == NULL)
@@ -261,25 +359,33 @@ static int pbuf_free(pbuf_element_t *buf, CSP_BASE_TYPE *task_woken) {
  */
 static pbuf_element_t *pbuf_new(uint32_t id, CSP_BASE_TYPE *task_woken) {
 
-	/* Search for free buffer */
-	int i;
-	pbuf_element_t *buf, *ret = NULL;
+	pbuf_element_t *buf = NULL;
 
 	/* Lock packet buffer */
 	if (task_woken == NULL)
 		CSP_ENTER_CRITICAL(pbuf_sem);
 
-	/* Loop through buffer elements */
-	for (i = 0; i < PBUF_ELEMENTS; i++) {
+	/* Take the first free element */
+	int16_t i = pbuf_free_list;
+	if (i != PBUF_NONE) {
 		buf = &pbuf[i];
-		if(buf->state == BUF_FREE) {
-			buf->state = BUF_USED;
-			buf->cfpid = id;
-			buf->remain = 0;
-			pbuf_timestamp(buf, task_woken);
-			ret = buf;
-			break;
-		}
+		pbuf_free_list = buf->next;
+
+		buf->state = BUF_USED;
+		buf->cfpid = id;
+		buf->remain = 0;
+		pbuf_timestamp(buf, task_woken);
+
+		/* Index by connection */
+		unsigned int bucket = pbuf_hash_index(id);
+		buf->next = pbuf_hash[bucket];
+		pbuf_hash[bucket] = i;
+
+		/* Schedule expiry */
+		pbuf_wheel_insert(i, (buf->last_used + PBUF_TIMEOUT_MS) / PBUF_WHEEL_TICK_MS);
+	} else {
+		/* Counted under the lock, both RX and TX take elements */
+		can_stats.pbuf_full++;
 	}
 
 	/* Unlock packet buffer */
@@ -287,29 +393,30 @@ static pbuf_element_t *pbuf_new(uint32_t id, CSP_BASE_TYPE *task_woken) {
 		CSP_EXIT_CRITICAL(pbuf_sem);
 
 	/* No free buffer was found */
-	return ret;
+	return buf;
   
 }
 
 
 /** pbuf_find
- * Find matching packet buffer or create a new one.
+ * Find matching packet buffer.
  * @param id CFP identifier to match
- * @param mask Match mask
- * @return Pointer to matching or new packet buffer element on success, NULL on error.
+ * @param mask Match mask. Elements are hashed on id & CFP_ID_CONN_MASK, so the
+ * mask must include every bit of CFP_ID_CONN_MASK, or matches in other chains are missed
+ * @return Pointer to matching packet buffer element on success, NULL on error.
  */
 static pbuf_element_t *pbuf_find(uint32_t id, uint32_t mask, CSP_BASE_TYPE *task_woken) {
 	
 	/* Search for matching buffer */
-	int i;
+	int16_t i;
 	pbuf_element_t *buf, *ret = NULL;
 
 	/* Lock packet buffer */
 	if (task_woken == NULL)
 		CSP_ENTER_CRITICAL(pbuf_sem);
 
-	/* Loop through buffer elements */
-	for (i = 0; i < PBUF_ELEMENTS; i++) {
+	/* Walk the hash chain */
+	for (i = pbuf_hash[pbuf_hash_index(id)]; i != PBUF_NONE; i = buf->next) {
 		buf = &pbuf[i];
 
 		if((buf->state == BUF_USED) && ((buf->cfpid & mask) == (id & mask))) {
@@ -329,28 +436,47 @@ static pbuf_element_t *pbuf_find(uint32_t id, uint32_t mask, CSP_BASE_TYPE *task
 }
 
 /** pbuf_cleanup
- * Purge all packets buffers that have timed out
+ * Purge all packets buffers that have timed out. Only the timer wheel slots
+ * that came due since the last call are visited.
  */
 static void pbuf_cleanup(void) {
 
-	int i;
-	pbuf_element_t *buf;
+	uint32_t now = csp_get_ms();
+	uint32_t now_tick = now / PBUF_WHEEL_TICK_MS;
 
 	/* Lock packet buffer */
 	CSP_ENTER_CRITICAL(pbuf_sem);
 
-	/* Loop through buffer elements */
-	for (i = 0; i < PBUF_ELEMENTS; i++) {
-		buf = &pbuf[i];
-		if (buf->state == BUF_USED) {
-			/* Check timeout */
-			uint32_t now = csp_get_ms();
+	/* Skip rounds that cannot hold anything after a long pause */
+	if (now_tick - pbuf_wheel_tick > PBUF_WHEEL_SLOTS)
+		pbuf_wheel_tick = now_tick - PBUF_WHEEL_SLOTS;
+
+	while (pbuf_wheel_tick != now_tick) {
+
+		pbuf_wheel_tick++;
+
+		/* Detach the slot, then expire or reschedule each element */
+		int16_t i = pbuf_wheel[pbuf_wheel_tick % PBUF_WHEEL_SLOTS];
+		pbuf_wheel[pbuf_wheel_tick % PBUF_WHEEL_SLOTS] = PBUF_NONE;
+
+		while (i != PBUF_NONE) {
+			pbuf_element_t *buf = &pbuf[i];
+			int16_t next = buf->wheel_next;
+
+			/* Put it back on a list so pbuf_free can unlink it */
+			uint32_t due_tick = (buf->last_used + PBUF_TIMEOUT_MS) / PBUF_WHEEL_TICK_MS;
+			pbuf_wheel_insert(i, (due_tick > pbuf_wheel_tick) ? due_tick : pbuf_wheel_tick + 1);
+
 			if (now - buf->last_used > PBUF_TIMEOUT_MS) {
 				csp_log_warn("CAN Buffer element timed out\r\n");
-				/* Reuse packet buffer */
-				pbuf_free(buf, NULL);
+				can_stats.pbuf_timeout++;
+				/* Reuse packet buffer, the lock is already held */
+				pbuf_release(buf, NULL);
 			}
+
+			i = next;
 		}
+
 	}
 
 	/* Unlock packet buffer */
@@ -358,6 +484,26 @@ static void pbuf_cleanup(void) {
 
 }
 
+int csp_can_get_stats(csp_can_stats_t *stats) {
+
+	int i;
+
+	if (stats == NULL)
+		return CSP_ERR_INVAL;
+
+	CSP_ENTER_CRITICAL(pbuf_sem);
+	*stats = can_stats;
+	stats->pbuf_in_use = 0;
+	for (i = 0; i < PBUF_ELEMENTS; i++)
+		if (pbuf[i].state == BUF_USED)
+			stats->pbuf_in_use++;
+	stats->pbuf_count = PBUF_ELEMENTS;
+	CSP_EXIT_CRITICAL(pbuf_sem);
+
+	return CSP_ERR_NONE;
+
+}
+
 int csp_tx_callback(can_id_t canid, can_error_t error, CSP_BASE_TYPE *task_woken) {
 
 	int bytes;
@@ -519,6 +665,7 @@ static int csp_can_process_frame(can_frame_t *frame) {
 				csp_log_error("CAN frame lost in CSP packet\r\n");
 				pbuf_free(buf, NULL);
 				csp_if_can.frame++;
+				can_stats.lost++;
 				break;
 			}
 
@@ -543,6 +690,7 @@ static int csp_can_process_frame(can_frame_t *frame) {
 
 			/* Data is available */
 			csp_new_packet(buf->packet, &csp_if_can, NULL);
+			can_stats.reassembled++;
 
 			/* Drop packet buffer reference */
 			buf->packet = NULL;
@@ -569,20 +717,110 @@ CSP_DEFINE_TASK(csp_can_rx_task) {
 	can_frame_t frame;
 
 	while (1) {
-		ret = csp_queue_dequeue(can_rx_queue, &frame, 1000);
-		if (ret != CSP_QUEUE_OK) {
-			pbuf_cleanup();
-			continue;
-		}
+		ret = csp_queue_dequeue(can_rx_queue, &frame, PBUF_WHEEL_TICK_MS);
+
+		/* Expire stale buffers on a busy bus too, this only walks due slots */
+		pbuf_cleanup();
 
-		csp_can_process_frame(&frame);
+		if (ret == CSP_QUEUE_OK)
+			csp_can_process_frame(&frame);
 	}
 
 	csp_thread_exit();
 
 }
 
-int csp_can_tx(csp_iface_t * interface, csp_packet_t *packet, uint32_t timeout) {
+#ifdef CSP_CAN_SEND_FRAMES
+
+/** Number of frames handed to the driver per call */
+#define CAN_TX_BATCH 32
+
+static int csp_can_send_packet(csp_packet_t *packet, uint32_t timeout) {
+
+	can_frame_t frames[CAN_TX_BATCH];
+	uint8_t bytes, overhead, avail, dest;
+	uint16_t tx_count = 0;
+	int count = 0;
+
+	/* Get CFP identification number */
+	int ident = id_get();
+	if (ident < 0) {
+		csp_log_warn("Failed to get CFP identification number\r\n");
+		return CSP_ERR_INVAL;
+	}
+
+	/* Calculate overhead */
+	overhead = sizeof(csp_id_t) + sizeof(uint16_t);
+
+	/* Insert destination node mac address into the CFP destination field */
+	dest = csp_route_get_nexthop_mac(packet->id.dst);
+	if (dest == CSP_NODE_MAC)
+		dest = packet->id.dst;
+
+	/* Create CAN identifier of the BEGIN frame */
+	can_id_t id = 0;
+	id |= CFP_MAKE_SRC(packet->id.src);
+	id |= CFP_MAKE_DST(dest);
+	id |= CFP_MAKE_ID(ident);
+	id |= CFP_MAKE_TYPE(CFP_BEGIN);
+	id |= CFP_MAKE_REMAIN((packet->length + overhead - 1) / 8);
+
+	/* Calculate first frame data bytes */
+	avail = 8 - overhead;
+	bytes = (packet->length <= avail) ? packet->length : avail;
+
+	/* Copy CSP headers and data */
+	uint32_t csp_id_be = csp_hton32(packet->id.ext);
+	uint16_t csp_length_be = csp_hton16(packet->length);
+
+	frames[0].id = id;
+	frames[0].dlc = overhead + bytes;
+	memcpy(frames[0].data, &csp_id_be, sizeof(csp_id_be));
+	memcpy(frames[0].data + sizeof(csp_id_be), &csp_length_be, sizeof(csp_length_be));
+	memcpy(frames[0].data + overhead, packet->data, bytes);
+	tx_count = bytes;
+	count = 1;
+
+	/* Fragment the rest of the packet and hand it to the driver in batches */
+	while (1) {
+		if (count == CAN_TX_BATCH || (count > 0 && tx_count >= packet->length)) {
+			if (can_send_frames(frames, count) != 0) {
+				csp_log_warn("Failed to send CAN frames in csp_tx_can\r\n");
+				csp_if_can.tx_error++;
+				return CSP_ERR_DRIVER;
+			}
+			count = 0;
+		}
+
+		if (tx_count >= packet->length)
+			break;
+
+		bytes = (packet->length - tx_count >= 8) ? 8 : packet->length - tx_count;
+
+		id = 0;
+		id |= CFP_MAKE_SRC(packet->id.src);
+		id |= CFP_MAKE_DST(dest);
+		id |= CFP_MAKE_ID(ident);
+		id |= CFP_MAKE_TYPE(CFP_MORE);
+		id |= CFP_MAKE_REMAIN((packet->length - tx_count - bytes + 7) / 8);
+
+		frames[count].id = id;
+		frames[count].dlc = bytes;
+		memcpy(frames[count].data, packet->data + tx_count, bytes);
+		tx_count += bytes;
+		count++;
+	}
+
+	/* All frames are queued in the driver, the interface owns the packet */
+	csp_buffer_free(packet);
+
+	return CSP_ERR_NONE;
+
+}
+
+#else
+
+static int csp_can_send_packet(csp_packet_t *packet, uint32_t timeout) {
 
 	uint8_t bytes, overhead, avail, dest;
 	uint8_t frame_buf[8];
@@ -642,6 +880,10 @@ int csp_can_tx(csp_iface_t * interface, csp_packet_t *packet, uint32_t timeout)
 	/* Send frame */
 	if (can_send(id, frame_buf, overhead + bytes, NULL) != 0) {
 		csp_log_warn("Failed to send CAN frame in csp_tx_can\r\n");
+		/* The caller keeps the packet on error */
+		buf->packet = NULL;
+		pbuf_free(buf, NULL);
+		csp_bin_sem_post(&buf->tx_sem);
 		return CSP_ERR_DRIVER;
 	}
 
@@ -649,17 +891,136 @@ int csp_can_tx(csp_iface_t * interface, csp_packet_t *packet, uint32_t timeout)
 	if (timeout == 0)
 		return CSP_ERR_NONE;
 
-	/* Blocking mode */
+	/* Blocking mode. The packet buffer owns the packet from here on, so a
+	 * timeout reports the unconfirmed transmission but keeps the packet */
 	if (csp_bin_sem_wait(&buf->tx_sem, timeout) != CSP_SEMAPHORE_OK) {
-		csp_bin_sem_post(&buf->tx_sem);
+		csp_log_warn("Timeout waiting for CAN transmission\r\n");
 		return CSP_ERR_TIMEDOUT;
-	} else {
-		csp_bin_sem_post(&buf->tx_sem);
-		return CSP_ERR_NONE;
 	}
+	csp_bin_sem_post(&buf->tx_sem);
+
+	return CSP_ERR_NONE;
 
 }
 
+#endif
+
+#if (CSP_CAN_TX_QUEUE > 0)
+
+/** TX queue per priority, and one event token per queued packet */
+static csp_queue_handle_t can_tx_fifo[CSP_PRIORITIES];
+static csp_queue_handle_t can_tx_event;
+
+/** TX queue semaphore */
+CSP_DEFINE_CRITICAL(can_tx_sem);
+
+/** TX task handle */
+static csp_thread_handle_t can_tx_task;
+
+/** Time in ms the TX task waits for a packet to leave through the mailboxes */
+#define CSP_CAN_TX_TIMEOUT 1000
+
+CSP_DEFINE_TASK(csp_can_tx_task) {
+
+	int prio, event, ret;
+	csp_packet_t *packet;
+
+	while (1) {
+		if (csp_queue_dequeue(can_tx_event, &event, CSP_MAX_DELAY) != CSP_QUEUE_OK)
+			continue;
+
+		/* Take packets with highest priority first */
+		packet = NULL;
+		CSP_ENTER_CRITICAL(can_tx_sem);
+		for (prio = 0; prio < CSP_PRIORITIES; prio++) {
+			if (csp_queue_dequeue(can_tx_fifo[prio], &packet, 0) == CSP_QUEUE_OK) {
+				csp_if_can.tx_queue--;
+				break;
+			}
+		}
+		CSP_EXIT_CRITICAL(can_tx_sem);
+
+		if (packet == NULL) {
+			csp_log_warn("Spurious wakeup of CAN TX task. No packet found\r\n");
+			continue;
+		}
+
+		/* After a timeout the packet buffer still owns the packet */
+		ret = csp_can_send_packet(packet, CSP_CAN_TX_TIMEOUT);
+		if (ret != CSP_ERR_NONE) {
+			csp_if_can.tx_error++;
+			if (ret != CSP_ERR_TIMEDOUT)
+				csp_buffer_free(packet);
+		}
+	}
+
+	csp_thread_exit();
+
+}
+
+/* Queue mode is fire and forget: the timeout is ignored, the packet is
+ * queued or refused at once, and transmit errors are only counted */
+int csp_can_tx(csp_iface_t * interface, csp_packet_t *packet, uint32_t timeout) {
+
+	static int event = 0;
+	int prio = packet->id.pri;
+
+	/* Queue the packet without blocking, the TX task fragments it */
+	CSP_ENTER_CRITICAL(can_tx_sem);
+	if (interface->tx_queue >= CSP_CAN_TX_QUEUE
+			|| csp_queue_enqueue(can_tx_fifo[prio], &packet, 0) != CSP_QUEUE_OK) {
+		interface->tx_queue_drop++;
+		CSP_EXIT_CRITICAL(can_tx_sem);
+		return CSP_ERR_NOBUFS;
+	}
+	interface->tx_queue++;
+	if (interface->tx_queue > interface->tx_queue_max)
+		interface->tx_queue_max = interface->tx_queue;
+	CSP_EXIT_CRITICAL(can_tx_sem);
+
+	/* There is always room for the token, the queue holds one per packet */
+	csp_queue_enqueue(can_tx_event, &event, 0);
+
+	return CSP_ERR_NONE;
+
+}
+
+static int csp_can_tx_queue_init(void) {
+
+	int prio;
+
+	for (prio = 0; prio < CSP_PRIORITIES; prio++) {
+		can_tx_fifo[prio] = csp_queue_create(CSP_CAN_TX_QUEUE, sizeof(csp_packet_t *));
+		if (can_tx_fifo[prio] == NULL)
+			return CSP_ERR_NOMEM;
+	}
+
+	can_tx_event = csp_queue_create(CSP_CAN_TX_QUEUE, sizeof(int));
+	if (can_tx_event == NULL)
+		return CSP_ERR_NOMEM;
+
+	if (CSP_INIT_CRITICAL(can_tx_sem) != CSP_ERR_NONE)
+		return CSP_ERR_NOMEM;
+
+	csp_if_can.tx_queue_size = CSP_CAN_TX_QUEUE;
+
+	if (csp_thread_create(csp_can_tx_task, (signed char *) "CANTX", 1000/sizeof(int), NULL, 3, &can_tx_task) != 0)
+		return CSP_ERR_NOMEM;
+
+	return CSP_ERR_NONE;
+
+}
+
+#else
+
+int csp_can_tx(csp_iface_t * interface, csp_packet_t *packet, uint32_t timeout) {
+
+	return csp_can_send_packet(packet, timeout);
+
+}
+
+#endif
+
 int csp_can_init(uint8_t mode, struct csp_can_config *conf) {
 
 	int ret;
@@ -699,6 +1060,13 @@ int csp_can_init(uint8_t mode, struct csp_can_config *conf) {
 		return CSP_ERR_NOMEM;
 	}
 
+#if (CSP_CAN_TX_QUEUE > 0)
+	if (csp_can_tx_queue_init() != CSP_ERR_NONE) {
+		csp_log_error("Failed to init CAN TX queue\r\n");
+		return CSP_ERR_NOMEM;
+	}
+#endif
+
 	/* Initialize CAN driver */
 	if (can_init(CFP_MAKE_DST(my_address), mask, csp_tx_callback, csp_rx_callback, conf) != 0) {
 		csp_log_error("Failed to initialize CAN driver\r\n");
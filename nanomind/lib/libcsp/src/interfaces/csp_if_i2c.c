@@ -32,6 +32,12 @@ static int csp_i2c_handle = 0;
 
 int csp_i2c_tx(csp_iface_t * interface, csp_packet_t * packet, uint32_t timeout) {
 
+	/* The frame header is written into the buffer, so it must not be shared */
+	csp_packet_t * shared = packet;
+	packet = csp_buffer_writable(shared);
+	if (packet == NULL)
+		return CSP_ERR_NOMEM;
+
 	/* Cast the CSP packet buffer into an i2c frame */
 	i2c_frame_t * frame = (i2c_frame_t *) packet;
 
@@ -56,8 +62,14 @@ int csp_i2c_tx(csp_iface_t * interface, csp_packet_t * packet, uint32_t timeout)
 	frame->retries = 0;
 
 	/* enqueue the frame */
-	if (i2c_send(csp_i2c_handle, frame, timeout) != E_NO_ERR)
+	if (i2c_send(csp_i2c_handle, frame, timeout) != E_NO_ERR) {
+		if (packet != shared)
+			csp_buffer_free(packet);
 		return CSP_ERR_DRIVER;
+	}
+
+	if (packet != shared)
+		csp_buffer_free(shared);
 
 	return CSP_ERR_NONE;
 
@@ -31,8 +31,6 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include <csp/arch/csp_semaphore.h>
 #include <csp/csp_crc32.h>
 
-#define KISS_MTU				256
-
 #define FEND  					0xC0
 #define FESC  					0xDB
 #define TFEND 					0xDC
@@ -42,8 +40,53 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #define TNC_SET_HARDWARE		0x06
 #define TNC_RETURN				0xFF
 
-static int kiss_lock_init = 0;
-static csp_bin_sem_handle_t kiss_lock;
+/**
+ * Escape a block into the output buffer. Runs between FEND and FESC bytes
+ * are located with memchr and copied in one go.
+ * @param out output buffer with room for twice the input length
+ * @param in input data
+ * @param len length of input data
+ * @return number of bytes written to out
+ */
+static unsigned int csp_kiss_escape(uint8_t * out, const uint8_t * in, unsigned int len) {
+
+	const uint8_t * end = in + len;
+	const uint8_t * next_fend = memchr(in, FEND, len);
+	const uint8_t * next_fesc = memchr(in, FESC, len);
+	uint8_t * start = out;
+
+	while (1) {
+
+		/* Copy the run up to the next special char */
+		const uint8_t * special = end;
+		if (next_fend != NULL && next_fend < special)
+			special = next_fend;
+		if (next_fesc != NULL && next_fesc < special)
+			special = next_fesc;
+
+		memcpy(out, in, special - in);
+		out += special - in;
+		in = special;
+
+		if (in == end)
+			break;
+
+		/* Escape it and look for the next one of the same kind */
+		*out++ = FESC;
+		if (*in == FEND) {
+			*out++ = TFEND;
+			next_fend = memchr(in + 1, FEND, end - in - 1);
+		} else {
+			*out++ = TFESC;
+			next_fesc = memchr(in + 1, FESC, end - in - 1);
+		}
+		in++;
+
+	}
+
+	return out - start;
+
+}
 
 /* Send a CSP packet over the KISS RS232 protocol */
 static int csp_kiss_tx(csp_iface_t * interface, csp_packet_t * packet, uint32_t timeout) {
@@ -51,202 +94,255 @@ static int csp_kiss_tx(csp_iface_t * interface, csp_packet_t * packet, uint32_t
 	if (interface == NULL || interface->driver == NULL)
 		return CSP_ERR_DRIVER;
 
-	/* Add CRC32 checksum */
-	csp_crc32_append(packet);
+	csp_kiss_handle_t * driver = interface->driver;
+
+	if (packet->length > CSP_KISS_MTU)
+		return CSP_ERR_INVAL;
 
-	/* Save the outgoing id in the buffer */
-	packet->id.ext = csp_hton32(packet->id.ext);
-	packet->length += sizeof(packet->id.ext);
+	/* The frame is built in the TX buffer, so the packet is left untouched */
+	uint32_t id_be = csp_hton32(packet->id.ext);
+	uint32_t crc_be = csp_hton32(csp_crc32_memory(packet->data, packet->length));
 
 	/* Lock */
-	csp_bin_sem_wait(&kiss_lock, 1000);
+	if (csp_bin_sem_wait(&driver->tx_lock, 1000) != CSP_SEMAPHORE_OK)
+		return CSP_ERR_BUSY;
+
+	/* Frame and escape header, data and checksum */
+	uint8_t * out = driver->tx_buf;
+	*out++ = FEND;
+	*out++ = TNC_DATA;
+	out += csp_kiss_escape(out, (uint8_t *) &id_be, sizeof(id_be));
+	out += csp_kiss_escape(out, packet->data, packet->length);
+	out += csp_kiss_escape(out, (uint8_t *) &crc_be, sizeof(crc_be));
+	*out++ = FEND;
 
 	/* Transmit data */
-	csp_kiss_handle_t * driver = interface->driver;
-	driver->kiss_putc(FEND);
-	driver->kiss_putc(TNC_DATA);
-	for (unsigned int i = 0; i < packet->length; i++) {
-		if (((unsigned char *) &packet->id.ext)[i] == FEND) {
-			((unsigned char *) &packet->id.ext)[i] = TFEND;
-			driver->kiss_putc(FESC);
-		} else if (((unsigned char *) &packet->id.ext)[i] == FESC) {
-			((unsigned char *) &packet->id.ext)[i] = TFESC;
-			driver->kiss_putc(FESC);
-		}
-		driver->kiss_putc(((unsigned char *) &packet->id.ext)[i]);
+	int len = out - driver->tx_buf;
+	if (driver->kiss_write != NULL) {
+		driver->kiss_write((char *) driver->tx_buf, len);
+	} else {
+		for (int i = 0; i < len; i++)
+			driver->kiss_putc(driver->tx_buf[i]);
 	}
-	driver->kiss_putc(FEND);
+
+	/* Unlock */
+	csp_bin_sem_post(&driver->tx_lock);
 
 	/* Free data */
 	csp_buffer_free(packet);
 
-	/* Unlock */
-	csp_bin_sem_post(&kiss_lock);
-
 	return CSP_ERR_NONE;
 }
 
+/** Largest unescaped frame: CSP header, data and CRC32 */
+#define KISS_RX_MAX(interface)	(CSP_HEADER_LENGTH + (interface)->mtu + sizeof(uint32_t))
+
 /**
- * When a frame is received, decode the kiss-stuff
- * and eventually send it directly to the CSP new packet function.
+ * Hand a complete frame to the router, or count why it was dropped.
+ * The packet buffer is kept for the next frame if the frame is dropped.
  */
-void csp_kiss_rx(csp_iface_t * interface, uint8_t * buf, int len, void * pxTaskWoken) {
+static void csp_kiss_rx_frame(csp_iface_t * interface, csp_kiss_handle_t * driver, unsigned int length, void * pxTaskWoken) {
 
-	/* Driver handle */
-	csp_kiss_handle_t * driver = interface->driver;
+	/* Check for valid length */
+	if (length < CSP_HEADER_LENGTH + sizeof(uint32_t)) {
+		csp_log_warn("KISS short frame skipped, len: %u\r\n", length);
+		interface->rx_error++;
+		return;
+	}
 
-	while (len--) {
+	/* Count received frame */
+	interface->frame++;
 
-		/* Input */
-		unsigned char inputbyte = *buf++;
+	/* The CSP packet length is without the header */
+	driver->rx_packet->length = length - CSP_HEADER_LENGTH;
 
-		/* If packet was too long */
-		if (driver->rx_length > interface->mtu) {
-			csp_log_warn("KISS RX overflow\r\n");
-			interface->rx_error++;
-			driver->rx_mode = KISS_MODE_NOT_STARTED;
-			driver->rx_length = 0;
-		}
+	/* Convert the packet from network to host order */
+	driver->rx_packet->id.ext = csp_ntoh32(driver->rx_packet->id.ext);
+
+	/* Validate CRC */
+	if (csp_crc32_verify(driver->rx_packet) != CSP_ERR_NONE) {
+		csp_log_warn("KISS invalid crc frame skipped, len: %u\r\n", driver->rx_packet->length);
+		interface->rx_error++;
+		return;
+	}
 
-		switch (driver->rx_mode) {
+	/* Send back into CSP */
+	csp_new_packet(driver->rx_packet, interface, pxTaskWoken);
+	driver->rx_packet = NULL;
 
-		case KISS_MODE_NOT_STARTED:
+}
+
+void csp_kiss_rx_buf(csp_iface_t * interface, const uint8_t * buf, int len, void * pxTaskWoken) {
+
+	/* Work on a local copy of the decoder state */
+	csp_kiss_handle_t * driver = interface->driver;
+	const uint8_t * end = buf + len;
+	const unsigned int max = KISS_RX_MAX(interface);
+	kiss_mode_e mode = driver->rx_mode;
+	unsigned int length = driver->rx_length;
+	unsigned int first = driver->rx_first;
+	uint8_t * rx = (driver->rx_packet != NULL) ? (uint8_t *) &driver->rx_packet->id.ext : NULL;
+
+	while (buf < end) {
+
+		switch (mode) {
+
+		case KISS_MODE_NOT_STARTED: {
 
 			/* Send normal chars back to usart driver */
-			if (inputbyte != FEND) {
-				if (driver->kiss_discard != NULL)
-					driver->kiss_discard(inputbyte, pxTaskWoken);
+			const uint8_t * fend = memchr(buf, FEND, end - buf);
+			if (fend == NULL)
+				fend = end;
+			if (driver->kiss_discard != NULL)
+				while (buf < fend)
+					driver->kiss_discard(*buf++, pxTaskWoken);
+			buf = fend;
+			if (buf == end)
 				break;
-			}
+			buf++;
 
-			/* Try to allocate new buffer */
+			/* Try to allocate new buffer, with room for the CRC32 */
 			if (driver->rx_packet == NULL) {
 				if (pxTaskWoken == NULL) {
-					driver->rx_packet = csp_buffer_get(interface->mtu);
+					driver->rx_packet = csp_buffer_get(interface->mtu + sizeof(uint32_t));
 				} else {
-					driver->rx_packet = csp_buffer_get_isr(interface->mtu);
+					driver->rx_packet = csp_buffer_get_isr(interface->mtu + sizeof(uint32_t));
 				}
 			}
 
 			/* If no more memory, skip frame */
 			if (driver->rx_packet == NULL) {
-				driver->rx_mode = KISS_MODE_SKIP_FRAME;
+				mode = KISS_MODE_SKIP_FRAME;
 				break;
 			}
 
 			/* Start transfer */
-			driver->rx_length = 0;
-			driver->rx_mode = KISS_MODE_STARTED;
-			driver->rx_first = 1;
+			rx = (uint8_t *) &driver->rx_packet->id.ext;
+			length = 0;
+			mode = KISS_MODE_STARTED;
+			first = 1;
 			break;
+		}
 
-		case KISS_MODE_STARTED:
+		case KISS_MODE_STARTED: {
 
-			/* Escape char */
-			if (inputbyte == FESC) {
-				driver->rx_mode = KISS_MODE_ESCAPED;
+			/* Skip the first char after FEND which is TNC_DATA (0x00) */
+			if (first && *buf != FEND && *buf != FESC) {
+				first = 0;
+				buf++;
 				break;
 			}
 
-			/* End Char */
-			if (inputbyte == FEND) {
-
-				/* Accept message */
-				if (driver->rx_length > 0) {
-
-					/* Check for valid length */
-					if (driver->rx_length < CSP_HEADER_LENGTH + sizeof(uint32_t)) {
-						csp_log_warn("KISS short frame skipped, len: %u\r\n", driver->rx_length);
-						interface->rx_error++;
-						driver->rx_mode = KISS_MODE_NOT_STARTED;
-						break;
-					}
-
-					/* Count received frame */
-					interface->frame++;
-
-					/* The CSP packet length is without the header */
-					driver->rx_packet->length = driver->rx_length - CSP_HEADER_LENGTH;
-
-					/* Convert the packet from network to host order */
-					driver->rx_packet->id.ext = csp_ntoh32(driver->rx_packet->id.ext);
-
-					/* Validate CRC */
-					if (csp_crc32_verify(driver->rx_packet) != CSP_ERR_NONE) {
-						csp_log_warn("KISS invalid crc frame skipped, len: %u\r\n", driver->rx_packet->length);
-						interface->rx_error++;
-						driver->rx_mode = KISS_MODE_NOT_STARTED;
-						break;
-					}
-
-					/* Send back into CSP, notice calling from task so last argument must be NULL! */
-					csp_new_packet(driver->rx_packet, interface, pxTaskWoken);
-					driver->rx_packet = NULL;
-					driver->rx_mode = KISS_MODE_NOT_STARTED;
+			/* Copy the run of plain data up to the next FEND or FESC */
+			const uint8_t * stop = end;
+			const uint8_t * fend = memchr(buf, FEND, end - buf);
+			if (fend != NULL)
+				stop = fend;
+			const uint8_t * fesc = memchr(buf, FESC, stop - buf);
+			if (fesc != NULL)
+				stop = fesc;
+
+			if (stop > buf) {
+				if (length + (stop - buf) > max) {
+					csp_log_warn("KISS RX overflow\r\n");
+					interface->rx_error++;
+					mode = KISS_MODE_SKIP_FRAME;
 					break;
-
 				}
+				memcpy(rx + length, buf, stop - buf);
+				length += stop - buf;
+				first = 0;
+				buf = stop;
+			}
 
-				/* Break after the end char */
+			if (buf == end)
 				break;
-			}
 
-			/* Skip the first char after FEND which is TNC_DATA (0x00) */
-			if (driver->rx_first) {
-				driver->rx_first = 0;
+			/* Escape char */
+			if (*buf++ == FESC) {
+				mode = KISS_MODE_ESCAPED;
 				break;
 			}
 
-			/* Valid data char */
-			((char *) &driver->rx_packet->id.ext)[driver->rx_length++] = inputbyte;
-
+			/* End char, accept message. Empty frames are just repeated FENDs */
+			if (length > 0) {
+				csp_kiss_rx_frame(interface, driver, length, pxTaskWoken);
+				rx = NULL;
+				mode = KISS_MODE_NOT_STARTED;
+			}
 			break;
+		}
+
+		case KISS_MODE_ESCAPED: {
+
+			uint8_t inputbyte = *buf++;
 
-		case KISS_MODE_ESCAPED:
+			if (length + 1 > max) {
+				csp_log_warn("KISS RX overflow\r\n");
+				interface->rx_error++;
+				mode = KISS_MODE_SKIP_FRAME;
+				break;
+			}
 
 			/* Escaped escape char */
 			if (inputbyte == TFESC)
-				((char *) &driver->rx_packet->id.ext)[driver->rx_length++] = FESC;
+				rx[length++] = FESC;
 
 			/* Escaped fend char */
 			if (inputbyte == TFEND)
-				((char *) &driver->rx_packet->id.ext)[driver->rx_length++] = FEND;
+				rx[length++] = FEND;
 
 			/* Go back to started mode */
-			driver->rx_mode = KISS_MODE_STARTED;
+			first = 0;
+			mode = KISS_MODE_STARTED;
 			break;
+		}
 
-		case KISS_MODE_SKIP_FRAME:
+		case KISS_MODE_SKIP_FRAME: {
 
 			/* Just wait for end char */
-			if (inputbyte == FEND)
-				driver->rx_mode = KISS_MODE_NOT_STARTED;
-
+			const uint8_t * fend = memchr(buf, FEND, end - buf);
+			if (fend == NULL) {
+				buf = end;
+			} else {
+				buf = fend + 1;
+				mode = KISS_MODE_NOT_STARTED;
+			}
 			break;
+		}
 
 		}
 
 	}
 
+	/* Save the decoder state for the next buffer */
+	driver->rx_mode = mode;
+	driver->rx_length = length;
+	driver->rx_first = first;
+
+}
+
+void csp_kiss_rx(csp_iface_t * interface, uint8_t * buf, int len, void * pxTaskWoken) {
+
+	csp_kiss_rx_buf(interface, buf, len, pxTaskWoken);
+
 }
 
 void csp_kiss_init(csp_iface_t * csp_iface, csp_kiss_handle_t * csp_kiss_handle, csp_kiss_putc_f kiss_putc_f, csp_kiss_discard_f kiss_discard_f, const char * name) {
 
-	/* Init lock only once */
-	if (kiss_lock_init == 0) {
-		csp_bin_sem_create(&kiss_lock);
-		kiss_lock_init = 1;
-	}
+	/* Each interface has its own TX lock and buffer */
+	csp_bin_sem_create(&csp_kiss_handle->tx_lock);
 
 	/* Register device handle as member of interface */
 	csp_iface->driver = csp_kiss_handle;
 	csp_kiss_handle->kiss_discard = kiss_discard_f;
 	csp_kiss_handle->kiss_putc = kiss_putc_f;
+	csp_kiss_handle->kiss_write = NULL;
 	csp_kiss_handle->rx_packet = NULL;
 	csp_kiss_handle->rx_mode = KISS_MODE_NOT_STARTED;
 
 	/* Setop other mandatories */
-	csp_iface->mtu = KISS_MTU;
+	csp_iface->mtu = CSP_KISS_MTU;
 	csp_iface->nexthop = csp_kiss_tx;
 	csp_iface->name = name;
 
@@ -254,3 +350,9 @@ void csp_kiss_init(csp_iface_t * csp_iface, csp_kiss_handle_t * csp_kiss_handle,
 	csp_route_add_if(csp_iface);
 
 }
+
+void csp_kiss_set_write(csp_kiss_handle_t * csp_kiss_handle, csp_kiss_write_f kiss_write_f) {
+
+	csp_kiss_handle->kiss_write = kiss_write_f;
+
+}
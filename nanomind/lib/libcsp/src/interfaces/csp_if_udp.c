@@ -0,0 +1,499 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* UDP/IP interface */
+
+/* sendmmsg and recvmmsg */
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+
+#include <csp/csp.h>
+#include <csp/csp_endian.h>
+#include <csp/csp_platform.h>
+#include <csp/csp_interface.h>
+#include <csp/interfaces/csp_if_udp.h>
+#include <csp/arch/csp_queue.h>
+#include <csp/arch/csp_semaphore.h>
+#include <csp/arch/csp_thread.h>
+
+/** Number of datagrams per sendmmsg/recvmmsg call */
+#define UDP_BATCH 32
+
+/** Number of packets in the TX queue */
+#define UDP_TX_QUEUE_LENGTH 256
+
+/** How long to leave datagrams in the socket when out of CSP buffers [ms] */
+#define UDP_RX_RETRY_MS 10
+
+/** Socket, TX wakeup event and epoll instance */
+static int udp_socket = -1;
+static int udp_event = -1;
+static int udp_epoll = -1;
+
+/** TX queue, and set while a wakeup is pending on udp_event */
+static csp_queue_handle_t udp_tx_queue;
+static volatile int udp_tx_signalled;
+
+/** UDP endpoint per CSP host, sin_port 0 marks no mapping */
+static struct sockaddr_in udp_peers[CSP_ROUTE_COUNT];
+
+/** Peer table semaphore */
+CSP_DEFINE_CRITICAL(udp_peer_sem);
+
+/** UDP task handle */
+static csp_thread_handle_t udp_task;
+
+/** A batch of outgoing datagrams */
+typedef struct {
+	struct mmsghdr msgs[UDP_BATCH];
+	struct iovec iov[UDP_BATCH][2];
+	struct sockaddr_in addr[UDP_BATCH];
+	uint32_t header[UDP_BATCH];
+	csp_packet_t *packet[UDP_BATCH];	/**< Packet to free once the datagram is sent, or NULL */
+	int count;
+} udp_tx_batch_t;
+
+static udp_tx_batch_t udp_tx;
+
+/** Receive buffers, refilled after each recvmmsg */
+static csp_packet_t *udp_rx_packet[UDP_BATCH];
+
+/** Set while the socket is out of the epoll set for lack of buffers */
+static int udp_rx_paused;
+
+static int csp_udp_same_endpoint(const struct sockaddr_in *a, const struct sockaddr_in *b) {
+
+	return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+
+}
+
+/**
+ * Add a datagram to the TX batch
+ * @param packet packet to send
+ * @param addr destination
+ * @param owner packet to free after sending, or NULL if another datagram frees it
+ */
+static void csp_udp_tx_add(csp_packet_t *packet, struct sockaddr_in *addr, csp_packet_t *owner) {
+
+	udp_tx_batch_t *b = &udp_tx;
+	int i = b->count++;
+
+	b->header[i] = csp_hton32(packet->id.ext);
+	b->addr[i] = *addr;
+	b->packet[i] = owner;
+
+	b->iov[i][0].iov_base = &b->header[i];
+	b->iov[i][0].iov_len = sizeof(b->header[i]);
+	b->iov[i][1].iov_base = packet->data;
+	b->iov[i][1].iov_len = packet->length;
+
+	memset(&b->msgs[i], 0, sizeof(b->msgs[i]));
+	b->msgs[i].msg_hdr.msg_name = &b->addr[i];
+	b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addr[i]);
+	b->msgs[i].msg_hdr.msg_iov = b->iov[i];
+	b->msgs[i].msg_hdr.msg_iovlen = 2;
+
+}
+
+/** Send the TX batch and free its packets */
+static void csp_udp_tx_flush(void) {
+
+	udp_tx_batch_t *b = &udp_tx;
+	int i, sent = 0;
+
+	while (sent < b->count) {
+		int ret = sendmmsg(udp_socket, &b->msgs[sent], b->count - sent, 0);
+		if (ret > 0) {
+			sent += ret;
+			continue;
+		}
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		/* Skip the datagram that failed and go on with the rest */
+		csp_log_warn("UDP sendmmsg: %s\r\n", strerror(errno));
+		csp_if_udp.tx_error++;
+		sent++;
+	}
+
+	for (i = 0; i < b->count; i++)
+		if (b->packet[i] != NULL)
+			csp_buffer_free(b->packet[i]);
+
+	b->count = 0;
+
+}
+
+/** Send everything in the TX queue */
+static void csp_udp_tx_drain(void) {
+
+	csp_packet_t *packets[UDP_BATCH];
+	struct sockaddr_in addr;
+	int i, n, node;
+
+	while ((n = csp_queue_dequeue_batch(udp_tx_queue, packets, sizeof(csp_packet_t *), UDP_BATCH, 0)) > 0) {
+
+		for (i = 0; i < n; i++) {
+			csp_packet_t *packet = packets[i];
+
+			if (packet->id.dst == CSP_BROADCAST_ADDR) {
+
+				/* Copy to every mapped endpoint once, also when several hosts or
+				 * the default route share it. The last datagram frees the packet */
+				int targets[CSP_ROUTE_COUNT], count = 0, j;
+				CSP_ENTER_CRITICAL(udp_peer_sem);
+				for (node = 0; node < CSP_ROUTE_COUNT; node++) {
+					if (udp_peers[node].sin_port == 0)
+						continue;
+					for (j = 0; j < count; j++)
+						if (csp_udp_same_endpoint(&udp_peers[targets[j]], &udp_peers[node]))
+							break;
+					if (j == count)
+						targets[count++] = node;
+				}
+				for (j = 0; j < count; j++) {
+					if (udp_tx.count == UDP_BATCH)
+						csp_udp_tx_flush();
+					csp_udp_tx_add(packet, &udp_peers[targets[j]], (j == count - 1) ? packet : NULL);
+				}
+				CSP_EXIT_CRITICAL(udp_peer_sem);
+
+				if (count == 0)
+					csp_buffer_free(packet);
+				continue;
+
+			}
+
+			/* Look up the endpoint, fall back to the default route */
+			CSP_ENTER_CRITICAL(udp_peer_sem);
+			node = (udp_peers[packet->id.dst].sin_port != 0) ? packet->id.dst : CSP_DEFAULT_ROUTE;
+			addr = udp_peers[node];
+			CSP_EXIT_CRITICAL(udp_peer_sem);
+
+			if (addr.sin_port == 0) {
+				csp_log_warn("No UDP endpoint for host %u\r\n", packet->id.dst);
+				csp_if_udp.tx_error++;
+				csp_buffer_free(packet);
+				continue;
+			}
+
+			if (udp_tx.count == UDP_BATCH)
+				csp_udp_tx_flush();
+			csp_udp_tx_add(packet, &addr, packet);
+		}
+
+		csp_udp_tx_flush();
+		csp_if_udp.tx_queue = csp_queue_size(udp_tx_queue);
+
+	}
+
+}
+
+/**
+ * Stop or resume waiting for datagrams. While out of buffers the datagrams
+ * stay in the socket, and the level triggered socket would otherwise wake
+ * the task again at once
+ */
+static void csp_udp_rx_pause(int pause) {
+
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = pause ? 0 : EPOLLIN;
+	ev.data.fd = udp_socket;
+	if (epoll_ctl(udp_epoll, EPOLL_CTL_MOD, udp_socket, &ev) < 0)
+		csp_log_warn("UDP epoll_ctl: %s\r\n", strerror(errno));
+	udp_rx_paused = pause;
+
+}
+
+/** Receive everything waiting on the socket */
+static void csp_udp_rx_drain(void) {
+
+	struct mmsghdr msgs[UDP_BATCH];
+	struct iovec iov[UDP_BATCH];
+	uint16_t mtu = csp_if_udp.mtu;
+	int i, n, ret;
+
+	while (1) {
+
+		/* Refill receive buffers */
+		for (n = 0; n < UDP_BATCH; n++) {
+			if (udp_rx_packet[n] == NULL)
+				udp_rx_packet[n] = csp_buffer_get(mtu);
+			if (udp_rx_packet[n] == NULL)
+				break;
+		}
+
+		/* Out of buffers, try again in a while */
+		if (n == 0) {
+			if (!udp_rx_paused)
+				csp_udp_rx_pause(1);
+			return;
+		}
+
+		memset(msgs, 0, sizeof(msgs[0]) * n);
+		for (i = 0; i < n; i++) {
+			/* The header is received in front of the data */
+			iov[i].iov_base = &udp_rx_packet[i]->id.ext;
+			iov[i].iov_len = sizeof(uint32_t) + mtu;
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		ret = recvmmsg(udp_socket, msgs, n, MSG_DONTWAIT, NULL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				csp_log_warn("UDP recvmmsg: %s\r\n", strerror(errno));
+			return;
+		}
+
+		for (i = 0; i < ret; i++) {
+			csp_packet_t *packet = udp_rx_packet[i];
+
+			if ((msgs[i].msg_hdr.msg_flags & MSG_TRUNC) || msgs[i].msg_len < sizeof(uint32_t)) {
+				csp_if_udp.rx_error++;
+				continue;
+			}
+
+			packet->length = msgs[i].msg_len - sizeof(uint32_t);
+			packet->id.ext = csp_ntoh32(packet->id.ext);
+			udp_rx_packet[i] = NULL;
+			csp_new_packet(packet, &csp_if_udp, NULL);
+		}
+
+		/* The socket is drained */
+		if (ret < n)
+			return;
+
+	}
+
+}
+
+CSP_DEFINE_TASK(csp_udp_rx_task) {
+
+	struct epoll_event events[2];
+	int i, n;
+
+	while (1) {
+		n = epoll_wait(udp_epoll, events, 2, udp_rx_paused ? UDP_RX_RETRY_MS : -1);
+		if (n < 0) {
+			if (errno != EINTR)
+				csp_log_error("UDP epoll_wait: %s\r\n", strerror(errno));
+			continue;
+		}
+
+		/* Buffers may be free again */
+		if (udp_rx_paused) {
+			csp_udp_rx_pause(0);
+			csp_udp_rx_drain();
+		}
+
+		for (i = 0; i < n; i++) {
+			if (events[i].data.fd == udp_event) {
+				/* Clear the wakeup before draining, so later packets signal again */
+				uint64_t count;
+				if (read(udp_event, &count, sizeof(count)) < 0 && errno != EAGAIN)
+					csp_log_warn("UDP eventfd: %s\r\n", strerror(errno));
+				__sync_lock_release(&udp_tx_signalled);
+				csp_udp_tx_drain();
+			} else {
+				csp_udp_rx_drain();
+			}
+		}
+	}
+
+	csp_thread_exit();
+
+}
+
+/**
+ * Queue a packet for the UDP task. Never blocks, so the timeout is unused.
+ */
+static int csp_udp_tx(csp_iface_t * interface, csp_packet_t * packet, uint32_t timeout) {
+
+	if (csp_queue_enqueue(udp_tx_queue, &packet, 0) != CSP_QUEUE_OK) {
+		interface->tx_queue_drop++;
+		return CSP_ERR_NOBUFS;
+	}
+
+	int queued = csp_queue_size(udp_tx_queue);
+	interface->tx_queue = queued;
+	if (queued > interface->tx_queue_max)
+		interface->tx_queue_max = queued;
+
+	/* Only the first packet after a drain needs to wake the task */
+	if (__sync_lock_test_and_set(&udp_tx_signalled, 1) == 0) {
+		uint64_t one = 1;
+		if (write(udp_event, &one, sizeof(one)) != sizeof(one))
+			csp_log_warn("UDP eventfd: %s\r\n", strerror(errno));
+	}
+
+	return CSP_ERR_NONE;
+
+}
+
+static int csp_udp_resolve(const char * host, uint16_t port, struct sockaddr_in * addr) {
+
+	struct addrinfo hints, *res;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+
+	if (getaddrinfo(host, NULL, &hints, &res) != 0 || res == NULL)
+		return CSP_ERR_INVAL;
+
+	memcpy(addr, res->ai_addr, sizeof(*addr));
+	addr->sin_port = htons(port);
+	freeaddrinfo(res);
+
+	return CSP_ERR_NONE;
+
+}
+
+int csp_udp_peer_set(uint8_t node, const char * host, uint16_t port) {
+
+	struct sockaddr_in addr;
+
+	if (node >= CSP_ROUTE_COUNT)
+		return CSP_ERR_INVAL;
+
+	memset(&addr, 0, sizeof(addr));
+	if (host != NULL) {
+		if (port == 0 || csp_udp_resolve(host, port, &addr) != CSP_ERR_NONE) {
+			csp_log_error("Failed to resolve UDP endpoint %s\r\n", host);
+			return CSP_ERR_INVAL;
+		}
+	}
+
+	CSP_ENTER_CRITICAL(udp_peer_sem);
+	udp_peers[node] = addr;
+	CSP_EXIT_CRITICAL(udp_peer_sem);
+
+	return CSP_ERR_NONE;
+
+}
+
+int csp_udp_init(const char * address, uint16_t port) {
+
+	struct sockaddr_in addr;
+	struct epoll_event ev;
+	int ret = CSP_ERR_DRIVER;
+
+	if (CSP_INIT_CRITICAL(udp_peer_sem) != CSP_ERR_NONE) {
+		csp_log_error("No more memory for UDP peer semaphore\r\n");
+		return CSP_ERR_NOMEM;
+	}
+
+	/* Bind socket */
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (address != NULL && csp_udp_resolve(address, port, &addr) != CSP_ERR_NONE) {
+		csp_log_error("Failed to resolve UDP address %s\r\n", address);
+		return CSP_ERR_INVAL;
+	}
+
+	udp_tx_queue = csp_queue_create(UDP_TX_QUEUE_LENGTH, sizeof(csp_packet_t *));
+	if (udp_tx_queue == NULL) {
+		csp_log_error("Failed to create UDP TX queue\r\n");
+		return CSP_ERR_NOMEM;
+	}
+
+	udp_socket = socket(AF_INET, SOCK_DGRAM, 0);
+	if (udp_socket < 0) {
+		csp_log_error("UDP socket: %s\r\n", strerror(errno));
+		goto fail;
+	}
+
+	if (bind(udp_socket, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		csp_log_error("UDP bind: %s\r\n", strerror(errno));
+		goto fail;
+	}
+
+	/* Wait on the socket and the TX wakeup in one epoll set */
+	udp_event = eventfd(0, EFD_NONBLOCK);
+	udp_epoll = epoll_create(2);
+	if (udp_event < 0 || udp_epoll < 0) {
+		csp_log_error("UDP epoll: %s\r\n", strerror(errno));
+		goto fail;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = udp_socket;
+	if (epoll_ctl(udp_epoll, EPOLL_CTL_ADD, udp_socket, &ev) < 0)
+		goto fail_epoll;
+	ev.data.fd = udp_event;
+	if (epoll_ctl(udp_epoll, EPOLL_CTL_ADD, udp_event, &ev) < 0)
+		goto fail_epoll;
+
+	/* The largest CSP buffer limits the datagram size */
+	csp_if_udp.mtu = csp_buffer_size() - CSP_BUFFER_PACKET_OVERHEAD;
+	csp_if_udp.tx_queue_size = UDP_TX_QUEUE_LENGTH;
+
+	if (csp_thread_create(csp_udp_rx_task, (signed char *) "UDP", 1000, NULL, 3, &udp_task) != 0) {
+		csp_log_error("Failed to start UDP task\r\n");
+		ret = CSP_ERR_NOMEM;
+		goto fail;
+	}
+
+	/* Register interface */
+	csp_route_add_if(&csp_if_udp);
+
+	return CSP_ERR_NONE;
+
+fail_epoll:
+	csp_log_error("UDP epoll_ctl: %s\r\n", strerror(errno));
+fail:
+	if (udp_epoll >= 0)
+		close(udp_epoll);
+	if (udp_event >= 0)
+		close(udp_event);
+	if (udp_socket >= 0)
+		close(udp_socket);
+	udp_epoll = udp_event = udp_socket = -1;
+	csp_queue_remove(udp_tx_queue);
+	udp_tx_queue = NULL;
+	return ret;
+
+}
+
+/** Interface definition */
+csp_iface_t csp_if_udp = {
+	.name = "UDP",
+	.nexthop = csp_udp_tx,
+};
@@ -49,6 +49,19 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #define RDP_EAK 0x04
 #define RDP_RST	0x08
 
+/* Extensions advertised in the seventh SYN option word and echoed in the SYN/ACK.
+ * Peers that do not send the word only get the original RDP behaviour. */
+#define RDP_FEAT_EACK_BITMAP	0x00000001
+#define RDP_FEAT_RCV_WINDOW		0x00000002
+#define RDP_FEATURES			(RDP_FEAT_EACK_BITMAP | RDP_FEAT_RCV_WINDOW)
+
+/* Smallest variation allowed for in the RTO, covers timer and processing
+ * delays that a steady round trip time does not show (G in RFC 6298) */
+#define RDP_RTO_GRANULARITY		10
+
+/* Interval between attempts to deliver segments held for a full RX queue */
+#define RDP_RX_RETRY_MS			10
+
 static uint32_t csp_rdp_window_size = 4;
 static uint32_t csp_rdp_conn_timeout = 10000;
 static uint32_t csp_rdp_packet_timeout = 1000;
@@ -74,7 +87,8 @@ typedef struct __attribute__((__packed__)) {
 		uint8_t flags;
 		struct __attribute__((__packed__)) {
 #if defined(CSP_BIG_ENDIAN) && !defined(CSP_LITTLE_ENDIAN)
-			unsigned int res : 4;
+			unsigned int res : 3;
+			unsigned int wnd : 1;
 			unsigned int syn : 1;
 			unsigned int ack : 1;
 			unsigned int eak : 1;
@@ -84,7 +98,8 @@ typedef struct __attribute__((__packed__)) {
 			unsigned int eak : 1;
 			unsigned int ack : 1;
 			unsigned int syn : 1;
-			unsigned int res : 4;
+			unsigned int wnd : 1;
+			unsigned int res : 3;
 #else
   #error "Must define one of CSP_BIG_ENDIAN or CSP_LITTLE_ENDIAN in csp_platform.h"
 #endif
@@ -149,6 +164,194 @@ static inline int csp_rdp_time_after(uint32_t time, uint32_t cmp) {
 	return csp_rdp_time_before(cmp, time);
 }
 
+/**
+ * RETRANSMISSION TIMEOUT
+ * The RTO is estimated from round trip samples as described by Jacobson/Karels
+ * (RFC 6298). Only one segment is timed at a time, and timing is abandoned when
+ * anything is retransmitted (Karn's rule). The SYN is not timed, a short
+ * control segment says little about the round trip of data queued on a slow
+ * link, so the RTO starts at packet_timeout. Each retransmission timeout doubles
+ * the RTO until a new sample arrives. The negotiated packet_timeout bounds
+ * the estimate, so the worst case is the fixed timeout used before. With
+ * delayed ACKs ack_timeout is added to the estimate.
+ */
+static uint32_t csp_rdp_rto_estimate(csp_conn_t * conn) {
+
+	/* Round trip plus its variation, at least RDP_RTO_GRANULARITY */
+	uint32_t var = 4 * conn->rdp.rttvar;
+	if (var < RDP_RTO_GRANULARITY)
+		var = RDP_RTO_GRANULARITY;
+	return conn->rdp.srtt + var;
+
+}
+
+static void csp_rdp_rto_set(csp_conn_t * conn, uint32_t rto) {
+
+	/* A delayed ACK must never look like a lost segment. The receiver may
+	 * hold it for ack_timeout after the segment arrived, which the timed
+	 * segments, often ACKed at once, do not show. */
+	uint32_t rto_min = conn->rdp.delayed_acks ? csp_rdp_rto_estimate(conn) + conn->rdp.ack_timeout : 1;
+
+	if (rto < rto_min)
+		rto = rto_min;
+	if (rto > conn->rdp.packet_timeout)
+		rto = conn->rdp.packet_timeout;
+	conn->rdp.rto = rto;
+
+}
+
+static void csp_rdp_rto_init(csp_conn_t * conn) {
+
+	conn->rdp.srtt = 0;
+	conn->rdp.rttvar = 0;
+	conn->rdp.rtt_active = 0;
+	conn->rdp.una_timestamp = csp_get_ms();
+	csp_rdp_rto_set(conn, conn->rdp.packet_timeout);
+
+}
+
+/* Start timing seq_nr, unless another segment is already being timed */
+static inline void csp_rdp_rtt_start(csp_conn_t * conn, uint16_t seq_nr) {
+
+	if (conn->rdp.rtt_active)
+		return;
+	conn->rdp.rtt_seq = seq_nr;
+	conn->rdp.rtt_timestamp = csp_get_ms();
+	conn->rdp.rtt_active = 1;
+
+}
+
+/* Take a round trip sample if ack_nr covers the timed segment */
+static void csp_rdp_rtt_ack(csp_conn_t * conn, uint16_t ack_nr) {
+
+	if (!conn->rdp.rtt_active || csp_rdp_seq_before(ack_nr, conn->rdp.rtt_seq))
+		return;
+
+	uint32_t rtt = csp_get_ms() - conn->rdp.rtt_timestamp;
+	conn->rdp.rtt_active = 0;
+
+	if (conn->rdp.srtt == 0) {
+		conn->rdp.srtt = rtt ? rtt : 1;
+		conn->rdp.rttvar = rtt / 2;
+	} else {
+		uint32_t delta = (rtt > conn->rdp.srtt) ? rtt - conn->rdp.srtt : conn->rdp.srtt - rtt;
+		conn->rdp.rttvar = (3 * conn->rdp.rttvar + delta) / 4;
+		conn->rdp.srtt = (7 * conn->rdp.srtt + rtt) / 8;
+		if (conn->rdp.srtt == 0)
+			conn->rdp.srtt = 1;
+	}
+
+	uint32_t rto = csp_rdp_rto_estimate(conn);
+#ifdef CSP_USE_RDP_CC
+	/* Slow start doubles the data in flight every round trip, and with it
+	 * the time the next segments may wait in the queue of a slow link */
+	if (conn->rdp.cwnd < conn->rdp.ssthresh && rto < 2 * rtt)
+		rto = 2 * rtt;
+#endif
+	csp_rdp_rto_set(conn, rto);
+	csp_log_protocol("RDP: RTT %"PRIu32", srtt %"PRIu32", rttvar %"PRIu32", rto %"PRIu32"\r\n",
+			rtt, conn->rdp.srtt, conn->rdp.rttvar, conn->rdp.rto);
+
+}
+
+/**
+ * WINDOWS
+ * The sender keeps at most the smallest of the negotiated window, the window
+ * advertised by the receiver and, with congestion control, the congestion
+ * window in flight. The receiver advertises the free slots of its connection
+ * RX queues in ACK-only packets flagged with wnd, if the peer supports it.
+ */
+static uint16_t csp_rdp_rcv_window(csp_conn_t * conn) {
+
+	int prio, free, window = CSP_RX_QUEUE_LENGTH;
+	for (prio = 0; prio < CSP_RX_QUEUES; prio++) {
+		free = CSP_RX_QUEUE_LENGTH - csp_queue_size(conn->rx_queue[prio]);
+		if (free < window)
+			window = free;
+	}
+
+	return (window > 0) ? window : 0;
+
+}
+
+static uint32_t csp_rdp_snd_window(csp_conn_t * conn) {
+
+	uint32_t window = conn->rdp.window_size;
+
+	/* The advertised window counts from the ACK that carried it */
+	if (conn->rdp.features & RDP_FEAT_RCV_WINDOW) {
+		uint16_t rcv = csp_rdp_seq_after(conn->rdp.snd_wnd_end, conn->rdp.snd_una) ?
+				conn->rdp.snd_wnd_end - conn->rdp.snd_una : 0;
+		if (rcv < window)
+			window = rcv;
+	}
+#ifdef CSP_USE_RDP_CC
+	if (conn->rdp.cwnd < window)
+		window = conn->rdp.cwnd;
+#endif
+
+	/* Always allow one segment, it probes a closed receive window */
+	return window ? window : 1;
+
+}
+
+#ifdef CSP_USE_RDP_CC
+/* A receiver with delayed ACKs only answers immediately after ack_delay_count + 1
+ * segments, a smaller window would stall on the ACK timer */
+static uint16_t csp_rdp_cc_min(csp_conn_t * conn) {
+
+	uint32_t cwnd_min = conn->rdp.delayed_acks ? conn->rdp.ack_delay_count + 1 : 2;
+	return (cwnd_min < conn->rdp.window_size) ? cwnd_min : conn->rdp.window_size;
+
+}
+
+static void csp_rdp_cc_init(csp_conn_t * conn) {
+
+	conn->rdp.cwnd = csp_rdp_cc_min(conn);
+	conn->rdp.ssthresh = conn->rdp.window_size;
+	conn->rdp.cwnd_acc = 0;
+	conn->rdp.cc_recover = conn->rdp.snd_nxt;
+
+}
+
+/* Slow start below ssthresh, one segment per window above it */
+static void csp_rdp_cc_ack(csp_conn_t * conn, uint16_t acked) {
+
+	while (acked--) {
+		if (conn->rdp.cwnd >= conn->rdp.window_size)
+			break;
+		if (conn->rdp.cwnd < conn->rdp.ssthresh) {
+			conn->rdp.cwnd++;
+		} else if (++conn->rdp.cwnd_acc >= conn->rdp.cwnd) {
+			conn->rdp.cwnd_acc = 0;
+			conn->rdp.cwnd++;
+		}
+	}
+
+}
+
+/* Halve the window on loss, at most once per window of data. A timeout restarts slow start. */
+static void csp_rdp_cc_loss(csp_conn_t * conn, int timeout) {
+
+	if (!timeout && csp_rdp_seq_before(conn->rdp.snd_una, conn->rdp.cc_recover))
+		return;
+
+	uint16_t flight = conn->rdp.snd_nxt - conn->rdp.snd_una;
+	uint16_t cwnd_min = csp_rdp_cc_min(conn);
+	conn->rdp.ssthresh = (flight / 2 > cwnd_min) ? flight / 2 : cwnd_min;
+	conn->rdp.cwnd = timeout ? cwnd_min : conn->rdp.ssthresh;
+	conn->rdp.cwnd_acc = 0;
+	conn->rdp.cc_recover = conn->rdp.snd_nxt;
+	csp_log_protocol("RDP: %s, cwnd %"PRIu16", ssthresh %"PRIu16"\r\n",
+			timeout ? "Timeout" : "EACK loss", conn->rdp.cwnd, conn->rdp.ssthresh);
+
+}
+#else
+static inline void csp_rdp_cc_init(csp_conn_t * conn) {}
+static inline void csp_rdp_cc_ack(csp_conn_t * conn, uint16_t acked) {}
+static inline void csp_rdp_cc_loss(csp_conn_t * conn, int timeout) {}
+#endif
+
 /**
  * CONTROL MESSAGES
  * The following function is used to send empty messages,
@@ -166,8 +369,17 @@ static int csp_rdp_send_cmp(csp_conn_t * conn, csp_packet_t * packet, int flags,
 		packet->length = 0;
 	}
 
+	/* Advertise the receive window in plain ACKs */
+	int wnd = (flags == RDP_ACK) && (conn->rdp.features & RDP_FEAT_RCV_WINDOW);
+	if (wnd) {
+		conn->rdp.rcv_wnd = csp_rdp_rcv_window(conn);
+		packet->data16[0] = csp_hton16(conn->rdp.rcv_wnd);
+		packet->length = sizeof(uint16_t);
+	}
+
 	/* Add RDP header */
 	rdp_header_t * header = csp_rdp_header_add(packet);
+	header->wnd = wnd;
 	header->seq_nr = csp_hton16(seq_nr);
 	header->ack_nr = csp_hton16(ack_nr);
 	header->ack = (flags & RDP_ACK) ? 1 : 0;
@@ -180,6 +392,7 @@ static int csp_rdp_send_cmp(csp_conn_t * conn, csp_packet_t * packet, int flags,
 		rdp_packet_t * rdp_packet = csp_buffer_clone(packet);
 		if (rdp_packet == NULL) return CSP_ERR_NOMEM;
 		rdp_packet->timestamp = csp_get_ms();
+		rdp_packet->quarantine = 0;
 		if (csp_queue_enqueue(conn->rdp.tx_queue, &rdp_packet, 0) != CSP_QUEUE_OK)
 			csp_buffer_free(rdp_packet);
 	}
@@ -205,39 +418,66 @@ static int csp_rdp_send_cmp(csp_conn_t * conn, csp_packet_t * packet, int flags,
 
 }
 
+/* Return the reorder ring slot for a sequence number ahead of rcv_cur */
+static inline csp_packet_t ** csp_rdp_rx_slot(csp_conn_t * conn, uint16_t seq_nr) {
+	uint16_t offset = seq_nr - conn->rdp.rcv_cur - 1;
+	return &conn->rdp.rx_ring[(conn->rdp.rx_head + offset) % CSP_RDP_RX_RING];
+}
+
 /**
  * EXTENDED ACKNOWLEDGEMENTS
- * The following function sends an extended ACK packet
+ * The following function sends an extended ACK packet. If the peer supports it,
+ * the EACK data is a bitmap where bit n (LSB first) is set if segment
+ * rcv_cur + 2 + n is held in the reorder ring. Otherwise the held sequence
+ * numbers are listed one by one as in the original RDP implementation.
  */
 static int csp_rdp_send_eack(csp_conn_t * conn) {
 
+	int bitmap = conn->rdp.features & RDP_FEAT_EACK_BITMAP;
+	int entries = conn->rdp.rx_count;
+
 	/* Allocate message */
-	csp_packet_t * packet_eack = csp_buffer_get(100);
+	csp_packet_t * packet_eack;
+	if (bitmap) {
+		packet_eack = csp_buffer_get((CSP_RDP_RX_RING + 7) / 8 + sizeof(rdp_header_t));
+	} else {
+		/* List no more segments than fit in the largest buffer, with room
+		 * for the header and the HMAC, CRC32 and XTEA trailers. The peer
+		 * retransmits the segments left out when they time out. */
+		int max = (csp_buffer_size() - (int) CSP_BUFFER_PACKET_OVERHEAD - (int) sizeof(rdp_header_t) - 3 * (int) sizeof(uint32_t)) / (int) sizeof(uint16_t);
+		if (entries > max)
+			entries = max;
+		packet_eack = csp_buffer_get(entries * sizeof(uint16_t) + sizeof(rdp_header_t));
+	}
 	if (packet_eack == NULL) return CSP_ERR_NOMEM;
 	packet_eack->length = 0;
 
-	/* Loop through RX queue */
-	int i, count;
-	csp_packet_t * packet;
-	count = csp_queue_size(conn->rdp.rx_queue);
-	for (i = 0; i < count; i++) {
-
-		if (csp_queue_dequeue_isr(conn->rdp.rx_queue, &packet, &pdTrue) != CSP_QUEUE_OK) {
-			csp_log_error("Cannot dequeue from rx_queue in queue deliver\r\n");
-			break;
-		}
+	/* Walk the reorder ring, rcv_cur + 1 is missing by definition */
+	int i, last = -1;
+	int found = 0;
+	if (bitmap)
+		memset(packet_eack->data, 0, (CSP_RDP_RX_RING + 7) / 8);
+	for (i = 0; i < CSP_RDP_RX_RING - 1 && found < entries; i++) {
 
-		/* Add seq nr to EACK packet */
-		rdp_header_t * header = csp_rdp_header_ref(packet);
-		packet_eack->data16[packet_eack->length/sizeof(uint16_t)] = csp_hton16(header->seq_nr);
-		packet_eack->length += sizeof(uint16_t);
-		csp_log_protocol("Added EACK nr %u\r\n", header->seq_nr);
+		uint16_t seq_nr = conn->rdp.rcv_cur + 2 + i;
+		if (*csp_rdp_rx_slot(conn, seq_nr) == NULL)
+			continue;
 
-		/* Requeue */
-		csp_queue_enqueue_isr(conn->rdp.rx_queue, &packet, &pdTrue);
+		found++;
+		csp_log_protocol("Added EACK nr %u\r\n", seq_nr);
+		if (bitmap) {
+			packet_eack->data[i / 8] |= 1 << (i % 8);
+			last = i;
+		} else {
+			packet_eack->data16[packet_eack->length/sizeof(uint16_t)] = csp_hton16(seq_nr);
+			packet_eack->length += sizeof(uint16_t);
+		}
 
 	}
 
+	if (bitmap && last >= 0)
+		packet_eack->length = last / 8 + 1;
+
 	return csp_rdp_send_cmp(conn, packet_eack, RDP_ACK | RDP_EAK, conn->rdp.snd_nxt, conn->rdp.rcv_cur);
 
 }
@@ -260,12 +500,30 @@ static int csp_rdp_send_syn(csp_conn_t * conn) {
 	packet->data32[3] = csp_hton32(csp_rdp_delayed_acks);
 	packet->data32[4] = csp_hton32(csp_rdp_ack_timeout);
 	packet->data32[5] = csp_hton32(csp_rdp_ack_delay_count);
-	packet->length = 6 * sizeof(uint32_t);
+	packet->data32[6] = csp_hton32(RDP_FEATURES);
+	packet->length = 7 * sizeof(uint32_t);
 
 	return csp_rdp_send_cmp(conn, packet, RDP_SYN, conn->rdp.snd_iss, 0);
 
 }
 
+/**
+ * SYN/ACK Packet
+ * The following function sends a SYN/ACK packet carrying the accepted extensions
+ */
+static int csp_rdp_send_synack(csp_conn_t * conn) {
+
+	/* Allocate message */
+	csp_packet_t * packet = csp_buffer_get(20);
+	if (packet == NULL) return CSP_ERR_NOMEM;
+
+	packet->data32[0] = csp_hton32(conn->rdp.features);
+	packet->length = sizeof(uint32_t);
+
+	return csp_rdp_send_cmp(conn, packet, RDP_ACK | RDP_SYN, conn->rdp.snd_iss, conn->rdp.rcv_irs);
+
+}
+
 static inline int csp_rdp_receive_data(csp_conn_t * conn, csp_packet_t * packet) {
 
 	/* If a socket is set, this message is the first in a new connection
@@ -287,9 +545,10 @@ static inline int csp_rdp_receive_data(csp_conn_t * conn, csp_packet_t * packet)
 	/* Remove RDP header before passing to userspace */
 	csp_rdp_header_remove(packet);
 
-	/* Enqueue data */
+	/* Enqueue data, restore the header on failure so the packet can be retried */
 	if (csp_conn_enqueue_packet(conn, packet) < 0) {
 		csp_log_warn("Conn RX buffer full\r\n");
+		packet->length += sizeof(rdp_header_t);
 		return CSP_ERR_NOBUFS;
 	}
 
@@ -299,81 +558,167 @@ static inline int csp_rdp_receive_data(csp_conn_t * conn, csp_packet_t * packet)
 
 static inline void csp_rdp_rx_queue_flush(csp_conn_t * conn) {
 
-	/* Loop through RX queue */
-	int i, count;
-	csp_packet_t * packet;
+	/* Deliver held segments for as long as the next one in sequence is present */
+	while (conn->rdp.rx_count > 0) {
 
-front:
-	count = csp_queue_size(conn->rdp.rx_queue);
-	for (i = 0; i < count; i++) {
+		csp_packet_t ** slot = &conn->rdp.rx_ring[conn->rdp.rx_head];
+		csp_packet_t * packet = *slot;
+		if (packet == NULL)
+			break;
 
-		if (csp_queue_dequeue_isr(conn->rdp.rx_queue, &packet, &pdTrue) != CSP_QUEUE_OK) {
-			csp_log_error("Cannot dequeue from rx_queue in queue deliver\r\n");
+		/* Once queued the segment belongs to userspace, so it must leave the
+		 * ring first. Put it back if userspace is not keeping up. */
+		*slot = NULL;
+		if (csp_rdp_receive_data(conn, packet) != CSP_ERR_NONE) {
+			*slot = packet;
 			break;
 		}
 
-		rdp_header_t * header = csp_rdp_header_ref(packet);
-		csp_log_protocol("RX Queue deliver matching Element, seq %u\r\n", header->seq_nr);
+		conn->rdp.rx_count--;
+		conn->rdp.rx_head = (conn->rdp.rx_head + 1) % CSP_RDP_RX_RING;
+		conn->rdp.rcv_cur++;
+		csp_log_protocol("Deliver seq %u\r\n", conn->rdp.rcv_cur);
 
-		/* If the matching packet was found: */
-		if (header->seq_nr == (uint16_t)(conn->rdp.rcv_cur + 1)) {
-			csp_log_protocol("Deliver seq %u\r\n", header->seq_nr);
-			csp_rdp_receive_data(conn, packet);
-			conn->rdp.rcv_cur++;
-			/* Loop from first element again */
-			goto front;
+	}
 
-		/* Otherwise, requeue */
-		} else {
-			csp_queue_enqueue_isr(conn->rdp.rx_queue, &packet, &pdTrue);
-		}
+}
+
+static inline int csp_rdp_rx_queue_add(csp_conn_t * conn, csp_packet_t * packet, uint16_t seq_nr) {
+
+	csp_packet_t ** slot = csp_rdp_rx_slot(conn, seq_nr);
+	if (*slot != NULL)
+		return CSP_QUEUE_ERROR;
 
+	*slot = packet;
+	conn->rdp.rx_count++;
+	return CSP_QUEUE_OK;
+
+}
+
+/**
+ * Retransmit a segment from the TX queue.
+ * @return the element to requeue, which is a private copy if an earlier
+ * retransmission still holds the buffer
+ */
+static rdp_packet_t * csp_rdp_retransmit(csp_conn_t * conn, rdp_packet_t * packet) {
+
+	/* An earlier retransmission may still hold the buffer */
+	rdp_packet_t * private = csp_buffer_writable(packet);
+	if (private == NULL)
+		return packet;
+	if (private != packet) {
+		csp_buffer_free(packet);
+		packet = private;
 	}
 
+	/* Update to latest outgoing ACK */
+	rdp_header_t * header = csp_rdp_header_ref((csp_packet_t *) packet);
+	header->ack_nr = csp_hton16(conn->rdp.rcv_cur);
+
+	/* Send shared reference, the element stays in tx_queue */
+	packet->timestamp = csp_get_ms();
+	csp_packet_t * new_packet = csp_buffer_clone_ref(packet);
+	if (csp_send_direct(conn->idout, new_packet, 0) != CSP_ERR_NONE) {
+		csp_log_warn("Retransmission failed\r\n");
+		csp_buffer_free(new_packet);
+	}
+
+	/* Karn's rule */
+	conn->rdp.rtt_active = 0;
+
+	return packet;
+
 }
 
-static inline bool csp_rdp_seq_in_rx_queue(csp_conn_t * conn, uint16_t seq_nr) {
+/* Wake user task if TX queue is ready for more data */
+static void csp_rdp_tx_ready(csp_conn_t * conn) {
+
+	if (conn->rdp.state == RDP_OPEN)
+		if (csp_queue_size(conn->rdp.tx_queue) < (int)csp_rdp_snd_window(conn))
+			if (csp_rdp_seq_before(conn->rdp.snd_nxt - conn->rdp.snd_una, conn->rdp.window_size * 2))
+				csp_bin_sem_post(&conn->rdp.tx_wait);
+
+}
+
+/**
+ * Free segments acknowledged by snd_una from the TX queue, and wake a sender
+ * waiting for room. Called when an ACK advances snd_una, so the window opens
+ * without waiting for the next timeout scan.
+ */
+static void csp_rdp_release_acked(csp_conn_t * conn) {
 
-	/* Loop through RX queue */
 	int i, count;
 	rdp_packet_t * packet;
-	count = csp_queue_size(conn->rdp.rx_queue);
+
+	count = csp_queue_size(conn->rdp.tx_queue);
 	for (i = 0; i < count; i++) {
 
-		if (csp_queue_dequeue_isr(conn->rdp.rx_queue, &packet, &pdTrue) != CSP_QUEUE_OK) {
-			csp_log_error("Cannot dequeue from rx_queue in queue exists\r\n");
+		if ((csp_queue_dequeue_isr(conn->rdp.tx_queue, &packet, &pdTrue) != CSP_QUEUE_OK) || packet == NULL)
 			break;
-		}
-
-		csp_queue_enqueue_isr(conn->rdp.rx_queue, &packet, &pdTrue);
 
 		rdp_header_t * header = csp_rdp_header_ref((csp_packet_t *) packet);
-		csp_log_protocol("RX Queue exists matching Element, seq %u\r\n", header->seq_nr);
-
-		/* If the matching packet was found, deliver */
-		if (header->seq_nr == seq_nr) {
-			csp_log_protocol("We have a match\r\n");
-			return true;
+		if (csp_rdp_seq_before(csp_ntoh16(header->seq_nr), conn->rdp.snd_una)) {
+			csp_log_protocol("TX Element %u acked\r\n", csp_ntoh16(header->seq_nr));
+			csp_buffer_free(packet);
+			continue;
 		}
 
+		csp_queue_enqueue_isr(conn->rdp.tx_queue, &packet, &pdTrue);
+
 	}
 
-	return false;
+	csp_rdp_tx_ready(conn);
 
 }
 
-static inline int csp_rdp_rx_queue_add(csp_conn_t * conn, csp_packet_t * packet, uint16_t seq_nr) {
+/* Time an unacknowledged segment times out. Like the timer of RFC 6298, the
+ * RTO also runs from the last ACK that advanced snd_una, so segments queued
+ * behind others on a slow link are not taken for lost. */
+static inline uint32_t csp_rdp_rto_due(csp_conn_t * conn, rdp_packet_t * packet, uint32_t rto) {
 
-	if (csp_rdp_seq_in_rx_queue(conn, seq_nr))
-		return CSP_QUEUE_ERROR;
-	return csp_queue_enqueue_isr(conn->rdp.rx_queue, &packet, &pdTrue);
+	uint32_t start = packet->timestamp;
+	if (csp_rdp_time_after(conn->rdp.una_timestamp, start))
+		start = conn->rdp.una_timestamp;
+	return start + rto;
+
+}
+
+/* Time an unacknowledged segment below the highest EACK'ed one is taken as
+ * lost: once it has been out for longer than the reorder time, and at most
+ * twice per RTO. Younger ones may just be reordered. */
+static inline uint32_t csp_rdp_eack_due(csp_conn_t * conn, rdp_packet_t * packet, uint32_t reorder) {
+
+	uint32_t due = packet->timestamp + reorder;
+	if (packet->quarantine && csp_rdp_time_after(packet->quarantine, due))
+		due = packet->quarantine;
+	return due;
 
 }
 
-static void csp_rdp_flush_eack(csp_conn_t * conn, csp_packet_t * eack_packet) {
+static void csp_rdp_flush_eack(csp_conn_t * conn, csp_packet_t * eack_packet, uint16_t ack_nr) {
+
+	int bitmap = conn->rdp.features & RDP_FEAT_EACK_BITMAP;
+	unsigned int eack_len = eack_packet->length - sizeof(rdp_header_t);
+	unsigned int bits = eack_len * 8;
+	unsigned int j;
+
+	/* Find the highest sequence number held by the receiver. Anything
+	 * unacknowledged before it was most likely lost on the way. */
+	uint16_t highest = ack_nr;
+	if (bitmap) {
+		for (j = 0; j < bits; j++)
+			if (eack_packet->data[j / 8] & (1 << (j % 8)))
+				highest = ack_nr + 2 + j;
+	} else {
+		for (j = 0; j < eack_len / sizeof(uint16_t); j++)
+			if (csp_rdp_seq_after(csp_ntoh16(eack_packet->data16[j]), highest))
+				highest = csp_ntoh16(eack_packet->data16[j]);
+	}
+	if (csp_rdp_seq_after(highest, conn->rdp.snd_eack))
+		conn->rdp.snd_eack = highest;
 
 	/* Loop through TX queue */
-	int i, j, count;
+	int i, count, lost = 0;
 	rdp_packet_t * packet;
 	count = csp_queue_size(conn->rdp.tx_queue);
 	for (i = 0; i < count; i++) {
@@ -384,35 +729,58 @@ static void csp_rdp_flush_eack(csp_conn_t * conn, csp_packet_t * eack_packet) {
 		}
 
 		rdp_header_t * header = csp_rdp_header_ref((csp_packet_t *) packet);
-		csp_log_protocol("EACK compare element, time %u, seq %u\r\n", packet->timestamp, csp_ntoh16(header->seq_nr));
+		uint16_t seq_nr = csp_ntoh16(header->seq_nr);
+		csp_log_protocol("EACK compare element, time %u, seq %u\r\n", packet->timestamp, seq_nr);
 
 		/* Look for this element in EACKs */
 		int match = 0;
-		for (j = 0; j < (int)((eack_packet->length - sizeof(rdp_header_t)) / sizeof(uint16_t)); j++) {
-			if (csp_ntoh16(eack_packet->data16[j]) == csp_ntoh16(header->seq_nr))
+		if (bitmap) {
+			uint16_t offset = seq_nr - ack_nr - 2;
+			if (offset < bits && (eack_packet->data[offset / 8] & (1 << (offset % 8))))
 				match = 1;
-
-			/* Enable this if you want EACK's to trigger retransmission */
-			if (csp_ntoh16(eack_packet->data16[j]) > csp_ntoh16(header->seq_nr)) {
-				uint32_t time_now = csp_get_ms();
-				if (csp_rdp_time_after(time_now, packet->quarantine)) {
-					packet->timestamp = time_now - conn->rdp.packet_timeout - 1;
-					packet->quarantine = time_now +	conn->rdp.packet_timeout / 2;
+		} else {
+			for (j = 0; j < eack_len / sizeof(uint16_t); j++) {
+				if (csp_ntoh16(eack_packet->data16[j]) == seq_nr) {
+					match = 1;
+					break;
 				}
 			}
 		}
 
+		/* Acknowledged by ack_nr of this EACK */
+		if (csp_rdp_seq_before(seq_nr, conn->rdp.snd_una))
+			match = 1;
+
 		if (match == 0) {
+			/* Segments before the highest EACK'ed one are retransmitted once
+			 * they have been out for longer than a round trip and its variation,
+			 * or half the RTO before the first sample. The EACK is recent news
+			 * of the gap, so nothing longer is needed. */
+			uint32_t time_now = csp_get_ms();
+			uint32_t reorder = conn->rdp.srtt ? conn->rdp.srtt + conn->rdp.rttvar : conn->rdp.rto / 2;
+			if (csp_rdp_seq_before(seq_nr, highest)
+					&& csp_rdp_time_after(time_now, csp_rdp_eack_due(conn, packet, reorder))) {
+				csp_log_protocol("TX Element %u missing in EACK, retransmitting\r\n", seq_nr);
+				packet = csp_rdp_retransmit(conn, packet);
+				packet->quarantine = time_now + conn->rdp.rto / 2;
+				lost = 1;
+			}
+
 			/* If not found, put back on tx queue */
 			csp_queue_enqueue(conn->rdp.tx_queue, &packet, 0);
 		} else {
 			/* Found, free */
-			csp_log_protocol("TX Element %u freed\r\n", csp_ntoh16(header->seq_nr));
+			csp_log_protocol("TX Element %u freed\r\n", seq_nr);
 			csp_buffer_free(packet);
 		}
 
 	}
 
+	if (lost)
+		csp_rdp_cc_loss(conn, 0);
+
+	csp_rdp_tx_ready(conn);
+
 }
 
 static inline bool csp_rdp_should_ack(csp_conn_t * conn) {
@@ -451,44 +819,75 @@ void csp_rdp_flush_all(csp_conn_t * conn) {
 		}
 	}
 
-	/* Empty RX queue */
-	while (csp_queue_dequeue_isr(conn->rdp.rx_queue, &packet, &pdTrue) == CSP_QUEUE_OK) {
-		if (packet != NULL) {
-			csp_log_protocol("Flush RX Element, time %u, seq %u\r\n", packet->timestamp, csp_ntoh16(csp_rdp_header_ref((csp_packet_t *) packet)->seq_nr));
-			csp_buffer_free(packet);
+	/* Empty reorder ring */
+	int i;
+	for (i = 0; i < CSP_RDP_RX_RING; i++) {
+		if (conn->rdp.rx_ring[i] != NULL) {
+			csp_log_protocol("Flush RX Element, seq %u\r\n", csp_rdp_header_ref(conn->rdp.rx_ring[i])->seq_nr);
+			csp_buffer_free(conn->rdp.rx_ring[i]);
+			conn->rdp.rx_ring[i] = NULL;
 		}
 	}
+	conn->rdp.rx_head = 0;
+	conn->rdp.rx_count = 0;
+
+	/* Drop partially read stream data */
+	if (conn->rdp.stream_rx != NULL) {
+		csp_buffer_free(conn->rdp.stream_rx);
+		conn->rdp.stream_rx = NULL;
+	}
 
 }
 
 int csp_rdp_check_ack(csp_conn_t * conn) {
 
+	uint16_t window = csp_rdp_rcv_window(conn);
+	int ack = 0;
+
 	if (conn->rdp.rcv_lsa != conn->rdp.rcv_cur) {
-		/* Check all RX queues for spare capacity */
-		int prio, avail = 1;
-		for (prio = 0; prio < CSP_RX_QUEUES; prio++) {
-			if (CSP_RX_QUEUE_LENGTH - csp_queue_size(conn->rx_queue[prio]) <= (int32_t)conn->rdp.window_size) {
-				avail = 0;
-				break;
-			}
-		}
+		/* Check all RX queues for spare capacity. A peer that reads the advertised
+		 * window is told about a full queue instead of having its ACKs withheld. */
+		int avail = (window > conn->rdp.window_size) || (conn->rdp.features & RDP_FEAT_RCV_WINDOW);
 
 		/* If more space available, only send after ack timeout or immediately if delay_acks is zero */
 		if (avail && csp_rdp_should_ack(conn))
-			csp_rdp_send_cmp(conn, NULL, RDP_ACK, conn->rdp.snd_nxt, conn->rdp.rcv_cur);
+			ack = 1;
 	}
 
+	/* Reopen a shrunken window once a full window or half of one has been freed */
+	if ((conn->rdp.features & RDP_FEAT_RCV_WINDOW) && conn->rdp.rcv_wnd < conn->rdp.window_size && window > conn->rdp.rcv_wnd)
+		if (window >= conn->rdp.window_size || window - conn->rdp.rcv_wnd >= conn->rdp.window_size / 2)
+			ack = 1;
+
+	if (ack)
+		csp_rdp_send_cmp(conn, NULL, RDP_ACK, conn->rdp.snd_nxt, conn->rdp.rcv_cur);
+
 	return CSP_ERR_NONE;
 
 }
 
+/* Move deadline back to time, if time is earlier */
+static inline void csp_rdp_deadline(uint32_t * deadline, uint32_t time) {
+
+	if (csp_rdp_time_before(time, *deadline))
+		*deadline = time;
+
+}
+
 /**
  * This function must be called with regular intervals for the
  * RDP protocol to work as expected. This takes care of closing
  * stale connections and retransmitting traffic. A good place to
  * call this function is from the CSP router task.
+ *
+ * The timers use strict comparisons, so each one is reported as
+ * due one millisecond after it expires.
+ *
+ * @param conn connection to check
+ * @param deadline latest time of the next check
+ * @return time of the next check, no later than deadline
  */
-void csp_rdp_check_timeouts(csp_conn_t * conn) {
+uint32_t csp_rdp_check_timeouts(csp_conn_t * conn, uint32_t deadline) {
 
 	rdp_packet_t * packet;
 
@@ -501,8 +900,9 @@ void csp_rdp_check_timeouts(csp_conn_t * conn) {
 		if (csp_rdp_time_after(time_now, conn->timestamp + conn->rdp.conn_timeout)) {
 			csp_log_warn("Found a lost connection, closing now\r\n");
 			csp_close(conn);
-			return;
+			return deadline;
 		}
+		csp_rdp_deadline(&deadline, conn->timestamp + conn->rdp.conn_timeout + 1);
 	}
 
 	/**
@@ -513,15 +913,23 @@ void csp_rdp_check_timeouts(csp_conn_t * conn) {
 		if (csp_rdp_time_after(time_now, conn->timestamp + conn->rdp.conn_timeout)) {
 			csp_log_protocol("CLOSE_WAIT timeout\r\n");
 			csp_close(conn);
+			return deadline;
 		}
-		return;
+		csp_rdp_deadline(&deadline, conn->timestamp + conn->rdp.conn_timeout + 1);
+		return deadline;
 	}
 
 	/**
 	 * MESSAGE TIMEOUT:
 	 * Check each outgoing message for TX timeout
 	 */
-	int i, count;
+	int i, count, retransmitted = 0, lost = 0;
+	uint32_t rto = conn->rdp.rto;
+	/* EACK gaps wait for the RTO before any back off, long enough for a
+	 * delayed ACK of a gap that has been filled since */
+	uint32_t reorder = conn->rdp.srtt ? csp_rdp_rto_estimate(conn) + (conn->rdp.delayed_acks ? conn->rdp.ack_timeout : 0) : rto;
+	if (csp_rdp_seq_before(conn->rdp.snd_eack, conn->rdp.snd_una))
+		conn->rdp.snd_eack = conn->rdp.snd_una;
 	count = csp_queue_size(conn->rdp.tx_queue);
 	for (i = 0; i < count; i++) {
 
@@ -540,21 +948,26 @@ void csp_rdp_check_timeouts(csp_conn_t * conn) {
 			continue;
 		}
 
-		/* Check timestamp and retransmit if needed */
-		if (csp_rdp_time_after(time_now, packet->timestamp + conn->rdp.packet_timeout)) {
-			csp_log_protocol("TX Element timed out, retransmitting seq %u\r\n", csp_ntoh16(header->seq_nr));
-
-			/* Update to latest outgoing ACK */
-			header->ack_nr = csp_hton16(conn->rdp.rcv_cur);
-
-			/* Send copy to tx_queue */
-			packet->timestamp = csp_get_ms();
-			csp_packet_t * new_packet = csp_buffer_clone(packet);
-			if (csp_send_direct(conn->idout, new_packet, 0) != CSP_ERR_NONE) {
-				csp_log_warn("Retransmission failed\r\n");
-				csp_buffer_free(new_packet);
+		/* Check timestamp and retransmit if needed. As with the single timer
+		 * of RFC 6298, only the oldest expired segment is retransmitted. The
+		 * others restart their timer, they are most likely still queued on
+		 * a slow link, and are retransmitted after an EACK if they were lost. */
+		if (csp_rdp_time_after(time_now, csp_rdp_rto_due(conn, packet, rto))) {
+			if (!retransmitted) {
+				csp_log_protocol("TX Element timed out, retransmitting seq %u\r\n", csp_ntoh16(header->seq_nr));
+				packet = csp_rdp_retransmit(conn, packet);
+				retransmitted = 1;
+			} else {
+				packet->timestamp = time_now;
 			}
-
+		} else if (csp_rdp_seq_before(csp_ntoh16(header->seq_nr), conn->rdp.snd_eack)
+				&& csp_rdp_time_after(time_now, csp_rdp_eack_due(conn, packet, reorder))) {
+			/* A gap in an earlier EACK that was too young to count as lost,
+			 * and no later EACK arrived to retransmit it */
+			csp_log_protocol("TX Element %u still missing after EACK, retransmitting\r\n", csp_ntoh16(header->seq_nr));
+			packet = csp_rdp_retransmit(conn, packet);
+			packet->quarantine = time_now + conn->rdp.rto / 2;
+			lost = 1;
 		}
 
 		/* Requeue the TX element */
@@ -562,17 +975,52 @@ void csp_rdp_check_timeouts(csp_conn_t * conn) {
 
 	}
 
+	/* Back off once per scan */
+	if (retransmitted) {
+		csp_rdp_rto_set(conn, rto * 2);
+		csp_rdp_cc_loss(conn, 1);
+	} else if (lost) {
+		csp_rdp_cc_loss(conn, 0);
+	}
+
+	/* Next retransmission, with the RTO after any back off. Segments are
+	 * queued in sending order, but retransmissions restart their timer. */
+	count = csp_queue_size(conn->rdp.tx_queue);
+	for (i = 0; i < count; i++) {
+		if (csp_queue_dequeue_isr(conn->rdp.tx_queue, &packet, &pdTrue) != CSP_QUEUE_OK)
+			break;
+		csp_rdp_deadline(&deadline, csp_rdp_rto_due(conn, packet, conn->rdp.rto) + 1);
+		if (csp_rdp_seq_before(csp_ntoh16(csp_rdp_header_ref((csp_packet_t *) packet)->seq_nr), conn->rdp.snd_eack))
+			csp_rdp_deadline(&deadline, csp_rdp_eack_due(conn, packet, reorder) + 1);
+		csp_queue_enqueue_isr(conn->rdp.tx_queue, &packet, &pdTrue);
+	}
+
+	/**
+	 * HELD SEGMENTS:
+	 * Deliver segments kept in the reorder ring because the RX queue was
+	 * full. The sender has freed them after an EACK, so nothing else will.
+	 */
+	if (conn->rdp.rx_ring[conn->rdp.rx_head] != NULL) {
+		csp_rdp_rx_queue_flush(conn);
+		if (conn->rdp.rx_ring[conn->rdp.rx_head] != NULL)
+			csp_rdp_deadline(&deadline, time_now + RDP_RX_RETRY_MS);
+	}
+
 	/**
 	 * ACK TIMEOUT:
 	 * Check ACK timeouts, if we have unacknowledged segments
 	 */
 	csp_rdp_check_ack(conn);
+	if (conn->rdp.rcv_lsa != conn->rdp.rcv_cur && conn->rdp.delayed_acks) {
+		/* An ACK withheld for a full RX queue is retried at the latest deadline */
+		uint32_t ack_due = conn->rdp.ack_timestamp + conn->rdp.ack_timeout + 1;
+		if (csp_rdp_time_after(ack_due, time_now))
+			csp_rdp_deadline(&deadline, ack_due);
+	}
 
-	/* Wake user task if TX queue is ready for more data */
-	if (conn->rdp.state == RDP_OPEN)
-		if (csp_queue_size(conn->rdp.tx_queue) < (int)conn->rdp.window_size)
-			if (csp_rdp_seq_before(conn->rdp.snd_nxt - conn->rdp.snd_una, conn->rdp.window_size * 2))
-				csp_bin_sem_post(&conn->rdp.tx_wait);
+	csp_rdp_tx_ready(conn);
+
+	return deadline;
 
 }
 
@@ -640,6 +1088,7 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 		conn->rdp.snd_iss = (uint16_t)rand();
 		conn->rdp.snd_nxt = conn->rdp.snd_iss + 1;
 		conn->rdp.snd_una = conn->rdp.snd_iss;
+		conn->rdp.snd_eack = conn->rdp.snd_iss;
 
 		/* Store RX seq. */
 		conn->rdp.rcv_cur = rx_header->seq_nr;
@@ -653,6 +1102,9 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 		conn->rdp.delayed_acks 		= csp_ntoh32(packet->data32[3]);
 		conn->rdp.ack_timeout 		= csp_ntoh32(packet->data32[4]);
 		conn->rdp.ack_delay_count 	= csp_ntoh32(packet->data32[5]);
+		conn->rdp.features = 0;
+		if (packet->length >= 7 * sizeof(uint32_t) + sizeof(rdp_header_t))
+			conn->rdp.features = csp_ntoh32(packet->data32[6]) & RDP_FEATURES;
 		csp_log_protocol("RDP: Window Size %u, conn timeout %u, packet timeout %u\r\n",
 				conn->rdp.window_size, conn->rdp.conn_timeout, conn->rdp.packet_timeout);
 		csp_log_protocol("RDP: Delayed acks: %u, ack timeout %u, ack each %u packet\r\n",
@@ -662,7 +1114,11 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 		conn->rdp.state = RDP_SYN_RCVD;
 
 		/* Send SYN/ACK */
-		csp_rdp_send_cmp(conn, NULL, RDP_ACK | RDP_SYN, conn->rdp.snd_iss, conn->rdp.rcv_irs);
+		conn->rdp.snd_wnd_end = conn->rdp.snd_nxt + conn->rdp.window_size;
+		conn->rdp.rcv_wnd = conn->rdp.window_size;
+		csp_rdp_cc_init(conn);
+		csp_rdp_rto_init(conn);
+		csp_rdp_send_synack(conn);
 
 		goto discard_open;
 
@@ -682,14 +1138,23 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 			conn->rdp.rcv_lsa = rx_header->seq_nr - 1;
 			conn->rdp.snd_una = rx_header->ack_nr + 1;
 			conn->rdp.ack_timestamp = csp_get_ms();
+			conn->rdp.una_timestamp = conn->rdp.ack_timestamp;
 			conn->rdp.state = RDP_OPEN;
 
+			/* Extensions accepted by the peer, an old peer sends none */
+			conn->rdp.features = 0;
+			if (packet->length >= sizeof(uint32_t) + sizeof(rdp_header_t))
+				conn->rdp.features = csp_ntoh32(packet->data32[0]) & RDP_FEATURES;
+
 			csp_log_protocol("RDP: NP: Connection OPEN\r\n");
 
 			/* Send ACK */
 			if (conn->rdp.delayed_acks == 0)
 				csp_rdp_send_cmp(conn, NULL, RDP_ACK, conn->rdp.snd_nxt, conn->rdp.rcv_cur);
 
+			/* Free the acknowledged SYN, it takes up a slot in the TX queue */
+			csp_rdp_release_acked(conn);
+
 			/* Wake TX task */
 			csp_bin_sem_post(&conn->rdp.tx_wait);
 
@@ -737,13 +1202,18 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 			}
 		}
 
-		/* Check sequence number */
-		if (!csp_rdp_seq_between(rx_header->seq_nr, conn->rdp.rcv_cur + 1, conn->rdp.rcv_cur + conn->rdp.window_size * 2)) {
+		/* Check sequence number, the reorder ring bounds how far ahead we accept */
+		uint16_t rx_span = conn->rdp.window_size * 2;
+		if (rx_span > CSP_RDP_RX_RING)
+			rx_span = CSP_RDP_RX_RING;
+		if (!csp_rdp_seq_between(rx_header->seq_nr, conn->rdp.rcv_cur + 1, conn->rdp.rcv_cur + rx_span)) {
 			csp_log_protocol("Invalid sequence number! %"PRIu16" not between %"PRIu16" and %"PRIu16"\r\n",
-					rx_header->seq_nr, conn->rdp.rcv_cur + 1, conn->rdp.rcv_cur + 1 + conn->rdp.window_size * 2);
+					rx_header->seq_nr, conn->rdp.rcv_cur + 1, conn->rdp.rcv_cur + rx_span);
 			/* If duplicate SYN received, send another SYN/ACK */
-			if (conn->rdp.state == RDP_SYN_RCVD)
-				csp_rdp_send_cmp(conn, NULL, RDP_ACK | RDP_SYN, conn->rdp.snd_iss, conn->rdp.rcv_irs);
+			if (conn->rdp.state == RDP_SYN_RCVD) {
+				conn->rdp.rtt_active = 0;
+				csp_rdp_send_synack(conn);
+			}
 			/* If duplicate data packet received, send EACK back */
 			if (conn->rdp.state == RDP_OPEN)
 				csp_rdp_send_eack(conn);
@@ -769,12 +1239,32 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 		}
 
 		/* Store current ack'ed sequence number */
+		int acked = csp_rdp_seq_after(rx_header->ack_nr + 1, conn->rdp.snd_una);
+		if (acked)
+			csp_rdp_cc_ack(conn, rx_header->ack_nr + 1 - conn->rdp.snd_una);
 		conn->rdp.snd_una = rx_header->ack_nr + 1;
+		if (acked)
+			conn->rdp.una_timestamp = csp_get_ms();
+		csp_rdp_rtt_ack(conn, rx_header->ack_nr);
+
+		/* Free acknowledged segments, an EACK is handled below */
+		if (acked && !rx_header->eak)
+			csp_rdp_release_acked(conn);
+
+		/* Window update from the receiver */
+		if (rx_header->wnd) {
+			if (packet->length >= sizeof(uint16_t) + sizeof(rdp_header_t))
+				conn->rdp.snd_wnd_end = rx_header->ack_nr + 1 + csp_ntoh16(packet->data16[0]);
+			csp_rdp_tx_ready(conn);
+			goto discard_open;
+		}
 
 		/* We have an EACK */
 		if (rx_header->eak) {
 			if (packet->length > sizeof(rdp_header_t))
-				csp_rdp_flush_eack(conn, packet);
+				csp_rdp_flush_eack(conn, packet, rx_header->ack_nr);
+			else if (acked)
+				csp_rdp_release_acked(conn);
 			goto discard_open;
 		}
 
@@ -792,24 +1282,32 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 			goto accepted_open;
 		}
 
-		/* Store sequence number before stripping RDP header */
+		/* A retransmission of a segment held in the ring, retry delivering that */
+		if (*csp_rdp_rx_slot(conn, rx_header->seq_nr) != NULL) {
+			csp_rdp_rx_queue_flush(conn);
+			goto discard_open;
+		}
+
+		/* Store sequence number and queue before the packet is handed to userspace */
 		uint16_t seq_nr = rx_header->seq_nr;
+		int rxq = csp_conn_get_rxq(packet->id.pri);
 
 		/* Receive data */
 		if (csp_rdp_receive_data(conn, packet) != CSP_ERR_NONE)
 			goto discard_open;
 
-		/* Update last received packet */
+		/* Update last received packet, the ring slot of seq_nr is always empty */
 		conn->rdp.rcv_cur = seq_nr;
+		conn->rdp.rx_head = (conn->rdp.rx_head + 1) % CSP_RDP_RX_RING;
 
 		/* The message is in sequence and contains data */
-		int rxq = csp_conn_get_rxq(packet->id.pri);
 		int rx_queue_size = csp_queue_size(conn->rx_queue[rxq]);
 
-		/* Only ACK the message if there is room for a full window in the RX buffer.
+		/* Only ACK the message if there is room for a full window in the RX buffer,
+		 * or if the peer is told the remaining space in the ACK itself.
 		 * Unacknowledged segments are ACKed by csp_rdp_check_timeouts when the buffer is
 		 * no longer full. */
-		if (rx_queue_size + conn->rdp.window_size <= CSP_RX_QUEUE_LENGTH) {
+		if (rx_queue_size + conn->rdp.window_size <= CSP_RX_QUEUE_LENGTH || (conn->rdp.features & RDP_FEAT_RCV_WINDOW)) {
 			if (csp_rdp_should_ack(conn))
 				csp_rdp_send_cmp(conn, NULL, RDP_ACK, conn->rdp.snd_nxt, conn->rdp.rcv_cur);
 		} else {
@@ -895,6 +1393,7 @@ retry:
 
 	conn->rdp.snd_nxt = conn->rdp.snd_iss + 1;
 	conn->rdp.snd_una = conn->rdp.snd_iss;
+	conn->rdp.snd_eack = conn->rdp.snd_iss;
 
 	csp_log_protocol("RDP: AC: Sending SYN\r\n");
 
@@ -903,6 +1402,10 @@ retry:
 
 	/* Send SYN message */
 	conn->rdp.state = RDP_SYN_SENT;
+	conn->rdp.snd_wnd_end = conn->rdp.snd_nxt + conn->rdp.window_size;
+	conn->rdp.rcv_wnd = conn->rdp.window_size;
+	csp_rdp_cc_init(conn);
+	csp_rdp_rto_init(conn);
 	if (csp_rdp_send_syn(conn) != CSP_ERR_NONE)
 		goto error;
 
@@ -936,6 +1439,42 @@ error:
 
 }
 
+/* Wait until at most max_in_flight segments are unacknowledged, or the window has room if max_in_flight is negative */
+static int csp_rdp_tx_wait(csp_conn_t * conn, int max_in_flight, uint32_t timeout) {
+
+	uint32_t start = csp_get_ms();
+
+	while (1) {
+
+		if (conn->rdp.state != RDP_OPEN)
+			return CSP_ERR_RESET;
+
+		uint16_t in_flight = conn->rdp.snd_nxt - conn->rdp.snd_una;
+		if (max_in_flight < 0 ? in_flight < csp_rdp_snd_window(conn) : in_flight <= max_in_flight)
+			return CSP_ERR_NONE;
+
+		/* The semaphore may hold a stale post, so re-check after each wakeup */
+		uint32_t elapsed = csp_get_ms() - start;
+		if (elapsed >= timeout)
+			return CSP_ERR_TIMEDOUT;
+		csp_bin_sem_wait(&conn->rdp.tx_wait, timeout - elapsed);
+
+	}
+
+}
+
+int csp_rdp_send_wait(csp_conn_t * conn, uint32_t timeout) {
+
+	return csp_rdp_tx_wait(conn, -1, timeout);
+
+}
+
+int csp_rdp_ack_wait(csp_conn_t * conn, uint32_t timeout) {
+
+	return csp_rdp_tx_wait(conn, 0, timeout);
+
+}
+
 int csp_rdp_send(csp_conn_t * conn, csp_packet_t * packet, uint32_t timeout) {
 
 	if (conn->rdp.state != RDP_OPEN) {
@@ -943,11 +1482,15 @@ int csp_rdp_send(csp_conn_t * conn, csp_packet_t * packet, uint32_t timeout) {
 		return CSP_ERR_RESET;
 	}
 
-	/* If TX window is full, wait here */
+	/* If TX window is full, wait here. Clear stale posts before looking at the
+	 * window, so a window update posted in between is not lost. */
 	uint16_t in_flight = conn->rdp.snd_nxt - conn->rdp.snd_una + 1;
-	if (in_flight > conn->rdp.window_size) {
-		csp_log_protocol("RDP: Waiting for window update before sending seq %u\r\n", conn->rdp.snd_nxt);
+	if (in_flight > csp_rdp_snd_window(conn)) {
 		csp_bin_sem_wait(&conn->rdp.tx_wait, 0);
+		in_flight = conn->rdp.snd_nxt - conn->rdp.snd_una + 1;
+	}
+	if (in_flight > csp_rdp_snd_window(conn)) {
+		csp_log_protocol("RDP: Waiting for window update before sending seq %u\r\n", conn->rdp.snd_nxt);
 		if ((csp_bin_sem_wait(&conn->rdp.tx_wait, conn->rdp.conn_timeout)) != CSP_SEMAPHORE_OK) {
 			csp_log_error("Timeout during send\r\n");
 			return CSP_ERR_TIMEDOUT;
@@ -986,6 +1529,7 @@ int csp_rdp_send(csp_conn_t * conn, csp_packet_t * packet, uint32_t timeout) {
 				tx_header->rst, csp_ntoh16(tx_header->seq_nr), csp_ntoh16(tx_header->ack_nr),
 				packet->length, packet->length - sizeof(rdp_header_t));
 
+	csp_rdp_rtt_start(conn, conn->rdp.snd_nxt);
 	conn->rdp.snd_nxt++;
 	return CSP_ERR_NONE;
 
@@ -999,6 +1543,7 @@ int csp_rdp_allocate(csp_conn_t * conn) {
 	conn->rdp.state = RDP_CLOSED;
 	conn->rdp.conn_timeout = csp_rdp_conn_timeout;
 	conn->rdp.packet_timeout = csp_rdp_packet_timeout;
+	conn->rdp.rto = csp_rdp_packet_timeout;
 
 	/* Create a binary semaphore to wait on for tasks */
 	if (csp_bin_sem_create(&conn->rdp.tx_wait) != CSP_SEMAPHORE_OK) {
@@ -1014,14 +1559,11 @@ int csp_rdp_allocate(csp_conn_t * conn) {
 		return CSP_ERR_NOMEM;
 	}
 
-	/* Create RX queue */
-	conn->rdp.rx_queue = csp_queue_create(CSP_RDP_MAX_WINDOW * 2, sizeof(csp_packet_t *));
-	if (conn->rdp.rx_queue == NULL) {
-		csp_log_error("Failed to create RX queue for conn\r\n");
-		csp_bin_sem_remove(&conn->rdp.tx_wait);
-		csp_queue_remove(conn->rdp.tx_queue);
-		return CSP_ERR_NOMEM;
-	}
+	/* Empty reorder ring */
+	memset(conn->rdp.rx_ring, 0, sizeof(conn->rdp.rx_ring));
+	conn->rdp.rx_head = 0;
+	conn->rdp.rx_count = 0;
+	conn->rdp.stream_rx = NULL;
 
 	return CSP_ERR_NONE;
 
@@ -1092,8 +1634,8 @@ void csp_rdp_conn_print(csp_conn_t * conn) {
 	if (conn == NULL)
 		return;
 
-	printf("\tRDP: State %"PRIu16", rcv %"PRIu16", snd %"PRIu16", win %"PRIu32"\r\n",
-			conn->rdp.state, conn->rdp.rcv_cur, conn->rdp.snd_una, conn->rdp.window_size);
+	printf("\tRDP: State %"PRIu16", rcv %"PRIu16", snd %"PRIu16", win %"PRIu32", srtt %"PRIu32", rto %"PRIu32"\r\n",
+			conn->rdp.state, conn->rdp.rcv_cur, conn->rdp.snd_una, conn->rdp.window_size, conn->rdp.srtt, conn->rdp.rto);
 
 }
 #endif
@@ -25,6 +25,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 extern "C" {
 #endif
 
+/** Upper bound of the RDP header appended to data segments */
+#define CSP_RDP_HEADER_MAX 8
+
 /** ARRIVING SEGMENT */
 void csp_udp_new_packet(csp_conn_t * conn, csp_packet_t * packet);
 void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet);
@@ -36,8 +39,10 @@ int csp_rdp_close(csp_conn_t * conn);
 void csp_rdp_conn_print(csp_conn_t * conn);
 int csp_rdp_send(csp_conn_t * conn, csp_packet_t * packet, uint32_t timeout);
 int csp_rdp_check_ack(csp_conn_t * conn);
-void csp_rdp_check_timeouts(csp_conn_t * conn);
+uint32_t csp_rdp_check_timeouts(csp_conn_t * conn, uint32_t deadline);
 void csp_rdp_flush_all(csp_conn_t * conn);
+int csp_rdp_send_wait(csp_conn_t * conn, uint32_t timeout);
+int csp_rdp_ack_wait(csp_conn_t * conn, uint32_t timeout);
 
 #ifdef __cplusplus
 } /* extern "C" */
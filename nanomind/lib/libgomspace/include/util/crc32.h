@@ -6,6 +6,13 @@
  */
 uint32_t chksum_crc32_step(uint32_t crc, uint8_t byte);
 
+/**
+ * Continue crc32 over a block, a word at a time
+ * Start with crc 0xFFFFFFFF and xor the result with 0xFFFFFFFF when done,
+ * like chksum_crc32_step.
+ */
+uint32_t chksum_crc32_block(uint32_t crc, const uint8_t *block, unsigned int length);
+
 /**
  * Caluclate crc32 of a block
  */
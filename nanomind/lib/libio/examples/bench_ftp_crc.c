@@ -0,0 +1,269 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* FTP CRC benchmark
+ *
+ * Drives the server backends directly, without a connection, for 1, 4 and
+ * 16 MB files. The chunks are written in order, once without loss and once
+ * with the given fraction dropped and written again in a second pass, the
+ * way STATUS repairs them. Then the CRC is requested the way task_ftp does
+ * for CRC and DONE.
+ *
+ * Reports the time of the CRC request and, for the FAT backend, the bytes
+ * it read. The FAT backend runs both with and without crc_readback, which
+ * reads the whole file back. Every CRC is checked against a bitwise CRC32
+ * of the file. The FAT backend works on files in a host directory through
+ * the FatFs calls of ff_posix.c, and is only built with --enable-fat,
+ * which needs the FatFs headers of libstorage. Build with
+ * --enable-ftp-server --enable-io-examples.
+ *
+ * usage: bench_ftp_crc [-s size] [-c chunk size] [-l loss] [-d dir]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <sys/mman.h>
+
+#include <ftp/ftp_server.h>
+
+#ifdef BENCH_FAT
+#include "ff_posix.h"
+#endif
+
+static unsigned int fixed_size = 0, chunk_size = 200, loss = 50;
+static const char * dir = "/tmp";
+
+static double now(void) {
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+
+}
+
+/* Reference CRC32, a bit at a time */
+static uint32_t crc32_bitwise(const uint8_t * data, uint32_t length) {
+
+	uint32_t i, crc = 0xFFFFFFFF;
+	int k;
+
+	for (i = 0; i < length; i++) {
+		crc ^= data[i];
+		for (k = 0; k < 8; k++)
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+	}
+
+	return crc ^ 0xFFFFFFFF;
+
+}
+
+/* Write every chunk not yet received, dropping drop per mille of them */
+static int pass(ftp_backend_t * backend, uint8_t * data, uint32_t size, unsigned int drop) {
+
+	uint32_t chunk, chunks = (size + chunk_size - 1) / chunk_size, length;
+	int s;
+
+	for (chunk = 0; chunk < chunks; chunk++) {
+		if (backend->status_get(NULL, chunk, &s) != FTP_RET_OK)
+			return -1;
+		if (s || (unsigned int) (rand() % 1000) < drop)
+			continue;
+		length = (chunk == chunks - 1) ? size - chunk * chunk_size : chunk_size;
+		if (backend->chunk_write(NULL, chunk, data + chunk * chunk_size, length) != FTP_RET_OK ||
+				backend->status_set(NULL, chunk) != FTP_RET_OK)
+			return -1;
+	}
+
+	return 0;
+
+}
+
+/* Upload, repair and request the CRC. Returns the time of the CRC request
+ * in ms, or -1 if it failed or did not match */
+static double bench(ftp_backend_t * backend, uint8_t * data, uint8_t * ram, uint32_t size, unsigned int drop, uint32_t expect) {
+
+	char path[100];
+	uint32_t crc = 0;
+	double start, elapsed;
+	int fat = (backend != &backend_ram);
+
+	snprintf(path, sizeof(path), "%s/BENCH.BIN", dir);
+	srand(1);
+
+	if (backend->upload(NULL, path, (uint32_t) (uintptr_t) ram, size, chunk_size) != FTP_RET_OK)
+		return -1;
+	if (pass(backend, data, size, drop) != 0 || pass(backend, data, size, 0) != 0)
+		return -1;
+
+#ifdef BENCH_FAT
+	ff_posix_stats_t stats;
+	ff_posix_stats(&stats);
+#endif
+
+	start = now();
+	if (backend->crc(NULL, &crc) != FTP_RET_OK)
+		return -1;
+	elapsed = (now() - start) * 1e3;
+
+#ifdef BENCH_FAT
+	ff_posix_stats(&stats);
+	if (fat)
+		printf(" %8.2f ms %8"PRIu32" kB read", elapsed, stats.data.read_bytes >> 10);
+	else
+#endif
+		printf(" %8.2f ms", elapsed);
+
+	backend->done(NULL);
+	if (fat)
+		unlink(path);
+
+	return crc == expect ? elapsed : -1;
+
+}
+
+#ifdef BENCH_FAT
+/* Change a byte of the file behind the backend, like a page that failed to
+ * program. Returns 1 if the CRC request caught it */
+static int corrupt(uint8_t * data, uint32_t size, uint32_t expect) {
+
+	char path[100];
+	uint32_t crc = 0;
+	uint8_t byte;
+	FILE * f;
+
+	snprintf(path, sizeof(path), "%s/BENCH.BIN", dir);
+
+	if (backend_fat.upload(NULL, path, 0, size, chunk_size) != FTP_RET_OK || pass(&backend_fat, data, size, 0) != 0)
+		return -1;
+
+	f = fopen(path, "r+");
+	if (f == NULL)
+		return -1;
+	byte = ~data[size / 2];
+	fseek(f, size / 2, SEEK_SET);
+	fwrite(&byte, 1, 1, f);
+	fclose(f);
+
+	backend_fat.crc(NULL, &crc);
+	backend_fat.done(NULL);
+	unlink(path);
+
+	return crc != expect;
+
+}
+#endif
+
+int main(int argc, char * argv[]) {
+
+	int opt, ret = 0;
+	unsigned int i, j, max = 16 << 20;
+	uint32_t sizes[] = {1 << 20, 4 << 20, 16 << 20};
+	unsigned int drops[] = {0, 0};
+	uint32_t expect;
+	uint8_t * data, * ram;
+
+	while ((opt = getopt(argc, argv, "s:c:l:d:")) != -1) {
+		switch (opt) {
+		case 's': fixed_size = atoi(optarg); break;
+		case 'c': chunk_size = atoi(optarg); break;
+		case 'l': loss = atoi(optarg); break;
+		case 'd': dir = optarg; break;
+		default:
+			printf("usage: %s [-s size] [-c chunk size] [-l loss] [-d dir]\r\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (chunk_size < 1 || chunk_size > FTP_CHUNK_SIZE || loss > 1000) {
+		printf("Need chunks of 1 to %d bytes and a loss of at most 1000\r\n", FTP_CHUNK_SIZE);
+		return 1;
+	}
+	drops[1] = loss;
+
+	if (fixed_size)
+		max = fixed_size;
+
+	/* The RAM backend takes a 32 bit address */
+	ram = mmap(NULL, max, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+	data = malloc(max);
+	if (ram == MAP_FAILED || data == NULL) {
+		printf("Failed to allocate %u bytes\r\n", max);
+		return 1;
+	}
+	for (i = 0; i < max; i++)
+		data[i] = rand();
+
+	printf("%u byte chunks, CRC request time\r\n", chunk_size);
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		if (fixed_size)
+			sizes[i] = (i == 0) ? fixed_size : 0;
+		if (sizes[i] == 0)
+			continue;
+
+		expect = crc32_bitwise(data, sizes[i]);
+
+		for (j = 0; j < 2; j++) {
+			printf("%5"PRIu32" kB, loss %3u/1000: ram", sizes[i] >> 10, drops[j]);
+			memset(ram, 0, sizes[i]);
+			if (bench(&backend_ram, data, ram, sizes[i], drops[j], expect) < 0) {
+				printf(" FAILED");
+				ret = 1;
+			}
+
+#ifdef BENCH_FAT
+			printf(", fat");
+			backend_fat.crc_readback = 0;
+			if (bench(&backend_fat, data, ram, sizes[i], drops[j], expect) < 0) {
+				printf(" FAILED");
+				ret = 1;
+			}
+			printf(", fat readback");
+			backend_fat.crc_readback = 1;
+			if (bench(&backend_fat, data, ram, sizes[i], drops[j], expect) < 0) {
+				printf(" FAILED");
+				ret = 1;
+			}
+#endif
+			printf("\r\n");
+		}
+	}
+
+#ifdef BENCH_FAT
+	/* Only a read back sees what is on the medium */
+	expect = crc32_bitwise(data, sizes[0]);
+	backend_fat.crc_readback = 0;
+	printf("Corrupted byte on the medium: %s without readback", corrupt(data, sizes[0], expect) ? "caught" : "missed");
+	backend_fat.crc_readback = 1;
+	i = corrupt(data, sizes[0], expect);
+	printf(", %s with readback\r\n", i ? "caught" : "missed");
+	if (i != 1)
+		ret = 1;
+#endif
+
+	return ret;
+
+}
@@ -0,0 +1,321 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* FTP chunk map benchmark
+ *
+ * Drives the server backends directly, without a connection, for 1, 4 and
+ * 16 MB files. A first pass writes the chunks and drops the given fraction
+ * of them, then the status of the upload is generated the way task_ftp
+ * does: with status_get for every chunk, from the chunk map into a status
+ * reply, and from the chunk map into status map segments. A second pass
+ * writes the missing chunks.
+ *
+ * Reports the time of each pass and the average time of each kind of
+ * status. For the FAT backend it also counts the writes and syncs of the
+ * map file and the syncs of the data file in each pass, through the FatFs
+ * calls of ff_posix.c on files in a host directory. The FAT backend is
+ * only built with --enable-fat, which needs the FatFs headers of
+ * libstorage. Build with --enable-ftp-server --enable-io-examples.
+ *
+ * usage: bench_ftp_map [-s size] [-c chunk size] [-l loss] [-n repeats] [-d dir]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <sys/mman.h>
+
+#include <csp/csp_endian.h>
+
+#include <ftp/ftp_server.h>
+#include <ftp/ftp_map.h>
+
+#ifdef BENCH_FAT
+#include "ff_posix.h"
+#endif
+
+static unsigned int fixed_size = 0, chunk_size = 200, loss = 50, repeats = 20;
+static const char * dir = "/tmp";
+
+static double now(void) {
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+
+}
+
+/* Status reply from status_get, as task_ftp builds it without status_map */
+static int status_loop(ftp_backend_t * backend, uint32_t chunks, ftp_status_reply_t * status) {
+
+	uint32_t i, next = 0, count = 0;
+	int s;
+
+	status->entries = 0;
+	status->complete = 0;
+	for (i = 0; i < chunks; i++) {
+		if (backend->status_get(NULL, i, &s) != FTP_RET_OK)
+			return -1;
+		if (s)
+			status->complete++;
+		if (status->entries < FTP_STATUS_CHUNKS) {
+			if (!s) {
+				if (!count)
+					next = i;
+				count++;
+			}
+			if (count > 0 && (s || i == chunks - 1)) {
+				status->entry[status->entries].next = csp_hton32(next);
+				status->entry[status->entries].count = csp_hton16(count);
+				status->entries++;
+				count = 0;
+			}
+		}
+	}
+
+	return 0;
+
+}
+
+/* Status map segments, as ftp_send_status_map fills them */
+static unsigned int status_segments(ftp_map_t * map, ftp_status_map_t * status) {
+
+	uint32_t first;
+	unsigned int segments = 0;
+
+	for (first = ftp_map_next_segment(map, 0); first < map->chunks;
+			first = ftp_map_next_segment(map, first + FTP_STATUS_MAP_CHUNKS)) {
+		ftp_map_segment_get(map, first, status->bits);
+		segments++;
+	}
+
+	return segments;
+
+}
+
+/* Write every chunk not yet received, dropping drop per mille of them.
+ * Returns the number of chunks written, or -1 */
+static int pass(ftp_backend_t * backend, uint8_t * data, uint32_t size, unsigned int drop) {
+
+	uint32_t chunk, chunks = (size + chunk_size - 1) / chunk_size, length;
+	int s, written = 0;
+
+	for (chunk = 0; chunk < chunks; chunk++) {
+		if (backend->status_get(NULL, chunk, &s) != FTP_RET_OK)
+			return -1;
+		if (s || (unsigned int) (rand() % 1000) < drop)
+			continue;
+		length = (chunk == chunks - 1) ? size - chunk * chunk_size : chunk_size;
+		if (backend->chunk_write(NULL, chunk, data + chunk * chunk_size, length) != FTP_RET_OK ||
+				backend->status_set(NULL, chunk) != FTP_RET_OK)
+			return -1;
+		written++;
+	}
+
+	return written;
+
+}
+
+#ifdef BENCH_FAT
+static void print_fat(void) {
+
+	ff_posix_stats_t stats;
+
+	ff_posix_stats(&stats);
+	printf(" (map %"PRIu32" writes %"PRIu32" B %"PRIu32" syncs, data %"PRIu32" syncs)",
+			stats.map.writes, stats.map.write_bytes, stats.map.syncs, stats.data.syncs);
+
+}
+#endif
+
+static int bench(const char * name, ftp_backend_t * backend, uint8_t * data, uint8_t * ram, uint32_t size) {
+
+	char path[100];
+	uint32_t chunks = (size + chunk_size - 1) / chunk_size;
+	unsigned int i, segments = 0;
+	int written;
+	double start, t_first, t_get, t_reply, t_map, t_repair;
+	ftp_status_reply_t status;
+	ftp_status_map_t segment;
+	ftp_map_t * map;
+	int fat = (backend != &backend_ram);
+
+	snprintf(path, sizeof(path), "%s/BENCH.BIN", dir);
+	srand(1);
+
+#ifdef BENCH_FAT
+	/* Start the counters with this file */
+	ff_posix_stats_t stats;
+	ff_posix_stats(&stats);
+#endif
+
+	if (backend->upload(NULL, path, (uint32_t) (uintptr_t) ram, size, chunk_size) != FTP_RET_OK)
+		return -1;
+
+	printf("%-3s %5"PRIu32" kB, %6"PRIu32" chunks:", name, size >> 10, chunks);
+#ifdef BENCH_FAT
+	if (fat)
+		print_fat();
+#endif
+	printf("\r\n");
+
+	start = now();
+	written = pass(backend, data, size, loss);
+	if (written < 0)
+		return -1;
+	t_first = now() - start;
+	printf("  first pass  %6d chunks %8.1f ms", written, t_first * 1e3);
+#ifdef BENCH_FAT
+	if (fat)
+		print_fat();
+#endif
+	printf("\r\n");
+
+	start = now();
+	for (i = 0; i < repeats; i++)
+		if (status_loop(backend, chunks, &status) != 0)
+			return -1;
+	t_get = (now() - start) / repeats;
+
+	start = now();
+	for (i = 0; i < repeats; i++) {
+		if (backend->status_map(NULL, &map) != FTP_RET_OK)
+			return -1;
+		ftp_map_status(map, &status);
+	}
+	t_reply = (now() - start) / repeats;
+
+	start = now();
+	for (i = 0; i < repeats; i++) {
+		if (backend->status_map(NULL, &map) != FTP_RET_OK)
+			return -1;
+		segments = status_segments(map, &segment);
+	}
+	t_map = (now() - start) / repeats;
+
+	printf("  status: status_get %8.3f ms, reply %7.4f ms, %u segments %7.4f ms", t_get * 1e3, t_reply * 1e3, segments, t_map * 1e3);
+#ifdef BENCH_FAT
+	if (fat)
+		print_fat();
+#endif
+	printf("\r\n");
+
+	start = now();
+	written = pass(backend, data, size, 0);
+	if (written < 0)
+		return -1;
+	t_repair = now() - start;
+	printf("  repair pass %6d chunks %8.1f ms", written, t_repair * 1e3);
+#ifdef BENCH_FAT
+	if (fat)
+		print_fat();
+#endif
+	printf("\r\n");
+
+	if (backend->status_map(NULL, &map) != FTP_RET_OK || map->complete != chunks)
+		return -1;
+
+	backend->done(NULL);
+
+	/* The FAT file is checked here, the RAM contents by the caller */
+	if (fat) {
+		uint8_t * file = malloc(size);
+		FILE * f = fopen(path, "r");
+		int ok = file && f && fread(file, 1, size, f) == size && memcmp(file, data, size) == 0;
+		if (f)
+			fclose(f);
+		free(file);
+		unlink(path);
+		if (!ok)
+			return -1;
+	}
+
+	return 0;
+
+}
+
+int main(int argc, char * argv[]) {
+
+	int opt, ret = 0;
+	unsigned int i, max = 16 << 20;
+	uint32_t sizes[] = {1 << 20, 4 << 20, 16 << 20};
+	uint8_t * data, * ram;
+
+	while ((opt = getopt(argc, argv, "s:c:l:n:d:")) != -1) {
+		switch (opt) {
+		case 's': fixed_size = atoi(optarg); break;
+		case 'c': chunk_size = atoi(optarg); break;
+		case 'l': loss = atoi(optarg); break;
+		case 'n': repeats = atoi(optarg); break;
+		case 'd': dir = optarg; break;
+		default:
+			printf("usage: %s [-s size] [-c chunk size] [-l loss] [-n repeats] [-d dir]\r\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (chunk_size < 1 || chunk_size > FTP_CHUNK_SIZE || loss > 1000 || repeats < 1) {
+		printf("Need chunks of 1 to %d bytes, a loss of at most 1000 and a repeat\r\n", FTP_CHUNK_SIZE);
+		return 1;
+	}
+
+	if (fixed_size)
+		max = fixed_size;
+
+	/* The RAM backend takes a 32 bit address */
+	ram = mmap(NULL, max, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+	data = malloc(max);
+	if (ram == MAP_FAILED || data == NULL) {
+		printf("Failed to allocate %u bytes\r\n", max);
+		return 1;
+	}
+	for (i = 0; i < max; i++)
+		data[i] = rand();
+
+	printf("%u byte chunks, loss %u/1000, status averaged over %u\r\n", chunk_size, loss, repeats);
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		if (fixed_size)
+			sizes[i] = (i == 0) ? fixed_size : 0;
+		if (sizes[i] == 0)
+			continue;
+
+		memset(ram, 0, sizes[i]);
+		if (bench("ram", &backend_ram, data, ram, sizes[i]) != 0 || memcmp(ram, data, sizes[i]) != 0) {
+			printf("RAM backend FAILED\r\n");
+			ret = 1;
+		}
+
+#ifdef BENCH_FAT
+		if (bench("fat", &backend_fat, data, ram, sizes[i]) != 0) {
+			printf("FAT backend FAILED\r\n");
+			ret = 1;
+		}
+#endif
+	}
+
+	return ret;
+
+}
@@ -0,0 +1,312 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* SDCP load test
+ *
+ * Runs the SIA interface on the loopback address and connects many SDCP
+ * clients to it from a second process. Each client keeps a window of data
+ * frames in flight and sends the next one for every ACK. The node delivers
+ * the packets to a socket. Prints once a second the frames per second, and
+ * the resident memory and thread count of the node process.
+ *
+ * usage: bench_sdcp [-n clients] [-w window] [-s size] [-t seconds] [-p port]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <csp/csp.h>
+#include <csp_extra/csp_if_sia.h>
+
+#include "../src/crypto/csp_sha1.h"
+
+#define MY_ADDRESS		1
+#define CLIENT_ADDRESS	2
+#define MY_PORT			10
+#define CLIENT_PORT		11
+
+/* SDCP key shared by the node and the clients */
+static char key[] = "bench_sdcp shared key";
+
+static unsigned int clients = 100, window = 4, size = 100, seconds = 10, port = 56734;
+
+typedef struct {
+	int sock;
+	uint32_t publickey;
+	uint32_t sequence;
+	unsigned int in_flight;
+	unsigned int length;
+	uint8_t buf[SDCP_RX_BUF_SIZE];
+} client_t;
+
+static double now(void) {
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+
+}
+
+/* HMAC-SHA1 of the sequence number and public key, little endian, and the payload */
+static void checksum(uint32_t sequence, uint32_t publickey, const uint8_t * data, unsigned int length, uint8_t * out) {
+
+	uint8_t k[SHA1_BLOCKSIZE], pad[SHA1_BLOCKSIZE], prefix[8], digest[SHA1_DIGESTSIZE];
+	csp_sha1_state sha1;
+	int i;
+
+	memset(k, 0, sizeof(k));
+	memcpy(k, key, strlen(key));
+	for (i = 0; i < 4; i++) {
+		prefix[i] = sequence >> (8 * i);
+		prefix[4 + i] = publickey >> (8 * i);
+	}
+
+	for (i = 0; i < SHA1_BLOCKSIZE; i++)
+		pad[i] = k[i] ^ 0x36;
+	csp_sha1_init(&sha1);
+	csp_sha1_process(&sha1, pad, SHA1_BLOCKSIZE);
+	csp_sha1_process(&sha1, prefix, sizeof(prefix));
+	csp_sha1_process(&sha1, data, length);
+	csp_sha1_done(&sha1, digest);
+
+	for (i = 0; i < SHA1_BLOCKSIZE; i++)
+		pad[i] = k[i] ^ 0x5c;
+	csp_sha1_init(&sha1);
+	csp_sha1_process(&sha1, pad, SHA1_BLOCKSIZE);
+	csp_sha1_process(&sha1, digest, SHA1_DIGESTSIZE);
+	csp_sha1_done(&sha1, out);
+
+}
+
+/* Send one data frame carrying a CSP packet to the node */
+static int client_send(client_t * c) {
+
+	uint8_t frame[sizeof(csp_sdcp_packet_t) + sizeof(uint32_t) + 256];
+	csp_sdcp_packet_t * h = (csp_sdcp_packet_t *) frame;
+	unsigned int length = sizeof(uint32_t) + size;
+	csp_id_t id;
+
+	id.ext = 0;
+	id.pri = CSP_PRIO_NORM;
+	id.src = CLIENT_ADDRESS;
+	id.dst = MY_ADDRESS;
+	id.dport = MY_PORT;
+	id.sport = CLIENT_PORT;
+	id.ext = htonl(id.ext);
+
+	memset(h, 0, sizeof(*h));
+	h->type = CSP_SDCP_DATA;
+	h->length = length;
+	h->sequence = c->sequence;
+	memcpy(h->data, &id, sizeof(id));
+	memset(h->data + sizeof(id), 0x55, size);
+	checksum(c->sequence, c->publickey, h->data, length, h->checksum);
+
+	if (send(c->sock, frame, sizeof(*h) + length, MSG_NOSIGNAL) != (ssize_t) (sizeof(*h) + length))
+		return -1;
+
+	c->sequence++;
+	c->in_flight++;
+	return 0;
+
+}
+
+/* Handle the frames from the node, and refill the window */
+static int client_rx(client_t * c) {
+
+	csp_sdcp_packet_t h;
+	unsigned int offset = 0;
+	int n;
+
+	n = recv(c->sock, c->buf + c->length, sizeof(c->buf) - c->length, 0);
+	if (n <= 0)
+		return -1;
+	c->length += n;
+
+	while (c->length - offset >= sizeof(h)) {
+		memcpy(&h, c->buf + offset, sizeof(h));
+		if (c->length - offset < sizeof(h) + h.length)
+			break;
+		if (h.type == CSP_SDCP_KEYEXCHANGE && h.length >= sizeof(c->publickey))
+			memcpy(&c->publickey, c->buf + offset + sizeof(h), sizeof(c->publickey));
+		else if (h.type == CSP_SDCP_ACK && c->in_flight > 0)
+			c->in_flight--;
+		offset += sizeof(h) + h.length;
+	}
+	memmove(c->buf, c->buf + offset, c->length - offset);
+	c->length -= offset;
+
+	while (c->publickey != SDCP_PUBLICKEY_NON && c->in_flight < window)
+		if (client_send(c) != 0)
+			return -1;
+
+	return 0;
+
+}
+
+/* Runs in its own process, so the node process only holds the node */
+static void run_clients(void) {
+
+	struct sockaddr_in addr;
+	struct epoll_event ev, events[64];
+	client_t * c;
+	unsigned int i;
+	int ep, n, flag = 1;
+
+	c = calloc(clients, sizeof(*c));
+	ep = epoll_create(clients);
+	if (c == NULL || ep < 0)
+		exit(1);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	for (i = 0; i < clients; i++) {
+		c[i].sock = socket(AF_INET, SOCK_STREAM, 0);
+		if (c[i].sock < 0 || connect(c[i].sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+			printf("Client %u failed to connect: %s\r\n", i, strerror(errno));
+			exit(1);
+		}
+		setsockopt(c[i].sock, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = &c[i];
+		epoll_ctl(ep, EPOLL_CTL_ADD, c[i].sock, &ev);
+	}
+
+	while (1) {
+		n = epoll_wait(ep, events, 64, -1);
+		for (i = 0; i < (unsigned int) n; i++) {
+			if (client_rx(events[i].data.ptr) != 0) {
+				printf("Client lost its connection\r\n");
+				exit(1);
+			}
+		}
+	}
+
+}
+
+static void memory(unsigned int * rss, unsigned int * threads) {
+
+	char line[128];
+	FILE * f = fopen("/proc/self/status", "r");
+
+	*rss = *threads = 0;
+	if (f == NULL)
+		return;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		sscanf(line, "VmRSS: %u", rss);
+		sscanf(line, "Threads: %u", threads);
+	}
+	fclose(f);
+
+}
+
+int main(int argc, char * argv[]) {
+
+	int opt;
+	unsigned int last = 0, total, rss, threads;
+	double start, next;
+	pid_t pid;
+	csp_packet_t * packet;
+	csp_socket_t * sock;
+
+	while ((opt = getopt(argc, argv, "n:w:s:t:p:")) != -1) {
+		switch (opt) {
+		case 'n': clients = atoi(optarg); break;
+		case 'w': window = atoi(optarg); break;
+		case 's': size = atoi(optarg); break;
+		case 't': seconds = atoi(optarg); break;
+		case 'p': port = atoi(optarg); break;
+		default:
+			printf("usage: %s [-n clients] [-w window] [-s size] [-t seconds] [-p port]\r\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (clients < 1 || window < 1 || size > 256 || seconds < 1) {
+		printf("Need at least one client, a window and packets of up to 256 bytes\r\n");
+		return 1;
+	}
+
+	/* Every client can have a window waiting in the router */
+	csp_buffer_init(clients * window + 100, 300);
+	csp_init(MY_ADDRESS);
+	csp_debug_set_level(CSP_ERROR, false);
+	csp_debug_set_level(CSP_WARN, false);
+	csp_debug_set_level(CSP_INFO, false);
+	csp_route_start_task(1000, 0);
+	if (csp_sia_init(port, "127.0.0.1", key) != CSP_ERR_NONE) {
+		printf("Failed to start SIA on port %u\r\n", port);
+		return 1;
+	}
+
+	sock = csp_socket(CSP_SO_CONN_LESS);
+	csp_bind(sock, MY_PORT);
+	usleep(100000);
+
+	pid = fork();
+	if (pid == 0)
+		run_clients();
+
+	printf("%u clients, window %u, %u byte packets\r\n", clients, window, size);
+	start = now();
+	next = start + 1;
+	total = 0;
+
+	while (now() < start + seconds) {
+		packet = csp_recvfrom(sock, 100);
+		if (packet != NULL) {
+			csp_buffer_free(packet);
+			total++;
+		}
+		if (now() >= next) {
+			memory(&rss, &threads);
+			printf("%u frames/s, rss %u kB, %u threads, %"PRIu32" dropped\r\n",
+					total - last, rss, threads, csp_if_sia.drop);
+			last = total;
+			next += 1;
+		}
+	}
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+
+	printf("%u frames in %u s, %.0f frames/s\r\n", total, seconds, total / (now() - start));
+
+	/* At least a frame per client must have got through */
+	return total >= clients ? 0 : 1;
+
+}
@@ -0,0 +1,211 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* The FatFs calls used by backend_fat, on host files. Only the types and
+ * constants come from the FatFs headers, so this is linked instead of the
+ * FatFs library. Directories are not supported. */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/stat.h>
+
+#include <fat_sd/ffconf.h>
+#include <fat_sd/ff.h>
+
+#include "ff_posix.h"
+
+/* backend_fat has a data file and a map file open */
+#define MAX_FILES	4
+
+static struct {
+	FIL * fp;
+	int fd;
+	ff_posix_count_t * count;
+} files[MAX_FILES];
+
+static ff_posix_stats_t stats;
+
+void ff_posix_stats(ff_posix_stats_t * out) {
+
+	*out = stats;
+	memset(&stats, 0, sizeof(stats));
+
+}
+
+static int file_find(FIL * fp) {
+
+	int i;
+
+	for (i = 0; i < MAX_FILES; i++)
+		if (files[i].fp == fp)
+			return i;
+
+	return -1;
+
+}
+
+FRESULT f_open(FIL * fp, const TCHAR * path, BYTE mode) {
+
+	int i, fd, flags = O_RDWR;
+	size_t len = strlen(path);
+	struct stat st;
+
+	if (mode & FA_CREATE_ALWAYS)
+		flags |= O_CREAT | O_TRUNC;
+	else if (mode & FA_OPEN_ALWAYS)
+		flags |= O_CREAT;
+
+	i = file_find(fp);
+	if (i < 0)
+		i = file_find(NULL);
+	if (i < 0)
+		return FR_TOO_MANY_OPEN_FILES;
+
+	fd = open(path, flags, 0644);
+	if (fd < 0)
+		return FR_NO_FILE;
+	fstat(fd, &st);
+
+	files[i].fp = fp;
+	files[i].fd = fd;
+	files[i].count = (len > 4 && strcmp(path + len - 4, ".MAP") == 0) ? &stats.map : &stats.data;
+	fp->fptr = 0;
+	fp->fsize = st.st_size;
+
+	return FR_OK;
+
+}
+
+FRESULT f_close(FIL * fp) {
+
+	int i = file_find(fp);
+
+	if (i < 0)
+		return FR_INVALID_OBJECT;
+
+	close(files[i].fd);
+	files[i].fp = NULL;
+
+	return FR_OK;
+
+}
+
+FRESULT f_read(FIL * fp, void * buff, UINT btr, UINT * br) {
+
+	int i = file_find(fp);
+	ssize_t n;
+
+	if (i < 0)
+		return FR_INVALID_OBJECT;
+
+	n = pread(files[i].fd, buff, btr, fp->fptr);
+	if (n < 0)
+		return FR_DISK_ERR;
+	files[i].count->reads++;
+	files[i].count->read_bytes += n;
+	fp->fptr += n;
+	if (br)
+		*br = n;
+
+	return FR_OK;
+
+}
+
+FRESULT f_write(FIL * fp, const void * buff, UINT btw, UINT * bw) {
+
+	int i = file_find(fp);
+	ssize_t n;
+
+	if (i < 0)
+		return FR_INVALID_OBJECT;
+
+	n = pwrite(files[i].fd, buff, btw, fp->fptr);
+	if (n < 0)
+		return FR_DISK_ERR;
+	files[i].count->writes++;
+	files[i].count->write_bytes += n;
+	fp->fptr += n;
+	if (fp->fptr > fp->fsize)
+		fp->fsize = fp->fptr;
+	if (bw)
+		*bw = n;
+
+	return FR_OK;
+
+}
+
+FRESULT f_lseek(FIL * fp, DWORD ofs) {
+
+	if (file_find(fp) < 0)
+		return FR_INVALID_OBJECT;
+
+	fp->fptr = ofs;
+
+	return FR_OK;
+
+}
+
+FRESULT f_sync(FIL * fp) {
+
+	int i = file_find(fp);
+
+	if (i < 0)
+		return FR_INVALID_OBJECT;
+
+	files[i].count->syncs++;
+
+	return fdatasync(files[i].fd) == 0 ? FR_OK : FR_DISK_ERR;
+
+}
+
+FRESULT f_unlink(const TCHAR * path) {
+
+	return unlink(path) == 0 ? FR_OK : FR_NO_FILE;
+
+}
+
+FRESULT f_stat(const TCHAR * path, FILINFO * fno) {
+
+	struct stat st;
+
+	if (stat(path, &st) != 0)
+		return FR_NO_FILE;
+
+	fno->fsize = st.st_size;
+	fno->fattrib = S_ISDIR(st.st_mode) ? AM_DIR : 0;
+
+	return FR_OK;
+
+}
+
+FRESULT f_opendir(FATDIR * dp, const TCHAR * path) {
+
+	return FR_NO_PATH;
+
+}
+
+FRESULT f_readdir(FATDIR * dp, FILINFO * fno) {
+
+	return FR_NO_PATH;
+
+}
@@ -0,0 +1,37 @@
+/**
+ * @file ff_posix.h
+ * FatFs calls of the FTP FAT backend on host files
+ *
+ * Lets the benchmarks run backend_fat on a posix host. Paths are host
+ * paths, and each f_write, f_read and f_sync is counted, split by data
+ * files and .MAP chunk map files.
+ *
+ * Copyright 2012 GomSpace ApS. All rights reserved.
+ */
+
+#ifndef _FF_POSIX_H_
+#define _FF_POSIX_H_
+
+#include <stdint.h>
+
+/** Counters of one kind of file */
+typedef struct {
+	uint32_t writes;			//! f_write calls
+	uint32_t write_bytes;		//! Bytes written
+	uint32_t reads;				//! f_read calls
+	uint32_t read_bytes;		//! Bytes read
+	uint32_t syncs;				//! f_sync calls
+} ff_posix_count_t;
+
+typedef struct {
+	ff_posix_count_t data;		//! Data files
+	ff_posix_count_t map;		//! Chunk map files
+} ff_posix_stats_t;
+
+/**
+ * Read and clear the counters
+ * @param stats returns the counters since the last call
+ */
+void ff_posix_stats(ff_posix_stats_t * stats);
+
+#endif /* _FF_POSIX_H_ */
@@ -0,0 +1,256 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* FTP STATUS over a lossy link
+ *
+ * Uploads a file of random bytes to the RAM backend of an FTP server on the
+ * same node with a data window, over csp_if_link of the libcsp tests. The
+ * link drops the given fraction of all packets: chunks, acknowledgements,
+ * STATUS requests and status map segments alike. Lost chunks are repaired
+ * with STATUS until the CRC of the uploaded file matches. A STATUS round
+ * with lost segments asks again for the map, so a round must end with the
+ * whole map known to the client.
+ *
+ * Runs 5% and 20% loss unless a loss is given, and reports per loss the
+ * transfer time, the STATUS rounds, the STATUS requests sent, the segments
+ * sent and lost, and checks the RAM contents against the file. The client
+ * and server progress output is discarded. Build with --enable-ftp-server
+ * --enable-ftp-client --enable-io-examples --enable-examples.
+ *
+ * usage: test_ftp_status [-s size] [-c chunk size] [-d delay] [-r rate]
+ *                        [-q queue] [-w window] [-l loss]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <sys/mman.h>
+
+#include <csp/csp.h>
+#include <csp/arch/csp_thread.h>
+
+#include <ftp/ftp_server.h>
+#include <ftp/ftp_client.h>
+
+#include "csp_if_link.h"
+
+#define MY_ADDRESS	1
+#define FTP_PORT	7
+
+/* STATUS and DATA rounds before an upload is given up */
+#define MAX_ROUNDS	50
+
+static unsigned int size = 1048576, chunk_size = 200, window = 16;
+
+/* FTP packets seen by the link, no RDP header in a windowed upload */
+static volatile unsigned int requests, segments, segments_lost;
+
+static double now(void) {
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+
+}
+
+static void tap(csp_packet_t * packet, int event) {
+
+	if (packet->length < 1)
+		return;
+
+	if (packet->data[0] == FTP_STATUS_REQUEST && event == CSP_LINK_SENT)
+		requests++;
+	if (packet->data[0] == FTP_STATUS_MAP && event == CSP_LINK_SENT)
+		segments++;
+	if (packet->data[0] == FTP_STATUS_MAP && event == CSP_LINK_LOST) {
+		segments++;
+		segments_lost++;
+	}
+
+}
+
+CSP_DEFINE_TASK(task_ftp_conn) {
+
+	task_ftp(param);
+
+	return CSP_TASK_RETURN;
+
+}
+
+CSP_DEFINE_TASK(task_server) {
+
+	csp_conn_t * conn;
+	csp_thread_handle_t handle;
+	csp_socket_t * sock = csp_socket(CSP_SO_NONE);
+
+	csp_bind(sock, FTP_PORT);
+	csp_listen(sock, 5);
+
+	while (1) {
+		conn = csp_accept(sock, CSP_MAX_DELAY);
+		if (conn != NULL)
+			csp_thread_create(task_ftp_conn, (signed char *) "FTP", 1000, conn, 0, &handle);
+	}
+
+	return CSP_TASK_RETURN;
+
+}
+
+/* Upload the file, repairing lost chunks until the CRC matches. Returns
+ * the number of STATUS rounds, or -1 */
+static int upload(const char * path, uint8_t * ram) {
+
+	int rounds, ret = -1;
+	uint32_t addr = (uint32_t) (uintptr_t) ram;
+
+	ftp_set_window(window);
+	if (ftp_upload(MY_ADDRESS, FTP_PORT, path, BACKEND_RAM, chunk_size, addr, "ram", NULL, NULL) != 0)
+		return -1;
+
+	for (rounds = 1; rounds <= MAX_ROUNDS; rounds++) {
+		if (ftp_status_request() != 0 || ftp_data(0) != 0)
+			break;
+		if (ftp_crc() == 0) {
+			ret = rounds;
+			break;
+		}
+	}
+
+	if (ftp_done() != 0)
+		ret = -1;
+
+	return ret;
+
+}
+
+int main(int argc, char * argv[]) {
+
+	int opt, fd, out, rounds, ret = 0;
+	unsigned int i, run, runs = 2;
+	uint32_t losses[] = {50, 200};
+	char path[] = "/tmp/test_ftp_status.XXXXXX";
+	uint8_t * data, * ram;
+	double start, elapsed;
+	csp_link_conf_t link = {0};
+	csp_link_stats_t stats;
+	csp_thread_handle_t handle;
+
+	link.delay = 20;
+	link.rate = 100000;
+	link.queue = 100;
+
+	while ((opt = getopt(argc, argv, "s:c:d:r:q:w:l:")) != -1) {
+		switch (opt) {
+		case 's': size = atoi(optarg); break;
+		case 'c': chunk_size = atoi(optarg); break;
+		case 'd': link.delay = atoi(optarg); break;
+		case 'r': link.rate = atoi(optarg); break;
+		case 'q': link.queue = atoi(optarg); break;
+		case 'w': window = atoi(optarg); break;
+		case 'l': losses[0] = atoi(optarg); runs = 1; break;
+		default:
+			printf("usage: %s [-s size] [-c chunk size] [-d delay] [-r rate] [-q queue] [-w window] [-l loss]\r\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (size < 1 || chunk_size < 1 || chunk_size > FTP_CHUNK_SIZE || window < 1 || window > FTP_WINDOW_MAX) {
+		printf("Need a file, chunks of 1 to %d bytes and a window of 1 to %d\r\n", FTP_CHUNK_SIZE, FTP_WINDOW_MAX);
+		return 1;
+	}
+
+	/* The RAM backend takes a 32 bit address */
+	ram = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+	data = malloc(size);
+	fd = mkstemp(path);
+	if (ram == MAP_FAILED || data == NULL || fd < 0) {
+		printf("Failed to allocate the file\r\n");
+		return 1;
+	}
+	srand(1);
+	for (i = 0; i < size; i++)
+		data[i] = rand();
+	if (write(fd, data, size) != (ssize_t) size) {
+		printf("Failed to write %s\r\n", path);
+		return 1;
+	}
+	close(fd);
+
+	/* A full window of data in the link, with acknowledgements and status */
+	csp_buffer_init(2 * FTP_WINDOW_MAX + 100, FTP_CHUNK_SIZE + 32 + CSP_BUFFER_PACKET_OVERHEAD);
+	csp_init(MY_ADDRESS);
+	csp_debug_set_level(CSP_ERROR, false);
+	csp_debug_set_level(CSP_WARN, false);
+
+	/* Send to ourselves over the emulated link */
+	csp_link_init(&link, 1);
+	csp_link_tap(tap);
+	csp_route_set(MY_ADDRESS, &csp_if_link, CSP_NODE_MAC);
+	csp_route_start_task(1000, 1);
+
+	ftp_register_backend(BACKEND_RAM, &backend_ram);
+	csp_thread_create(task_server, (signed char *) "SERVER", 1000, NULL, 0, &handle);
+
+	printf("%u bytes in %u byte chunks, window %u, delay %"PRIu32" ms, rate %"PRIu32" B/s, queue %"PRIu32"\r\n",
+			size, chunk_size, window, link.delay, link.rate, link.queue);
+
+	out = dup(STDOUT_FILENO);
+	for (run = 0; run < runs; run++) {
+		link.loss = losses[run];
+		csp_link_set(&link);
+		memset(ram, 0, size);
+		csp_link_stats(&stats);
+		requests = segments = segments_lost = 0;
+
+		/* Keep the progress output off the results */
+		fflush(stdout);
+		fd = open("/dev/null", O_WRONLY);
+		dup2(fd, STDOUT_FILENO);
+		close(fd);
+
+		start = now();
+		rounds = upload(path, ram);
+		elapsed = now() - start;
+
+		fflush(stdout);
+		dup2(out, STDOUT_FILENO);
+		csp_link_stats(&stats);
+
+		printf("loss %3"PRIu32"/1000: ", link.loss);
+		if (rounds < 0 || memcmp(ram, data, size) != 0) {
+			printf("FAILED after %.2f s\r\n", elapsed);
+			ret = 1;
+			continue;
+		}
+		printf("%6.2f s, %d status rounds, %u status requests, %u of %u segments lost, %"PRIu32" packets lost\r\n",
+				elapsed, rounds, requests, segments_lost, segments, stats.lost);
+	}
+
+	unlink(path);
+
+	return ret;
+
+}
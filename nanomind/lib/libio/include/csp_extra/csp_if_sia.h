@@ -22,7 +22,7 @@
  */
 /* Struct binding IP to node */
 typedef struct csp_sia_route_s {
-	char * ip;
+	uint32_t ip;	/* IPv4 address in network order, 0 if no route */
 } csp_sia_route_t;
 
 /* Interface */
@@ -46,29 +46,18 @@ void csp_sia_rx(csp_packet_t * packet);
 #define SDCP_KEEPALIVE_PERIODE 300 // Send each 5 min
 #define SDCP_PUBLICKEY_NON 0
 
+/* Receive buffer per connection. Frames are parsed where they are received,
+ * so this limits the largest SDCP frame that can be received */
+#define SDCP_RX_BUF_SIZE 4096
+
+/* Number of buckets in the connection table */
+#define SDCP_CONN_HASH 64
+
 typedef enum csp_sdcp_conn_state_s {
 	CSP_SDCP_STATE_OPEN		= 1,
 	CSP_SDCP_STATE_CLOSING	= 0,
 } csp_sdcp_conn_state_t;
 
-/* Struct for linked list of active connections */
-typedef struct csp_sdcp_conn_s {
-	int sock;
-	char ip[20];
-	uint32_t sequence_tx;
-	uint32_t sequence_rx;
-	uint32_t publickey;
-	sem_t lock;
-	sem_t sendlock;
-	pthread_mutex_t sig_mutex;
-	pthread_cond_t signal;
-	int packet_acked;
-	csp_sdcp_conn_state_t state;
-	uint32_t lastpacket;
-	int lastpacket_time;
-	struct csp_sdcp_conn_s *next;
-} csp_sdcp_conn_t;
-
 /* enum for types for SDCP packet */
 typedef enum csp_sdcp_packet_type_s {
 	CSP_SDCP_DATA 			= 0,
@@ -92,25 +81,40 @@ typedef struct csp_sdcp_packet_s {
 	uint8_t data[0];
 } csp_sdcp_packet_t;
 
+/* Struct for an open connection. Connections are found by address through
+ * a hash table, and served by a single epoll task */
+typedef struct csp_sdcp_conn_s {
+	int sock;
+	uint32_t addr;			/* Peer IPv4 address in network order */
+	char ip[20];
+	uint32_t sequence_tx;
+	uint32_t sequence_rx;
+	uint32_t publickey;
+	sem_t lock;
+	sem_t sendlock;
+	pthread_mutex_t sig_mutex;
+	pthread_cond_t signal;
+	int packet_acked;
+	csp_sdcp_conn_state_t state;
+	uint32_t lastpacket;
+	int lastpacket_time;
+	int refcount;			/* Tables and senders using the connection */
+	uint32_t rx_head;		/* Start of the first unparsed frame in rx_buf */
+	uint32_t rx_tail;		/* End of received data in rx_buf */
+	uint8_t rx_buf[SDCP_RX_BUF_SIZE];
+	struct csp_sdcp_conn_s *next;
+} csp_sdcp_conn_t;
+
 typedef void (*csp_sdcp_rx_func)(csp_packet_t * packet);
 
 int csp_sdcp_init(uint16_t port, char * ip, csp_sdcp_rx_func rxRef, char* privatekey);
 void csp_sdcp_setprivatekey(char * privatekey);
-void* csp_sdcp_newconn_task(void * pvParameters);
-void* csp_sdcp_rx_task(void * pvParameters);
-void* csp_sdcp_keepaliveTask(void * pvParameters);
+void* csp_sdcp_task(void * pvParameters);
 
 int csp_sdcp_tx(char * IPaddress, csp_packet_t * packet, unsigned int timeout);
-csp_sdcp_conn_t * csp_sdcp_findconn(char * IPaddress);
-csp_sdcp_conn_t* csp_sdcp_connect(char* IP);
-void csp_sdcp_insert_checksum(csp_sdcp_packet_t * sdcp_packet, csp_sdcp_conn_t * connection);
 int csp_sdcp_send_packet(csp_sdcp_conn_t * connection, csp_sdcp_packet_type type, void * data, uint32_t length);
 void csp_sdcp_close(char * IP);
 
-void csp_sdcp_conn_insert(csp_sdcp_conn_t * newNode);
-void csp_sdcp_conn_remove(csp_sdcp_conn_t * conn);
-csp_sdcp_conn_t * csp_sdcp_conn_find(char * IPaddress);
-
 
 
 #endif /* CSP_IF_SIP_H_ */
@@ -14,6 +14,13 @@
 typedef void (*ftp_progress_handler)(uint32_t current_chunk, uint32_t total_chunks, double bps, void *data);
 void ftp_set_progress_handler(ftp_progress_handler handler, void *data);
 
+/* Number of chunks ftp_data may send ahead of the acknowledgements, 0 sends
+ * the upload over RDP. Size it to the bandwidth-delay product of the link,
+ * chunks beyond what the link can buffer are lost and must be repaired with
+ * STATUS. Applies to the next upload, which falls back to RDP if the server
+ * does not support windows */
+void ftp_set_window(unsigned int window);
+
 int ftp_upload(uint8_t host, uint8_t port, const char * path, uint8_t type, int chunk_size, uint32_t addr, const char * remote_path, uint32_t * size, uint32_t * checksum);
 int ftp_download(uint8_t host, uint8_t port, const char * path, uint8_t backend, int chunk_size, uint32_t memaddr, uint32_t memsize, const char * remote_path, uint32_t * size);
 int ftp_status_request(void);
@@ -0,0 +1,110 @@
+/**
+ * @file ftp_map.h
+ * FTP chunk map
+ *
+ * One bit per chunk, set when the chunk has been received. The map is kept
+ * in RAM and persisted by the owner in aligned blocks covering the words
+ * changed since the last write, so a map file is written every
+ * FTP_MAP_FLUSH chunks instead of once per chunk. The map file holds the
+ * words in host byte order.
+ *
+ * Copyright 2012 GomSpace ApS. All rights reserved.
+ */
+
+#ifndef _FTP_MAP_H_
+#define _FTP_MAP_H_
+
+#include <stdint.h>
+#include <ftp/ftp_types.h>
+
+/** Map file writes are aligned to and sized in blocks of this many bytes */
+#define FTP_MAP_BLOCK 512
+
+/** Number of chunks set before the map should be persisted */
+#define FTP_MAP_FLUSH 64
+
+typedef struct {
+	uint32_t * bits;			//! Bit per chunk, set when received
+	uint32_t chunks;			//! Number of chunks
+	uint32_t complete;			//! Number of bits set
+	uint32_t dirty_first;		//! First word changed since last persist
+	uint32_t dirty_last;		//! Last word changed since last persist
+	unsigned int unsaved;		//! Chunks set since last persist
+} ftp_map_t;
+
+/**
+ * Allocate a map with all chunks missing
+ * @return 0 on success, -1 if out of memory
+ */
+int ftp_map_init(ftp_map_t * map, uint32_t chunks);
+
+/** Free the map bits, leaving an empty map */
+void ftp_map_free(ftp_map_t * map);
+
+/** Size of the map in bytes, which is also the size of the map file */
+uint32_t ftp_map_size(const ftp_map_t * map);
+
+/**
+ * Recount the map after its bits were read from a map file
+ */
+void ftp_map_loaded(ftp_map_t * map);
+
+/** Return 1 if chunk was received */
+int ftp_map_get(const ftp_map_t * map, uint32_t chunk);
+
+/**
+ * Mark chunk as received
+ * @return 1 if FTP_MAP_FLUSH chunks are now waiting to be persisted
+ */
+int ftp_map_set(ftp_map_t * map, uint32_t chunk);
+
+/** Mark chunk as missing */
+void ftp_map_clear(ftp_map_t * map, uint32_t chunk);
+
+/**
+ * Find the next run of missing chunks
+ * @param chunk first chunk to look at
+ * @param count returns the length of the run
+ * @return first missing chunk, or map->chunks if there is none
+ */
+uint32_t ftp_map_next_missing(const ftp_map_t * map, uint32_t chunk, uint32_t * count);
+
+/**
+ * Get the part of the map file that must be written
+ * The range is aligned to FTP_MAP_BLOCK and ends at most at ftp_map_size.
+ * @return 1 if there is something to write, 0 otherwise
+ */
+int ftp_map_dirty(const ftp_map_t * map, uint32_t * offset, uint32_t * length);
+
+/** Mark the map as persisted */
+void ftp_map_clean(ftp_map_t * map);
+
+/**
+ * Fill a status reply with the first FTP_STATUS_CHUNKS runs of missing
+ * chunks. All fields are converted to network byte order.
+ */
+void ftp_map_status(const ftp_map_t * map, ftp_status_reply_t * status);
+
+/**
+ * Find the next status map segment holding a missing chunk
+ * @param first chunk to start from, a multiple of FTP_STATUS_MAP_CHUNKS
+ * @return first chunk of the segment, or map->chunks if there is none
+ */
+uint32_t ftp_map_next_segment(const ftp_map_t * map, uint32_t first);
+
+/**
+ * Copy a status map segment out of the map
+ * @param first first chunk of the segment, a multiple of FTP_STATUS_MAP_CHUNKS
+ * @param bits FTP_STATUS_MAP_CHUNKS / 8 bytes, LSB first
+ * @return number of bytes used, the rest of bits is cleared
+ */
+unsigned int ftp_map_segment_get(const ftp_map_t * map, uint32_t first, uint8_t * bits);
+
+/**
+ * Replace a status map segment in the map
+ * @param first first chunk of the segment, a multiple of FTP_STATUS_MAP_CHUNKS
+ * @param bits segment bits, LSB first, or NULL to mark the segment received
+ */
+void ftp_map_segment_set(ftp_map_t * map, uint32_t first, const uint8_t * bits);
+
+#endif /* _FTP_MAP_H_ */
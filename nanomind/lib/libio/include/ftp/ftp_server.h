@@ -10,6 +10,7 @@
 
 #include <stdint.h>
 #include <ftp/ftp_types.h>
+#include <ftp/ftp_map.h>
 
 enum {
 	BACKEND_RAM			= 0,
@@ -17,6 +18,10 @@ enum {
 	BACKEND_UFFS		= 2,
 };
 
+/** Files are read in blocks of this size to calculate their CRC, a
+ * multiple of the FAT sector size */
+#define FTP_CRC_BLOCK 512
+
 typedef enum {
 	FTP_STATE_IDLE 		= 0,
 	FTP_STATE_UPLOAD 	= 1,
@@ -57,6 +62,12 @@ typedef struct {
 	ftp_return_t (*abort)(void * state);
 	/* Timeout of transfer */
 	ftp_return_t (*timeout)(void * state);
+	/* Get chunk map, optional. Used instead of status_get for status replies */
+	ftp_return_t (*status_map)(void * state, ftp_map_t ** map);
+	/* CRC reads the whole file back instead of continuing the CRC of the
+	 * chunks written in order, to catch write errors of the medium.
+	 * Ignored by the RAM backend */
+	int crc_readback;
 } ftp_backend_t;
 
 extern ftp_backend_t backend_ram;
@@ -65,4 +76,8 @@ extern ftp_backend_t backend_uffs;
 
 int ftp_register_backend(uint8_t id, ftp_backend_t *backend);
 
+/* Serve an FTP connection, run as a task per accepted connection. Closes
+ * the connection and exits the task when done */
+void task_ftp(void * conn_param);
+
 #endif /* TASK_UPLOAD_H_ */
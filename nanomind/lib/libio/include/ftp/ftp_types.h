@@ -20,6 +20,12 @@
 /** Number of chunks in status message */
 #define FTP_STATUS_CHUNKS 10
 
+/** Number of chunks covered by a status map segment */
+#define FTP_STATUS_MAP_CHUNKS 1024
+
+/** Maximum number of unacknowledged chunks in a windowed upload */
+#define FTP_WINDOW_MAX 256
+
 /** FTP Type enumeration */
 typedef enum __attribute__ ((__packed__)) {
 	FTP_UPLOAD_REQUEST		= 0, 	/**< New upload request */
@@ -40,6 +46,8 @@ typedef enum __attribute__ ((__packed__)) {
 	FTP_DATA				= 16, 	/**< Data chunk */
 	FTP_DONE				= 17,	/**< Transfer done */
 	FTP_ABORT				= 18,	/**< Abort transfer */
+	FTP_DATA_ACK			= 19,	/**< Data acknowledgement */
+	FTP_STATUS_MAP			= 20,	/**< Status map segment */
 } ftp_type_t;
 
 /** FTP return codes */
@@ -64,11 +72,13 @@ typedef struct {
 	uint8_t backend;
 	uint32_t mem_addr;
 	char path[FTP_PATH_LENGTH];
+	uint16_t window;			//! Data window in chunks, 0 for none. Omitted by old clients
 } __attribute__ ((__packed__)) ftp_upload_request_t;
 
 /** Upload file reply */
 typedef struct {
 	uint8_t ret;
+	uint16_t window;			//! Data window the server acknowledges, 0 for none. Only sent to clients that send a window
 } __attribute__ ((__packed__)) ftp_upload_reply_t;
 
 /** Download file request */
@@ -116,11 +126,29 @@ typedef struct {
 	uint8_t bytes[FTP_CHUNK_SIZE];
 } __attribute__ ((__packed__)) ftp_data_t;
 
+/** Data acknowledgement, sent every half window during a windowed upload */
+typedef struct {
+	uint32_t chunk;				//! Last chunk received
+	uint32_t received;			//! Chunks received since the upload request
+} __attribute__ ((__packed__)) ftp_data_ack_t;
+
 typedef struct {
 	uint32_t next;
 	uint16_t count;
 } __attribute__ ((__packed__)) ftp_status_element_t;
 
+/** Status request modes */
+typedef enum __attribute__ ((__packed__)) {
+	FTP_STATUS_MODE_RUNS	= 0,	/**< Single status reply, first FTP_STATUS_CHUNKS runs */
+	FTP_STATUS_MODE_MAP		= 1,	/**< Status map segments covering every missing chunk */
+} ftp_status_mode_t;
+
+/** Status request. Old clients send the type only, which selects runs */
+typedef struct {
+	uint8_t mode;
+	uint8_t seq;				//! Echoed in status map segments
+} __attribute__ ((__packed__)) ftp_status_request_t;
+
 /** Status packet */
 typedef struct {
 	uint8_t ret;
@@ -130,6 +158,19 @@ typedef struct {
 	ftp_status_element_t entry[FTP_STATUS_CHUNKS];
 } __attribute__ ((__packed__)) ftp_status_reply_t;
 
+/** Status map segment. Segments without missing chunks are not sent, so
+ * when all segments arrive, chunks outside them have been received. */
+typedef struct {
+	uint8_t ret;
+	uint8_t seq;				//! Sequence number of the request
+	uint32_t complete;
+	uint32_t total;
+	uint16_t segment;			//! Index of this segment in the reply
+	uint16_t segments;			//! Number of segments in the reply, 0 if complete
+	uint32_t first;				//! First chunk, a multiple of FTP_STATUS_MAP_CHUNKS
+	uint8_t bits[FTP_STATUS_MAP_CHUNKS / 8];	//! Bit set for received chunks, LSB first
+} __attribute__ ((__packed__)) ftp_status_map_t;
+
 /** List files request */
 typedef struct {
 	uint8_t backend;
@@ -175,9 +216,12 @@ typedef struct {
 
 		/* Data */
 		ftp_data_t data;
+		ftp_data_ack_t dataack;
 
-		/* Status reply */
+		/* Status */
+		ftp_status_request_t statusreq;
 		ftp_status_reply_t statusrep;
+		ftp_status_map_t statusmap;
 
 		/* Listing */
 		ftp_list_request_t list;
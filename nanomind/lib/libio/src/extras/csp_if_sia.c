@@ -25,17 +25,22 @@ Author: Martin Dam
 #include <stdlib.h>
 #include <string.h>     /* for memset() */
 #include <unistd.h>     /* for close() */
+#include <errno.h>
+#include <fcntl.h>
 #include <time.h>
 #include <sys/time.h>
-#include <dev/x86/ipsocket.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 
 #include <csp/csp.h>
 #include <csp/csp_platform.h>
 #include <csp/csp_interface.h>
 #include <csp_extra/csp_if_sia.h>
 
-#include <util/log.h>
-
 #include <csp/arch/csp_semaphore.h>
 #include <csp/arch/csp_queue.h>
 
@@ -60,6 +65,8 @@ static uint8_t csp_sia_initated = 0;
 
 static char csp_sia_myaddress[16];
 
+static int csp_sdcp_tx_addr(uint32_t addr, csp_packet_t * packet, unsigned int timeout);
+
 
 
 /** Initiate static ip TCP/IP interface
@@ -82,10 +89,10 @@ int csp_sia_init(uint16_t port, char * ip, char * privatekey) {
 		return -1;
 	}
 
-	/* Initiate the routing table by setting all to NULL */
+	/* Initiate the routing table by clearing all addresses */
 	int i = 0;
 	for(i = 0; i < CSP_ID_HOST_MAX+3; i++) {
-		sia_route[i].ip = NULL;
+		sia_route[i].ip = 0;
 	}
 	// Initiate SDCP driver
 	return csp_sdcp_init(port, ip, csp_sia_rx, privatekey);
@@ -105,19 +112,15 @@ int csp_sia_route_set(uint8_t node, char * IP) {
 		return 0;
 	}
 
-	sem_wait(&sia_route_sem);
-	if(IP == NULL) {
-		if(sia_route[node].ip != NULL) {
-			free(sia_route[node].ip);
-		}
-		sia_route[node].ip = NULL;
-	} else {
-		if(sia_route[node].ip != NULL) {
-			free(sia_route[node].ip);
-		}
-		sia_route[node].ip = (char *)malloc(strlen(IP)+2);
-		strcpy(sia_route[node].ip, IP);
+	struct in_addr addr;
+	addr.s_addr = 0;
+	if(IP != NULL && inet_pton(AF_INET, IP, &addr) != 1) {
+		csp_debug(CSP_WARN, "Invalid IP %s for node %i\r\n", IP, node);
+		return 0;
 	}
+
+	sem_wait(&sia_route_sem);
+	sia_route[node].ip = addr.s_addr;
 	sem_post(&sia_route_sem);
 
 
@@ -139,33 +142,28 @@ int csp_sia_tx(csp_iface_t * interface, csp_packet_t * packet, uint32_t timeout)
 
 	if(csp_sia_initated == 0) return 0;
 
-	char tmpIP[16];
+	/* The CSP id is sent from a copy in network order, so the packet is not modified */
+	uint32_t addr;
 	uint8_t nodeID;					/* Node ID for dest */
 	int returnValue;
-	int i;
-	int nodeAvail = 0;
+	int i, j;
 
 	if(packet->id.dst == CSP_BROADCAST_ADDR) {
 
-		/* Save the outgoing id in the buffer */
-		packet->id.ext = htonl(packet->id.ext);
-		packet->length += 4;
-
 		csp_debug(CSP_INFO, "Sending broadcast packet to all routes\r\n");
 
 		/* Packet is a broadcast, run through the entire routing tabel and send to everyone including default route */
-		// TODO: BUG: If there is set two routes to the same IP, there will be sent to packets to that destination.
 		for(i = 0; i < CSP_ID_HOST_MAX+2; i++) {
 			sem_wait(&sia_route_sem);
-			if(sia_route[i].ip != NULL) {
-				strcpy(tmpIP, sia_route[i].ip);
-				nodeAvail = 1;
-			} else {
-				nodeAvail = 0;
+			addr = sia_route[i].ip;
+			/* Send only once to an address with several routes */
+			for(j = 0; j < i && addr != 0; j++) {
+				if(sia_route[j].ip == addr)
+					addr = 0;
 			}
 			sem_post(&sia_route_sem);
-			if(nodeAvail == 1) {
-				csp_sdcp_tx(tmpIP, packet, timeout);
+			if(addr != 0) {
+				csp_sdcp_tx_addr(addr, packet, timeout);
 			}
 		}
 		returnValue = 1; // Assume all is sent correct
@@ -173,8 +171,8 @@ int csp_sia_tx(csp_iface_t * interface, csp_packet_t * packet, uint32_t timeout)
 	} else {
 		/* Lookup the node in routing table */
 		sem_wait(&sia_route_sem);
-		if(sia_route[packet->id.dst].ip == NULL) {
-			if(sia_route[CSP_DEFAULT_ROUTE].ip == NULL) {
+		if(sia_route[packet->id.dst].ip == 0) {
+			if(sia_route[CSP_DEFAULT_ROUTE].ip == 0) {
 				csp_debug(CSP_ERROR, "No route to %i nor default route\r\n", packet->id.dst);
 				sem_post(&sia_route_sem);
 				// Free the packet
@@ -186,15 +184,10 @@ int csp_sia_tx(csp_iface_t * interface, csp_packet_t * packet, uint32_t timeout)
 		} else {
 			nodeID = packet->id.dst;
 		}
-		strcpy(tmpIP, sia_route[nodeID].ip);
+		addr = sia_route[nodeID].ip;
 		sem_post(&sia_route_sem);
 
-
-		/* Save the outgoing id in the buffer */
-		packet->id.ext = htonl(packet->id.ext);
-		packet->length += 4;
-
-		returnValue = csp_sdcp_tx(tmpIP, packet, timeout);
+		returnValue = csp_sdcp_tx_addr(addr, packet, timeout);
 
 	}
 	// Free the packet
@@ -230,16 +223,28 @@ void csp_sia_rx(csp_packet_t * packet) {
  *****************************************************************************************************************************
  *****************************************************************************************************************************/
 
-/* Create mounting point for linked list of open connections */
-static csp_sdcp_conn_t * sdcp_conn = NULL;
-/* Semaphores for connection list */
+/* Open connections, hashed by peer address */
+static csp_sdcp_conn_t * sdcp_conn[SDCP_CONN_HASH];
+/* Semaphores for connection table */
 static csp_bin_sem_handle_t sdcp_conn_sem;
+/* Serializes outgoing connects, so only one connection is made per address */
+static csp_bin_sem_handle_t sdcp_connect_sem;
+/* epoll instance for the listening socket and all connections */
+static int sdcp_epoll = -1;
+/* Listening socket */
+static int sdcp_listen = -1;
 /* Port number for SDCP. Will be overwriten by the init function */
 uint16_t CSP_SDCP_PORT = 56734;
 /* Pointer to the RX function for the CSP-interface */
 static csp_sdcp_rx_func csp_sdcp_rx_ref;
 /* SDCP password for HMAC */
 char SDCP_PASSWORD[] =  {"q7Wh7jTgXmWSb69iVF8gkiIvQmGUy9IwgrrHAebvpxuB6HU5xVz9cN75GJmqv6K"}; // 63 characters
+/* SHA1 states after absorbing the inner and outer padded password */
+static csp_sha1_state sdcp_hmac_inner;
+static csp_sha1_state sdcp_hmac_outer;
+
+/* Number of epoll events handled per wakeup */
+#define SDCP_EVENTS 32
 
 
 /**
@@ -254,34 +259,33 @@ int csp_sdcp_init(uint16_t port, char * ip, csp_sdcp_rx_func rxRef, char* privat
 	CSP_SDCP_PORT = port;
 	csp_sdcp_rx_ref = rxRef;
 
-	if(csp_bin_sem_create(&sdcp_conn_sem) == CSP_SEMAPHORE_ERROR) {
+	if(csp_bin_sem_create(&sdcp_conn_sem) == CSP_SEMAPHORE_ERROR ||
+			csp_bin_sem_create(&sdcp_connect_sem) == CSP_SEMAPHORE_ERROR) {
 		csp_debug(CSP_ERROR, "No more memory for SDCP connection semaphore\r\n");
 		return CSP_ERR_DRIVER;
 	}
 
+	if((sdcp_epoll = epoll_create(SDCP_CONN_HASH)) < 0) {
+		csp_debug(CSP_ERROR, "epoll_create() failed for SDCP\r\n");
+		return CSP_ERR_DRIVER;
+	}
+
 	/* Start randomizer */
 	srand ( time(NULL) );
 
 	/* Set password */
 	csp_sdcp_setprivatekey(privatekey);
 
-	/* Copy IP address to local memory before passing argument to pthreads 
+	/* Copy IP address to local memory before passing argument to pthreads
 	 * Note: this is needed by JNI at least. */
 	static char ip_copy[16];
 	strcpy(ip_copy, ip);
 
-	/** Create incoming connection task */
+	/** Create SDCP task, it serves all connections and sends keep-alives */
 	pthread_t handle_tcpip;
 	int threadError;
-	if((threadError = pthread_create(&handle_tcpip, NULL, csp_sdcp_newconn_task, (void *) ip_copy)) != 0) {
-		csp_debug(CSP_ERROR, "Creation of TCP/IP incoming task failed: %i\r\n", threadError);
-		return CSP_ERR_DRIVER;
-	}
-
-	/** Create keepalice task */
-	pthread_t handle_keepalive;
-	if((threadError = pthread_create(&handle_keepalive, NULL, csp_sdcp_keepaliveTask, NULL)) != 0) {
-		csp_debug(CSP_ERROR, "Creation of TCP/IP incoming task failed: %i\r\n", threadError);
+	if((threadError = pthread_create(&handle_tcpip, NULL, csp_sdcp_task, (void *) ip_copy)) != 0) {
+		csp_debug(CSP_ERROR, "Creation of TCP/IP task failed: %i\r\n", threadError);
 		return CSP_ERR_DRIVER;
 	}
 
@@ -300,327 +304,438 @@ void csp_sdcp_setprivatekey(char * privatekey) {
 	if(privatekey != NULL) {
 		strcpy(SDCP_PASSWORD, privatekey);
 	}
+
+	/* HMAC (http://en.wikipedia.org/wiki/HMAC) key pads are the same for
+	 * every packet, so hash them once here */
+	uint8_t key[SHA1_BLOCKSIZE];
+	uint8_t pad[SHA1_BLOCKSIZE];
+	int i;
+
+	memset(key, 0, sizeof(key));
+	memcpy(key, SDCP_PASSWORD, strlen(SDCP_PASSWORD));
+
+	for(i = 0; i < SHA1_BLOCKSIZE; i++)
+		pad[i] = key[i] ^ 0x36;
+	csp_sha1_init(&sdcp_hmac_inner);
+	csp_sha1_process(&sdcp_hmac_inner, pad, SHA1_BLOCKSIZE);
+
+	for(i = 0; i < SHA1_BLOCKSIZE; i++)
+		pad[i] = key[i] ^ 0x5c;
+	csp_sha1_init(&sdcp_hmac_outer);
+	csp_sha1_process(&sdcp_hmac_outer, pad, SHA1_BLOCKSIZE);
 }
 
+/**
+ * Calculate the SDCP checksum: HMAC-SHA1 of the sequence number and public key,
+ * both little endian, followed by the payload. The payload is given in two parts.
+ */
+static void csp_sdcp_checksum(uint32_t sequence, uint32_t publickey, const void * data1, uint32_t length1,
+		const void * data2, uint32_t length2, unsigned char * checksum) {
+
+	csp_sha1_state sha1 = sdcp_hmac_inner;
+	uint8_t digest[SHA1_DIGESTSIZE];
+	uint8_t prefix[8];
+
+	prefix[0] = sequence;
+	prefix[1] = sequence >> 8;
+	prefix[2] = sequence >> 16;
+	prefix[3] = sequence >> 24;
+	prefix[4] = publickey;
+	prefix[5] = publickey >> 8;
+	prefix[6] = publickey >> 16;
+	prefix[7] = publickey >> 24;
+
+	csp_sha1_process(&sha1, prefix, sizeof(prefix));
+	if(length1 > 0)
+		csp_sha1_process(&sha1, data1, length1);
+	if(length2 > 0)
+		csp_sha1_process(&sha1, data2, length2);
+	csp_sha1_done(&sha1, digest);
+
+	sha1 = sdcp_hmac_outer;
+	csp_sha1_process(&sha1, digest, SHA1_DIGESTSIZE);
+	csp_sha1_done(&sha1, digest);
+
+	memcpy(checksum, digest, 20);
+}
 
 /**
- * Transmit a CSP-packet through SDCP to IPaddress.
- * @param char * IPaddress (The destination adress for the CSP-packet in dot quatted format)
- * @param csp_packet_t * packet (A pointer to the CSP packet to be transmitted)
- * @param unsigned int timeout (The timeout in milliseconds it should wait for the connection to be free)
+ * Send one SDCP frame with the payload given in two parts. Must be called with sendlock taken
+ * With MSG_DONTWAIT in flags, a full socket buffer fails the send but keeps the connection
  * @return int (1 = OK, 0 = error)
  */
-int csp_sdcp_tx(char * IPaddress, csp_packet_t * packet, unsigned int timeout) {
-
-	csp_sdcp_conn_t * connection;
-	csp_sdcp_packet_t * sdcp_packet = NULL;
-	int packetLength;
-	int waitcount = 0;
-
-	/* Get a socket to send to */
-	connection = csp_sdcp_findconn(IPaddress);
-	if(connection == NULL) {
-		csp_debug(CSP_ERROR, "Could not create connection to %s\r\n", IPaddress);
+static int csp_sdcp_send_frame(csp_sdcp_conn_t * connection, csp_sdcp_packet_type type,
+		const void * data1, uint32_t length1, const void * data2, uint32_t length2, int flags) {
+
+	csp_sdcp_packet_t sdcp_packet;
+	struct iovec iov[3];
+	struct msghdr msg;
+	ssize_t packetLength = sizeof(sdcp_packet) + length1 + length2;
+
+	memset(&sdcp_packet, 0, sizeof(sdcp_packet));
+	sdcp_packet.sequence = connection->sequence_tx;
+	sdcp_packet.type = type;
+	sdcp_packet.length = length1 + length2;
+	csp_sdcp_checksum(sdcp_packet.sequence, connection->publickey, data1, length1, data2, length2, sdcp_packet.checksum);
+
+	/* Header and payload go out in one send, straight from the callers buffers */
+	iov[0].iov_base = &sdcp_packet;
+	iov[0].iov_len = sizeof(sdcp_packet);
+	iov[1].iov_base = (void *) data1;
+	iov[1].iov_len = length1;
+	iov[2].iov_base = (void *) data2;
+	iov[2].iov_len = length2;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 3;
+
+	ssize_t sent = sendmsg(connection->sock, &msg, MSG_NOSIGNAL | flags);
+	if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && (flags & MSG_DONTWAIT)) {
+		/* Nothing was written, the stream is still in sync */
+		return 0;
+	}
+	if (sent != packetLength) {
+		csp_debug(CSP_ERROR, "send() on socket %i sent a different number of bytes than expected\r\n", connection->sock);
+		connection->state = CSP_SDCP_STATE_CLOSING;
+		csp_debug(CSP_WARN, "Lost connection to %s\r\n", connection->ip);
 		return 0;
 	}
 
-	/* Create SDCP packet */
-	packetLength = sizeof(csp_sdcp_packet_t)+packet->length;
-	sdcp_packet = (csp_sdcp_packet_t *)malloc(packetLength*sizeof(char));
+	connection->sequence_tx++;
+	return 1;
 
-	csp_debug(CSP_INFO, "Sending packet to %s via SDCP\r\n", IPaddress);
-	//csp_debug(CSP_INFO, "Create a packet of %i bytes with %i bytes overhead for SDCP\r\n", packetLength, sizeof(csp_sdcp_packet_t));
+}
 
-	// Set default timeout to 10000 ms
-	if(timeout == 0) {
-		timeout = 10000;
+/**
+ * Allocate a connection for a connected socket
+ */
+static csp_sdcp_conn_t * csp_sdcp_conn_new(int sock, uint32_t addr) {
+
+	csp_sdcp_conn_t * conn = (csp_sdcp_conn_t *)malloc(sizeof(csp_sdcp_conn_t));
+	if(conn == NULL) {
+		csp_debug(CSP_ERROR, "Failed to allocate space for connection\r\n");
+		return NULL;
 	}
 
+	/* Frames are sent whole, do not wait for more data */
+	int flag = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+	conn->sock = sock;
+	conn->addr = addr;
+	inet_ntop(AF_INET, &addr, conn->ip, sizeof(conn->ip));
+	conn->sequence_tx = 0;
+	conn->sequence_rx = 0;
+	conn->publickey = SDCP_PUBLICKEY_NON;
+	conn->state = CSP_SDCP_STATE_OPEN;
+	conn->packet_acked = 0;
+	conn->lastpacket = 0;
+	conn->lastpacket_time = 0;
+	conn->refcount = 1;
+	conn->rx_head = 0;
+	conn->rx_tail = 0;
+	conn->next = NULL;
+	// Initiate semaphore, mutex and conditions
+	csp_bin_sem_create(&conn->lock);
+	csp_bin_sem_create(&conn->sendlock);
+	pthread_cond_init(&conn->signal, NULL);
+	pthread_mutex_init(&conn->sig_mutex, NULL);
 
-	/* Make sure connection has a public key avaiable */
-	while(connection->publickey == SDCP_PUBLICKEY_NON && waitcount < (timeout/10)) {
-		usleep(10000); // wait 10 ms
-		waitcount++;
-	}
-	if(connection->publickey == SDCP_PUBLICKEY_NON) {
-		csp_debug(CSP_ERROR, "SDCP: Did not get a public key from %s\r\n", IPaddress);
-		free(sdcp_packet);
-		return 0;
-	}
+	return conn;
 
-	/* Make sure this packet is not in a loop */
-	if(memcmp(&packet->id.ext, &connection->lastpacket, 4) == 0) {
-		if(connection->lastpacket_time > time(0)-CSP_SDCP_PACKETLOOP_TIMEOUT) {
-			csp_debug(CSP_WARN, "SDCP: Packet %p was in a loop. Packet discarded\r\n", packet);
-			free(sdcp_packet);
-			return 0;
-		}
-	}
+}
 
+/**
+ * Insert a connection in the connection table and start receiving on it
+ * @return int (0 = error, 1 = OK)
+ */
+static int csp_sdcp_conn_insert(csp_sdcp_conn_t * conn) {
 
-	/* Fill out packet */
-	if(csp_bin_sem_wait(&connection->lock, timeout) == CSP_SEMAPHORE_OK) {
-		if(csp_bin_sem_wait(&connection->sendlock, timeout) == CSP_SEMAPHORE_OK) {
+	struct epoll_event ev;
+	unsigned int bucket = (conn->addr * 2654435761u >> 16) % SDCP_CONN_HASH;
 
-			sdcp_packet->sequence = connection->sequence_tx;
-			sdcp_packet->type = CSP_SDCP_DATA;
-			sdcp_packet->length = (uint32_t)packet->length;
-			memcpy(sdcp_packet->data, &packet->id.ext, packet->length);
-			csp_sdcp_insert_checksum(sdcp_packet, connection);
+	sem_wait(&sdcp_conn_sem);
+	conn->next = sdcp_conn[bucket];
+	sdcp_conn[bucket] = conn;
+	sem_post(&sdcp_conn_sem);
 
-			connection->packet_acked = 0;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = conn;
+	if(epoll_ctl(sdcp_epoll, EPOLL_CTL_ADD, conn->sock, &ev) < 0) {
+		csp_debug(CSP_ERROR, "epoll_ctl() failed for socket %i\r\n", conn->sock);
+		return 0;
+	}
 
-			/* Send packet */
-			if (csp_ip_send(connection->sock, sdcp_packet, packetLength, 0) != packetLength) {
-				csp_debug(CSP_ERROR, "send() on socket %i sent a different number of bytes than expected\r\n", connection->sock);
-				connection->state = CSP_SDCP_STATE_CLOSING;
-				csp_debug(CSP_WARN, "Lost connection to %s\r\n", connection->ip);
-				free(sdcp_packet);
-				csp_bin_sem_post(&connection->lock);
-				csp_bin_sem_post(&connection->sendlock);
-				return 0;
-			}
+	return 1;
 
-			// If succesed, update TX seq and unlock send lock
-			connection->sequence_tx++;
-			csp_bin_sem_post(&connection->sendlock);
+}
 
-#if SDCP_USE_ACK
-			/* wait for ACK */
-			// Calculate timeout
-			struct timespec ts;
-			if (clock_gettime(CLOCK_REALTIME, &ts)) {
-				csp_debug(CSP_ERROR, "Could not get time. Send possible failed\r\n");
-				csp_bin_sem_post(&connection->lock);
-				free(sdcp_packet);
-				return 0;
-			}
-			uint32_t sec = timeout / 1000;
-			uint32_t nsec = (timeout - 1000 * sec) * 1000000;
-			ts.tv_sec += sec;
-			if (ts.tv_nsec + nsec > 1000000000)
-				ts.tv_sec++;
-
-			ts.tv_nsec = (ts.tv_nsec + nsec) % 1000000000;
-
-			pthread_mutex_lock( &connection->sig_mutex );
-			if (connection->packet_acked == 0) {
-				if(pthread_cond_timedwait(&connection->signal, &connection->sig_mutex, &ts) == 0) {
-					csp_debug(CSP_INFO, "SDCP packet send to %s on socket %i\r\n", IPaddress, connection->sock);
-					pthread_mutex_unlock( &connection->sig_mutex );
-					/* Release packet */
-					free(sdcp_packet);
-					csp_bin_sem_post(&connection->lock);
-					return 1;
-				} else {
-					csp_debug(CSP_WARN, "Did not received ACK packet in time. Send failed\r\n");
-					pthread_mutex_unlock( &connection->sig_mutex );
-					/* Release packet */
-					free(sdcp_packet);
-					csp_bin_sem_post(&connection->lock);
-					return 0; // Send did not get ACK
-				}
-			}
-			pthread_mutex_unlock( &connection->sig_mutex );
-#endif
-			free(sdcp_packet);
-			csp_bin_sem_post(&connection->lock);
-			return 1;
+/**
+ * Release a reference to a connection. The last reference closes the socket
+ */
+static void csp_sdcp_conn_put(csp_sdcp_conn_t * conn) {
 
-		} else {
-			csp_debug(CSP_WARN, "The SDCP send is locked. Try again\r\n");
-			free(sdcp_packet);
-			return 0;
-		}
+	sem_wait(&sdcp_conn_sem);
+	int last = (--conn->refcount == 0);
+	sem_post(&sdcp_conn_sem);
 
-	} else {
-		csp_debug(CSP_WARN, "The SDCP connection is locked. Try again\r\n");
-		free(sdcp_packet);
-		return 0;
+	if(last) {
+		csp_debug(CSP_INFO, "Closing connection on socket %i to %s\r\n", conn->sock, conn->ip);
+		close(conn->sock);
+		sem_destroy(&conn->lock);
+		sem_destroy(&conn->sendlock);
+		pthread_cond_destroy(&conn->signal);
+		pthread_mutex_destroy(&conn->sig_mutex);
+		free(conn);
 	}
 
 }
+
 /**
- * Generate and insert checksum for SDCP packet via HMAC method (http://en.wikipedia.org/wiki/HMAC)
- *
- * @param csp_sdcp_packet_t * sdcp_packet (The packet to be transmitted)
- * @para, csp_packet_t * packet (The CSP packet inside sdcp_packet)
+ * Remove a connection from the connection table. Senders still holding it
+ * fail on the shut down socket and release it
  */
-void csp_sdcp_insert_checksum(csp_sdcp_packet_t * sdcp_packet, csp_sdcp_conn_t * connection) {
+static void csp_sdcp_conn_remove(csp_sdcp_conn_t * conn) {
 
+	unsigned int bucket = (conn->addr * 2654435761u >> 16) % SDCP_CONN_HASH;
+	csp_sdcp_conn_t ** tmp;
 
-	int i = 0;
-	char key[64];
-	strcpy(key, SDCP_PASSWORD);
-	char i_key_pad[64];
-	char o_key_pad[64];
-	int blocksize = 64; // blocksize for SHA-1
+	sem_wait(&sdcp_conn_sem);
+	for(tmp = &sdcp_conn[bucket]; *tmp != NULL; tmp = &(*tmp)->next) {
+		if(*tmp == conn) {
+			*tmp = conn->next;
+			break;
+		}
+	}
+	sem_post(&sdcp_conn_sem);
 
+	epoll_ctl(sdcp_epoll, EPOLL_CTL_DEL, conn->sock, NULL);
+	shutdown(conn->sock, SHUT_RDWR);
 
-	/*
-	 * 	if (length(key) > blocksize) then
-     *   	key = hash(key) // keys longer than blocksize are shortened
-     *	end if
-	 */
-	if(strlen(key) > blocksize) {
-		csp_sha1_memory((uint8_t*)key, 64, (uint8_t*)key);
-		key[20] = '\0';
-	}
+	/* Wake a sender waiting for an ACK */
+	pthread_mutex_lock(&conn->sig_mutex);
+	conn->state = CSP_SDCP_STATE_CLOSING;
+	pthread_cond_broadcast(&conn->signal);
+	pthread_mutex_unlock(&conn->sig_mutex);
 
-	/**
-	 * 	if (length(key) < blocksize) then
-     *   	key = key ∥ zeroes(blocksize - length(key)) // keys shorter than blocksize are zero-padded
-     *	end if
-	 */
-	if(strlen(key) < blocksize) {
-		for(i = strlen(key); i < 64; i++) {
-			key[i] = 0;
+	csp_sdcp_conn_put(conn);
+
+}
+
+/**
+ * Find an open connection to addr and take a reference to it
+ *
+ * @param uint32_t addr (IPv4 address in network order)
+ * @return csp_sdcp_conn_t * (The connection OR NULL)
+ */
+static csp_sdcp_conn_t * csp_sdcp_conn_find(uint32_t addr) {
+
+	unsigned int bucket = (addr * 2654435761u >> 16) % SDCP_CONN_HASH;
+	csp_sdcp_conn_t * tmp;
+
+	sem_wait(&sdcp_conn_sem);
+	for(tmp = sdcp_conn[bucket]; tmp != NULL; tmp = tmp->next) {
+		if(tmp->addr == addr && tmp->state == CSP_SDCP_STATE_OPEN) {
+			tmp->refcount++;
+			break;
 		}
 	}
+	sem_post(&sdcp_conn_sem);
 
-	/**
-	 * 	o_key_pad = [0x5c * blocksize] ⊕ key // Where blocksize is that of the underlying hash function
-     *	i_key_pad = [0x36 * blocksize] ⊕ key // Where ⊕ is exclusive or (XOR)
-	 */
-	for(i = 0; i < blocksize; i++) {
-		o_key_pad[i] = 0x5c ^ key[i];
-		i_key_pad[i] = 0x36 ^ key[i];
-	}
+	return tmp;
 
+}
 
-	/**
-	 * return hash(o_key_pad ∥ hash(i_key_pad ∥ message)) // Where ∥ is concatenation
-	 */
-	// Calculate the tmp variable (midSum), for holding the data. Because of second run, the minimum size has to be blocksize+SHA-1 outsize size+ = blocksize+20
-	int inputSize = blocksize+sdcp_packet->length+4+4; // Key (blocksize), message, sequence number and public key
-	if(inputSize < blocksize+20) { inputSize = blocksize+20; }
+/**
+ * Connect to addr. The returned connection holds a reference for the caller
+ */
+static csp_sdcp_conn_t * csp_sdcp_connect(uint32_t addr) {
 
-	// Allocate tmp variable
-	uint8_t* midSum = (uint8_t*)malloc(inputSize);
+	int sock;
+	csp_sdcp_conn_t * tmp = NULL;
+	struct sockaddr_in local, remote;
 
-	// Insert i_key_pad into midSum
-	for(i = 0; i < blocksize; i++) {
-		midSum[i] = i_key_pad[i];
-	}
-	// Insert sequence
-	midSum[blocksize] = (char)((sdcp_packet->sequence&0x000000FF) >> 0);
-	midSum[blocksize+1] = (char)((sdcp_packet->sequence&0x0000FF00) >> 8);
-	midSum[blocksize+2] = (char)((sdcp_packet->sequence&0x00FF0000) >> 16);
-	midSum[blocksize+3] = (char)((sdcp_packet->sequence&0xFF000000) >> 24);
-
-	// Insert public key
-	midSum[blocksize+4] = (char)((connection->publickey&0x000000FF) >> 0);
-	midSum[blocksize+5] = (char)((connection->publickey&0x0000FF00) >> 8);
-	midSum[blocksize+6] = (char)((connection->publickey&0x00FF0000) >> 16);
-	midSum[blocksize+7] = (char)((connection->publickey&0xFF000000) >> 24);
-
-	// Insert packet content (add 8 byte offset becuase of sequence and public key)
-	for(i = blocksize+8; i < blocksize+8+sdcp_packet->length; i++) {
-		midSum[i] = sdcp_packet->data[i-blocksize-8];
+	/* Create a reliable, stream socket using TCP */
+	if ((sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
+		csp_debug(CSP_ERROR, "TCP/IP socket() failed\r\n");
+		return NULL;
 	}
 
+	/* Send from the SIA address */
+	memset(&local, 0, sizeof(local));
+	local.sin_family = AF_INET;
+	inet_pton(AF_INET, csp_sia_myaddress, &local.sin_addr);
+	bind(sock, (struct sockaddr *) &local, sizeof(local));
 
-
-	// Calculate the SHA-1 value for midSum for all bytes
-	csp_sha1_memory(midSum, blocksize+sdcp_packet->length+8, midSum);
-	// Now midSum is only 20 bytes
-
-	/* Second run for o_key_pad and previous calculated hash value */
-	// Move the hash value blocksize bytes forward
-	for(i = blocksize; i < blocksize+20; i++) {
-		midSum[i] = midSum[i-blocksize];
+	/* Establish the connection to server */
+	memset(&remote, 0, sizeof(remote));
+	remote.sin_family = AF_INET;
+	remote.sin_addr.s_addr = addr;
+	remote.sin_port = htons(CSP_SDCP_PORT);
+	if (connect(sock, (struct sockaddr *) &remote, sizeof(remote)) < 0) {
+		csp_debug(CSP_ERROR, "TCP/IP connect() failed while creating new connection in SDCP\r\n");
+		close(sock);
+		return NULL;
 	}
-	// Insert the o_key_pad in the beginning
-	for(i = 0; i < blocksize; i++) {
-		midSum[i] = o_key_pad[i];
+
+	if((tmp = csp_sdcp_conn_new(sock, addr)) == NULL) {
+		close(sock);
+		return NULL;
 	}
-	// And calculate the SHA-1 value
-	csp_sha1_memory(midSum, blocksize+20, midSum);
 
-	// Copy back into sdcp packet
-	memcpy(sdcp_packet->checksum, midSum, 20);
-	free(midSum);
+	/* One reference for the table, one for the caller */
+	tmp->refcount = 2;
+	if(csp_sdcp_conn_insert(tmp) == 0) {
+		csp_sdcp_conn_remove(tmp);
+		csp_sdcp_conn_put(tmp);
+		return NULL;
+	}
 
+	return tmp;
 }
 
-
 /**
- * Find a connection to the IPaddress
- * If an open connection is found, this is returned, else a need connection is estabilished
+ * Find a connection to addr
+ * If an open connection is found, this is returned, else a new connection is estabilished
  */
-csp_sdcp_conn_t * csp_sdcp_findconn(char * IPaddress) {
+static csp_sdcp_conn_t * csp_sdcp_findconn(uint32_t addr) {
 
+	csp_sdcp_conn_t * tmp;
 
-	// Find a open connection to the address
-	csp_sdcp_conn_t * tmp = NULL;
-	if((tmp = csp_sdcp_conn_find(IPaddress)) != NULL) {
+	if((tmp = csp_sdcp_conn_find(addr)) != NULL) {
 		return tmp;
 	}
 
+	/* Check again after taking the connect lock, another sender may have connected */
+	sem_wait(&sdcp_connect_sem);
+	if((tmp = csp_sdcp_conn_find(addr)) == NULL) {
+		tmp = csp_sdcp_connect(addr);
+	}
+	sem_post(&sdcp_connect_sem);
 
-	// Else create a new connection to host
-	return csp_sdcp_connect(IPaddress);
+	return tmp;
 
 }
 
-csp_sdcp_conn_t* csp_sdcp_connect(char* IP) {
+/**
+ * Transmit a CSP-packet through SDCP to addr.
+ * @param uint32_t addr (The destination IPv4 address in network order)
+ * @param csp_packet_t * packet (A pointer to the CSP packet to be transmitted)
+ * @param unsigned int timeout (The timeout in milliseconds it should wait for the connection to be free)
+ * @return int (1 = OK, 0 = error)
+ */
+static int csp_sdcp_tx_addr(uint32_t addr, csp_packet_t * packet, unsigned int timeout) {
 
-	int sock;
-	csp_sdcp_conn_t * tmp = NULL;
+	csp_sdcp_conn_t * connection;
+	int waitcount = 0;
+	int result = 0;
+	uint32_t id = htonl(packet->id.ext);
 
-	/* Copy adress into struct */
-	tmp = (csp_sdcp_conn_t * )malloc(sizeof(csp_sdcp_conn_t));
-	if(tmp == NULL) {
-		csp_debug(CSP_ERROR, "Failed to allocate space for connection\r\n");
+	/* Get a socket to send to */
+	connection = csp_sdcp_findconn(addr);
+	if(connection == NULL) {
+		csp_debug(CSP_ERROR, "Could not create connection to %s\r\n", inet_ntoa(*(struct in_addr *) &addr));
 		return 0;
 	}
-	strcpy(tmp->ip, IP);
 
+	csp_debug(CSP_INFO, "Sending packet to %s via SDCP\r\n", connection->ip);
 
-	/* Create a reliable, stream socket using TCP */
-	if ((sock = csp_ip_socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
-		csp_debug(CSP_ERROR, "TCP/IP socket() failed\r\n");
-		free(tmp);
-		return NULL;
+	// Set default timeout to 10000 ms
+	if(timeout == 0) {
+		timeout = 10000;
 	}
 
 
-	/* Establish the connection to server */
-	if (csp_ip_connect(sock, PF_INET, IP, CSP_SDCP_PORT, csp_sia_myaddress) < 0) {
-		csp_debug(CSP_ERROR, "TCP/IP connect() failed while creating new connection in SDCP\r\n");
-		free(tmp);
-		csp_ip_close(sock);
-		return NULL;
+	/* Make sure connection has a public key avaiable */
+	while(connection->publickey == SDCP_PUBLICKEY_NON && waitcount < (timeout/10)) {
+		usleep(10000); // wait 10 ms
+		waitcount++;
+	}
+	if(connection->publickey == SDCP_PUBLICKEY_NON) {
+		csp_debug(CSP_ERROR, "SDCP: Did not get a public key from %s\r\n", connection->ip);
+		csp_sdcp_conn_put(connection);
+		return 0;
 	}
 
-	/* Bind socket, and insert into linked list */
-	tmp->sock = sock;
-	tmp->sequence_tx = 0;
-	tmp->sequence_rx = 0;
-	tmp->publickey = SDCP_PUBLICKEY_NON;
-	tmp->state = CSP_SDCP_STATE_OPEN;
-	// Initiate semaphore, mutex and conditions
-	csp_bin_sem_create(&tmp->lock);
-	csp_bin_sem_create(&tmp->sendlock);
-	pthread_cond_init(&tmp->signal, NULL);
-	pthread_mutex_init(&tmp->sig_mutex, NULL);
+	/* Make sure this packet is not in a loop */
+	if(memcmp(&id, &connection->lastpacket, 4) == 0) {
+		if(connection->lastpacket_time > time(0)-CSP_SDCP_PACKETLOOP_TIMEOUT) {
+			csp_debug(CSP_WARN, "SDCP: Packet %p was in a loop. Packet discarded\r\n", packet);
+			csp_sdcp_conn_put(connection);
+			return 0;
+		}
+	}
 
-	/** Create incoming connection task */
-	pthread_t handle_socket;
-	int threadError;
-	if((threadError = pthread_create(&handle_socket, NULL, csp_sdcp_rx_task, (void*)tmp)) != 0) {
-		csp_debug(CSP_ERROR, "Creation of TCP/IP incoming task failed: %i\r\n", threadError);
-		free(tmp);
-		csp_ip_close(sock);
-		return NULL;
+
+	/* Send packet */
+	if(csp_bin_sem_wait(&connection->lock, timeout) == CSP_SEMAPHORE_OK) {
+		if(csp_bin_sem_wait(&connection->sendlock, timeout) == CSP_SEMAPHORE_OK) {
+
+			connection->packet_acked = 0;
+			result = csp_sdcp_send_frame(connection, CSP_SDCP_DATA, &id, sizeof(id), packet->data, packet->length, 0);
+			csp_bin_sem_post(&connection->sendlock);
+
+#if SDCP_USE_ACK
+			/* wait for ACK */
+			if(result == 1) {
+				// Calculate timeout
+				struct timespec ts;
+				clock_gettime(CLOCK_REALTIME, &ts);
+				ts.tv_sec += timeout / 1000;
+				ts.tv_nsec += (timeout % 1000) * 1000000;
+				if (ts.tv_nsec >= 1000000000) {
+					ts.tv_sec++;
+					ts.tv_nsec -= 1000000000;
+				}
+
+				pthread_mutex_lock( &connection->sig_mutex );
+				while (connection->packet_acked == 0 && connection->state == CSP_SDCP_STATE_OPEN) {
+					if (pthread_cond_timedwait(&connection->signal, &connection->sig_mutex, &ts) != 0)
+						break;
+				}
+				if (connection->packet_acked == 0) {
+					csp_debug(CSP_WARN, "Did not received ACK packet in time. Send failed\r\n");
+					result = 0; // Send did not get ACK
+				} else {
+					csp_debug(CSP_INFO, "SDCP packet send to %s on socket %i\r\n", connection->ip, connection->sock);
+				}
+				pthread_mutex_unlock( &connection->sig_mutex );
+			}
+#endif
+
+		} else {
+			csp_debug(CSP_WARN, "The SDCP send is locked. Try again\r\n");
+		}
+		csp_bin_sem_post(&connection->lock);
+
+	} else {
+		csp_debug(CSP_WARN, "The SDCP connection is locked. Try again\r\n");
 	}
-	pthread_detach(handle_socket);
 
-	csp_sdcp_conn_insert(tmp);
+	csp_sdcp_conn_put(connection);
+	return result;
+
+}
 
-	usleep(10000); // wait 10 ms to allow socket task to start
+/**
+ * Transmit a CSP-packet through SDCP to IPaddress.
+ * @param char * IPaddress (The destination adress for the CSP-packet in dot quatted format)
+ * @param csp_packet_t * packet (A pointer to the CSP packet to be transmitted)
+ * @param unsigned int timeout (The timeout in milliseconds it should wait for the connection to be free)
+ * @return int (1 = OK, 0 = error)
+ */
+int csp_sdcp_tx(char * IPaddress, csp_packet_t * packet, unsigned int timeout) {
+
+	struct in_addr addr;
+
+	if(inet_pton(AF_INET, IPaddress, &addr) != 1) {
+		csp_debug(CSP_ERROR, "Invalid IP %s\r\n", IPaddress);
+		return 0;
+	}
+
+	return csp_sdcp_tx_addr(addr.s_addr, packet, timeout);
 
-	return tmp;
 }
 
 /**
@@ -629,12 +744,18 @@ csp_sdcp_conn_t* csp_sdcp_connect(char* IP) {
 void csp_sdcp_close(char * IP) {
 
 	csp_sdcp_conn_t * tmp = NULL;
+	struct in_addr addr;
 
-	tmp = csp_sdcp_conn_find(IP);
+	if(inet_pton(AF_INET, IP, &addr) != 1) return;
+
+	tmp = csp_sdcp_conn_find(addr.s_addr);
 	if(tmp != NULL) {
 
 		csp_sdcp_send_packet(tmp, CSP_SDCP_DISCONNECT, NULL, 0);
 		tmp->state = CSP_SDCP_STATE_CLOSING;
+		/* The SDCP task sees the hangup and removes the connection */
+		shutdown(tmp->sock, SHUT_RDWR);
+		csp_sdcp_conn_put(tmp);
 	}
 }
 
@@ -648,197 +769,122 @@ int csp_sdcp_send_packet(csp_sdcp_conn_t * connection, csp_sdcp_packet_type type
 		return 0;
 	}
 
-
-	int packetLength = 0;
-	csp_sdcp_packet_t * sdcp_packet;
-
-	/* Create SDCP packet */
 	if(data == NULL) {
-		packetLength = sizeof(csp_sdcp_packet_t);
-	} else {
-		packetLength = sizeof(csp_sdcp_packet_t)+length;
+		length = 0;
 	}
-	sdcp_packet = (csp_sdcp_packet_t *)malloc(packetLength*sizeof(char));
-
-	//csp_debug(CSP_INFO, "Create a packet of %i bytes with %i bytes overhead for SDCP\r\n", packetLength, sizeof(csp_sdcp_packet_t));
-
 
 	if(csp_bin_sem_wait(&connection->sendlock, 500) == CSP_SEMAPHORE_OK) {
-		/* Fill out packet */
-		sdcp_packet->sequence = connection->sequence_tx;
-		sdcp_packet->type = type;
-		if(data != NULL) {
-			sdcp_packet->length = (uint32_t)length;
-			memcpy(sdcp_packet->data, data, length);
-		} else {
-			sdcp_packet->length = 0;
-		}
-		csp_sdcp_insert_checksum(sdcp_packet, connection);
-
-
-		/* Send packet */
-		if (csp_ip_send(connection->sock, sdcp_packet, packetLength, 0) != packetLength) {
-			csp_debug(CSP_ERROR, "send() on socket %i sent a different number of bytes than expected\r\n", connection->sock);
-			connection->state = CSP_SDCP_STATE_CLOSING;
-			csp_debug(CSP_WARN, "Lost connection to %s\r\n", connection->ip);
-			free(sdcp_packet);
-
-			csp_bin_sem_post(&connection->sendlock);
-			return 0;
-		}
-		connection->sequence_tx++;
-
+		int result = csp_sdcp_send_frame(connection, type, data, length, NULL, 0, 0);
 		// Unlock send lock
 		csp_bin_sem_post(&connection->sendlock);
+		return result;
 	} else {
 		csp_debug(CSP_WARN, "The SDCP send is locked. Try again\r\n");
-		free(sdcp_packet);
 		return 0;
 	}
 
-	/* Release packet and update connection sequence */
-	free(sdcp_packet);
-
-	return 1;
-
-
-
 }
 
-
 /**
- * Keep alive task.
- * Every 5. min sends a keep alive packet on all open connections
- * @param void* pvParameter (The input to the function, in this case NULL)
- * @return csp_thread_return_t
+ * Send a keep alive packet on all open connections
+ * Runs in the SDCP task, so it never waits for a sender or a full socket
  */
-csp_thread_return_t csp_sdcp_keepaliveTask(void * pvParameters) {
-
-	while(1) {
+static void csp_sdcp_keepalive(void) {
 
-		sleep(SDCP_KEEPALIVE_PERIODE);
+	int i, count = 0, n = 0;
+	csp_sdcp_conn_t * tmp;
+	csp_sdcp_conn_t ** conns = NULL;
 
-		sem_wait(&sdcp_conn_sem);
-		csp_sdcp_conn_t * tmp = sdcp_conn;
-		while(tmp != NULL) {
-			csp_sdcp_send_packet(tmp, CSP_SDCP_KEEPALIVE, NULL, 0);
-			tmp = tmp->next;
+	/* Take a reference to every open connection, and send with the table unlocked */
+	sem_wait(&sdcp_conn_sem);
+	for(i = 0; i < SDCP_CONN_HASH; i++) {
+		for(tmp = sdcp_conn[i]; tmp != NULL; tmp = tmp->next) {
+			if(tmp->state == CSP_SDCP_STATE_OPEN)
+				count++;
 		}
-		sem_post(&sdcp_conn_sem);
-
+	}
+	if(count > 0)
+		conns = (csp_sdcp_conn_t **)malloc(count * sizeof(*conns));
+	if(conns != NULL) {
+		for(i = 0; i < SDCP_CONN_HASH; i++) {
+			for(tmp = sdcp_conn[i]; tmp != NULL; tmp = tmp->next) {
+				if(tmp->state == CSP_SDCP_STATE_OPEN) {
+					tmp->refcount++;
+					conns[n++] = tmp;
+				}
+			}
+		}
+	}
+	sem_post(&sdcp_conn_sem);
 
+	for(i = 0; i < n; i++) {
+		/* A connection busy sending or with a full socket is alive already */
+		if(sem_trywait(&conns[i]->sendlock) == 0) {
+			csp_sdcp_send_frame(conns[i], CSP_SDCP_KEEPALIVE, NULL, 0, NULL, 0, MSG_DONTWAIT);
+			sem_post(&conns[i]->sendlock);
+		}
+		csp_sdcp_conn_put(conns[i]);
 	}
+	free(conns);
 
-	return 0;
 }
 
-/** TCP/IP receive task
- * This task waits for a TCP/IP on CSP_SDCP_PORT
+/**
+ * Accept all pending incoming connections
  */
-csp_thread_return_t csp_sdcp_newconn_task(void * pvParameters) {
-
-	csp_debug(CSP_INFO, "Starting incoming TCP/IP task on ip %s\r\n", (char *) pvParameters);
+static void csp_sdcp_accept(void) {
 
-	int servSock;						/* Socket descriptor for server */
 	int clntSock;						/* Socket descriptor for client */
 	struct sockaddr_in ClntAddr; 		/* Client address */
-	unsigned int clntLen;            	/* Length of client address data structure */
+	socklen_t clntLen;					/* Length of client address data structure */
 	csp_sdcp_conn_t * newConn = NULL; 	/* Pointer for new connection */
 
-
-	/* Create socket for incoming conneccsp_sdcp_findconntions */
-	if ((servSock = csp_ip_socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
-		csp_debug(CSP_ERROR, "socket() failed while creating TCP server in vCsp_sip_rxTask()\r\n");
-		return 0;
-	}
-
-
-	/* Bind to the local address */
-	while(1) {
-		if (csp_ip_bind(servSock, AF_INET, CSP_SDCP_PORT, (char*) pvParameters) < 0) {
-			csp_debug(CSP_WARN, "bind() to %i failed in vCsp_sip_rxTask. Waiting 2 seconds for reconnect...\r\n", CSP_SDCP_PORT);
-			sleep(2);
-			continue;
-		}
-		break;
-	}
-
-	/* Mark the socket so it will listen for incoming connections. Allow 16 connections */
-	if (csp_ip_listen(servSock, 16) < 0) {
-		csp_debug(CSP_ERROR, "listen() failed in vCsp_sip_rxTask()\r\n");
-		return 0;
-	}
-
 	while(1) {
 		/* Set the size of the in-out parameter */
 		clntLen = sizeof(ClntAddr);
 
-		/* Wait for a client to connect */
-		if ((clntSock = csp_ip_accept(servSock, (struct sockaddr *) &ClntAddr, &clntLen)) < 0) {
-			csp_debug(CSP_ERROR, "accept() failed in vCsp_sip_rxTask()\r\n");
-			continue;
+		/* The listening socket is non-blocking, stop when no client is waiting */
+		if ((clntSock = accept(sdcp_listen, (struct sockaddr *) &ClntAddr, &clntLen)) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				csp_debug(CSP_ERROR, "accept() failed in csp_sdcp_task()\r\n");
+			return;
 		}
 		csp_debug(CSP_PACKET, "New client %s on port %i\n", inet_ntoa(ClntAddr.sin_addr), CSP_SDCP_PORT);
 
-
-		/* Copy adress into struct */
-		newConn = (csp_sdcp_conn_t * )malloc(sizeof(csp_sdcp_conn_t));
-		strcpy(newConn->ip, inet_ntoa(ClntAddr.sin_addr));
-
-		/* Bind socket, and insert into linked list */
-		newConn->sock = clntSock;
-		newConn->sequence_tx = 0;
-		newConn->sequence_rx = 0;
-		newConn->publickey = SDCP_PUBLICKEY_NON;
-		newConn->state = CSP_SDCP_STATE_OPEN;
-		// Initiate semaphore, mutex and conditions
-		csp_bin_sem_create(&newConn->lock);
-		csp_bin_sem_create(&newConn->sendlock);
-		pthread_cond_init(&newConn->signal, NULL);
-		pthread_mutex_init(&newConn->sig_mutex, NULL);
+		if((newConn = csp_sdcp_conn_new(clntSock, ClntAddr.sin_addr.s_addr)) == NULL) {
+			close(clntSock);
+			continue;
+		}
 
 		/* Generate public key and send. */
 		uint32_t publickey = rand()+1; // Todo: Fix this so it includes to entire 32 bit range
 		csp_sdcp_send_packet(newConn, CSP_SDCP_KEYEXCHANGE, &publickey, 4);
 		newConn->publickey = publickey;
 
-		/** Create incoming connection task */
-		pthread_t handle_socket;
-		int threadError;
-		if((threadError = pthread_create(&handle_socket, NULL, csp_sdcp_rx_task, (void*)newConn)) != 0) {
-			csp_debug(CSP_ERROR, "Creation of TCP/IP incoming task failed: %i\r\n", threadError);
-			csp_ip_close(clntSock);
-			free(newConn);
-			continue;
+		if(csp_sdcp_conn_insert(newConn) == 0) {
+			csp_sdcp_conn_remove(newConn);
 		}
-		pthread_detach(handle_socket);
-
-		csp_sdcp_conn_insert(newConn);
-
 	}
 
 }
+
 /**
  * Check the checksum of received packet
- * Pulls out the checksum in the packet, clear the checksum in the packet and generate a new, and compare the two checksums
+ * Generate the checksum of the packet content, and compare with the received checksum
  *
- * @param csp_sdcp_packet_t * sdcp_packet (The SDCP packet to validate)
+ * @param csp_sdcp_packet_t * sdcp_packet (The SDCP packet header to validate)
+ * @param uint8_t * data (The SDCP packet payload)
  * @param csp_sdcp_conn_t * conn (The connection on which the SDCP packet was received)
  * @return int (0 = error, 1 = OK)
  */
-static inline int csp_sdcp_rx_checksum(csp_sdcp_packet_t * sdcp_packet, csp_sdcp_conn_t * conn) {
-	// Variables
-	unsigned char orgChecksum[sizeof(sdcp_packet->checksum)];
-
-
-	memcpy(&orgChecksum, sdcp_packet->checksum, sizeof(sdcp_packet->checksum));
-	// Clear the checsum
-	bzero(sdcp_packet->checksum, sizeof(sdcp_packet->checksum));
-	// Insert new packet from packet content
-	csp_sdcp_insert_checksum(sdcp_packet, conn);
+static inline int csp_sdcp_rx_checksum(csp_sdcp_packet_t * sdcp_packet, uint8_t * data, csp_sdcp_conn_t * conn) {
+	unsigned char checksum[sizeof(sdcp_packet->checksum)];
 
+	csp_sdcp_checksum(sdcp_packet->sequence, conn->publickey, data, sdcp_packet->length, NULL, 0, checksum);
 
-	if(strncmp((char*)orgChecksum, (char*)sdcp_packet->checksum, sizeof(sdcp_packet->checksum)) != 0) {
+	if(memcmp(checksum, sdcp_packet->checksum, sizeof(checksum)) != 0) {
 		csp_debug(CSP_ERROR, "SDCP: Checksum error for packet (s: %u)\r\n", sdcp_packet->sequence);
 		if(sdcp_packet->type != CSP_SDCP_CHECKERROR) {
 			csp_sdcp_send_packet(conn, CSP_SDCP_CHECKERROR, NULL, 0);
@@ -851,19 +897,23 @@ static inline int csp_sdcp_rx_checksum(csp_sdcp_packet_t * sdcp_packet, csp_sdcp
  * Check the SDCP sequence number with the connection sequence number
  * Also handles if the received packet is a SYNC packet
  *
- * @param csp_sdcp_packet_t * sdcp_packet (The SDCP packet to validate)
+ * @param csp_sdcp_packet_t * sdcp_packet (The SDCP packet header to validate)
+ * @param uint8_t * data (The SDCP packet payload)
  * @param csp_sdcp_conn_t * conn (The connection on which the SDCP packet was received)
  * @return (0 = Error, 1 = OK)
  */
-static inline int csp_sdcp_rx_sequence(csp_sdcp_packet_t * sdcp_packet, csp_sdcp_conn_t * conn) {
+static inline int csp_sdcp_rx_sequence(csp_sdcp_packet_t * sdcp_packet, uint8_t * data, csp_sdcp_conn_t * conn) {
 	if(sdcp_packet->type == CSP_SDCP_SEQSYNC) {
 		csp_debug(CSP_ERROR, "Sequence error for last packet on socket %i\r\n", conn->sock);
-		uint32_t newSeq = (uint32_t)*sdcp_packet->data;
+		uint32_t newSeq = 0;
+		memcpy(&newSeq, data, sdcp_packet->length < 4 ? sdcp_packet->length : 4);
 
 		if((newSeq > conn->sequence_tx) || (newSeq < 10)) {
-			sem_wait(&conn->lock);
+			/* The sequence number is only changed with sendlock taken. Senders hold it
+			 * for one frame only, the wait for the ACK is under conn->lock */
+			sem_wait(&conn->sendlock);
 			conn->sequence_tx = newSeq;
-			sem_post(&conn->lock);
+			sem_post(&conn->sendlock);
 			csp_debug(CSP_WARN, "Sync sequence number for socket %i to %u\r\n", conn->sock, conn->sequence_tx);
 		} else {
 			csp_debug(CSP_ERROR, "Received sync request for SDCP connection %i, but sequence not uniq\r\n", conn->sock, conn->sequence_tx);
@@ -887,205 +937,246 @@ static inline int csp_sdcp_rx_sequence(csp_sdcp_packet_t * sdcp_packet, csp_sdcp
 }
 
 /**
- * Thread for each open connection
+ * Handle one received SDCP frame
  *
- * @param void * pvParameters (A pointer to the conn which the thread is monitoring)
- * @return csp_thread_return_t
+ * @param csp_sdcp_packet_t * sdcp_packet (The SDCP packet header)
+ * @param uint8_t * data (The SDCP packet payload, in the connection receive buffer)
+ * @param csp_sdcp_conn_t * conn (The connection on which the SDCP packet was received)
  */
-csp_thread_return_t csp_sdcp_rx_task(void * pvParameters) {
+static void csp_sdcp_rx_frame(csp_sdcp_packet_t * sdcp_packet, uint8_t * data, csp_sdcp_conn_t * conn) {
 
-	csp_sdcp_conn_t * conn = (csp_sdcp_conn_t *)pvParameters;
-	csp_sdcp_packet_t * sdcp_packet;		/* Pointer to the received packet */
 	csp_packet_t * packet;
-	int recvMsgSize;                    /* Size of received message */
 
-	csp_debug(CSP_INFO, "Started socket task for socket %i\r\n", conn->sock);
+	/*
+	 * Sequence number check and sync
+	 */
+	if(csp_sdcp_rx_sequence(sdcp_packet, data, conn) == 0) {
+		return;
+	}
+	// Sequence number checked out, continue
 
-	sdcp_packet = malloc(1000);
-	while(conn->state) {
+	/*
+	 * Check checksum
+	 */
+	if(csp_sdcp_rx_checksum(sdcp_packet, data, conn) == 0) {
+		return;
+	}
+
+	conn->sequence_rx++;
+
+	/*
+	 * Handle the packet
+	 */
+
+	if(conn->publickey == SDCP_PUBLICKEY_NON && sdcp_packet->type == CSP_SDCP_DATA) {
+		csp_debug(CSP_ERROR, "SDCP: No public key set for socket %i to %s\r\n", conn->sock, conn->ip);
+		return;
+	}
 
-		/* Receive header from client */
-		if ((recvMsgSize = csp_ip_recv(conn->sock, sdcp_packet, sizeof(csp_sdcp_packet_t), 0)) < 0) {
-			csp_debug(CSP_ERROR, "recv() failed\r\n");
-			break;
-		}
-		if(recvMsgSize == 0) {
-			break;
-		}
-		/* Check if received packet is minimum length */
-		if(recvMsgSize < sizeof(csp_sdcp_packet_t)) {
-			csp_debug(CSP_WARN, "Socket %i received packet of wrong length: %i\r\n", conn->sock, recvMsgSize);
-			continue;
-		}
 
-		/* Get payload of packet */
-		if(sdcp_packet->length > 0) {
-			if ((recvMsgSize = csp_ip_recv(conn->sock, sdcp_packet->data, sdcp_packet->length, 0)) < 0) {
-				csp_debug(CSP_ERROR, "recv() failed while getting content of packet\r\n");
+	switch(sdcp_packet->type) {
+		case CSP_SDCP_DATA:
+#if SDCP_USE_ACK
+			csp_sdcp_send_packet(conn, CSP_SDCP_ACK, NULL, 0);
+#endif
+
+			/* Allocate a CSP packet of the received size, the payload starts with the CSP id */
+			if(sdcp_packet->length < 4) {
+				csp_debug(CSP_WARN, "SDCP: Data packet of %u bytes on socket %i too short\r\n", sdcp_packet->length, conn->sock);
 				break;
 			}
-		}
+			packet = csp_buffer_get(sdcp_packet->length - 4);
+			if(packet == NULL) {
+				csp_debug(CSP_WARN, "SDCP: No buffer for %u bytes on socket %i\r\n", sdcp_packet->length, conn->sock);
+				break;
+			}
+			memcpy(&packet->id.ext, data, sdcp_packet->length);
 
+			/* Save a pointer to the last packet. */
+			memcpy(&conn->lastpacket, &packet->id.ext, 4);
+			conn->lastpacket_time = time(0);
 
-		/*
-		 * Sequence number check and sync
-		 */
-		if(csp_sdcp_rx_sequence(sdcp_packet, conn) == 0) {
-			continue;
-		}
-		// Sequence number checked out, continue
+			/* Set the packet length of received packet */
+			packet->length = sdcp_packet->length;
+			csp_sdcp_rx_ref(packet);
 
-		/*
-		 * Check checksum, by copying the received checksum, generate new, and compare
-		 */
-		if(csp_sdcp_rx_checksum(sdcp_packet, conn) == 0) {
-			continue;
-		}
+			break;
+		case CSP_SDCP_ACK:
+			pthread_mutex_lock( &conn->sig_mutex );
+			conn->packet_acked = 1;
+			pthread_cond_signal( &conn->signal );
+			pthread_mutex_unlock( &conn->sig_mutex );
+			break;
+		case CSP_SDCP_KEYEXCHANGE:
+			if(sdcp_packet->sequence == 0 && conn->publickey == 0x0 && sdcp_packet->length >= 4) {
+				sem_wait(&conn->sendlock);
+				memcpy(&conn->publickey, data, 4);
+				sem_post(&conn->sendlock);
+				csp_debug(CSP_INFO, "Received public key 0x%X for socket %i\r\n", conn->publickey, conn->sock);
+			} else {
+				csp_debug(CSP_WARN, "Received public key, but only sequencenum. 0 can be key exchange\r\n");
+			}
+			break;
+		case CSP_SDCP_KEEPALIVE:
+				csp_debug(CSP_INFO, "Keep-alive request on socket %i to %s\r\n", conn->sock, conn->ip);
+			break;
+		case CSP_SDCP_DISCONNECT:
+				conn->state = CSP_SDCP_STATE_CLOSING;
+			break;
+		case CSP_SDCP_CHECKERROR:
+				csp_debug(CSP_ERROR, "SDCP packet (s: %i) not delivered: Checksum error\r\n", sdcp_packet->sequence);
+				sem_wait(&conn->sendlock);
+				conn->sequence_tx--;
+				sem_post(&conn->sendlock);
+			break;
+		default:
+			csp_debug(CSP_WARN, "Received unknown packet type: %i\r\n", sdcp_packet->type);
+			break;
+	}
 
-		conn->sequence_rx++;
+}
 
-		/*
-		 * Handle the packet
-		 */
+/**
+ * Read from a connection and handle all complete frames
+ * Frames are parsed in the receive buffer, only a partial frame at the end is moved
+ *
+ * @param csp_sdcp_conn_t * conn (The connection that is readable)
+ * @return int (0 = connection must be closed, 1 = OK)
+ */
+static int csp_sdcp_rx(csp_sdcp_conn_t * conn) {
 
-		if(conn->publickey == SDCP_PUBLICKEY_NON && sdcp_packet->type == CSP_SDCP_DATA) {
-			csp_debug(CSP_ERROR, "SDCP: No public key set for socket %i to %s\r\n", conn->sock, conn->ip);
-			continue;
-		}
+	csp_sdcp_packet_t sdcp_packet;
+	int recvMsgSize;
+	uint32_t frameLength;
 
+	recvMsgSize = recv(conn->sock, conn->rx_buf + conn->rx_tail, SDCP_RX_BUF_SIZE - conn->rx_tail, MSG_DONTWAIT);
+	if(recvMsgSize == 0) {
+		return 0;
+	}
+	if(recvMsgSize < 0) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 1;
+		csp_debug(CSP_ERROR, "recv() failed\r\n");
+		return 0;
+	}
+	conn->rx_tail += recvMsgSize;
 
-		switch(sdcp_packet->type) {
-			case CSP_SDCP_DATA:
-#if SDCP_USE_ACK
-				csp_sdcp_send_packet(conn, CSP_SDCP_ACK, NULL, 0);
-#endif
+	while(conn->rx_tail - conn->rx_head >= sizeof(csp_sdcp_packet_t)) {
 
-				/* Allocate and fill CSP packet */
-				packet = csp_buffer_get(200);
-				memcpy(&packet->id.ext, sdcp_packet->data, sdcp_packet->length);
+		/* Frames are not aligned in the buffer, so the header is read through a copy */
+		memcpy(&sdcp_packet, conn->rx_buf + conn->rx_head, sizeof(sdcp_packet));
+		frameLength = sizeof(csp_sdcp_packet_t) + sdcp_packet.length;
 
-				/* Save a pointer to the last packet. */
-				memcpy(&conn->lastpacket, &packet->id.ext, 4);
-				conn->lastpacket_time = time(0);
+		if(frameLength > SDCP_RX_BUF_SIZE) {
+			csp_debug(CSP_WARN, "Socket %i received packet of wrong length: %u\r\n", conn->sock, sdcp_packet.length);
+			return 0;
+		}
+		if(conn->rx_tail - conn->rx_head < frameLength) {
+			break;
+		}
 
-				/* Set the packet length of received packet */
-				packet->length = sdcp_packet->length;
-				csp_sdcp_rx_ref(packet);
+		csp_sdcp_rx_frame(&sdcp_packet, conn->rx_buf + conn->rx_head + sizeof(csp_sdcp_packet_t), conn);
+		conn->rx_head += frameLength;
 
-				break;
-			case CSP_SDCP_ACK:
-				pthread_mutex_lock( &conn->sig_mutex );
-				conn->packet_acked = 1;
-				pthread_cond_signal( &conn->signal );
-				pthread_mutex_unlock( &conn->sig_mutex );
-				break;
-			case CSP_SDCP_KEYEXCHANGE:
-				if(sdcp_packet->sequence == 0 && conn->publickey == 0x0) {
-					sem_wait(&conn->sendlock);
-					memcpy(&conn->publickey, sdcp_packet->data, 4);
-					sem_post(&conn->sendlock);
-					csp_debug(CSP_INFO, "Received public key 0x%X for socket %i\r\n", conn->publickey, conn->sock);
-				} else {
-					csp_debug(CSP_WARN, "Received public key, but only sequencenum. 0 can be key exchange\r\n");
-				}
-				break;
-			case CSP_SDCP_KEEPALIVE:
-					csp_debug(CSP_INFO, "Keep-alive request on socket %i to %s\r\n", conn->sock, conn->ip);
-				break;
-			case CSP_SDCP_DISCONNECT:
-					conn->state = CSP_SDCP_STATE_CLOSING;
-				break;
-			case CSP_SDCP_CHECKERROR:
-					csp_debug(CSP_ERROR, "SDCP packet (s: %i) not delivered: Checksum error\r\n", sdcp_packet->sequence);
-					sem_wait(&conn->sendlock);
-					conn->sequence_tx--;
-					sem_post(&conn->sendlock);
-				break;
-			default:
-				csp_debug(CSP_WARN, "Received unknown packet type: %i\r\n", sdcp_packet->type);
-				break;
+		if(conn->state != CSP_SDCP_STATE_OPEN) {
+			return 0;
 		}
+	}
 
+	/* Move a partial frame to the front, to make room for the rest of it */
+	if(conn->rx_head == conn->rx_tail) {
+		conn->rx_head = conn->rx_tail = 0;
+	} else if(conn->rx_head > 0) {
+		memmove(conn->rx_buf, conn->rx_buf + conn->rx_head, conn->rx_tail - conn->rx_head);
+		conn->rx_tail -= conn->rx_head;
+		conn->rx_head = 0;
+	}
 
+	return 1;
 
+}
 
+/** SDCP task
+ * This task accepts connections on CSP_SDCP_PORT, receives on all connections
+ * with a single epoll set and sends the keep-alives every SDCP_KEEPALIVE_PERIODE
+ */
+void * csp_sdcp_task(void * pvParameters) {
+
+	csp_debug(CSP_INFO, "Starting TCP/IP task on ip %s\r\n", (char *) pvParameters);
+
+	struct sockaddr_in ServAddr;
+	struct epoll_event ev, events[SDCP_EVENTS];
+	time_t next_keepalive;
+	int i, n, timeout, flag = 1;
+
+	/* Create socket for incoming connections */
+	if ((sdcp_listen = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
+		csp_debug(CSP_ERROR, "socket() failed while creating TCP server in csp_sdcp_task()\r\n");
+		return 0;
 	}
+	setsockopt(sdcp_listen, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
 
-	/**
-	 * Release connection
-	 */
-	csp_debug(CSP_INFO, "Waiting on getting lock for connection to close\r\n");
-	sem_wait(&conn->sendlock);
+	/* Bind to the local address */
+	memset(&ServAddr, 0, sizeof(ServAddr));
+	ServAddr.sin_family = AF_INET;
+	ServAddr.sin_port = htons(CSP_SDCP_PORT);
+	inet_pton(AF_INET, (char *) pvParameters, &ServAddr.sin_addr);
+	while(1) {
+		if (bind(sdcp_listen, (struct sockaddr *) &ServAddr, sizeof(ServAddr)) < 0) {
+			csp_debug(CSP_WARN, "bind() to %i failed in csp_sdcp_task. Waiting 2 seconds for reconnect...\r\n", CSP_SDCP_PORT);
+			sleep(2);
+			continue;
+		}
+		break;
+	}
 
+	/* Mark the socket so it will listen for incoming connections */
+	if (listen(sdcp_listen, SOMAXCONN) < 0) {
+		csp_debug(CSP_ERROR, "listen() failed in csp_sdcp_task()\r\n");
+		return 0;
+	}
 
-	csp_debug(CSP_INFO, "Closing connection on socket %i to %s\r\n", conn->sock, conn->ip);
+	/* The listening socket is the only one without a connection */
+	fcntl(sdcp_listen, F_SETFL, fcntl(sdcp_listen, F_GETFL) | O_NONBLOCK);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(sdcp_epoll, EPOLL_CTL_ADD, sdcp_listen, &ev) < 0) {
+		csp_debug(CSP_ERROR, "epoll_ctl() failed in csp_sdcp_task()\r\n");
+		return 0;
+	}
 
-	/* Release the connection from the list */
-	csp_sdcp_conn_remove(conn);
+	next_keepalive = time(0) + SDCP_KEEPALIVE_PERIODE;
 
-	free(sdcp_packet);
-	csp_ip_close(conn->sock);
-	free(conn);
-	return 0;
-}
+	while(1) {
 
+		timeout = (next_keepalive - time(0)) * 1000;
+		if (timeout < 0)
+			timeout = 0;
 
-/**
- * Insert a new connection in connection list
- *
- * @param csp_sdcp_conn_t * newNode (The entry which to insert)
- * @return vodi
- */
-void csp_sdcp_conn_insert(csp_sdcp_conn_t * newNode) {
-	sem_wait(&sdcp_conn_sem);
-	newNode->next = sdcp_conn;
-	sdcp_conn = newNode;
-	sem_post(&sdcp_conn_sem);
-}
-/**
- * Remove a node from the linked list
- *
- * @param csp_sdcp_conn_t * conn (The entry to remove
- */
-void csp_sdcp_conn_remove(csp_sdcp_conn_t * conn) {
-	sem_wait(&conn->lock); // Lock the connection, never unlock because connections is removed
-	sem_wait(&sdcp_conn_sem);
-	csp_sdcp_conn_t * tmp = sdcp_conn;
-	if(tmp == conn) {
-		sdcp_conn = conn->next;
-	} else {
-		while(tmp->next != NULL) {
-			if(tmp->next == conn) {
-				tmp->next = conn->next;
-				break;
-			}
-			tmp = tmp->next;
+		n = epoll_wait(sdcp_epoll, events, SDCP_EVENTS, timeout);
+		if (n < 0 && errno != EINTR) {
+			csp_debug(CSP_ERROR, "epoll_wait() failed in csp_sdcp_task()\r\n");
+			sleep(1);
 		}
-	}
-	sem_post(&sdcp_conn_sem);
-}
 
-/**
- * Find a connection entry connected to IPaddress
- *
- * @param char * IPaddress
- * @return csp_sdcp_conn_t * (The connection OR NULL)
- */
-csp_sdcp_conn_t * csp_sdcp_conn_find(char * IPaddress) {
-	// Find a open connection to the address
-	csp_sdcp_conn_t * tmp = sdcp_conn;
-	tmp = sdcp_conn;
-	while(tmp != NULL) {
-
-		if(tmp->ip != NULL) {
-			if(strncmp(tmp->ip, IPaddress, strlen(IPaddress)) == 0) {
-				return tmp;
+		for (i = 0; i < n; i++) {
+			csp_sdcp_conn_t * conn = events[i].data.ptr;
+			if (conn == NULL) {
+				csp_sdcp_accept();
+			} else if (csp_sdcp_rx(conn) == 0) {
+				csp_sdcp_conn_remove(conn);
 			}
 		}
 
-		tmp = tmp->next;
+		if (time(0) >= next_keepalive) {
+			csp_sdcp_keepalive();
+			next_keepalive = time(0) + SDCP_KEEPALIVE_PERIODE;
+		}
+
 	}
-	return NULL;
+
+	return 0;
 }
 
 
@@ -1,3 +1,4 @@
+#include <stdio.h>
 #include <inttypes.h>
 #include <string.h>
 #include <unistd.h>
@@ -6,8 +7,6 @@
 #include <errno.h>
 #include <malloc.h>
 
-#include <freertos/FreeRTOS.h>
-
 #include <util/crc32.h>
 #include <util/log.h>
 
@@ -16,16 +15,12 @@
 
 #include <ftp/ftp_server.h>
 
-/* Chunk status markers */
-static const char const * packet_missing = "-";
-static const char const * packet_ok = "+";
-
 /* Current bitmap and file */
 static FIL fs_file, fs_map;
 static FATDIR dirp;
 static FIL * fd_file = NULL;
 static FIL * fd_map = NULL;
-static char * mem_map = NULL;
+static ftp_map_t chunk_map = {0};
 
 /* Current file info */
 char file_name[FTP_PATH_LENGTH];
@@ -33,41 +28,77 @@ uint32_t file_size;
 uint32_t file_chunk_size;
 uint32_t file_chunks;
 
+/* CRC of the chunks written in order from the start of the file */
+static uint32_t crc_run;
+static uint32_t crc_chunks;
+
 /* Directory pointer used in listing */
 char dirpath[FTP_PATH_LENGTH];
 
 ftp_return_t ftp_fat_abort(void * state);
 ftp_return_t ftp_fat_timeout(void * state);
 
-/* Calculate CRC of current file */
+/* Write the part of the chunk map changed since last time */
+static int map_persist(void) {
+
+	uint32_t offset, length;
+
+	if (fd_map == NULL || !ftp_map_dirty(&chunk_map, &offset, &length))
+		return 0;
+
+	/* Chunks must be on disk before the map says they are */
+	if (fd_file && f_sync(fd_file) != FR_OK)
+		return -1;
+
+	if (f_lseek(fd_map, offset) != FR_OK)
+		return -1;
+	if (f_write(fd_map, (uint8_t *) chunk_map.bits + offset, length, NULL) != FR_OK)
+		return -1;
+	if (f_sync(fd_map) != FR_OK)
+		return -1;
+
+	ftp_map_clean(&chunk_map);
+
+	return 0;
+
+}
+
+/* Calculate CRC of current file. Only the part after the chunks written in
+ * order is read, in whole sectors where possible, unless the backend reads
+ * the whole file back */
 static int file_crc(uint32_t * crc_arg) {
 
-	/* Calculate CRC32 */
-	uint8_t byte, bytes[256];
-	uint32_t crc = 0xFFFFFFFF;
-	unsigned int i, j;
+	uint8_t bytes[FTP_CRC_BLOCK];
+	uint32_t crc = crc_run;
+	uint32_t offset = crc_chunks * file_chunk_size;
+	unsigned int length, read;
 
 	if (fd_file == NULL)
 		return -1;
 
-	/* Flush file before calculating CRC */
-	f_sync(fd_file);
-	f_lseek(fd_file, 0);
-
-	int result;
-	for (i = 0; i < file_size / 256; i++) {
-		if ((result = f_read(fd_file, bytes, 256, NULL)) != FR_OK)
-			return -1;
-		for (j = 0; j < 256; j++)
-			crc = chksum_crc32_step(crc, bytes[j]);
+	if (backend_fat.crc_readback) {
+		offset = 0;
+		crc = 0xFFFFFFFF;
 	}
-	for (i = 0; i < file_size % 256; i++) {
-		if ((result = f_read(fd_file, &byte, 1, NULL)) != FR_OK)
+
+	if (offset < file_size) {
+		/* Flush file before calculating CRC */
+		f_sync(fd_file);
+		if (f_lseek(fd_file, offset) != FR_OK)
 			return -1;
-		crc = chksum_crc32_step(crc, byte);
+
+		while (offset < file_size) {
+			length = FTP_CRC_BLOCK - offset % FTP_CRC_BLOCK;
+			if (length > file_size - offset)
+				length = file_size - offset;
+			if (f_read(fd_file, bytes, length, &read) != FR_OK || read != length)
+				return -1;
+			crc = chksum_crc32_block(crc, bytes, length);
+			offset += length;
+		}
 	}
-	crc = (crc ^ 0xFFFFFFFF);
-	*crc_arg = crc;
+
+	*crc_arg = crc ^ 0xFFFFFFFF;
 
 	return 0;
 
@@ -83,10 +114,12 @@ ftp_return_t ftp_fat_upload(void * state, const char const * path, uint32_t mema
 	file_chunks = (size + chunk_size - 1) / chunk_size;
 	strncpy(file_name, path, FTP_PATH_LENGTH);
 	file_name[FTP_PATH_LENGTH - 1] = '\0';
+	crc_run = 0xFFFFFFFF;
+	crc_chunks = 0;
 
 	/* Abort if a previous transfer was incomplete */
-	if (fd_file || fd_map || mem_map) {
-		printf("Aborting previous transfer %p %p %p\r\n", fd_file, fd_map, mem_map);
+	if (fd_file || fd_map || chunk_map.bits) {
+		printf("Aborting previous transfer %p %p %p\r\n", fd_file, fd_map, chunk_map.bits);
 		ftp_fat_timeout(state);
 	}
 
@@ -100,60 +133,59 @@ ftp_return_t ftp_fat_upload(void * state, const char const * path, uint32_t mema
 		return FTP_RET_IO;
 	}
 
-	/* Allocate memory map */
-	if (mem_map == NULL) {
-		mem_map = malloc(file_chunks);
-		if (mem_map == NULL) {
-			f_close(fd_file);
-			fd_file = NULL;
-			return FTP_RET_NOSPC;
-		}
+	/* Allocate chunk map */
+	if (ftp_map_init(&chunk_map, file_chunks) != 0) {
+		f_close(fd_file);
+		fd_file = NULL;
+		return FTP_RET_NOSPC;
 	}
 
 	/* Try to create a new map file */
 	strncpy(map, path, FTP_PATH_LENGTH);
 	strcpy((char *) map + strlen(path) - 4, ".MAP");
 
-	/* Check if file already exists */
-	if (f_open(fd_map, map, FA_OPEN_EXISTING | FA_WRITE | FA_READ) == FR_OK) {
+	/* Resume from an existing map file of the right size */
+	uint32_t map_size = ftp_map_size(&chunk_map);
+	int result = f_open(fd_map, map, FA_OPEN_EXISTING | FA_WRITE | FA_READ);
+	if (result == FR_OK && f_size(fd_map) == map_size) {
 
 		unsigned int read;
-		if (f_read(fd_map, mem_map, file_chunks, &read) != FR_OK) {
+		if (f_read(fd_map, chunk_map.bits, map_size, &read) != FR_OK || read != map_size) {
 			f_close(fd_file);
 			fd_file = NULL;
 			f_close(fd_map);
 			fd_map = NULL;
+			ftp_map_free(&chunk_map);
 			return FTP_RET_IO;
 		}
 
+		ftp_map_loaded(&chunk_map);
+
 	} else {
 
-		unsigned int i;
+		if (result == FR_OK)
+			f_close(fd_map);
 
 		/* Create new file */
-		if (f_open(fd_map, map, FA_OPEN_ALWAYS | FA_WRITE | FA_READ) != FR_OK) {
+		if (f_open(fd_map, map, FA_CREATE_ALWAYS | FA_WRITE | FA_READ) != FR_OK) {
 			printf("Failed to create bitmap %s\r\n", map);
 			f_close(fd_file);
 			fd_file = NULL;
-			free(mem_map);
-			mem_map = NULL;
+			fd_map = NULL;
+			ftp_map_free(&chunk_map);
 			return FTP_RET_IO;
 		}
 
 		/* Clear contents */
-		for (i = 0; i < file_chunks; i++) {
-			int result = f_write(fd_map, packet_missing, 1, NULL);
-			if (result != FR_OK) {
-				printf("Failed to clear bitmap %u\r\n", result);
-				f_close(fd_map);
-				fd_map = NULL;
-				f_close(fd_file);
-				fd_file = NULL;
-				free(mem_map);
-				mem_map = NULL;
-				return FTP_RET_IO;
-			}
-			mem_map[i] = *packet_missing;
+		result = f_write(fd_map, chunk_map.bits, map_size, NULL);
+		if (result != FR_OK) {
+			printf("Failed to clear bitmap %u\r\n", result);
+			f_close(fd_map);
+			fd_map = NULL;
+			f_close(fd_file);
+			fd_file = NULL;
+			ftp_map_free(&chunk_map);
+			return FTP_RET_IO;
 		}
 
 		f_sync(fd_map);
@@ -190,6 +222,8 @@ ftp_return_t ftp_fat_download(void * state, const char const * path, uint32_t me
 	file_chunks = (file_size + chunk_size - 1) / chunk_size;
 	strncpy(file_name, path, FTP_PATH_LENGTH);
 	file_name[FTP_PATH_LENGTH - 1] = '\0';
+	crc_run = 0xFFFFFFFF;
+	crc_chunks = 0;
 
 	/* Calculate CRC */
 	if (file_crc(crc) != 0)
@@ -206,8 +240,12 @@ ftp_return_t ftp_fat_write_chunk(void * state, uint32_t chunk, uint8_t * data, u
 		goto chunk_write_error;
 	if (f_write(fd_file, data, size, NULL) != FR_OK)
 		goto chunk_write_error;
-	if (f_sync(fd_file) != FR_OK)
-		goto chunk_write_error;
+
+	/* Chunks written in order go into the CRC right away */
+	if (chunk == crc_chunks) {
+		crc_run = chksum_crc32_block(crc_run, data, size);
+		crc_chunks++;
+	}
 
 	return FTP_RET_OK;
 
@@ -239,8 +277,8 @@ chunk_read_error:
 
 ftp_return_t ftp_fat_get_status(void * state, uint32_t chunk, int * status) {
 
-	if (status) {
-		*status = (mem_map[chunk] == *packet_ok);
+	if (status && chunk_map.bits) {
+		*status = ftp_map_get(&chunk_map, chunk);
 		return FTP_RET_OK;
 	} else {
 		return FTP_RET_INVAL;
@@ -250,26 +288,38 @@ ftp_return_t ftp_fat_get_status(void * state, uint32_t chunk, int * status) {
 
 ftp_return_t ftp_fat_set_status(void * state, uint32_t chunk) {
 
-	/* Write to map file */
-	if (f_lseek(fd_map, chunk) != FR_OK)
-		goto status_write_error;
-	if (f_write(fd_map, packet_ok, 1, NULL) != FR_OK)
-		goto status_write_error;
-	if (f_sync(fd_map) != FR_OK)
-		goto status_write_error;
+	if (chunk_map.bits == NULL)
+		return FTP_RET_INVAL;
 
-	/* Mark in RAM map */
-	mem_map[chunk] = *packet_ok;
+	/* Mark in RAM map, and write the map file every FTP_MAP_FLUSH chunks.
+	 * The data file is synced along with it */
+	if (ftp_map_set(&chunk_map, chunk) && map_persist() != 0)
+		goto status_write_error;
 
 	return FTP_RET_OK;
 
 status_write_error:
 	printf("Failed to write status for chunk\r\n");
 	f_close(fd_map);
+	fd_map = NULL;
 	return FTP_RET_IO;
 
 }
 
+ftp_return_t ftp_fat_status_map(void * state, ftp_map_t ** map) {
+
+	if (map == NULL || chunk_map.bits == NULL)
+		return FTP_RET_INVAL;
+
+	/* A status request ends a pass, save what it received */
+	if (map_persist() != 0)
+		return FTP_RET_IO;
+
+	*map = &chunk_map;
+	return FTP_RET_OK;
+
+}
+
 ftp_return_t ftp_fat_get_crc(void * state, uint32_t * crc) {
 
 	return (crc != NULL && file_crc(crc) == 0) ? FTP_RET_OK : FTP_RET_INVAL;
@@ -278,6 +328,9 @@ ftp_return_t ftp_fat_get_crc(void * state, uint32_t * crc) {
 
 ftp_return_t ftp_fat_timeout(void * state) {
 
+	/* Keep the chunk map for a resumed upload */
+	map_persist();
+
 	/* Close files */
 	if (fd_file) {
 		f_close(fd_file);
@@ -287,10 +340,8 @@ ftp_return_t ftp_fat_timeout(void * state) {
 		f_close(fd_map);
 		fd_map = NULL;
 	}
-	if (mem_map) {
-		free(mem_map);
-		mem_map = NULL;
-	}
+	if (chunk_map.bits)
+		ftp_map_free(&chunk_map);
 
 	return FTP_RET_OK;
 
@@ -298,7 +349,8 @@ ftp_return_t ftp_fat_timeout(void * state) {
 
 ftp_return_t ftp_fat_done(void * state) {
 
-	/* Close handles */
+	/* Close handles, the map is removed below so it is not saved */
+	ftp_map_clean(&chunk_map);
 	ftp_fat_timeout(state);
 
 	/* Generate map path */
@@ -427,4 +479,5 @@ ftp_backend_t backend_fat = {
 	.abort 			= ftp_fat_abort,
 	.done 			= ftp_fat_done,
 	.timeout		= ftp_fat_timeout,
+	.status_map		= ftp_fat_status_map,
 };
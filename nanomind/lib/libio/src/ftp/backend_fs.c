@@ -15,15 +15,11 @@
 
 #include <ftp/ftp_server.h>
 
-/* Chunk status markers */
-static const char const *packet_missing = "-";
-static const char const *packet_ok = "+";
-
 struct ftp_uffs_state {
 	/* Current bitmap and file */
 	FILE *fd_file;
 	FILE *fd_map;
-	char *mem_map;
+	ftp_map_t map;
 
 	/* Current file info */
 	char file_name[FTP_PATH_LENGTH];
@@ -31,6 +27,10 @@ struct ftp_uffs_state {
 	uint32_t file_chunk_size;
 	uint32_t file_chunks;
 
+	/* CRC of the chunks written in order from the start of the file */
+	uint32_t crc;
+	uint32_t crc_chunks;
+
 	/* Directory pointer used in listing */
 	DIR *dirp;
 	char dirpath[FTP_PATH_LENGTH];
@@ -39,7 +39,36 @@ struct ftp_uffs_state {
 ftp_return_t ftp_uffs_abort(void *state);
 ftp_return_t ftp_uffs_timeout(void *state);
 
-/* Calculate CRC of current file */
+/* Write the part of the chunk map changed since last time */
+static int map_persist(struct ftp_uffs_state *uffs_state) {
+
+	uint32_t offset, length;
+
+	if (!uffs_state->fd_map || !ftp_map_dirty(&uffs_state->map, &offset, &length))
+		return 0;
+
+	/* Chunks must be on disk before the map says they are */
+	if (uffs_state->fd_file) {
+		fflush(uffs_state->fd_file);
+		fsync(fileno(uffs_state->fd_file));
+	}
+
+	if (fseek(uffs_state->fd_map, offset, SEEK_SET) != 0)
+		return -1;
+	if (fwrite((uint8_t *) uffs_state->map.bits + offset, 1, length, uffs_state->fd_map) != length)
+		return -1;
+
+	fflush(uffs_state->fd_map);
+	fsync(fileno(uffs_state->fd_map));
+	ftp_map_clean(&uffs_state->map);
+
+	return 0;
+
+}
+
+/* Calculate CRC of current file. Only the part after the chunks written in
+ * order is read, in blocks aligned to FTP_CRC_BLOCK, unless the backend
+ * reads the whole file back */
 int file_crc(void *state, uint32_t *crc_arg) {
 
 	struct ftp_uffs_state *uffs_state = (struct ftp_uffs_state *)state;
@@ -52,15 +81,23 @@ int file_crc(void *state, uint32_t *crc_arg) {
 		printf("Flush error\r\n");
 	if (fsync(fileno(uffs_state->fd_file)) != 0)
 		printf("Fsync error\r\n");
-	if (fseek(uffs_state->fd_file, 0, SEEK_SET) != 0)
+	uint32_t offset = uffs_state->crc_chunks * uffs_state->file_chunk_size;
+	uint32_t crc = uffs_state->crc;
+	if (backend_uffs.crc_readback) {
+		offset = 0;
+		crc = 0xFFFFFFFF;
+	}
+	if (fseek(uffs_state->fd_file, offset, SEEK_SET) != 0)
 		printf("Fseek error\r\n");
 
 
 	//printf("File size to check %"PRIu32", state %p, fd %p\r\n", uffs_state->file_size, uffs_state, uffs_state->fd_file);
-	uint8_t byte;
-	uint32_t crc = 0xFFFFFFFF;
-	while(fread(&byte, 1, 1, uffs_state->fd_file) == 1)
-		crc = chksum_crc32_step(crc, byte);
+	uint8_t bytes[FTP_CRC_BLOCK];
+	size_t length;
+	while ((length = fread(bytes, 1, FTP_CRC_BLOCK - offset % FTP_CRC_BLOCK, uffs_state->fd_file)) > 0) {
+		crc = chksum_crc32_block(crc, bytes, length);
+		offset += length;
+	}
 	crc = (crc ^ 0xFFFFFFFF);
 
 	*crc_arg = crc;
@@ -78,7 +115,7 @@ ftp_return_t ftp_uffs_init(void **state) {
 		if (uffs_state) {
 			uffs_state->fd_file = NULL;
 			uffs_state->fd_map = NULL;
-			uffs_state->mem_map = NULL;
+			uffs_state->map.bits = NULL;
 			uffs_state->dirp = NULL;
 			*state = uffs_state;
 			return FTP_RET_OK;
@@ -112,10 +149,12 @@ ftp_return_t ftp_uffs_upload(void *state, const char const *path, uint32_t memad
 	uffs_state->file_chunks = (size + chunk_size - 1) / chunk_size;
 	strncpy(uffs_state->file_name, path, FTP_PATH_LENGTH);
 	uffs_state->file_name[FTP_PATH_LENGTH - 1] = '\0';
+	uffs_state->crc = 0xFFFFFFFF;
+	uffs_state->crc_chunks = 0;
 
 	/* Abort if a previous transfer was incomplete */
-	if (uffs_state->fd_file || uffs_state->fd_map || uffs_state->mem_map) {
-		printf("Aborting previous transfer %p %p %p\r\n", uffs_state->fd_file, uffs_state->fd_map, uffs_state->mem_map);
+	if (uffs_state->fd_file || uffs_state->fd_map || uffs_state->map.bits) {
+		printf("Aborting previous transfer %p %p %p\r\n", uffs_state->fd_file, uffs_state->fd_map, uffs_state->map.bits);
 		ftp_uffs_timeout(state);
 		printf("ftp_uffs_abort complete\r\n");
 	}
@@ -131,24 +170,23 @@ ftp_return_t ftp_uffs_upload(void *state, const char const *path, uint32_t memad
 		}
 	}
 
-	/* Allocate memory map */
-	if (uffs_state->mem_map == NULL) {
-		uffs_state->mem_map = malloc(uffs_state->file_chunks);
-		if (uffs_state->mem_map == NULL) {
-			fclose(uffs_state->fd_file);
-			uffs_state->fd_file = NULL;
-			return FTP_RET_NOSPC;
-		}
+	/* Allocate chunk map */
+	if (ftp_map_init(&uffs_state->map, uffs_state->file_chunks) != 0) {
+		fclose(uffs_state->fd_file);
+		uffs_state->fd_file = NULL;
+		return FTP_RET_NOSPC;
 	}
 
 	/* Try to create a new map file */
 	strncpy(map, path, FTP_PATH_LENGTH);
 	strcpy((char *) map + strlen(path) - 4, ".MAP");
 
-	/* Check if file already exists */
+	/* Resume from an existing map file of the right size */
+	uint32_t map_size = ftp_map_size(&uffs_state->map);
 	uffs_state->fd_map = fopen(map, "r+");
-	if (uffs_state->fd_map == NULL || fread(uffs_state->mem_map, 1, uffs_state->file_chunks, uffs_state->fd_map) != uffs_state->file_chunks) {
-		unsigned int i;
+	if (uffs_state->fd_map == NULL ||
+			fread(uffs_state->map.bits, 1, map_size, uffs_state->fd_map) != map_size ||
+			fgetc(uffs_state->fd_map) != EOF) {
 
 		/* Close file if already open but data could not be read */
 		if (uffs_state->fd_map) {
@@ -157,35 +195,33 @@ ftp_return_t ftp_uffs_upload(void *state, const char const *path, uint32_t memad
 		}
 
 		/* Create new file */
+		memset(uffs_state->map.bits, 0, map_size);
 		uffs_state->fd_map = fopen(map, "w+");
 		if (uffs_state->fd_map == NULL) {
 			printf("Failed to create bitmap %s\r\n", map);
 			fclose(uffs_state->fd_file);
 			uffs_state->fd_file = NULL;
-			free(uffs_state->mem_map);
-			uffs_state->mem_map = NULL;
+			ftp_map_free(&uffs_state->map);
 			return FTP_RET_IO;
 		}
 
 		/* Clear contents */
-		for (i = 0; i < uffs_state->file_chunks; i++) {
-			if (fwrite(packet_missing, 1, 1, uffs_state->fd_map) < 1) {
-				printf("Failed to clear bitmap\r\n");
-				fclose(uffs_state->fd_map);
-				uffs_state->fd_map = NULL;
-				fclose(uffs_state->fd_file);
-				uffs_state->fd_file = NULL;
-				free(uffs_state->mem_map);
-				uffs_state->mem_map = NULL;
-				return FTP_RET_IO;
-			}
-			uffs_state->mem_map[i] = *packet_missing;
+		if (fwrite(uffs_state->map.bits, 1, map_size, uffs_state->fd_map) != map_size) {
+			printf("Failed to clear bitmap\r\n");
+			fclose(uffs_state->fd_map);
+			uffs_state->fd_map = NULL;
+			fclose(uffs_state->fd_file);
+			uffs_state->fd_file = NULL;
+			ftp_map_free(&uffs_state->map);
+			return FTP_RET_IO;
 		}
 
 		fflush(uffs_state->fd_map);
 		fsync(fileno(uffs_state->fd_map));
 	}
 
+	ftp_map_loaded(&uffs_state->map);
+
 	return FTP_RET_OK;
 
 }
@@ -213,6 +249,8 @@ ftp_return_t ftp_uffs_download(void *state, const char const *path, uint32_t mem
 	uffs_state->file_chunks = (uffs_state->file_size + chunk_size - 1) / chunk_size;
 	strncpy(uffs_state->file_name, path, FTP_PATH_LENGTH);
 	uffs_state->file_name[FTP_PATH_LENGTH - 1] = '\0';
+	uffs_state->crc = 0xFFFFFFFF;
+	uffs_state->crc_chunks = 0;
 
 	/* Calculate CRC */
 	if (file_crc(state, crc) != 0)
@@ -235,6 +273,12 @@ ftp_return_t ftp_uffs_write_chunk(void *state, uint32_t chunk, uint8_t *data, ui
 	if (fwrite(data, 1, size, uffs_state->fd_file) != size)
 		goto chunk_write_error;
 
+	/* Chunks written in order go into the CRC right away */
+	if (chunk == uffs_state->crc_chunks) {
+		uffs_state->crc = chksum_crc32_block(uffs_state->crc, data, size);
+		uffs_state->crc_chunks++;
+	}
+
 	return FTP_RET_OK;
 
 chunk_write_error:
@@ -273,10 +317,10 @@ ftp_return_t ftp_uffs_get_status(void *state, uint32_t chunk, int *status) {
 
 	struct ftp_uffs_state *uffs_state = (struct ftp_uffs_state *)state;
 
-	if (!uffs_state || !status)
+	if (!uffs_state || !status || !uffs_state->map.bits)
 		return FTP_RET_INVAL;
 
-	*status = (uffs_state->mem_map[chunk] == *packet_ok);
+	*status = ftp_map_get(&uffs_state->map, chunk);
 	return FTP_RET_OK;
 
 }
@@ -285,21 +329,13 @@ ftp_return_t ftp_uffs_set_status(void *state, uint32_t chunk) {
 
 	struct ftp_uffs_state *uffs_state = (struct ftp_uffs_state *)state;
 
-	if (!uffs_state)
+	if (!uffs_state || !uffs_state->map.bits)
 		return FTP_RET_INVAL;
 
-	/* Write to map file */
-	if (fseek(uffs_state->fd_map, chunk, SEEK_SET) != 0)
-		goto status_write_error;
-	if (fwrite(packet_ok, 1, 1, uffs_state->fd_map) != 1)
+	/* Mark in RAM map, and write the map file every FTP_MAP_FLUSH chunks */
+	if (ftp_map_set(&uffs_state->map, chunk) && map_persist(uffs_state) != 0)
 		goto status_write_error;
 
-	fflush(uffs_state->fd_map);
-	fsync(fileno(uffs_state->fd_map));
-
-	/* Mark in RAM map */
-	uffs_state->mem_map[chunk] = *packet_ok;
-
 	return FTP_RET_OK;
 
 status_write_error:
@@ -310,6 +346,22 @@ status_write_error:
 
 }
 
+ftp_return_t ftp_uffs_status_map(void *state, ftp_map_t **map) {
+
+	struct ftp_uffs_state *uffs_state = (struct ftp_uffs_state *)state;
+
+	if (!uffs_state || !map || !uffs_state->map.bits)
+		return FTP_RET_INVAL;
+
+	/* A status request ends a pass, save what it received */
+	if (map_persist(uffs_state) != 0)
+		return FTP_RET_IO;
+
+	*map = &uffs_state->map;
+	return FTP_RET_OK;
+
+}
+
 ftp_return_t ftp_uffs_get_crc(void *state, uint32_t *crc) {
 
 	return (crc != NULL && file_crc(state, crc) == 0) ? FTP_RET_OK : FTP_RET_INVAL;
@@ -332,10 +384,8 @@ ftp_return_t ftp_uffs_done(void *state) {
 		fclose(uffs_state->fd_map);
 		uffs_state->fd_map = NULL;
 	}
-	if (uffs_state->mem_map) {
-		free(uffs_state->mem_map);
-		uffs_state->mem_map = NULL;
-	}
+	if (uffs_state->map.bits)
+		ftp_map_free(&uffs_state->map);
 	if (uffs_state->dirp) {
 		closedir(uffs_state->dirp);
 		uffs_state->dirp = NULL;
@@ -369,10 +419,8 @@ ftp_return_t ftp_uffs_abort(void *state) {
 		fclose(uffs_state->fd_map);
 		uffs_state->fd_map = NULL;
 	}
-	if (uffs_state->mem_map) {
-		free(uffs_state->mem_map);
-		uffs_state->mem_map = NULL;
-	}
+	if (uffs_state->map.bits)
+		ftp_map_free(&uffs_state->map);
 	if (uffs_state->dirp) {
 		closedir(uffs_state->dirp);
 		uffs_state->dirp = NULL;
@@ -406,6 +454,9 @@ ftp_return_t ftp_uffs_timeout(void *state) {
 	if (!uffs_state)
 		return FTP_RET_INVAL;
 
+	/* Keep the chunk map for a resumed upload */
+	map_persist(uffs_state);
+
 	/* Close files */
 	if (uffs_state->fd_file) {
 		fclose(uffs_state->fd_file);
@@ -419,10 +470,8 @@ ftp_return_t ftp_uffs_timeout(void *state) {
 		closedir(uffs_state->dirp);
 		uffs_state->dirp = NULL;
 	}
-	if (uffs_state->mem_map) {
-		free(uffs_state->mem_map);
-		uffs_state->mem_map = NULL;
-	}
+	if (uffs_state->map.bits)
+		ftp_map_free(&uffs_state->map);
 
 	return FTP_RET_OK;
 
@@ -544,4 +593,7 @@ ftp_backend_t backend_uffs = {
 	.abort 			= ftp_uffs_abort,
 	.done 			= ftp_uffs_done,
 	.timeout		= ftp_uffs_timeout,
+	.status_map		= ftp_uffs_status_map,
+	/* Flash can fail to program a page without a write error */
+	.crc_readback	= 1,
 };
@@ -1,8 +1,7 @@
+#include <stdio.h>
 #include <string.h>
 #include <inttypes.h>
 
-#include <freertos/FreeRTOS.h>
-
 #include <util/crc32.h>
 #include <util/log.h>
 #include <lzo/lzoutils.h>
@@ -20,22 +19,23 @@ static uint32_t file_size;
 static uint32_t file_chunk_size;
 static uint32_t file_chunks;
 
-static unsigned char * ram_map = NULL;
+static ftp_map_t ram_map = {0};
+
+/* CRC of the chunks written in order from the start of the file */
+static uint32_t crc_run = 0xFFFFFFFF;
+static uint32_t crc_chunks = 0;
 
 ftp_return_t ftp_ram_get_crc(void * state, uint32_t * crc_arg) {
 
 	if (!crc_arg)
 		return FTP_RET_INVAL;
 
-	/* Calculate CRC32 */
-	unsigned int i;
-
-	uint32_t crc = 0xFFFFFFFF;
-
-	unsigned char * start = (unsigned char *) file_mem_addr;
+	/* Calculate CRC32 of what was not written in order */
+	uint32_t crc = crc_run;
+	uint32_t offset = crc_chunks * file_chunk_size;
 
-	for (i = 0; i < file_size; i++)
-		crc = chksum_crc32_step(crc, *(start + i));
+	if (offset < file_size)
+		crc = chksum_crc32_block(crc, (uint8_t *) (uintptr_t) file_mem_addr + offset, file_size - offset);
 	crc = (crc ^ 0xFFFFFFFF);
 	*crc_arg = crc;
 
@@ -49,14 +49,14 @@ ftp_return_t ftp_ram_upload(void * state, const char const * path, uint32_t mema
 	file_size = size;
 	file_chunk_size = chunk_size;
 	file_chunks = (size + chunk_size - 1) / chunk_size;
+	crc_run = 0xFFFFFFFF;
+	crc_chunks = 0;
 
 	/* Allocate map */
-	ram_map = pvPortMalloc(file_chunks);
-	if (ram_map == NULL)
+	ftp_map_free(&ram_map);
+	if (ftp_map_init(&ram_map, file_chunks) != 0)
 		return FTP_RET_NOSPC;
 
-	memset(ram_map, 0, file_chunks);
-
 	return FTP_RET_OK;
 
 }
@@ -67,6 +67,8 @@ ftp_return_t ftp_ram_download(void * state, const char const * path, uint32_t me
 	file_size = memsize;
 	file_chunk_size = chunk_size;
 	file_chunks = (memsize + chunk_size - 1) / chunk_size;
+	crc_run = 0xFFFFFFFF;
+	crc_chunks = 0;
 
 	*size = memsize;
 
@@ -78,10 +80,16 @@ ftp_return_t ftp_ram_download(void * state, const char const * path, uint32_t me
 ftp_return_t ftp_ram_write_chunk(void * state, uint32_t chunk, uint8_t * src, uint32_t size) {
 
 	/* Write to mem */
-	void * dst = (void *) (file_mem_addr + chunk * file_chunk_size);
+	void * dst = (void *) (uintptr_t) (file_mem_addr + chunk * file_chunk_size);
 
 	memcpy(dst, src, size);
 
+	/* Chunks written in order go into the CRC right away */
+	if (chunk == crc_chunks) {
+		crc_run = chksum_crc32_block(crc_run, src, size);
+		crc_chunks++;
+	}
+
 	return FTP_RET_OK;
 
 }
@@ -89,7 +97,7 @@ ftp_return_t ftp_ram_write_chunk(void * state, uint32_t chunk, uint8_t * src, ui
 ftp_return_t ftp_ram_read_chunk(void * state, uint32_t chunk, uint8_t * dst, uint32_t size) {
 
 	/* Read from mem */
-	void * src = (void *) (file_mem_addr + chunk * file_chunk_size);
+	void * src = (void *) (uintptr_t) (file_mem_addr + chunk * file_chunk_size);
 
 	memcpy(dst, src, size);
 
@@ -99,8 +107,8 @@ ftp_return_t ftp_ram_read_chunk(void * state, uint32_t chunk, uint8_t * dst, uin
 
 ftp_return_t ftp_ram_get_status(void * state, uint32_t chunk, int * status) {
 
-	if (status) {
-		*status = ram_map[chunk];
+	if (status && ram_map.bits) {
+		*status = ftp_map_get(&ram_map, chunk);
 		return FTP_RET_OK;
 	} else {
 		return FTP_RET_INVAL;
@@ -110,17 +118,29 @@ ftp_return_t ftp_ram_get_status(void * state, uint32_t chunk, int * status) {
 
 ftp_return_t ftp_ram_set_status(void * state, uint32_t chunk) {
 
+	if (ram_map.bits == NULL)
+		return FTP_RET_INVAL;
+
 	/* Write to map */
-	ram_map[chunk] = 1;
+	ftp_map_set(&ram_map, chunk);
+
+	return FTP_RET_OK;
+
+}
+
+ftp_return_t ftp_ram_status_map(void * state, ftp_map_t ** map) {
+
+	if (map == NULL || ram_map.bits == NULL)
+		return FTP_RET_INVAL;
 
+	*map = &ram_map;
 	return FTP_RET_OK;
 
 }
 
 ftp_return_t ftp_ram_abort(void * state) {
 
-	vPortFree(ram_map);
-	ram_map = NULL;
+	ftp_map_free(&ram_map);
 	return FTP_RET_OK;
 
 }
@@ -152,4 +172,5 @@ ftp_backend_t backend_ram = {
 	.abort 			= ftp_ram_abort,
 	.done 			= ftp_ram_done,
 	.timeout		= ftp_ram_abort,
+	.status_map		= ftp_ram_status_map,
 };
@@ -45,6 +45,17 @@ int cmd_ftp_set_host_port(struct command_context *ctx) {
 
 }
 
+int cmd_ftp_set_window(struct command_context *ctx) {
+
+	if (ctx->argc != 2)
+		return CMD_ERROR_SYNTAX;
+
+	ftp_set_window(atoi(ctx->argv[1]));
+
+	return CMD_ERROR_NONE;
+
+}
+
 int cmd_ftp_download_file(struct command_context *ctx) {
 
 	if (ctx->argc != 2)
@@ -238,6 +249,11 @@ command_t __sub_command ftp_subcommands[] = {
 		.name = "server",
 		.help = "set host and port",
 		.handler = cmd_ftp_set_host_port,
+	},{
+		.name = "window",
+		.help = "set upload window",
+		.usage = "<chunks>",
+		.handler = cmd_ftp_set_window,
 	},{
 		.name = "upload_file",
 		.help = "Upload file",
@@ -19,6 +19,7 @@
 
 #include <io/nanomind.h>
 #include <ftp/ftp_types.h>
+#include <ftp/ftp_map.h>
 
 #include <util/crc32.h>
 #include <util/color_printf.h>
@@ -29,11 +30,21 @@
 
 #define FTP_TIMEOUT 90000
 
-/* Chunk status markers */
-static const char const * packet_missing = "-";
-static const char const * packet_ok = "+";
+/* Time to wait for a reply before a request is repeated in a windowed
+ * upload, and the longest wait for a data acknowledgement before the window
+ * is reopened. The wait for acknowledgements follows the round trip time,
+ * but not below FTP_ACK_MIN */
+#define FTP_ACK_TIMEOUT 5000
+#define FTP_ACK_MIN 200
+#define FTP_RETRIES 5
+
+/* A CRC over a large file can take longer than FTP_ACK_TIMEOUT. The server
+ * answers repeated CRC requests from the value it computed, so the request
+ * is repeated for up to FTP_TIMEOUT instead of FTP_RETRIES times */
+#define FTP_CRC_RETRIES (FTP_TIMEOUT / FTP_ACK_TIMEOUT)
 
 static FILE * fp, * fp_map;
+static ftp_map_t download_map = {0};
 static csp_conn_t * conn = NULL;
 
 static int ftp_chunk_size = 100;
@@ -42,11 +53,22 @@ static uint32_t ftp_chunks = 0;
 static uint32_t ftp_checksum = 0xABCD0123;
 char ftp_file_name[FTP_PATH_LENGTH];
 
-static ftp_status_element_t last_status[FTP_STATUS_CHUNKS];
-static uint16_t last_entries = 0;
+/* Chunks the server has received, as of the last status request */
+static ftp_map_t upload_map = {0};
+static uint8_t status_seq = 0;
 static ftp_progress_handler progress_handler = NULL;
 static void* progress_handler_data = NULL;
 
+/* Windowed upload. Chunks sent but not yet acknowledged are kept in
+ * window_chunk, in the ascending order they were sent in, with the time
+ * they were sent in window_sent */
+static unsigned int ftp_window = 0, transfer_window = 0;
+static uint32_t window_chunk[FTP_WINDOW_MAX], window_sent[FTP_WINDOW_MAX];
+static unsigned int window_head = 0, window_count = 0;
+
+/* Round trip estimate for data acknowledgements, in ms */
+static uint32_t ack_srtt = 0, ack_rttvar = 0, ack_timeout = FTP_ACK_TIMEOUT;
+
 static double timespec_diff(struct timespec * start, struct timespec * end) {
 	struct timespec temp;
 	if ((end->tv_nsec - start->tv_nsec) < 0) {
@@ -59,6 +81,12 @@ static double timespec_diff(struct timespec * start, struct timespec * end) {
 	return (double)(temp.tv_sec + (double)temp.tv_nsec/1000000000);
 }
 
+static uint32_t ftp_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 static int ftp_perror(ftp_return_t ret) {
 	switch (ret) {
 	case FTP_RET_OK:
@@ -121,9 +149,171 @@ void ftp_set_progress_handler(ftp_progress_handler handler, void *data)
 	progress_handler_data = data;
 }
 
+/* Write the part of the download map changed since last time */
+static int map_persist(void) {
+
+	uint32_t offset, length;
+
+	if (fp_map == NULL || !ftp_map_dirty(&download_map, &offset, &length))
+		return 0;
+
+	/* Chunks must be on disk before the map says they are */
+	fflush(fp);
+	fsync(fileno(fp));
+
+	if (fseek(fp_map, offset, SEEK_SET) != 0)
+		return -1;
+	if (fwrite((uint8_t *) download_map.bits + offset, 1, length, fp_map) != length)
+		return -1;
+
+	fflush(fp_map);
+	fsync(fileno(fp_map));
+	ftp_map_clean(&download_map);
+
+	return 0;
+
+}
+
+/* CRC of the first size bytes of the local file */
+static uint32_t ftp_file_crc(uint32_t size) {
+
+	uint8_t bytes[4096];
+	uint32_t crc = 0xFFFFFFFF;
+	size_t length;
+
+	fseek(fp, 0, SEEK_SET);
+	while (size > 0 && (length = fread(bytes, 1, size < sizeof(bytes) ? size : sizeof(bytes), fp)) > 0) {
+		crc = chksum_crc32_block(crc, bytes, length);
+		size -= length;
+	}
+
+	return (crc ^ 0xFFFFFFFF);
+
+}
+
+void ftp_set_window(unsigned int window)
+{
+	ftp_window = window > FTP_WINDOW_MAX ? FTP_WINDOW_MAX : window;
+}
+
+/* Read the reply of the given type on the transfer connection, skipping
+ * data acknowledgements and replies to repeated requests */
+static int ftp_read_reply(ftp_packet_t * rep, int replen, uint8_t type, uint32_t timeout) {
+
+	csp_packet_t * packet;
+	int length;
+
+	while ((packet = csp_read(conn, timeout)) != NULL) {
+		length = packet->length;
+		if (((ftp_packet_t *) packet->data)->type != type ||
+				length > (int) sizeof(ftp_packet_t) || (replen >= 0 && length != replen)) {
+			csp_buffer_free(packet);
+			continue;
+		}
+
+		memcpy(rep, packet->data, length);
+		csp_buffer_free(packet);
+		return length;
+	}
+
+	return 0;
+
+}
+
+/* Send a request on the transfer connection and read the reply. A windowed
+ * upload runs without RDP, so the request is sent up to tries times, until
+ * a reply arrives within FTP_ACK_TIMEOUT */
+static int ftp_request(ftp_packet_t * req, int reqlen, ftp_packet_t * rep, int replen, uint8_t type, int tries) {
+
+	uint32_t timeout = transfer_window ? FTP_ACK_TIMEOUT : FTP_TIMEOUT;
+	int length;
+
+	if (!transfer_window)
+		tries = 1;
+
+	while (tries--) {
+		if (csp_transaction_persistent(conn, FTP_TIMEOUT, req, reqlen, NULL, 0) != 1)
+			return 0;
+		length = ftp_read_reply(rep, replen, type, timeout);
+		if (length > 0)
+			return length;
+	}
+
+	return 0;
+
+}
+
+/* Update the acknowledgement timeout with the round trip of a chunk, the
+ * same way RDP estimates its retransmission timeout */
+static void ftp_ack_sample(uint32_t rtt) {
+
+	if (ack_srtt == 0) {
+		ack_srtt = rtt;
+		ack_rttvar = rtt / 2;
+	} else {
+		ack_rttvar = (3 * ack_rttvar + (ack_srtt > rtt ? ack_srtt - rtt : rtt - ack_srtt)) / 4;
+		ack_srtt = (7 * ack_srtt + rtt) / 8;
+	}
+
+	ack_timeout = ack_srtt + 4 * ack_rttvar;
+	if (ack_timeout < FTP_ACK_MIN)
+		ack_timeout = FTP_ACK_MIN;
+	if (ack_timeout > FTP_ACK_TIMEOUT)
+		ack_timeout = FTP_ACK_TIMEOUT;
+
+}
+
+/* Retire the chunks covered by a data acknowledgement, or the whole
+ * window if none arrives. Lost chunks are repaired with STATUS */
+static void ftp_window_wait(void) {
+
+	csp_packet_t * packet;
+	ftp_packet_t * ack;
+	uint32_t chunk;
+
+	while ((packet = csp_read(conn, ack_timeout)) != NULL) {
+		ack = (ftp_packet_t *) packet->data;
+		if (ack->type != FTP_DATA_ACK || packet->length < sizeof(ftp_type_t) + sizeof(ftp_data_ack_t)) {
+			csp_buffer_free(packet);
+			continue;
+		}
+
+		chunk = csp_ntoh32(ack->dataack.chunk);
+		csp_buffer_free(packet);
+
+		while (window_count > 0 && window_chunk[window_head] <= chunk) {
+			if (window_chunk[window_head] == chunk)
+				ftp_ack_sample(ftp_ms() - window_sent[window_head]);
+			window_head = (window_head + 1) % FTP_WINDOW_MAX;
+			window_count--;
+		}
+		return;
+	}
+
+	/* The acknowledgement or the chunks were lost, back off */
+	ack_timeout = ack_timeout * 2 > FTP_ACK_TIMEOUT ? FTP_ACK_TIMEOUT : ack_timeout * 2;
+	window_count = 0;
+
+}
+
+/* End the transfer with DONE or ABORT. The server confirms them in a
+ * windowed upload, where a lost one would leave the file open until the
+ * server times out */
+static int ftp_end(uint8_t type) {
+
+	ftp_packet_t req, rep;
+
+	req.type = type;
+	if (transfer_window)
+		return ftp_request(&req, sizeof(ftp_type_t), &rep, sizeof(ftp_type_t), type, FTP_RETRIES) > 0 ? 0 : -1;
+
+	return csp_transaction_persistent(conn, FTP_TIMEOUT, &req, sizeof(ftp_type_t), NULL, 0) == 1 ? 0 : -1;
+
+}
+
 int ftp_upload(uint8_t host, uint8_t port, const char * path, uint8_t backend, int chunk_size, uint32_t addr, const char * remote_path, uint32_t * size, uint32_t * checksum) {
 
-	int req_length, rep_length;
+	int req_length, rep_length, length;
 	ftp_packet_t req, rep;
 
 	/* Open file and read size */
@@ -137,16 +327,7 @@ int ftp_upload(uint8_t host, uint8_t port, const char * path, uint8_t backend, i
 	color_printf(COLOR_GREEN, "File size is %u\r\n", (unsigned int) statbuf.st_size);
 
 	/* Calculate CRC32 */
-	char byte;
-	int i;
-	fseek(fp, 0, SEEK_SET);
-	uint32_t crc = 0xFFFFFFFF;
-	for (i = 0; i < statbuf.st_size; i++) {
-		if (!fread(&byte, 1, 1, fp))
-			break;
-		crc = chksum_crc32_step(crc, byte);
-	}
-	crc = (crc ^ 0xFFFFFFFF);
+	uint32_t crc = ftp_file_crc(statbuf.st_size);
 	ftp_checksum = crc;
 	color_printf(COLOR_GREEN, "Checksum is %#010"PRIx32"\r\n", crc);
 
@@ -161,6 +342,13 @@ int ftp_upload(uint8_t host, uint8_t port, const char * path, uint8_t backend, i
 	ftp_chunks = (ftp_file_size + ftp_chunk_size - 1) / ftp_chunk_size;
 	strncpy(ftp_file_name, path, FTP_PATH_LENGTH);
 
+	/* Everything is missing until the server tells otherwise */
+	ftp_map_free(&upload_map);
+	if (ftp_map_init(&upload_map, ftp_chunks) != 0) {
+		color_printf(COLOR_RED, "Failed to allocate bitmap\r\n");
+		return -1;
+	}
+
 	/* Assemble upload request */
 	req.type = FTP_UPLOAD_REQUEST;
 	req.up.chunk_size = csp_hton16(ftp_chunk_size);
@@ -169,15 +357,38 @@ int ftp_upload(uint8_t host, uint8_t port, const char * path, uint8_t backend, i
 	req.up.mem_addr = csp_hton32(addr);
 	req.up.backend = backend;
 	strncpy(req.up.path, remote_path, FTP_PATH_LENGTH);
+	req.up.window = csp_hton16(ftp_window);
+	transfer_window = ftp_window;
+	ack_srtt = ack_rttvar = 0;
+	ack_timeout = FTP_ACK_TIMEOUT;
 
 	req_length = sizeof(ftp_type_t) + sizeof(ftp_upload_request_t);
 	rep_length = sizeof(ftp_type_t) + sizeof(ftp_upload_reply_t);
 
-	conn = csp_connect(CSP_PRIO_NORM, host, port, FTP_TIMEOUT, CSP_O_RDP);
+	/* A windowed upload paces itself, so it does not need RDP, whose
+	 * window is limited to CSP_RDP_MAX_WINDOW packets */
+	conn = csp_connect(CSP_PRIO_NORM, host, port, FTP_TIMEOUT, transfer_window ? CSP_O_NONE : CSP_O_RDP);
 	if (conn == NULL)
 		return -1;
 
-	if (csp_transaction_persistent(conn, FTP_TIMEOUT, &req, req_length, &rep, rep_length) != rep_length) {
+	length = ftp_request(&req, req_length, &rep, -1, FTP_UPLOAD_REPLY, FTP_RETRIES);
+
+	/* Servers without windowed uploads send no data acknowledgements, and
+	 * reply without a window or not at all if they require RDP */
+	if (transfer_window && (length < rep_length || rep.uprep.window == 0)) {
+		color_printf(COLOR_YELLOW, "Server does not support windowed upload, using RDP\r\n");
+		transfer_window = 0;
+		if (length > 0)
+			ftp_end(FTP_ABORT);
+		csp_close(conn);
+		req.up.window = 0;
+		conn = csp_connect(CSP_PRIO_NORM, host, port, FTP_TIMEOUT, CSP_O_RDP);
+		if (conn == NULL)
+			return -1;
+		length = ftp_request(&req, req_length, &rep, -1, FTP_UPLOAD_REPLY, 1);
+	}
+
+	if (length < (int) (sizeof(ftp_type_t) + sizeof(rep.uprep.ret))) {
 		color_printf(COLOR_RED, "No reply to upload request received\r\n");
 		return -1;
 	}
@@ -187,6 +398,10 @@ int ftp_upload(uint8_t host, uint8_t port, const char * path, uint8_t backend, i
 		return -1;
 	}
 
+	/* The server may allow a smaller window */
+	if (transfer_window && csp_ntoh16(rep.uprep.window) < transfer_window)
+		transfer_window = csp_ntoh16(rep.uprep.window);
+
 	return 0;
 
 }
@@ -197,6 +412,7 @@ int ftp_download(uint8_t host, uint8_t port, const char * path, uint8_t backend,
 	ftp_packet_t req, rep;
 
 	ftp_chunk_size = chunk_size;
+	transfer_window = 0;
 
 	req.type = FTP_DOWNLOAD_REQUEST;
 	req.down.chunk_size = csp_hton16(ftp_chunk_size);
@@ -252,15 +468,26 @@ int ftp_download(uint8_t host, uint8_t port, const char * path, uint8_t backend,
 		}
 	}
 
+	/* Allocate chunk map */
+	ftp_map_free(&download_map);
+	if (ftp_map_init(&download_map, ftp_chunks) != 0) {
+		color_printf(COLOR_RED, "Failed to allocate bitmap\r\n");
+		fclose(fp);
+		return -1;
+	}
+
 	/* Try to create a new bitmap */
 	sprintf(map, "%s.map", path);
 
-	/* Check if file already exists */
+	/* Resume from an existing bitmap of the right size */
+	uint32_t map_size = ftp_map_size(&download_map);
 	fp_map = fopen(map, "r+");
-	if (fp_map == NULL) {
-		int i;
+	if (fp_map == NULL || fread(download_map.bits, 1, map_size, fp_map) != map_size || fgetc(fp_map) != EOF) {
+		if (fp_map)
+			fclose(fp_map);
 
 		/* Create new file */
+		memset(download_map.bits, 0, map_size);
 		fp_map = fopen(map, "w+");
 		if (fp_map == NULL) {
 			color_printf(COLOR_RED, "Failed to create bitmap\r\n");
@@ -269,67 +496,177 @@ int ftp_download(uint8_t host, uint8_t port, const char * path, uint8_t backend,
 		}
 
 		/* Clear contents */
-		for (i = 0; i < ftp_chunks; i++) {
-			if (fwrite(packet_missing, 1, 1, fp_map) < 1) {
-				color_printf(COLOR_RED, "Failed to clear bitmap\r\n");
-				fclose(fp_map);
-				fclose(fp);
-				return -1;
-			}
+		if (fwrite(download_map.bits, 1, map_size, fp_map) != map_size) {
+			color_printf(COLOR_RED, "Failed to clear bitmap\r\n");
+			fclose(fp_map);
+			fp_map = NULL;
+			fclose(fp);
+			return -1;
 		}
 
 		fflush(fp_map);
 		fsync(fileno(fp_map));
 	}
 
+	ftp_map_loaded(&download_map);
+
 	return 0;
 
 }
 
-int ftp_status_request(void) {
-
-	/* Request */
-	int req_length;
-	ftp_packet_t req, rep;
-	req.type = FTP_STATUS_REQUEST;
-
-	req_length = sizeof(ftp_type_t);
+/* Status reply from a server that does not send status maps. Only the
+ * runs in the reply are marked missing, like before status maps */
+static int ftp_status_runs(ftp_status_reply_t * status) {
 
-	/* Transaction */
-	if (csp_transaction_persistent(conn, FTP_TIMEOUT, &req, req_length, &rep, -1) == 0) {
-		color_printf(COLOR_RED, "Failed to receive status reply\r\n");
-		return -1;
-	}
+	uint32_t i, j, first;
 
-	if (rep.type != FTP_STATUS_REPLY || rep.statusrep.ret != FTP_RET_OK) {
+	if (status->ret != FTP_RET_OK) {
 		color_printf(COLOR_RED, "Reply was not STATUS_REPLY\r\n");
 		return -1;
 	}
 
-	rep.statusrep.complete = csp_ntoh32(rep.statusrep.complete);
-	rep.statusrep.total = csp_ntoh32(rep.statusrep.total);
-	rep.statusrep.entries = csp_ntoh16(rep.statusrep.entries);
+	status->complete = csp_ntoh32(status->complete);
+	status->total = csp_ntoh32(status->total);
+	status->entries = csp_ntoh16(status->entries);
 
 	color_printf(COLOR_BLUE, "\r\nTransfer Status: ");
 	color_printf(COLOR_BLUE, "%u of %u (%.2f%%)\r\n",
-			rep.statusrep.complete, rep.statusrep.total,
-			(double) rep.statusrep.complete * 100 / (double) rep.statusrep.total);
-
-	if (rep.statusrep.complete != rep.statusrep.total) {
-		int i;
-		for (i = 0; i < rep.statusrep.entries; i++) {
-			rep.statusrep.entry[i].next = csp_ntoh32(rep.statusrep.entry[i].next);
-			rep.statusrep.entry[i].count = csp_ntoh16(rep.statusrep.entry[i].count);
-			last_status[i].next = rep.statusrep.entry[i].next;
-			last_status[i].count = rep.statusrep.entry[i].count;
+			status->complete, status->total,
+			(double) status->complete * 100 / (double) status->total);
+
+	for (first = 0; first < upload_map.chunks; first += FTP_STATUS_MAP_CHUNKS)
+		ftp_map_segment_set(&upload_map, first, NULL);
+
+	if (status->entries > FTP_STATUS_CHUNKS)
+		status->entries = FTP_STATUS_CHUNKS;
+
+	for (i = 0; i < status->entries; i++) {
+		uint32_t next = csp_ntoh32(status->entry[i].next);
+		uint16_t count = csp_ntoh16(status->entry[i].count);
+		for (j = 0; j < count && next + j < upload_map.chunks; j++)
+			ftp_map_clear(&upload_map, next + j);
+	}
+
+	return 0;
+
+}
+
+int ftp_status_request(void) {
+
+	int tries = transfer_window ? FTP_RETRIES : 1;
+	uint32_t timeout, first, count, bytes;
+	uint16_t segments = 0;
+	uint8_t bits[FTP_STATUS_MAP_CHUNKS / 8];
+	csp_packet_t * packet;
+	ftp_packet_t req, * rep;
+	ftp_map_t covered;
+	int ret = -1;
+
+	/* Bit per status map segment received. Segments that are not sent
+	 * have no missing chunks, which is only known once all have arrived */
+	if (ftp_map_init(&covered, (ftp_chunks + FTP_STATUS_MAP_CHUNKS - 1) / FTP_STATUS_MAP_CHUNKS) != 0) {
+		color_printf(COLOR_RED, "Failed to allocate bitmap\r\n");
+		return -1;
+	}
+
+	/* Request */
+	req.type = FTP_STATUS_REQUEST;
+	req.statusreq.mode = FTP_STATUS_MODE_MAP;
+
+	/* The server does not receive data while it sends the map, so segments
+	 * from earlier requests still hold. Each retry asks for all of them and
+	 * fills in the ones that were lost */
+	while (tries-- > 0) {
+		req.statusreq.seq = ++status_seq;
+		if (csp_transaction_persistent(conn, FTP_TIMEOUT, &req, sizeof(ftp_type_t) + sizeof(ftp_status_request_t), NULL, 0) != 1)
+			break;
+
+		timeout = transfer_window ? FTP_ACK_TIMEOUT : FTP_TIMEOUT;
+
+		while ((packet = csp_read(conn, timeout)) != NULL) {
+			rep = (ftp_packet_t *) packet->data;
+
+			/* Server without status maps */
+			if (rep->type == FTP_STATUS_REPLY && packet->length <= sizeof(ftp_packet_t)) {
+				ret = ftp_status_runs(&rep->statusrep);
+				csp_buffer_free(packet);
+				goto out;
+			}
+
+			/* Skip data acknowledgements and replies to lost requests */
+			if (rep->type != FTP_STATUS_MAP || rep->statusmap.seq != status_seq ||
+					packet->length < sizeof(ftp_type_t) + sizeof(ftp_status_map_t) - sizeof(rep->statusmap.bits)) {
+				csp_buffer_free(packet);
+				continue;
+			}
+
+			if (rep->statusmap.ret != FTP_RET_OK) {
+				color_printf(COLOR_RED, "Reply was not STATUS_MAP\r\n");
+				csp_buffer_free(packet);
+				goto out;
+			}
+
+			if (covered.complete == 0) {
+				color_printf(COLOR_BLUE, "\r\nTransfer Status: ");
+				color_printf(COLOR_BLUE, "%u of %u (%.2f%%)\r\n",
+						csp_ntoh32(rep->statusmap.complete), csp_ntoh32(rep->statusmap.total),
+						(double) csp_ntoh32(rep->statusmap.complete) * 100 / (double) csp_ntoh32(rep->statusmap.total));
+			}
+
+			segments = csp_ntoh16(rep->statusmap.segments);
+			first = csp_ntoh32(rep->statusmap.first);
+			if (segments > 0 && first < upload_map.chunks && first % FTP_STATUS_MAP_CHUNKS == 0) {
+				/* A short segment is dropped like a lost one */
+				count = upload_map.chunks - first;
+				if (count > FTP_STATUS_MAP_CHUNKS)
+					count = FTP_STATUS_MAP_CHUNKS;
+				bytes = (count + 7) / 8;
+				if (packet->length < sizeof(ftp_type_t) + sizeof(ftp_status_map_t) - sizeof(rep->statusmap.bits) + bytes) {
+					csp_buffer_free(packet);
+					continue;
+				}
+				memset(bits, 0, sizeof(bits));
+				memcpy(bits, rep->statusmap.bits, bytes);
+				ftp_map_segment_set(&upload_map, first, bits);
+				ftp_map_set(&covered, first / FTP_STATUS_MAP_CHUNKS);
+			}
+			csp_buffer_free(packet);
+
+			/* The server sends the segments back to back, a longer gap
+			 * means the next one was lost */
+			if (transfer_window)
+				timeout = ack_timeout;
+
+			if (covered.complete >= segments) {
+				/* The server has every chunk outside the segments */
+				for (first = ftp_map_next_missing(&covered, 0, &count); first < covered.chunks;
+						first = ftp_map_next_missing(&covered, first + count, &count)) {
+					uint32_t i;
+					for (i = first; i < first + count; i++)
+						ftp_map_segment_set(&upload_map, i * FTP_STATUS_MAP_CHUNKS, NULL);
+				}
+				ret = 0;
+				goto out;
+			}
 		}
 
-		last_entries = rep.statusrep.entries;
+		if (covered.complete > 0 && tries > 0)
+			color_printf(COLOR_YELLOW, "%u of %u status segments lost, asking again\r\n",
+					segments - covered.complete, segments);
+	}
+
+	/* Out of retries with segments still lost. Send what is known to be
+	 * missing, the chunks of the lost segments are sent again if they were */
+	if (covered.complete > 0) {
+		color_printf(COLOR_YELLOW, "Using %u of %u status segments\r\n", covered.complete, segments);
+		ret = 0;
 	} else {
-		last_entries = 0;
+		color_printf(COLOR_RED, "Failed to receive status reply\r\n");
 	}
 
-	return 0;
+out:
+	ftp_map_free(&covered);
+	return ret;
 
 }
 
@@ -349,50 +686,11 @@ int ftp_status_reply(void) {
 	ftp_status_reply_t * status = (ftp_status_reply_t *) &ftp_packet.statusrep;
 	ftp_packet.type = FTP_STATUS_REPLY;
 
-	/* Build status reply */
-	int i = 0, next = 0, count = 0;
-
-	status->entries = 0;
-	status->complete = 0;
-	for (i = 0; i < ftp_chunks; i++) {
-		int s;
-		char cstat;
-
-		/* Read chunk status */
-		if (fseek(fp_map, i, SEEK_SET) != 0) {
-			color_printf(COLOR_RED, "fseek failed\r\n");
-			return -1;
-		}
-		if (fread(&cstat, 1, 1, fp_map) != 1) {
-			color_printf(COLOR_RED, "fread byte %u failed\r\n", i);
-			return -1;
-		}
-
-		s = (cstat == *packet_ok);
-
-		/* Increase complete counter if chunk was received */
-		if (s) status->complete++;
-
-		/* Add chunk status to packet */
-		if (status->entries < FTP_STATUS_CHUNKS) {
-			if (!s) {
-				if (!count)
-					next = i;
-				count++;
-			}
-
-			if (count > 0 && (s || i == ftp_chunks - 1)) {
-				status->entry[status->entries].next = csp_hton32(next);
-				status->entry[status->entries].count = csp_hton16(count);
-				status->entries++;
-			}
-		}
-	}
+	if (download_map.bits == NULL)
+		return -1;
 
-	status->entries = csp_hton16(status->entries);
-	status->complete = csp_hton32(status->complete);
-	status->total = csp_hton32(ftp_chunks);
-	status->ret = FTP_RET_OK;
+	/* Build status reply */
+	ftp_map_status(&download_map, status);
 
 	/* Send reply */
 	if (csp_transaction_persistent(conn, FTP_TIMEOUT, &ftp_packet, sizeof(ftp_type_t) + sizeof(ftp_status_reply_t), NULL, 0) != 1) {
@@ -440,12 +738,8 @@ int ftp_status_reply(void) {
 			return -1;
 		}
 
-		if (fseek(fp_map, ftp_packet->data.chunk, SEEK_SET) != 0) {
-			color_printf(COLOR_RED, "Map Seek error\r\n");
-			return -1;
-		}
-
-		if (fwrite(packet_ok, 1, 1, fp_map) != 1) {
+		/* Mark in RAM map, and write the map file every FTP_MAP_FLUSH chunks */
+		if (ftp_map_set(&download_map, ftp_packet->data.chunk) && map_persist() != 0) {
 			color_printf(COLOR_RED, "Map write error\r\n");
 			return -1;
 		}
@@ -494,19 +788,23 @@ int ftp_status_reply(void) {
 
 	color_printf(COLOR_NONE, "\r\n");
 
-	/* Sync file to disk */
+	/* Sync file and map to disk */
 	fflush(fp);
 	fsync(fileno(fp));
+	if (map_persist() != 0) {
+		color_printf(COLOR_RED, "Map write error\r\n");
+		return -1;
+	}
 
 	return 0;
 }
 
 int ftp_data(int count) {
 
-	int i, j;
+	int j;
 	double sec = 0.0, bps = 0.0;
 	struct timespec now = {0,0}, last = {0,0};
-	uint32_t last_chunk = 0;
+	uint32_t last_chunk = 0, next, run;
 	int ret;
 
 	/* Clear line buffer */
@@ -518,12 +816,13 @@ int ftp_data(int count) {
 	/* Request */
 	ftp_packet_t packet;
 	packet.type = FTP_DATA;
-	for (i = 0; i < last_entries; i++) {
-		ftp_status_element_t * n = &last_status[i];
+	window_head = window_count = 0;
+	for (next = ftp_map_next_missing(&upload_map, 0, &run); next < upload_map.chunks;
+			next = ftp_map_next_missing(&upload_map, next + run, &run)) {
 
-		for (j = 0; j < n->count; j++) {
+		for (j = 0; j < run; j++) {
 			/* Calculate chunk number */
-			packet.data.chunk = n->next + j;
+			packet.data.chunk = next + j;
 
 			/* Print progress bar */
 			if (!(packet.data.chunk % 25) || packet.data.chunk == ftp_chunks - 1) {
@@ -569,6 +868,15 @@ int ftp_data(int count) {
 					break;
 			}
 
+			/* Wait for the window to open */
+			if (transfer_window) {
+				while (window_count >= transfer_window)
+					ftp_window_wait();
+				window_chunk[(window_head + window_count) % FTP_WINDOW_MAX] = packet.data.chunk;
+				window_sent[(window_head + window_count) % FTP_WINDOW_MAX] = ftp_ms();
+				window_count++;
+			}
+
 			/* Chunk number MUST be little-endian!
 			 * Note: Yes, this is due to an old mistake, and now we are stuck with it! :( */
 			packet.data.chunk = htole32(packet.data.chunk);
@@ -586,6 +894,10 @@ int ftp_data(int count) {
 
 	}
 
+	/* Let the last window drain, the next request would queue behind it */
+	while (transfer_window && window_count > 0)
+		ftp_window_wait();
+
 	return 0;
 
 }
@@ -593,24 +905,28 @@ int ftp_data(int count) {
 int ftp_done(void) {
 
 	/* Delete map file if it exits */
+	if (fp_map) {
+		fclose(fp_map);
+		fp_map = NULL;
+	}
+	ftp_map_free(&download_map);
+
 	char map[FTP_PATH_LENGTH];
 	snprintf(map, FTP_PATH_LENGTH, "%s.map", ftp_file_name);
 	if (access(map, F_OK) == 0)
 		if (remove(map) != 0)
 			color_printf(COLOR_RED, "Failed to remove %s\r\n", map);
 
-	/* Request */
-	ftp_packet_t packet;
-	packet.type = FTP_DONE;
-
-	csp_transaction_persistent(conn, FTP_TIMEOUT, &packet, sizeof(ftp_type_t), NULL, 0);
+	int ret = ftp_end(FTP_DONE);
+	if (ret != 0)
+		color_printf(COLOR_RED, "No reply to DONE received\r\n");
 	csp_close(conn);
 	conn = NULL;
 
-	last_entries = 0;
+	ftp_map_free(&upload_map);
 	progress_handler = NULL;
 	progress_handler_data = NULL;
-	return 0;
+	return ret;
 
 }
 
@@ -622,7 +938,7 @@ int ftp_crc(void) {
 
 	/* Reply */
 	int repsiz = sizeof(ftp_type_t) + sizeof(ftp_crc_reply_t);
-	if (csp_transaction_persistent(conn, FTP_TIMEOUT, &packet, sizeof(ftp_type_t), &packet, repsiz) != repsiz)
+	if (ftp_request(&packet, sizeof(ftp_type_t), &packet, repsiz, FTP_CRC_REPLY, FTP_CRC_RETRIES) != repsiz)
 		return -1;
 	if (packet.type != FTP_CRC_REPLY)
 		return -1;
@@ -632,17 +948,7 @@ int ftp_crc(void) {
 	}
 
 	/* Calculate CRC32 */
-	char byte;
-	int i;
-	fseek(fp, 0, SEEK_SET);
-	uint32_t crc = 0xFFFFFFFF;
-	for (i = 0; i < ftp_file_size; i++) {
-		if (!fread(&byte, 1, 1, fp))
-			break;
-		crc = chksum_crc32_step(crc, byte);
-	}
-	crc = (crc ^ 0xFFFFFFFF);
-	ftp_checksum = crc;
+	ftp_checksum = ftp_file_crc(ftp_file_size);
 
 	/* Validate checksum */
 	packet.crcrep.crc = csp_ntoh32(packet.crcrep.crc);
@@ -0,0 +1,265 @@
+/**
+ * @file ftp_map.c
+ * FTP chunk map
+ *
+ * Copyright 2012 GomSpace ApS. All rights reserved.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <csp/csp.h>
+#include <csp/csp_endian.h>
+
+#include <ftp/ftp_map.h>
+
+#define MAP_WORDS(chunks) (((chunks) + 31) / 32)
+
+int ftp_map_init(ftp_map_t * map, uint32_t chunks) {
+
+	map->chunks = chunks;
+	map->bits = calloc(MAP_WORDS(chunks) ? MAP_WORDS(chunks) : 1, sizeof(uint32_t));
+	if (map->bits == NULL)
+		return -1;
+
+	map->complete = 0;
+	ftp_map_clean(map);
+
+	return 0;
+
+}
+
+void ftp_map_free(ftp_map_t * map) {
+
+	free(map->bits);
+	map->bits = NULL;
+	map->chunks = 0;
+	map->complete = 0;
+
+}
+
+uint32_t ftp_map_size(const ftp_map_t * map) {
+
+	return MAP_WORDS(map->chunks) * sizeof(uint32_t);
+
+}
+
+void ftp_map_loaded(ftp_map_t * map) {
+
+	uint32_t i, words = MAP_WORDS(map->chunks);
+
+	/* Bits past the last chunk must stay clear */
+	if (map->chunks % 32)
+		map->bits[words - 1] &= (1UL << (map->chunks % 32)) - 1;
+
+	map->complete = 0;
+	for (i = 0; i < words; i++)
+		map->complete += __builtin_popcount(map->bits[i]);
+
+	ftp_map_clean(map);
+
+}
+
+int ftp_map_get(const ftp_map_t * map, uint32_t chunk) {
+
+	return (map->bits[chunk / 32] >> (chunk % 32)) & 1;
+
+}
+
+int ftp_map_set(ftp_map_t * map, uint32_t chunk) {
+
+	uint32_t word = chunk / 32;
+	uint32_t mask = 1UL << (chunk % 32);
+
+	if (map->bits[word] & mask)
+		return 0;
+
+	map->bits[word] |= mask;
+	map->complete++;
+
+	if (word < map->dirty_first)
+		map->dirty_first = word;
+	if (word > map->dirty_last)
+		map->dirty_last = word;
+
+	return ++map->unsaved >= FTP_MAP_FLUSH;
+
+}
+
+void ftp_map_clear(ftp_map_t * map, uint32_t chunk) {
+
+	uint32_t word = chunk / 32;
+	uint32_t mask = 1UL << (chunk % 32);
+
+	if (!(map->bits[word] & mask))
+		return;
+
+	map->bits[word] &= ~mask;
+	map->complete--;
+
+	if (word < map->dirty_first)
+		map->dirty_first = word;
+	if (word > map->dirty_last)
+		map->dirty_last = word;
+
+}
+
+uint32_t ftp_map_next_missing(const ftp_map_t * map, uint32_t chunk, uint32_t * count) {
+
+	uint32_t word, end, w, words = MAP_WORDS(map->chunks);
+
+	*count = 0;
+	if (chunk >= map->chunks)
+		return map->chunks;
+
+	/* Find first clear bit */
+	w = chunk / 32;
+	word = ~map->bits[w] & (0xFFFFFFFFUL << (chunk % 32));
+	while (!word) {
+		if (++w >= words)
+			return map->chunks;
+		word = ~map->bits[w];
+	}
+
+	chunk = w * 32 + __builtin_ctz(word);
+	if (chunk >= map->chunks)
+		return map->chunks;
+
+	/* Find the set bit that ends the run */
+	word = map->bits[w] & (0xFFFFFFFFUL << (chunk % 32));
+	while (!word) {
+		if (++w >= words) {
+			*count = map->chunks - chunk;
+			return chunk;
+		}
+		word = map->bits[w];
+	}
+
+	end = w * 32 + __builtin_ctz(word);
+	*count = (end < map->chunks ? end : map->chunks) - chunk;
+
+	return chunk;
+
+}
+
+int ftp_map_dirty(const ftp_map_t * map, uint32_t * offset, uint32_t * length) {
+
+	uint32_t first, last;
+
+	if (map->dirty_first > map->dirty_last)
+		return 0;
+
+	first = (map->dirty_first * sizeof(uint32_t)) / FTP_MAP_BLOCK * FTP_MAP_BLOCK;
+	last = ((map->dirty_last + 1) * sizeof(uint32_t) + FTP_MAP_BLOCK - 1) / FTP_MAP_BLOCK * FTP_MAP_BLOCK;
+	if (last > ftp_map_size(map))
+		last = ftp_map_size(map);
+
+	*offset = first;
+	*length = last - first;
+
+	return 1;
+
+}
+
+void ftp_map_clean(ftp_map_t * map) {
+
+	map->dirty_first = UINT32_MAX;
+	map->dirty_last = 0;
+	map->unsaved = 0;
+
+}
+
+void ftp_map_status(const ftp_map_t * map, ftp_status_reply_t * status) {
+
+	uint32_t next = 0, count;
+	uint16_t entries = 0;
+
+	while (entries < FTP_STATUS_CHUNKS) {
+		next = ftp_map_next_missing(map, next, &count);
+		if (next >= map->chunks)
+			break;
+
+		/* Longer runs continue in the next entry */
+		if (count > UINT16_MAX)
+			count = UINT16_MAX;
+
+		status->entry[entries].next = csp_hton32(next);
+		status->entry[entries].count = csp_hton16(count);
+		entries++;
+		next += count;
+	}
+
+	status->entries = csp_hton16(entries);
+	status->complete = csp_hton32(map->complete);
+	status->total = csp_hton32(map->chunks);
+	status->ret = FTP_RET_OK;
+
+}
+
+uint32_t ftp_map_next_segment(const ftp_map_t * map, uint32_t first) {
+
+	uint32_t count;
+
+	first = ftp_map_next_missing(map, first, &count);
+	if (first >= map->chunks)
+		return map->chunks;
+
+	return first - first % FTP_STATUS_MAP_CHUNKS;
+
+}
+
+unsigned int ftp_map_segment_get(const ftp_map_t * map, uint32_t first, uint8_t * bits) {
+
+	uint32_t i, word, chunks = map->chunks - first;
+
+	if (chunks > FTP_STATUS_MAP_CHUNKS)
+		chunks = FTP_STATUS_MAP_CHUNKS;
+
+	memset(bits, 0, FTP_STATUS_MAP_CHUNKS / 8);
+	for (i = 0; i < MAP_WORDS(chunks); i++) {
+		word = map->bits[first / 32 + i];
+		bits[i * 4 + 0] = word;
+		bits[i * 4 + 1] = word >> 8;
+		bits[i * 4 + 2] = word >> 16;
+		bits[i * 4 + 3] = word >> 24;
+	}
+
+	return (chunks + 7) / 8;
+
+}
+
+void ftp_map_segment_set(ftp_map_t * map, uint32_t first, const uint8_t * bits) {
+
+	uint32_t i, w, word, chunks = map->chunks - first;
+
+	if (chunks > FTP_STATUS_MAP_CHUNKS)
+		chunks = FTP_STATUS_MAP_CHUNKS;
+
+	for (i = 0; i < MAP_WORDS(chunks); i++) {
+		if (bits) {
+			word = bits[i * 4 + 0] | bits[i * 4 + 1] << 8 |
+					bits[i * 4 + 2] << 16 | (uint32_t) bits[i * 4 + 3] << 24;
+		} else {
+			word = 0xFFFFFFFFUL;
+		}
+
+		/* Bits past the last chunk must stay clear */
+		if (i == MAP_WORDS(chunks) - 1 && chunks % 32)
+			word &= (1UL << (chunks % 32)) - 1;
+
+		w = first / 32 + i;
+		if (word == map->bits[w])
+			continue;
+
+		map->complete += __builtin_popcount(word);
+		map->complete -= __builtin_popcount(map->bits[w]);
+		map->bits[w] = word;
+
+		if (w < map->dirty_first)
+			map->dirty_first = w;
+		if (w > map->dirty_last)
+			map->dirty_last = w;
+	}
+
+}
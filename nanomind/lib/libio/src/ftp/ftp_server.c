@@ -1,12 +1,11 @@
+#include <stdio.h>
 #include <stdint.h>
 #include <inttypes.h>
 #include <string.h>
 
-#include <freertos/FreeRTOS.h>
-#include <freertos/task.h>
-
 #include <csp/csp.h>
 #include <csp/csp_endian.h>
+#include <csp/arch/csp_thread.h>
 
 #include <util/crc32.h>
 #include <util/log.h>
@@ -15,6 +14,9 @@
 
 #define FTP_MAX_BACKENDS 5
 
+/* A transfer without a packet for this long is aborted */
+#define FTP_SERVER_TIMEOUT 60000
+
 struct backend_container {
 	uint8_t id;					//! Backend ID
 	ftp_backend_t *backend;		//! Backend operations
@@ -50,12 +52,57 @@ ftp_backend_t * ftp_get_backend(uint8_t backend) {
 	return ret;
 }
 
+/* Send a status map segment for every part of the map with missing chunks */
+static int ftp_send_status_map(csp_conn_t * conn, ftp_map_t * map, uint8_t seq) {
+
+	uint32_t first;
+	uint16_t segment = 0, segments = 0;
+
+	for (first = ftp_map_next_segment(map, 0); first < map->chunks;
+			first = ftp_map_next_segment(map, first + FTP_STATUS_MAP_CHUNKS))
+		segments++;
+
+	/* A complete transfer is answered with an empty segment */
+	first = ftp_map_next_segment(map, 0);
+	do {
+		csp_packet_t * packet = csp_buffer_get(sizeof(ftp_type_t) + sizeof(ftp_status_map_t));
+		if (packet == NULL)
+			return -1;
+
+		ftp_packet_t * ftp_packet = (void *) packet->data;
+		ftp_status_map_t * status = &ftp_packet->statusmap;
+		unsigned int bytes = 0;
+
+		ftp_packet->type = FTP_STATUS_MAP;
+		status->ret = FTP_RET_OK;
+		status->seq = seq;
+		status->complete = csp_hton32(map->complete);
+		status->total = csp_hton32(map->chunks);
+		status->segment = csp_hton16(segment);
+		status->segments = csp_hton16(segments);
+		status->first = csp_hton32(first < map->chunks ? first : 0);
+		if (first < map->chunks)
+			bytes = ftp_map_segment_get(map, first, status->bits);
+
+		packet->length = sizeof(ftp_type_t) + sizeof(ftp_status_map_t) - sizeof(status->bits) + bytes;
+		if (!csp_send(conn, packet, 60000)) {
+			csp_buffer_free(packet);
+			return -1;
+		}
+
+		first = ftp_map_next_segment(map, first + FTP_STATUS_MAP_CHUNKS);
+	} while (++segment < segments);
+
+	return 0;
+
+}
+
 void task_ftp(void * conn_param) {
 
 	/* Delete task if passed an invalid connection */
 	if (!conn_param) {
 		printf("NULL connection passed to FTP worker task\r\n");
-		vTaskDelete(NULL);
+		csp_thread_exit();
 	}
 
 	/* Cast input parameter */
@@ -71,12 +118,23 @@ void task_ftp(void * conn_param) {
 	uint32_t ftp_size;
 	uint32_t ftp_checksum;
 
+	/* Windowed upload */
+	uint8_t upload_ret = FTP_RET_PROTO;
+	unsigned int upload_replen = 0;
+	unsigned int ack_every = 0;
+	uint32_t received = 0;
+
+	/* CRC of the file, valid until the next chunk is written */
+	int crc_valid = 0;
+	uint8_t crc_ret = FTP_RET_NOTSUP;
+	uint32_t crc_value = 0;
+
 	void * backend_state = NULL;
 
 	while(1) {
 
 		/* Read packet from stream */
-		packet = csp_read(conn, 60 * configTICK_RATE_HZ);
+		packet = csp_read(conn, FTP_SERVER_TIMEOUT);
 		if (!packet) {
 			printf("Timeout during transfer, aborting\r\n");
 			if (backend && backend->timeout)
@@ -90,6 +148,18 @@ void task_ftp(void * conn_param) {
 		switch(ftp_packet->type) {
 
 		case FTP_UPLOAD_REQUEST: {
+			/* A windowed upload runs without RDP, so the client repeats
+			 * the request if the reply was lost */
+			if (state == FTP_STATE_UPLOAD && ul.window) {
+				ftp_packet->type = FTP_UPLOAD_REPLY;
+				ftp_packet->uprep.ret = upload_ret;
+				ftp_packet->uprep.window = csp_hton16(ul.window);
+				packet->length = upload_replen;
+				if (!csp_send(conn, packet, 0))
+					goto out_free;
+				break;
+			}
+
 			/* Validate state */
 			if (state != FTP_STATE_IDLE) {
 				printf("Upload request received in state %"PRIu8"\r\n", state);
@@ -104,9 +174,26 @@ void task_ftp(void * conn_param) {
 			upload->crc32 = csp_ntoh32(upload->crc32);
 			upload->chunk_size = csp_ntoh16(upload->chunk_size);
 			upload->mem_addr = csp_ntoh32(upload->mem_addr);
+
+			/* Old clients do not send a window, and expect a reply without */
+			upload_replen = sizeof(ftp_type_t) + sizeof(ftp_upload_reply_t);
+			if (packet->length >= sizeof(ftp_type_t) + sizeof(ftp_upload_request_t)) {
+				upload->window = csp_ntoh16(upload->window);
+			} else {
+				upload->window = 0;
+				upload_replen -= sizeof(ftp_packet->uprep.window);
+			}
+			if (upload->window > FTP_WINDOW_MAX)
+				upload->window = FTP_WINDOW_MAX;
+
 			memcpy(&ul, upload, sizeof(ftp_upload_request_t));
-			printf("Upload begin: size %"PRIu32", path %s, type %"PRIu8", addr 0x%"PRIX32" chunk size %u\r\n",
-													ul.size, ul.path, ul.backend, ul.mem_addr, ul.chunk_size);
+			printf("Upload begin: size %"PRIu32", path %s, type %"PRIu8", addr 0x%"PRIX32" chunk size %u window %u\r\n",
+													ul.size, ul.path, ul.backend, ul.mem_addr, ul.chunk_size, ul.window);
+
+			/* Acknowledge every half window, so the client can keep sending
+			 * while an acknowledgement is in flight */
+			ack_every = ul.window > 1 ? ul.window / 2 : ul.window;
+			received = 0;
 
 			backend = ftp_get_backend(ul.backend);
 			if (backend == NULL) {
@@ -129,8 +216,10 @@ void task_ftp(void * conn_param) {
 			} else {
 				ftp_packet->uprep.ret = FTP_RET_NOTSUP;
 			}
+			upload_ret = ftp_packet->uprep.ret;
+			ftp_packet->uprep.window = csp_hton16(ul.window);
 
-			packet->length = sizeof(ftp_type_t) + sizeof(ftp_upload_reply_t);
+			packet->length = upload_replen;
 
 			if (!csp_send(conn, packet, 0))
 				goto out_free;
@@ -203,20 +292,37 @@ void task_ftp(void * conn_param) {
 			 * Therefore csp_letoh32 is used instead of csp_ntoh32 */
 			data->chunk = csp_letoh32(data->chunk);
 
-			if (data->chunk >= (ul.size + ul.chunk_size - 1)/ ul.chunk_size)
+			uint32_t chunk = data->chunk;
+			uint32_t chunks = (ul.size + ul.chunk_size - 1) / ul.chunk_size;
+
+			if (chunk >= chunks)
 				goto out_free;
 
-			unsigned int remain = ul.size - data->chunk * ul.chunk_size;
+			unsigned int remain = ul.size - chunk * ul.chunk_size;
 			unsigned int size = remain > ul.chunk_size ? ul.chunk_size : remain;
 
 			if (!backend->chunk_write ||
-					backend->chunk_write(backend_state, data->chunk, data->bytes, size) != FTP_RET_OK)
+					backend->chunk_write(backend_state, chunk, data->bytes, size) != FTP_RET_OK)
 				goto out_free;
+			crc_valid = 0;
 
 			if (!backend->status_set ||
-					backend->status_set(backend_state, data->chunk) != FTP_RET_OK)
+					backend->status_set(backend_state, chunk) != FTP_RET_OK)
 				goto out_free;
 
+			/* Acknowledge cumulatively in windowed mode. Lost chunks are
+			 * not tracked here, the client repairs them with STATUS */
+			received++;
+			if (ack_every && (received % ack_every == 0 || chunk == chunks - 1)) {
+				ftp_packet->type = FTP_DATA_ACK;
+				ftp_packet->dataack.chunk = csp_hton32(chunk);
+				ftp_packet->dataack.received = csp_hton32(received);
+				packet->length = sizeof(ftp_type_t) + sizeof(ftp_data_ack_t);
+				if (!csp_send(conn, packet, 0))
+					csp_buffer_free(packet);
+				break;
+			}
+
 			csp_buffer_free(packet);
 			break;
 		}
@@ -231,10 +337,29 @@ void task_ftp(void * conn_param) {
 			if (backend == NULL)
 				goto out_free;
 
+			/* Old clients send the type only */
+			uint8_t mode = FTP_STATUS_MODE_RUNS, seq = 0;
+			if (packet->length >= sizeof(ftp_type_t) + sizeof(ftp_status_request_t)) {
+				mode = ftp_packet->statusreq.mode;
+				seq = ftp_packet->statusreq.seq;
+			}
+
 			ftp_status_reply_t * status = (ftp_status_reply_t *) &ftp_packet->statusrep;
 			ftp_packet->type = FTP_STATUS_REPLY;
 
-			if (backend->status_get) {
+			ftp_map_t * map;
+			if (backend->status_map && backend->status_map(backend_state, &map) == FTP_RET_OK) {
+				/* Send every missing chunk if the client understands it */
+				if (mode == FTP_STATUS_MODE_MAP) {
+					if (ftp_send_status_map(conn, map, seq) < 0)
+						goto out_free;
+					csp_buffer_free(packet);
+					break;
+				}
+
+				/* Scan the chunk map a word at a time */
+				ftp_map_status(map, status);
+			} else if (backend->status_get) {
 				/* Build status reply */
 				int i = 0, next = 0, count = 0;
 				int chunks = (ul.size + ul.chunk_size - 1) / ul.chunk_size;
@@ -362,17 +487,17 @@ void task_ftp(void * conn_param) {
 
 			ftp_crc_reply_t * crc = (ftp_crc_reply_t *) &ftp_packet->crcrep;
 
-			/* Let the backend do the work */
-			int ret = FTP_RET_NOTSUP;
-			if (backend->crc) {
-				uint32_t c;
-				ret = backend->crc(backend_state, &c);
-				crc->crc = csp_hton32(c);
-			}
+			/* Let the backend do the work. A windowed upload repeats the
+			 * request while the CRC is calculated, the repeats are
+			 * answered with the same result */
+			if (!crc_valid && backend->crc)
+				crc_ret = backend->crc(backend_state, &crc_value);
+			crc_valid = 1;
+			crc->crc = csp_hton32(crc_value);
 
 			/* Send back reply */
 			ftp_packet->type = FTP_CRC_REPLY;
-			ftp_packet->crcrep.ret = ret;
+			ftp_packet->crcrep.ret = crc_ret;
 			packet->length = sizeof(ftp_type_t) + sizeof(ftp_crc_reply_t);
 
 			if (!csp_send(conn, packet, 0))
@@ -385,7 +510,7 @@ void task_ftp(void * conn_param) {
 			/* Validate state */
 			if (state == FTP_STATE_IDLE) {
 				printf("FTP ABORT received in state %"PRIu8"\r\n", state);
-				goto out_free;
+				goto out_end;
 			}
 
 			if (backend == NULL)
@@ -395,14 +520,14 @@ void task_ftp(void * conn_param) {
 			if (backend->abort)
 				backend->abort(backend_state);
 
-			goto out_free;
+			goto out_end;
 		}
 
 		case FTP_DONE: {
 			/* Validate state */
 			if (state == FTP_STATE_IDLE) {
 				printf("FTP DONE received in state %"PRIu8"\r\n", state);
-				goto out_free;
+				goto out_end;
 			}
 
 			if (backend == NULL)
@@ -412,7 +537,7 @@ void task_ftp(void * conn_param) {
 			if (backend->done)
 				backend->done(backend_state);
 
-			goto out_free;
+			goto out_end;
 		}
 
 		case FTP_LIST_REQUEST: {
@@ -548,6 +673,15 @@ void task_ftp(void * conn_param) {
 		}
 	}
 
+out_end:
+	/* Without RDP the client repeats DONE and ABORT until they are
+	 * confirmed. A repeat after the transfer ended opens a new connection,
+	 * which finds nothing to end and only confirms */
+	if (!(csp_conn_flags(conn) & CSP_FRDP)) {
+		packet->length = sizeof(ftp_type_t);
+		if (csp_send(conn, packet, 0))
+			goto out;
+	}
 out_free:
 	csp_buffer_free(packet);
 out:
@@ -556,5 +690,5 @@ out:
 		backend->timeout(backend_state);
 	if (backend_state && backend && backend->release)
 		backend->release(backend_state);
-	vTaskDelete(NULL);
+	csp_thread_exit();
 }